@@ -24,6 +24,7 @@
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/errcodes.h"
+#include "utils/lsyscache.h"
 
 
 /* declarations for dynamic loading */
@@ -35,7 +36,9 @@ PG_FUNCTION_INFO_V1(partition_column_to_node_string);
  * representation of a partition column node (Var), suitable for use within
  * CitusDB's metadata tables. This function expects an Oid identifying a table
  * previously distributed using pg_shard and will raise an ERROR if the Oid
- * is NULL, or does not identify a pg_shard-distributed table.
+ * is NULL, or does not identify a pg_shard-distributed table. Reference tables
+ * have no partition column and no counterpart in CitusDB, so they raise an
+ * ERROR as well.
  */
 Datum
 partition_column_to_node_string(PG_FUNCTION_ARGS)
@@ -52,6 +55,14 @@ partition_column_to_node_string(PG_FUNCTION_ARGS)
 	}
 
 	distributedTableId = PG_GETARG_OID(0);
+	if (PartitionType(distributedTableId) == REFERENCE_PARTITION_TYPE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot sync metadata of reference table \"%s\"",
+							   get_rel_name(distributedTableId)),
+						errdetail("CitusDB does not support reference tables.")));
+	}
+
 	partitionColumn = PartitionColumn(distributedTableId);
 	partitionColumnString = nodeToString(partitionColumn);
 	partitionColumnText = cstring_to_text(partitionColumnString);
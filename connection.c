@@ -16,19 +16,27 @@
 #include "postgres_ext.h"
 
 #include "connection.h"
+#include "node_health.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stddef.h>
 #include <string.h>
 
+#include "access/xact.h"
 #include "commands/dbcommands.h"
 #include "lib/stringinfo.h"
 #include "mb/pg_wchar.h"
+#include "nodes/pg_list.h"
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/errcodes.h"
 #include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/memutils.h"
+#include "storage/proc.h"
 #include "utils/palloc.h"
+#include "utils/timestamp.h"
 
 
 /*
@@ -37,10 +45,49 @@
  */
 static HTAB *NodeConnectionHash = NULL;
 
+/* maximum number of connections a backend keeps to a single node */
+int MaxConnectionsPerNode = 1;
+
+/* maximum number of statements kept prepared on each remote session */
+int MaxCachedStatementsPerConnection = 64;
+
+/* number used to name the next statement prepared on a remote session */
+static uint32 NextCachedStatementNumber = 0;
+
 
 /* local function forward declarations */
 static HTAB * CreateNodeConnectionHash(void);
-static PGconn * ConnectToNode(char *nodeName, char *nodePort);
+static NodeConnectionEntry * FindConnectionEntry(PGconn *connection);
+static void CancelRemoteQueries(SubTransactionId subtransactionId);
+static void CancelRemoteQueriesAtAbort(XactEvent event, void *arg);
+static void CancelRemoteQueriesAtSubAbort(SubXactEvent event, SubTransactionId mySubid,
+										  SubTransactionId parentSubid, void *arg);
+static bool CancelRemoteQuery(PGconn *connection);
+static List * CancelRemoteQueryList(List *connectionList);
+static bool SendCancelRequest(PGconn *connection);
+static bool DrainCancelledQuery(PGconn *connection, bool *queryEnded);
+static bool AwaitRemoteInput(PGconn *connection);
+static PGresult * AwaitRemoteQuery(PGconn *connection, const char *queryString,
+								   int parameterCount, const Oid *parameterTypes,
+								   const char *const *parameterValues, Oid relationId);
+static CachedStatement * GetCachedStatement(NodeConnectionEntry *nodeConnectionEntry,
+											const char *queryString,
+											int parameterCount,
+											const Oid *parameterTypes,
+											Oid relationId);
+static bool DeallocateStaleStatements(NodeConnectionEntry *nodeConnectionEntry);
+static void InvalidateCachedStatements(Datum argument, Oid relationId);
+static void ForgetCachedStatements(NodeConnectionEntry *nodeConnectionEntry);
+static void FreeCachedStatement(CachedStatement *cachedStatement);
+static bool ConnectionFailedInStatement(NodeConnectionKey *nodeConnectionKey);
+static bool PendingConnectionExists(List *pendingConnectionList,
+									NodeConnectionKey *nodeConnectionKey);
+static void StartConnectionAttempt(PendingConnection *pendingConnection);
+static void SkipUnavailableNode(PendingConnection *pendingConnection);
+static void PollPendingConnections(List *pendingConnectionList);
+static void HandleFailedConnectionAttempt(PendingConnection *pendingConnection,
+										  bool attemptTimedOut);
+static void FinishPendingConnections(List *pendingConnectionList);
 static char * ConnectionGetOptionValue(PGconn *connection, char *optionKeyword);
 
 
@@ -48,16 +95,32 @@ static char * ConnectionGetOptionValue(PGconn *connection, char *optionKeyword);
  * GetConnection returns a PGconn which can be used to execute queries on a
  * remote PostgreSQL server. If no suitable connection to the specified node on
  * the specified port yet exists, the function establishes a new connection and
- * returns that.
+ * returns that. This is simply the connection in the node's first slot; see
+ * GetConnectionForSlot for details.
+ */
+PGconn *
+GetConnection(char *nodeName, int32 nodePort)
+{
+	return GetConnectionForSlot(nodeName, nodePort, 0);
+}
+
+
+/*
+ * GetConnectionForSlot returns the connection in the given slot for a remote
+ * PostgreSQL server, establishing it if needed. Connections in different slots
+ * are independent of one another, so callers may use them to run several
+ * queries on the same node at the same time.
  *
  * Returned connections are guaranteed to be in the CONNECTION_OK state. If the
  * requested connection cannot be established, or if it was previously created
- * but is now in an unrecoverable bad state, this function returns NULL.
+ * but is now in an unrecoverable bad state, this function returns NULL. It also
+ * returns NULL without a new attempt if connecting to the node already failed
+ * during the current statement.
  *
  * This function throws an error if a hostname over 255 characters is provided.
  */
 PGconn *
-GetConnection(char *nodeName, int32 nodePort)
+GetConnectionForSlot(char *nodeName, int32 nodePort, int32 connectionSlot)
 {
 	PGconn *connection = NULL;
 	NodeConnectionKey nodeConnectionKey;
@@ -82,33 +145,45 @@ GetConnection(char *nodeName, int32 nodePort)
 	memset(&nodeConnectionKey, 0, sizeof(nodeConnectionKey));
 	strncpy(nodeConnectionKey.nodeName, nodeName, MAX_NODE_LENGTH);
 	nodeConnectionKey.nodePort = nodePort;
+	nodeConnectionKey.connectionSlot = connectionSlot;
 
 	nodeConnectionEntry = hash_search(NodeConnectionHash, &nodeConnectionKey,
 									  HASH_FIND, &entryFound);
-	if (entryFound)
+	if (entryFound && nodeConnectionEntry->connection != NULL)
 	{
+		bool connectionIdle = true;
+
 		connection = nodeConnectionEntry->connection;
-		if (PQstatus(connection) == CONNECTION_OK)
+
+		/* a query left running would make the next one block until it ends */
+		if (nodeConnectionEntry->queryInProgress)
+		{
+			connectionIdle = CancelRemoteQuery(connection);
+			nodeConnectionEntry->queryInProgress = !connectionIdle;
+		}
+
+		if (connectionIdle && PQstatus(connection) == CONNECTION_OK)
 		{
 			needNewConnection = false;
 		}
 		else
 		{
 			PurgeConnection(connection);
+			connection = NULL;
 		}
 	}
 
 	if (needNewConnection)
 	{
-		StringInfo nodePortString = makeStringInfo();
-		appendStringInfo(nodePortString, "%d", nodePort);
+		List *nodeConnectionKeyList = list_make1(&nodeConnectionKey);
 
-		connection = ConnectToNode(nodeName, nodePortString->data);
-		if (connection != NULL)
+		EstablishConnections(nodeConnectionKeyList);
+
+		nodeConnectionEntry = hash_search(NodeConnectionHash, &nodeConnectionKey,
+										  HASH_FIND, &entryFound);
+		if (entryFound)
 		{
-			nodeConnectionEntry = hash_search(NodeConnectionHash, &nodeConnectionKey,
-											  HASH_ENTER, &entryFound);
-			nodeConnectionEntry->connection = connection;
+			connection = nodeConnectionEntry->connection;
 		}
 	}
 
@@ -117,65 +192,197 @@ GetConnection(char *nodeName, int32 nodePort)
 
 
 /*
- * PurgeConnection removes the given connection from the connection hash and
- * closes it using PQfinish. If our hash does not contain the given connection,
- * this method simply prints a warning and exits.
+ * EstablishConnections opens connections to each node in the provided list of
+ * node connection keys which does not already have a usable connection in the
+ * connection hash. Rather than connecting to one node after another, all
+ * connection attempts are started at once and then driven to completion by a
+ * single poll loop, so the total time spent is roughly that of the slowest
+ * connection rather than the sum of all of them.
+ *
+ * Like GetConnection, this function attempts each connection up to
+ * MAX_CONNECT_ATTEMPTS times and warns about nodes which could not be reached
+ * after the final attempt. Successfully established connections are added to
+ * the connection hash, where subsequent calls to GetConnection will find them.
+ * Nodes which could not be reached are remembered for the remainder of the
+ * current statement, so that each unreachable node costs at most one timeout
+ * (and one warning) per statement. Connection failures are also recorded in
+ * the node health table; nodes which that table considers to be down are not
+ * contacted at all.
  */
 void
-PurgeConnection(PGconn *connection)
+EstablishConnections(List *nodeConnectionKeyList)
 {
-	NodeConnectionKey nodeConnectionKey;
-	NodeConnectionEntry *nodeConnectionEntry = NULL;
-	bool entryFound = false;
-	char *nodeNameString = NULL;
-	char *nodePortString = NULL;
+	List *pendingConnectionList = NIL;
+	ListCell *nodeConnectionKeyCell = NULL;
+	ListCell *pendingConnectionCell = NULL;
 
-	nodeNameString = ConnectionGetOptionValue(connection, "host");
-	if (nodeNameString == NULL)
+	/* if first call, initialize the connection hash */
+	if (NodeConnectionHash == NULL)
 	{
-		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-						errmsg("connection is missing host option")));
+		NodeConnectionHash = CreateNodeConnectionHash();
 	}
 
-	nodePortString = ConnectionGetOptionValue(connection, "port");
-	if (nodePortString == NULL)
+	foreach(nodeConnectionKeyCell, nodeConnectionKeyList)
 	{
-		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-						errmsg("connection is missing port option")));
+		NodeConnectionKey *inputKey = (NodeConnectionKey *) lfirst(nodeConnectionKeyCell);
+		NodeConnectionKey nodeConnectionKey;
+		NodeConnectionEntry *nodeConnectionEntry = NULL;
+		PendingConnection *pendingConnection = NULL;
+		bool entryFound = false;
+
+		/* normalize key so that hashing ignores any bytes past the name */
+		memset(&nodeConnectionKey, 0, sizeof(nodeConnectionKey));
+		strncpy(nodeConnectionKey.nodeName, inputKey->nodeName, MAX_NODE_LENGTH);
+		nodeConnectionKey.nodePort = inputKey->nodePort;
+		nodeConnectionKey.connectionSlot = inputKey->connectionSlot;
+
+		/* don't wait on a node we failed to reach earlier in this statement */
+		if (ConnectionFailedInStatement(&nodeConnectionKey))
+		{
+			continue;
+		}
+
+		nodeConnectionEntry = hash_search(NodeConnectionHash, &nodeConnectionKey,
+										  HASH_FIND, &entryFound);
+		if (entryFound && nodeConnectionEntry->connection != NULL)
+		{
+			PGconn *connection = nodeConnectionEntry->connection;
+
+			if (PQstatus(connection) == CONNECTION_OK)
+			{
+				continue;
+			}
+
+			PurgeConnection(connection);
+		}
+
+		if (PendingConnectionExists(pendingConnectionList, &nodeConnectionKey))
+		{
+			continue;
+		}
+
+		pendingConnection = (PendingConnection *) palloc0(sizeof(PendingConnection));
+		pendingConnection->nodeConnectionKey = nodeConnectionKey;
+		pendingConnection->pollingStatus = PGRES_POLLING_FAILED;
+
+		pendingConnectionList = lappend(pendingConnectionList, pendingConnection);
 	}
 
-	memset(&nodeConnectionKey, 0, sizeof(nodeConnectionKey));
-	strncpy(nodeConnectionKey.nodeName, nodeNameString, MAX_NODE_LENGTH);
-	nodeConnectionKey.nodePort = pg_atoi(nodePortString, sizeof(int32), 0);
+	if (pendingConnectionList == NIL)
+	{
+		return;
+	}
 
-	pfree(nodeNameString);
-	pfree(nodePortString);
+	/* make sure no half-open connections leak if we error out or are canceled */
+	PG_TRY();
+	{
+		foreach(pendingConnectionCell, pendingConnectionList)
+		{
+			PendingConnection *pendingConnection = lfirst(pendingConnectionCell);
 
-	nodeConnectionEntry = hash_search(NodeConnectionHash, &nodeConnectionKey,
-									  HASH_REMOVE, &entryFound);
-	if (entryFound)
+			/* don't make queries wait on nodes which are known to be down */
+			if (NodeAvailable(&pendingConnection->nodeConnectionKey))
+			{
+				StartConnectionAttempt(pendingConnection);
+			}
+			else
+			{
+				SkipUnavailableNode(pendingConnection);
+			}
+		}
+
+		PollPendingConnections(pendingConnectionList);
+	}
+	PG_CATCH();
+	{
+		FinishPendingConnections(pendingConnectionList);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	foreach(pendingConnectionCell, pendingConnectionList)
 	{
-		/*
-		 * It's possible the provided connection matches the host and port for
-		 * an entry in the hash without being precisely the same connection. In
-		 * that case, we will want to close the hash's connection (because the
-		 * entry has already been removed) in addition to the provided one.
-		 */
-		if (nodeConnectionEntry->connection != connection)
+		PendingConnection *pendingConnection = lfirst(pendingConnectionCell);
+		NodeConnectionEntry *nodeConnectionEntry = NULL;
+		bool entryFound = false;
+
+		/* share the outcome of any attempt we made with other backends */
+		if (pendingConnection->connection != NULL)
+		{
+			RecordNodeSuccess(&pendingConnection->nodeConnectionKey);
+		}
+		else if (pendingConnection->attemptCount > 0)
+		{
+			RecordNodeFailure(&pendingConnection->nodeConnectionKey);
+		}
+
+		nodeConnectionEntry = hash_search(NodeConnectionHash,
+										  &pendingConnection->nodeConnectionKey,
+										  HASH_ENTER, &entryFound);
+		nodeConnectionEntry->connection = pendingConnection->connection;
+		nodeConnectionEntry->failedStatementTime = 0;
+		nodeConnectionEntry->queryInProgress = false;
+		nodeConnectionEntry->querySubtransactionId = InvalidSubTransactionId;
+		nodeConnectionEntry->remoteStatementTimeout = 0;
+		nodeConnectionEntry->blockStatementTimeout = -1;
+
+		if (entryFound)
 		{
-			ereport(WARNING, (errmsg("hash entry for \"%s:%d\" contained different "
-									 "connection than that provided by caller",
-									 nodeConnectionKey.nodeName,
-									 nodeConnectionKey.nodePort)));
-			PQfinish(nodeConnectionEntry->connection);
+			ForgetCachedStatements(nodeConnectionEntry);
 		}
+
+		nodeConnectionEntry->cachedStatementList = NIL;
+		nodeConnectionEntry->staleStatementList = NIL;
+
+		/* remember failures so later calls in this statement return quickly */
+		if (pendingConnection->connection == NULL)
+		{
+			nodeConnectionEntry->failedStatementTime =
+				GetCurrentStatementStartTimestamp();
+		}
+	}
+}
+
+
+/*
+ * PurgeConnection removes the given connection from the connection hash and
+ * closes it using PQfinish. If our hash does not contain the given connection,
+ * this method prints a warning and just closes the connection.
+ */
+void
+PurgeConnection(PGconn *connection)
+{
+	NodeConnectionEntry *nodeConnectionEntry = FindConnectionEntry(connection);
+
+	if (nodeConnectionEntry != NULL)
+	{
+		NodeConnectionKey nodeConnectionKey = nodeConnectionEntry->cacheKey;
+		bool entryFound = false;
+
+		ForgetCachedStatements(nodeConnectionEntry);
+		hash_search(NodeConnectionHash, &nodeConnectionKey, HASH_REMOVE, &entryFound);
 	}
 	else
 	{
+		char *nodeNameString = ConnectionGetOptionValue(connection, "host");
+		char *nodePortString = ConnectionGetOptionValue(connection, "port");
+
+		if (nodeNameString == NULL)
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							errmsg("connection is missing host option")));
+		}
+
+		if (nodePortString == NULL)
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							errmsg("connection is missing port option")));
+		}
+
 		ereport(WARNING, (errcode(ERRCODE_NO_DATA),
-						  errmsg("could not find hash entry for connection to \"%s:%d\"",
-								 nodeConnectionKey.nodeName,
-								 nodeConnectionKey.nodePort)));
+						  errmsg("could not find hash entry for connection to \"%s:%s\"",
+								 nodeNameString, nodePortString)));
 	}
 
 	PQfinish(connection);
@@ -233,101 +440,1366 @@ ReportRemoteError(PGconn *connection, PGresult *result)
 
 
 /*
- * CreateNodeConnectionHash returns a newly created hash table suitable for
- * storing unlimited connections indexed by node name and port.
+ * ApplyRemoteStatementTimeout sets statement_timeout on the given connection's
+ * remote session to the local statement_timeout. Remote queries start after the
+ * local statement does, so the local timeout always expires first, and remote
+ * queries are then cancelled as part of the abort; the remote timeout merely
+ * bounds queries whose cancellation fails. Older releases only arm a changed
+ * statement_timeout from the next query message on, so setting it takes a round
+ * trip of its own. That round trip is only made if the local setting differs
+ * from the one in effect on the remote session. Within a remote transaction
+ * block, the timeout is set with SET LOCAL, so that it lasts for the rest of the
+ * block whether it commits or aborts, and the session's own setting is left as
+ * it was. Aborted blocks only accept ROLLBACK, so nothing is set in them. The
+ * function returns false if setting the timeout failed; PQerrorMessage then
+ * describes the failure.
  */
-static HTAB *
-CreateNodeConnectionHash(void)
+bool
+ApplyRemoteStatementTimeout(PGconn *connection)
 {
-	HTAB *nodeConnectionHash = NULL;
-	HASHCTL info;
-	int hashFlags = 0;
+	NodeConnectionEntry *nodeConnectionEntry = FindConnectionEntry(connection);
+	PGTransactionStatusType transactionStatus = PQtransactionStatus(connection);
+	bool inTransactionBlock = (transactionStatus == PQTRANS_INTRANS);
+	StringInfo timeoutCommand = NULL;
+	PGresult *result = NULL;
+	bool timeoutApplied = false;
+	int remoteStatementTimeout = -1;
 
-	memset(&info, 0, sizeof(info));
-	info.keysize = sizeof(NodeConnectionKey);
-	info.entrysize = sizeof(NodeConnectionEntry);
-	info.hash = tag_hash;
-	info.hcxt = CacheMemoryContext;
-	hashFlags = (HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	if (transactionStatus == PQTRANS_INERROR)
+	{
+		return true;
+	}
 
-	nodeConnectionHash = hash_create("pg_shard connections", 32, &info, hashFlags);
+	if (nodeConnectionEntry != NULL)
+	{
+		/* a timeout set in an earlier block ended along with it */
+		if (!inTransactionBlock)
+		{
+			nodeConnectionEntry->blockStatementTimeout = -1;
+		}
 
-	return nodeConnectionHash;
+		remoteStatementTimeout = nodeConnectionEntry->blockStatementTimeout;
+		if (remoteStatementTimeout < 0)
+		{
+			remoteStatementTimeout = nodeConnectionEntry->remoteStatementTimeout;
+		}
+	}
+
+	if (remoteStatementTimeout == StatementTimeout)
+	{
+		return true;
+	}
+
+	timeoutCommand = makeStringInfo();
+	if (inTransactionBlock)
+	{
+		appendStringInfo(timeoutCommand, "SET LOCAL statement_timeout TO %d",
+						 StatementTimeout);
+	}
+	else
+	{
+		appendStringInfo(timeoutCommand, "SET statement_timeout TO %d",
+						 StatementTimeout);
+	}
+
+	result = AwaitRemoteQuery(connection, timeoutCommand->data, 0, NULL, NULL,
+							  InvalidOid);
+	if (PQresultStatus(result) == PGRES_COMMAND_OK)
+	{
+		timeoutApplied = true;
+
+		if (nodeConnectionEntry != NULL && inTransactionBlock)
+		{
+			nodeConnectionEntry->blockStatementTimeout = StatementTimeout;
+		}
+		else if (nodeConnectionEntry != NULL)
+		{
+			nodeConnectionEntry->remoteStatementTimeout = StatementTimeout;
+		}
+	}
+
+	PQclear(result);
+
+	return timeoutApplied;
 }
 
 
 /*
- * ConnectToNode opens a connection to a remote PostgreSQL server. The function
- * configures the connection's fallback application name to 'pg_shard' and sets
- * the remote encoding to match the local one. This function requires that the
- * port be specified as a string for easier use with libpq functions.
- *
- * We attempt to connect up to MAX_CONNECT_ATTEMPT times. After that we give up
- * and return NULL.
+ * RemoteQueryStarted notes that a query has been sent on the given connection,
+ * and that its results are outstanding until RemoteQueryFinished is called. If
+ * the local (sub)transaction is aborted in the meantime, the query is cancelled.
  */
-static PGconn *
-ConnectToNode(char *nodeName, char *nodePort)
+void
+RemoteQueryStarted(PGconn *connection)
 {
-	PGconn *connection = NULL;
-	const char *clientEncoding = GetDatabaseEncodingName();
-	const char *dbname = get_database_name(MyDatabaseId);
+	NodeConnectionEntry *nodeConnectionEntry = FindConnectionEntry(connection);
 
-	const char *keywordArray[] = {
-		"host", "port", "fallback_application_name",
-		"client_encoding", "connect_timeout", "dbname", NULL
-	};
-	const char *valueArray[] = {
-		nodeName, nodePort, "pg_shard", clientEncoding,
-		CLIENT_CONNECT_TIMEOUT_SECONDS, dbname, NULL
-	};
+	if (nodeConnectionEntry != NULL)
+	{
+		nodeConnectionEntry->queryInProgress = true;
+		nodeConnectionEntry->querySubtransactionId = GetCurrentSubTransactionId();
+	}
+}
 
-	Assert(sizeof(keywordArray) == sizeof(valueArray));
 
-	for (int attemptIndex = 0; attemptIndex < MAX_CONNECT_ATTEMPTS; attemptIndex++)
+/*
+ * RemoteQueryFinished notes that all results of the query running on the given
+ * connection have been received.
+ */
+void
+RemoteQueryFinished(PGconn *connection)
+{
+	NodeConnectionEntry *nodeConnectionEntry = FindConnectionEntry(connection);
+
+	if (nodeConnectionEntry != NULL)
 	{
-		connection = PQconnectdbParams(keywordArray, valueArray, false);
-		if (PQstatus(connection) == CONNECTION_OK)
+		nodeConnectionEntry->queryInProgress = false;
+
+		/* the query may have ended a block in which a timeout was set */
+		if (PQtransactionStatus(connection) == PQTRANS_IDLE)
 		{
-			break;
+			nodeConnectionEntry->blockStatementTimeout = -1;
 		}
-		else
-		{
-			/* warn if still erroring on final attempt */
-			if (attemptIndex == MAX_CONNECT_ATTEMPTS - 1)
-			{
-				ReportRemoteError(connection, NULL);
-			}
+	}
+}
 
-			PQfinish(connection);
-			connection = NULL;
+
+/*
+ * RemoteQueryInProgress returns whether results of a query are outstanding on
+ * the connection in the given slot to the given node. Such connections are in
+ * use by a cursor, and should not be used for other queries.
+ */
+bool
+RemoteQueryInProgress(char *nodeName, int32 nodePort, int32 connectionSlot)
+{
+	NodeConnectionKey nodeConnectionKey;
+	NodeConnectionEntry *nodeConnectionEntry = NULL;
+	bool entryFound = false;
+
+	if (NodeConnectionHash == NULL)
+	{
+		return false;
+	}
+
+	memset(&nodeConnectionKey, 0, sizeof(nodeConnectionKey));
+	strncpy(nodeConnectionKey.nodeName, nodeName, MAX_NODE_LENGTH);
+	nodeConnectionKey.nodePort = nodePort;
+	nodeConnectionKey.connectionSlot = connectionSlot;
+
+	nodeConnectionEntry = hash_search(NodeConnectionHash, &nodeConnectionKey,
+									  HASH_FIND, &entryFound);
+	if (!entryFound || nodeConnectionEntry->connection == NULL)
+	{
+		return false;
+	}
+
+	return nodeConnectionEntry->queryInProgress;
+}
+
+
+/*
+ * SendRemoteQuery sends the given query and parameter values, if any, on the
+ * given connection without waiting for its results, and notes the query as in
+ * progress. A parameterized query on a distributed table is sent as execution
+ * of a statement prepared on the remote session, so that the remote node parses
+ * and plans each query only once; see GetCachedStatement. The function returns
+ * false if the query could not be sent; PQerrorMessage then describes why.
+ */
+bool
+SendRemoteQuery(PGconn *connection, const char *queryString, int parameterCount,
+				const Oid *parameterTypes, const char *const *parameterValues,
+				Oid relationId)
+{
+	NodeConnectionEntry *nodeConnectionEntry = NULL;
+	int querySent = 0;
+
+	if (parameterCount > 0 && OidIsValid(relationId) &&
+		MaxCachedStatementsPerConnection > 0)
+	{
+		nodeConnectionEntry = FindConnectionEntry(connection);
+	}
+
+	if (nodeConnectionEntry != NULL)
+	{
+		CachedStatement *cachedStatement = GetCachedStatement(nodeConnectionEntry,
+															  queryString,
+															  parameterCount,
+															  parameterTypes,
+															  relationId);
+		if (cachedStatement == NULL)
+		{
+			return false;
 		}
+
+		querySent = PQsendQueryPrepared(connection, cachedStatement->statementName,
+										parameterCount, parameterValues, NULL, NULL,
+										0);
+	}
+	else if (parameterCount > 0)
+	{
+		querySent = PQsendQueryParams(connection, queryString, parameterCount,
+									  parameterTypes, parameterValues, NULL, NULL, 0);
+	}
+	else
+	{
+		querySent = PQsendQuery(connection, queryString);
 	}
 
-	return connection;
+	if (querySent == 0)
+	{
+		return false;
+	}
+
+	RemoteQueryStarted(connection);
+
+	return true;
 }
 
 
 /*
- * ConnectionGetOptionValue inspects the provided connection for an option with
- * a given keyword and returns a new palloc'd string with that options's value.
- * The function returns NULL if the connection has no setting for an option with
- * the provided keyword.
+ * AwaitRemoteResult waits until the next result of the query running on the
+ * given connection can be retrieved with PQgetResult without blocking. Unlike
+ * PQgetResult itself, the function checks for interrupts while it waits, which
+ * lets users cancel queries that are waiting on a remote node. The function
+ * returns false if the connection fails while waiting.
  */
-static char *
-ConnectionGetOptionValue(PGconn *connection, char *optionKeyword)
+bool
+AwaitRemoteResult(PGconn *connection)
 {
-	char *optionValue = NULL;
-	PQconninfoOption *conninfoOptions = PQconninfo(connection);
+	while (PQisBusy(connection))
+	{
+		bool inputConsumed = AwaitRemoteInput(connection);
+		if (!inputConsumed)
+		{
+			return false;
+		}
+	}
 
-	for (PQconninfoOption *option = conninfoOptions; option->keyword != NULL; option++)
+	return true;
+}
+
+
+/*
+ * ReceiveRemoteCopyData returns the next row of data sent by the COPY ... TO
+ * STDOUT command running on the given connection, much like PQgetCopyData. It
+ * waits for the data to arrive, checking for interrupts meanwhile. The function
+ * returns the length of the row stored in buffer, which the caller frees with
+ * PQfreemem; -1 once the copy is done; and -2 if the copy failed.
+ */
+int
+ReceiveRemoteCopyData(PGconn *connection, char **buffer)
+{
+	for (;;)
 	{
-		if (strncmp(option->keyword, optionKeyword, NAMEDATALEN) == 0)
+		bool inputConsumed = false;
+		bool async = true;
+
+		int dataLength = PQgetCopyData(connection, buffer, async);
+		if (dataLength != 0)
 		{
-			optionValue = pstrdup(option->val);
+			return dataLength;
+		}
+
+		inputConsumed = AwaitRemoteInput(connection);
+		if (!inputConsumed)
+		{
+			return -2;
 		}
 	}
+}
 
-	PQconninfoFree(conninfoOptions);
 
-	return optionValue;
+/*
+ * AwaitRemoteResults waits for all results of the query in progress on the
+ * given connection, checking for interrupts meanwhile. The function returns the
+ * result of the query's last statement, or of the first statement which failed,
+ * and NULL if the connection failed.
+ */
+PGresult *
+AwaitRemoteResults(PGconn *connection)
+{
+	PGresult *lastResult = NULL;
+
+	for (;;)
+	{
+		PGresult *result = NULL;
+
+		bool resultReady = AwaitRemoteResult(connection);
+		if (!resultReady)
+		{
+			PQclear(lastResult);
+			lastResult = NULL;
+			break;
+		}
+
+		result = PQgetResult(connection);
+		if (result == NULL)
+		{
+			RemoteQueryFinished(connection);
+			break;
+		}
+
+		/* hold on to the first error, as later statements are not run */
+		if (lastResult != NULL && PQresultStatus(lastResult) == PGRES_FATAL_ERROR)
+		{
+			PQclear(result);
+		}
+		else
+		{
+			PQclear(lastResult);
+			lastResult = result;
+		}
+	}
+
+	return lastResult;
+}
+
+
+/*
+ * ExecuteRemoteQuery executes the given query on the given connection, much
+ * like PQexec. Unlike PQexec, the function first applies the local
+ * statement_timeout to the remote session, unless it is already in effect there
+ * (see ApplyRemoteStatementTimeout), and remains interruptible while the query
+ * runs; if interrupted, the query is cancelled as part of the abort. The
+ * function returns the result of the query's last statement, or of the first
+ * statement which failed. It returns NULL if the query could not be sent or the
+ * timeout could not be applied; PQerrorMessage then describes the failure.
+ */
+PGresult *
+ExecuteRemoteQuery(PGconn *connection, const char *queryString)
+{
+	return ExecuteRemoteQueryParams(connection, queryString, 0, NULL, NULL,
+									InvalidOid);
+}
+
+
+/*
+ * ExecuteRemoteQueryParams works like ExecuteRemoteQuery, but sends the given
+ * parameter values (in text format) along with the query, much like PQexecParams.
+ * A query with parameters must consist of a single statement. If it refers to
+ * the given distributed table, the query is run through a cached statement; see
+ * SendRemoteQuery.
+ */
+PGresult *
+ExecuteRemoteQueryParams(PGconn *connection, const char *queryString,
+						 int parameterCount, const Oid *parameterTypes,
+						 const char *const *parameterValues, Oid relationId)
+{
+	bool timeoutApplied = ApplyRemoteStatementTimeout(connection);
+	if (!timeoutApplied)
+	{
+		return NULL;
+	}
+
+	return AwaitRemoteQuery(connection, queryString, parameterCount, parameterTypes,
+							parameterValues, relationId);
+}
+
+
+/*
+ * AbandonRemoteQuery cancels the query in progress on the given connection, if
+ * any, once its remaining results are no longer needed. If the query does not
+ * wind down in time, the connection is closed.
+ */
+void
+AbandonRemoteQuery(PGconn *connection)
+{
+	NodeConnectionEntry *nodeConnectionEntry = FindConnectionEntry(connection);
+	bool connectionIdle = false;
+
+	if (nodeConnectionEntry == NULL || !nodeConnectionEntry->queryInProgress)
+	{
+		return;
+	}
+
+	connectionIdle = CancelRemoteQuery(connection);
+	nodeConnectionEntry->queryInProgress = false;
+
+	if (!connectionIdle)
+	{
+		PurgeConnection(connection);
+	}
+}
+
+
+/*
+ * CancelRemoteQueries cancels all queries which were started in the given
+ * subtransaction or one of its children and are still in progress, and waits
+ * for them to wind down. That way, the remote nodes stop working on results
+ * which will never be read and the connections can be used for further queries.
+ * All queries are cancelled at once, and connections whose queries do not wind
+ * down in time are closed.
+ */
+static void
+CancelRemoteQueries(SubTransactionId subtransactionId)
+{
+	NodeConnectionEntry *nodeConnectionEntry = NULL;
+	HASH_SEQ_STATUS status;
+	List *connectionList = NIL;
+	List *failedConnectionList = NIL;
+	ListCell *connectionCell = NULL;
+
+	if (NodeConnectionHash == NULL)
+	{
+		return;
+	}
+
+	hash_seq_init(&status, NodeConnectionHash);
+	while ((nodeConnectionEntry = hash_seq_search(&status)) != NULL)
+	{
+		PGconn *connection = nodeConnectionEntry->connection;
+
+		if (connection == NULL || !nodeConnectionEntry->queryInProgress)
+		{
+			continue;
+		}
+
+		/* subtransaction IDs are assigned in order, so children have higher IDs */
+		if (nodeConnectionEntry->querySubtransactionId < subtransactionId)
+		{
+			continue;
+		}
+
+		nodeConnectionEntry->queryInProgress = false;
+		connectionList = lappend(connectionList, connection);
+	}
+
+	failedConnectionList = CancelRemoteQueryList(connectionList);
+
+	foreach(connectionCell, failedConnectionList)
+	{
+		PGconn *connection = (PGconn *) lfirst(connectionCell);
+		NodeConnectionKey nodeConnectionKey;
+		bool entryFound = false;
+
+		nodeConnectionEntry = FindConnectionEntry(connection);
+		Assert(nodeConnectionEntry != NULL);
+
+		nodeConnectionKey = nodeConnectionEntry->cacheKey;
+
+		ForgetCachedStatements(nodeConnectionEntry);
+		hash_search(NodeConnectionHash, &nodeConnectionKey, HASH_REMOVE, &entryFound);
+		PQfinish(connection);
+	}
+
+	list_free(connectionList);
+	list_free(failedConnectionList);
+}
+
+
+/*
+ * CreateNodeConnectionHash returns a newly created hash table suitable for
+ * storing unlimited connections indexed by node name and port.
+ */
+static HTAB *
+CreateNodeConnectionHash(void)
+{
+	HTAB *nodeConnectionHash = NULL;
+	HASHCTL info;
+	int hashFlags = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(NodeConnectionKey);
+	info.entrysize = sizeof(NodeConnectionEntry);
+	info.hash = tag_hash;
+	info.hcxt = CacheMemoryContext;
+	hashFlags = (HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	nodeConnectionHash = hash_create("pg_shard connections", 32, &info, hashFlags);
+
+	/* remote queries should not outlive an aborted local query */
+	RegisterXactCallback(CancelRemoteQueriesAtAbort, NULL);
+	RegisterSubXactCallback(CancelRemoteQueriesAtSubAbort, NULL);
+
+	/* statements prepared remotely may no longer fit a table after DDL */
+	CacheRegisterRelcacheCallback(InvalidateCachedStatements, (Datum) 0);
+
+	return nodeConnectionHash;
+}
+
+
+/*
+ * FindConnectionEntry returns the hash entry holding the given connection, or
+ * NULL if no such entry exists. As connections may live in any slot, the entry
+ * is looked for by the connection itself.
+ */
+static NodeConnectionEntry *
+FindConnectionEntry(PGconn *connection)
+{
+	NodeConnectionEntry *nodeConnectionEntry = NULL;
+	HASH_SEQ_STATUS status;
+
+	if (NodeConnectionHash == NULL)
+	{
+		return NULL;
+	}
+
+	hash_seq_init(&status, NodeConnectionHash);
+	while ((nodeConnectionEntry = hash_seq_search(&status)) != NULL)
+	{
+		if (nodeConnectionEntry->connection == connection)
+		{
+			hash_seq_term(&status);
+			break;
+		}
+	}
+
+	return nodeConnectionEntry;
+}
+
+
+/*
+ * CancelRemoteQueriesAtAbort cancels remote queries which are still running
+ * when the local transaction aborts, for instance because the user cancelled
+ * the query or the local statement_timeout expired.
+ */
+static void
+CancelRemoteQueriesAtAbort(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT)
+	{
+		CancelRemoteQueries(TopSubTransactionId);
+	}
+}
+
+
+/*
+ * CancelRemoteQueriesAtSubAbort does the same as CancelRemoteQueriesAtAbort for
+ * subtransactions, whose errors may be caught without aborting the transaction.
+ * Queries started before the subtransaction, such as those of cursors opened
+ * earlier, are left alone.
+ */
+static void
+CancelRemoteQueriesAtSubAbort(SubXactEvent event, SubTransactionId mySubid,
+							  SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
+		CancelRemoteQueries(mySubid);
+	}
+}
+
+
+/*
+ * CancelRemoteQuery asks the remote node to cancel the query running on the
+ * given connection, and then discards any results which arrive until the query
+ * has ended. The function returns false if the connection failed or the query
+ * did not end within CANCEL_DRAIN_TIMEOUT_MSECS, in which case the caller should
+ * close the connection.
+ */
+static bool
+CancelRemoteQuery(PGconn *connection)
+{
+	List *connectionList = list_make1(connection);
+	List *failedConnectionList = CancelRemoteQueryList(connectionList);
+	bool connectionIdle = (failedConnectionList == NIL);
+
+	list_free(connectionList);
+	list_free(failedConnectionList);
+
+	return connectionIdle;
+}
+
+
+/*
+ * CancelRemoteQueryList cancels the queries running on all given connections.
+ * Cancel requests are sent for all queries first, and a single poll loop then
+ * discards the results of all of them until they have ended, so that cancelling
+ * many queries takes about as long as cancelling the slowest one. As this
+ * function is also called while aborting, it neither checks for interrupts nor
+ * throws errors: instead, it returns the connections which failed or whose
+ * queries did not end within CANCEL_DRAIN_TIMEOUT_MSECS.
+ */
+static List *
+CancelRemoteQueryList(List *connectionList)
+{
+	TimestampTz drainStartTime = GetCurrentTimestamp();
+	List *drainingConnectionList = NIL;
+	List *failedConnectionList = NIL;
+	ListCell *connectionCell = NULL;
+	struct pollfd *pollDescriptorArray = NULL;
+
+	if (connectionList == NIL)
+	{
+		return NIL;
+	}
+
+	foreach(connectionCell, connectionList)
+	{
+		PGconn *connection = (PGconn *) lfirst(connectionCell);
+
+		if (SendCancelRequest(connection))
+		{
+			drainingConnectionList = lappend(drainingConnectionList, connection);
+		}
+		else
+		{
+			failedConnectionList = lappend(failedConnectionList, connection);
+		}
+	}
+
+	pollDescriptorArray = palloc0(list_length(connectionList) * sizeof(struct pollfd));
+
+	while (drainingConnectionList != NIL)
+	{
+		List *busyConnectionList = NIL;
+		int pollDescriptorCount = 0;
+		int pollResult = 0;
+
+		foreach(connectionCell, drainingConnectionList)
+		{
+			PGconn *connection = (PGconn *) lfirst(connectionCell);
+			bool queryEnded = false;
+
+			bool connectionOK = DrainCancelledQuery(connection, &queryEnded);
+			if (!connectionOK)
+			{
+				failedConnectionList = lappend(failedConnectionList, connection);
+			}
+			else if (!queryEnded)
+			{
+				busyConnectionList = lappend(busyConnectionList, connection);
+			}
+		}
+
+		list_free(drainingConnectionList);
+		drainingConnectionList = busyConnectionList;
+
+		if (drainingConnectionList == NIL)
+		{
+			break;
+		}
+
+		if (TimestampDifferenceExceeds(drainStartTime, GetCurrentTimestamp(),
+									   CANCEL_DRAIN_TIMEOUT_MSECS))
+		{
+			failedConnectionList = list_concat(failedConnectionList,
+											   drainingConnectionList);
+			break;
+		}
+
+		foreach(connectionCell, drainingConnectionList)
+		{
+			PGconn *connection = (PGconn *) lfirst(connectionCell);
+			struct pollfd *pollDescriptor = &pollDescriptorArray[pollDescriptorCount];
+
+			pollDescriptor->fd = PQsocket(connection);
+			pollDescriptor->events = POLLIN;
+			pollDescriptor->revents = 0;
+
+			pollDescriptorCount++;
+		}
+
+		pollResult = poll(pollDescriptorArray, pollDescriptorCount,
+						  CONNECT_POLL_TIMEOUT_MSECS);
+		if (pollResult < 0 && errno != EINTR && errno != EAGAIN)
+		{
+			failedConnectionList = list_concat(failedConnectionList,
+											   drainingConnectionList);
+			break;
+		}
+	}
+
+	pfree(pollDescriptorArray);
+
+	return failedConnectionList;
+}
+
+
+/*
+ * SendCancelRequest asks the remote node to cancel the query running on the
+ * given connection, and returns whether the request could be sent.
+ */
+static bool
+SendCancelRequest(PGconn *connection)
+{
+	char errorBuffer[256];
+	PGcancel *cancelObject = PQgetCancel(connection);
+	int cancelSent = 0;
+
+	if (cancelObject == NULL)
+	{
+		return false;
+	}
+
+	cancelSent = PQcancel(cancelObject, errorBuffer, sizeof(errorBuffer));
+	PQfreeCancel(cancelObject);
+
+	return (cancelSent != 0);
+}
+
+
+/*
+ * DrainCancelledQuery consumes whatever input is available on the connection of
+ * a cancelled query and discards any results received, without blocking. The
+ * queryEnded output parameter is set once all of the query's results have been
+ * received. The function returns false if the connection failed, or if the query
+ * is a copy out of the remote node, which does not end by itself.
+ */
+static bool
+DrainCancelledQuery(PGconn *connection, bool *queryEnded)
+{
+	*queryEnded = false;
+
+	if (PQconsumeInput(connection) == 0)
+	{
+		return false;
+	}
+
+	while (!PQisBusy(connection))
+	{
+		ExecStatusType resultStatus = PGRES_EMPTY_QUERY;
+
+		PGresult *result = PQgetResult(connection);
+		if (result == NULL)
+		{
+			*queryEnded = true;
+			return (PQstatus(connection) == CONNECTION_OK);
+		}
+
+		resultStatus = PQresultStatus(result);
+		PQclear(result);
+
+		/* copies in progress do not end by themselves, so end or give up on them */
+		if (resultStatus == PGRES_COPY_IN)
+		{
+			PQputCopyEnd(connection, "remote copy cancelled");
+		}
+		else if (resultStatus == PGRES_COPY_OUT || resultStatus == PGRES_COPY_BOTH)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * ConnectionFailedInStatement returns whether connecting to the node of the
+ * provided key already failed during the current statement. A failure of a
+ * node's first slot counts for all of its slots, so that additional slots do
+ * not make a failing node cost additional timeouts and warnings.
+ */
+static bool
+ConnectionFailedInStatement(NodeConnectionKey *nodeConnectionKey)
+{
+	TimestampTz statementStartTime = GetCurrentStatementStartTimestamp();
+	NodeConnectionKey slotKey = *nodeConnectionKey;
+	int32 slotArray[2] = { nodeConnectionKey->connectionSlot, 0 };
+
+	for (int slotIndex = 0; slotIndex < 2; slotIndex++)
+	{
+		NodeConnectionEntry *nodeConnectionEntry = NULL;
+		bool entryFound = false;
+
+		slotKey.connectionSlot = slotArray[slotIndex];
+		nodeConnectionEntry = hash_search(NodeConnectionHash, &slotKey,
+										  HASH_FIND, &entryFound);
+		if (entryFound && nodeConnectionEntry->connection == NULL &&
+			nodeConnectionEntry->failedStatementTime == statementStartTime)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * PendingConnectionExists returns whether the provided list of pending
+ * connections already contains an entry for the given node.
+ */
+static bool
+PendingConnectionExists(List *pendingConnectionList, NodeConnectionKey *nodeConnectionKey)
+{
+	ListCell *pendingConnectionCell = NULL;
+
+	foreach(pendingConnectionCell, pendingConnectionList)
+	{
+		PendingConnection *pendingConnection = lfirst(pendingConnectionCell);
+		NodeConnectionKey *pendingKey = &pendingConnection->nodeConnectionKey;
+
+		if (pendingKey->nodePort == nodeConnectionKey->nodePort &&
+			pendingKey->connectionSlot == nodeConnectionKey->connectionSlot &&
+			strncmp(pendingKey->nodeName, nodeConnectionKey->nodeName,
+					MAX_NODE_LENGTH) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * StartConnectionAttempt begins a non-blocking connection attempt to the node
+ * of the provided pending connection. The function configures the connection's
+ * fallback application name to 'pg_shard' and sets the remote encoding to match
+ * the local one. If libpq rejects the attempt outright, the failure is handled
+ * immediately, which may in turn start another attempt.
+ */
+static void
+StartConnectionAttempt(PendingConnection *pendingConnection)
+{
+	NodeConnectionKey *nodeConnectionKey = &pendingConnection->nodeConnectionKey;
+	PGconn *connection = NULL;
+	const char *clientEncoding = GetDatabaseEncodingName();
+	const char *dbname = get_database_name(MyDatabaseId);
+	StringInfo nodePortString = makeStringInfo();
+
+	const char *keywordArray[] = {
+		"host", "port", "fallback_application_name",
+		"client_encoding", "connect_timeout", "dbname", NULL
+	};
+	const char *valueArray[] = {
+		nodeConnectionKey->nodeName, NULL, "pg_shard", clientEncoding,
+		CLIENT_CONNECT_TIMEOUT_SECONDS, dbname, NULL
+	};
+
+	Assert(sizeof(keywordArray) == sizeof(valueArray));
+
+	appendStringInfo(nodePortString, "%d", nodeConnectionKey->nodePort);
+	valueArray[1] = nodePortString->data;
+
+	connection = PQconnectStartParams(keywordArray, valueArray, false);
+	if (connection == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY),
+						errmsg("out of memory")));
+	}
+
+	pendingConnection->connection = connection;
+	pendingConnection->attemptStartTime = GetCurrentTimestamp();
+	pendingConnection->attemptCount++;
+
+	if (PQstatus(connection) == CONNECTION_BAD)
+	{
+		HandleFailedConnectionAttempt(pendingConnection, false);
+	}
+	else
+	{
+		/* libpq asks that we act as though polling last returned "writing" */
+		pendingConnection->pollingStatus = PGRES_POLLING_WRITING;
+	}
+}
+
+
+/*
+ * SkipUnavailableNode marks the provided pending connection as failed without
+ * attempting to connect, because its node recently failed and has not yet
+ * recovered. We still warn, just as though the attempt had been made.
+ */
+static void
+SkipUnavailableNode(PendingConnection *pendingConnection)
+{
+	NodeConnectionKey *nodeConnectionKey = &pendingConnection->nodeConnectionKey;
+
+	ereport(WARNING, (errcode(ERRCODE_CONNECTION_FAILURE),
+					  errmsg("Connection failed to %s:%d", nodeConnectionKey->nodeName,
+							 nodeConnectionKey->nodePort),
+					  errdetail("Recent connection attempts to this node failed, so "
+								"it is being skipped until it responds again.")));
+
+	pendingConnection->connection = NULL;
+	pendingConnection->pollingStatus = PGRES_POLLING_FAILED;
+}
+
+
+/*
+ * PollPendingConnections waits on the sockets of all provided pending
+ * connections at once, advancing each with PQconnectPoll whenever its socket
+ * becomes ready. Attempts which fail or exceed CLIENT_CONNECT_TIMEOUT_MSECS are
+ * retried until MAX_CONNECT_ATTEMPTS is reached. The function returns once
+ * every connection has either been established or has definitively failed.
+ * Failed connections are left with a NULL connection field.
+ */
+static void
+PollPendingConnections(List *pendingConnectionList)
+{
+	int pendingConnectionCount = list_length(pendingConnectionList);
+	struct pollfd *pollDescriptorArray = palloc0(pendingConnectionCount *
+												 sizeof(struct pollfd));
+	PendingConnection **pollConnectionArray = palloc0(pendingConnectionCount *
+													  sizeof(PendingConnection *));
+
+	for (;;)
+	{
+		ListCell *pendingConnectionCell = NULL;
+		TimestampTz currentTime = GetCurrentTimestamp();
+		int pollDescriptorCount = 0;
+		int pollResult = 0;
+
+		foreach(pendingConnectionCell, pendingConnectionList)
+		{
+			PendingConnection *pendingConnection = lfirst(pendingConnectionCell);
+			struct pollfd *pollDescriptor = NULL;
+			int socketDescriptor = -1;
+
+			if (pendingConnection->connection == NULL ||
+				pendingConnection->pollingStatus == PGRES_POLLING_OK)
+			{
+				continue;
+			}
+
+			if (TimestampDifferenceExceeds(pendingConnection->attemptStartTime,
+										   currentTime, CLIENT_CONNECT_TIMEOUT_MSECS))
+			{
+				HandleFailedConnectionAttempt(pendingConnection, true);
+				if (pendingConnection->connection == NULL)
+				{
+					continue;
+				}
+			}
+
+			socketDescriptor = PQsocket(pendingConnection->connection);
+			if (socketDescriptor < 0)
+			{
+				HandleFailedConnectionAttempt(pendingConnection, false);
+				continue;
+			}
+
+			pollDescriptor = &pollDescriptorArray[pollDescriptorCount];
+			pollDescriptor->fd = socketDescriptor;
+			pollDescriptor->revents = 0;
+			if (pendingConnection->pollingStatus == PGRES_POLLING_READING)
+			{
+				pollDescriptor->events = POLLIN;
+			}
+			else
+			{
+				pollDescriptor->events = POLLOUT;
+			}
+
+			pollConnectionArray[pollDescriptorCount] = pendingConnection;
+			pollDescriptorCount++;
+		}
+
+		if (pollDescriptorCount == 0)
+		{
+			break;
+		}
+
+		pollResult = poll(pollDescriptorArray, pollDescriptorCount,
+						  CONNECT_POLL_TIMEOUT_MSECS);
+		if (pollResult < 0 && errno != EINTR && errno != EAGAIN)
+		{
+			ereport(ERROR, (errcode_for_socket_access(),
+							errmsg("poll() failed: %m")));
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (int pollIndex = 0; pollIndex < pollDescriptorCount && pollResult > 0;
+			 pollIndex++)
+		{
+			PendingConnection *pendingConnection = pollConnectionArray[pollIndex];
+
+			if (pollDescriptorArray[pollIndex].revents == 0)
+			{
+				continue;
+			}
+
+			pendingConnection->pollingStatus =
+				PQconnectPoll(pendingConnection->connection);
+			if (pendingConnection->pollingStatus == PGRES_POLLING_FAILED)
+			{
+				HandleFailedConnectionAttempt(pendingConnection, false);
+			}
+		}
+	}
+
+	pfree(pollDescriptorArray);
+	pfree(pollConnectionArray);
+}
+
+
+/*
+ * HandleFailedConnectionAttempt closes the current connection attempt of the
+ * provided pending connection. If fewer than MAX_CONNECT_ATTEMPTS attempts have
+ * been made, a new attempt is started; otherwise, we give up on the node and
+ * warn about the failure.
+ */
+static void
+HandleFailedConnectionAttempt(PendingConnection *pendingConnection, bool attemptTimedOut)
+{
+	PGconn *connection = pendingConnection->connection;
+	NodeConnectionKey *nodeConnectionKey = &pendingConnection->nodeConnectionKey;
+	bool finalAttempt = (pendingConnection->attemptCount >= MAX_CONNECT_ATTEMPTS);
+
+	/* warn if still erroring on final attempt */
+	if (finalAttempt)
+	{
+		if (attemptTimedOut)
+		{
+			ereport(WARNING, (errcode(ERRCODE_CONNECTION_FAILURE),
+							  errmsg("Connection failed to %s:%d",
+									 nodeConnectionKey->nodeName,
+									 nodeConnectionKey->nodePort),
+							  errdetail("Remote message: timeout expired")));
+		}
+		else
+		{
+			ReportRemoteError(connection, NULL);
+		}
+	}
+
+	PQfinish(connection);
+	pendingConnection->connection = NULL;
+	pendingConnection->pollingStatus = PGRES_POLLING_FAILED;
+
+	if (!finalAttempt)
+	{
+		StartConnectionAttempt(pendingConnection);
+	}
+}
+
+
+/*
+ * FinishPendingConnections closes every connection attempt in the provided
+ * list, regardless of its state. It is used to clean up after an error or an
+ * interrupt aborts EstablishConnections.
+ */
+static void
+FinishPendingConnections(List *pendingConnectionList)
+{
+	ListCell *pendingConnectionCell = NULL;
+
+	foreach(pendingConnectionCell, pendingConnectionList)
+	{
+		PendingConnection *pendingConnection = lfirst(pendingConnectionCell);
+
+		if (pendingConnection->connection != NULL)
+		{
+			PQfinish(pendingConnection->connection);
+			pendingConnection->connection = NULL;
+		}
+	}
+}
+
+
+/*
+ * ConnectionGetOptionValue inspects the provided connection for an option with
+ * a given keyword and returns a new palloc'd string with that options's value.
+ * The function returns NULL if the connection has no setting for an option with
+ * the provided keyword.
+ */
+static char *
+ConnectionGetOptionValue(PGconn *connection, char *optionKeyword)
+{
+	char *optionValue = NULL;
+	PQconninfoOption *conninfoOptions = PQconninfo(connection);
+
+	for (PQconninfoOption *option = conninfoOptions; option->keyword != NULL; option++)
+	{
+		if (strncmp(option->keyword, optionKeyword, NAMEDATALEN) == 0)
+		{
+			optionValue = pstrdup(option->val);
+		}
+	}
+
+	PQconninfoFree(conninfoOptions);
+
+	return optionValue;
+}
+
+
+/*
+ * AwaitRemoteInput waits for input to arrive on the given connection, for at
+ * most CONNECT_POLL_TIMEOUT_MSECS, checks for interrupts, and consumes the input
+ * which arrived, if any. The function returns false if the connection failed.
+ */
+static bool
+AwaitRemoteInput(PGconn *connection)
+{
+	struct pollfd pollDescriptor;
+	int pollResult = 0;
+
+	pollDescriptor.fd = PQsocket(connection);
+	pollDescriptor.events = POLLIN;
+	pollDescriptor.revents = 0;
+
+	pollResult = poll(&pollDescriptor, 1, CONNECT_POLL_TIMEOUT_MSECS);
+	if (pollResult < 0 && errno != EINTR && errno != EAGAIN)
+	{
+		ereport(ERROR, (errcode_for_socket_access(),
+						errmsg("poll() failed: %m")));
+	}
+
+	CHECK_FOR_INTERRUPTS();
+
+	if (pollResult > 0 && PQconsumeInput(connection) == 0)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * AwaitRemoteQuery sends the given query and parameter values, if any, on the
+ * given connection and waits for all of its results; see AwaitRemoteResults.
+ * The function returns NULL if the query could not be sent.
+ */
+static PGresult *
+AwaitRemoteQuery(PGconn *connection, const char *queryString, int parameterCount,
+				 const Oid *parameterTypes, const char *const *parameterValues,
+				 Oid relationId)
+{
+	bool querySent = SendRemoteQuery(connection, queryString, parameterCount,
+									 parameterTypes, parameterValues, relationId);
+	if (!querySent)
+	{
+		return NULL;
+	}
+
+	return AwaitRemoteResults(connection);
+}
+
+
+/*
+ * GetCachedStatement returns the statement prepared on the remote session of
+ * the given connection entry for the given query and parameter types. If no
+ * such statement exists yet, the function prepares one, which takes a round
+ * trip of its own. The entry keeps at most max_cached_statements_per_connection
+ * statements; to make room for a new statement, the least recently used one is
+ * evicted. Evicted or invalidated statements are deallocated on the remote
+ * session before the next statement is prepared. The function returns NULL if
+ * the statement could not be prepared; PQerrorMessage then describes why.
+ */
+static CachedStatement *
+GetCachedStatement(NodeConnectionEntry *nodeConnectionEntry, const char *queryString,
+				   int parameterCount, const Oid *parameterTypes, Oid relationId)
+{
+	PGconn *connection = nodeConnectionEntry->connection;
+	CachedStatement *cachedStatement = NULL;
+	ListCell *cachedStatementCell = NULL;
+	MemoryContext oldContext = NULL;
+	PGresult *result = NULL;
+	bool statementsDeallocated = false;
+	bool statementPrepared = false;
+	int prepareSent = 0;
+	char statementName[NAMEDATALEN];
+
+	foreach(cachedStatementCell, nodeConnectionEntry->cachedStatementList)
+	{
+		CachedStatement *candidateStatement = lfirst(cachedStatementCell);
+
+		if (candidateStatement->relationId == relationId &&
+			candidateStatement->parameterCount == parameterCount &&
+			memcmp(candidateStatement->parameterTypes, parameterTypes,
+				   parameterCount * sizeof(Oid)) == 0 &&
+			strcmp(candidateStatement->queryString, queryString) == 0)
+		{
+			cachedStatement = candidateStatement;
+			break;
+		}
+	}
+
+	oldContext = MemoryContextSwitchTo(CacheMemoryContext);
+
+	if (cachedStatement != NULL)
+	{
+		/* move the statement to the front to keep the list in order of use */
+		nodeConnectionEntry->cachedStatementList =
+			list_delete_ptr(nodeConnectionEntry->cachedStatementList, cachedStatement);
+		nodeConnectionEntry->cachedStatementList =
+			lcons(cachedStatement, nodeConnectionEntry->cachedStatementList);
+
+		MemoryContextSwitchTo(oldContext);
+
+		return cachedStatement;
+	}
+
+	/* evict the least recently used statements to make room for a new one */
+	while (list_length(nodeConnectionEntry->cachedStatementList) >=
+		   MaxCachedStatementsPerConnection)
+	{
+		CachedStatement *evictedStatement =
+			llast(nodeConnectionEntry->cachedStatementList);
+
+		nodeConnectionEntry->cachedStatementList =
+			list_truncate(nodeConnectionEntry->cachedStatementList,
+						  list_length(nodeConnectionEntry->cachedStatementList) - 1);
+		nodeConnectionEntry->staleStatementList =
+			lappend(nodeConnectionEntry->staleStatementList, evictedStatement);
+	}
+
+	MemoryContextSwitchTo(oldContext);
+
+	statementsDeallocated = DeallocateStaleStatements(nodeConnectionEntry);
+	if (!statementsDeallocated)
+	{
+		return NULL;
+	}
+
+	snprintf(statementName, NAMEDATALEN, "%s%u", CACHED_STATEMENT_NAME_PREFIX,
+			 NextCachedStatementNumber++);
+
+	prepareSent = PQsendPrepare(connection, statementName, queryString,
+								parameterCount, parameterTypes);
+	if (prepareSent == 0)
+	{
+		return NULL;
+	}
+
+	RemoteQueryStarted(connection);
+
+	result = AwaitRemoteResults(connection);
+	statementPrepared = (PQresultStatus(result) == PGRES_COMMAND_OK);
+	PQclear(result);
+
+	if (!statementPrepared)
+	{
+		return NULL;
+	}
+
+	oldContext = MemoryContextSwitchTo(CacheMemoryContext);
+
+	cachedStatement = palloc0(sizeof(CachedStatement));
+	strlcpy(cachedStatement->statementName, statementName, NAMEDATALEN);
+	cachedStatement->queryString = pstrdup(queryString);
+	cachedStatement->parameterCount = parameterCount;
+	cachedStatement->parameterTypes = palloc(parameterCount * sizeof(Oid));
+	memcpy(cachedStatement->parameterTypes, parameterTypes,
+		   parameterCount * sizeof(Oid));
+	cachedStatement->relationId = relationId;
+
+	nodeConnectionEntry->cachedStatementList =
+		lcons(cachedStatement, nodeConnectionEntry->cachedStatementList);
+
+	MemoryContextSwitchTo(oldContext);
+
+	return cachedStatement;
+}
+
+
+/*
+ * DeallocateStaleStatements deallocates the stale statements of the given
+ * connection entry on its remote session, all in a single round trip. Failing
+ * to deallocate a statement only leaves it behind on the remote session, so the
+ * function just returns whether the connection is still usable afterwards.
+ */
+static bool
+DeallocateStaleStatements(NodeConnectionEntry *nodeConnectionEntry)
+{
+	PGconn *connection = nodeConnectionEntry->connection;
+	StringInfo deallocateCommand = NULL;
+	ListCell *staleStatementCell = NULL;
+	PGresult *result = NULL;
+	bool connectionUsable = false;
+
+	if (nodeConnectionEntry->staleStatementList == NIL)
+	{
+		return true;
+	}
+
+	deallocateCommand = makeStringInfo();
+	foreach(staleStatementCell, nodeConnectionEntry->staleStatementList)
+	{
+		CachedStatement *staleStatement = lfirst(staleStatementCell);
+
+		appendStringInfo(deallocateCommand, "DEALLOCATE %s;",
+						 staleStatement->statementName);
+		FreeCachedStatement(staleStatement);
+	}
+
+	list_free(nodeConnectionEntry->staleStatementList);
+	nodeConnectionEntry->staleStatementList = NIL;
+
+	result = AwaitRemoteQuery(connection, deallocateCommand->data, 0, NULL, NULL,
+							  InvalidOid);
+	connectionUsable = (result != NULL && PQstatus(connection) == CONNECTION_OK);
+	PQclear(result);
+
+	return connectionUsable;
+}
+
+
+/*
+ * InvalidateCachedStatements is called whenever the relation cache entry of the
+ * given relation, or of all relations if given InvalidOid, is invalidated, for
+ * instance as DDL commands change the relation. As statements which refer to
+ * such a relation may no longer be valid, the function marks them as stale.
+ */
+static void
+InvalidateCachedStatements(Datum argument, Oid relationId)
+{
+	NodeConnectionEntry *nodeConnectionEntry = NULL;
+	MemoryContext oldContext = NULL;
+	HASH_SEQ_STATUS status;
+
+	if (NodeConnectionHash == NULL)
+	{
+		return;
+	}
+
+	oldContext = MemoryContextSwitchTo(CacheMemoryContext);
+
+	hash_seq_init(&status, NodeConnectionHash);
+	while ((nodeConnectionEntry = hash_seq_search(&status)) != NULL)
+	{
+		List *validStatementList = NIL;
+		ListCell *cachedStatementCell = NULL;
+
+		foreach(cachedStatementCell, nodeConnectionEntry->cachedStatementList)
+		{
+			CachedStatement *cachedStatement = lfirst(cachedStatementCell);
+
+			if (relationId == InvalidOid || cachedStatement->relationId == relationId)
+			{
+				nodeConnectionEntry->staleStatementList =
+					lappend(nodeConnectionEntry->staleStatementList, cachedStatement);
+			}
+			else
+			{
+				validStatementList = lappend(validStatementList, cachedStatement);
+			}
+		}
+
+		list_free(nodeConnectionEntry->cachedStatementList);
+		nodeConnectionEntry->cachedStatementList = validStatementList;
+	}
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * ForgetCachedStatements frees all statements kept for the given connection
+ * entry, whose remote session is about to be closed along with its statements.
+ */
+static void
+ForgetCachedStatements(NodeConnectionEntry *nodeConnectionEntry)
+{
+	ListCell *cachedStatementCell = NULL;
+
+	foreach(cachedStatementCell, nodeConnectionEntry->cachedStatementList)
+	{
+		FreeCachedStatement((CachedStatement *) lfirst(cachedStatementCell));
+	}
+
+	foreach(cachedStatementCell, nodeConnectionEntry->staleStatementList)
+	{
+		FreeCachedStatement((CachedStatement *) lfirst(cachedStatementCell));
+	}
+
+	list_free(nodeConnectionEntry->cachedStatementList);
+	list_free(nodeConnectionEntry->staleStatementList);
+
+	nodeConnectionEntry->cachedStatementList = NIL;
+	nodeConnectionEntry->staleStatementList = NIL;
+}
+
+
+/* FreeCachedStatement frees the given cached statement and its fields. */
+static void
+FreeCachedStatement(CachedStatement *cachedStatement)
+{
+	pfree(cachedStatement->queryString);
+	pfree(cachedStatement->parameterTypes);
+	pfree(cachedStatement);
 }
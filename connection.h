@@ -16,9 +16,16 @@
 #include "c.h"
 #include "libpq-fe.h"
 
+#include "datatype/timestamp.h"
+#include "nodes/pg_list.h"
+
 
 /* maximum duration to wait for connection */
 #define CLIENT_CONNECT_TIMEOUT_SECONDS "5"
+#define CLIENT_CONNECT_TIMEOUT_MSECS 5000
+
+/* longest time to block in poll before rechecking for interrupts */
+#define CONNECT_POLL_TIMEOUT_MSECS 100
 
 /* maximum (textual) lengths of hostname */
 #define MAX_NODE_LENGTH 255
@@ -26,33 +33,124 @@
 /* times to attempt connection (or reconnection) */
 #define MAX_CONNECT_ATTEMPTS 2
 
+/* upper limit for the number of connections a backend may hold to one node */
+#define MAX_CONNECTIONS_PER_NODE_LIMIT 64
+
+/* connections from this slot on are reserved for streaming cursor results */
+#define FIRST_CURSOR_CONNECTION_SLOT MAX_CONNECTIONS_PER_NODE_LIMIT
+
+/* maximum number of cursors which may stream results from one node at once */
+#define MAX_CURSOR_CONNECTIONS_PER_NODE 64
+
+/* longest time to wait for a cancelled remote query to wind down */
+#define CANCEL_DRAIN_TIMEOUT_MSECS 1000
+
+/* prefix of the names of statements prepared on remote sessions */
+#define CACHED_STATEMENT_NAME_PREFIX "pg_shard_statement_"
+
 /* SQL statement for testing */
 #define TEST_SQL "DO $$ BEGIN RAISE EXCEPTION 'Raised remotely!'; END $$"
 
 
 /*
  * NodeConnectionKey acts as the key to index into the (process-local) hash
- * keeping track of open connections. Node name and port are sufficient.
+ * keeping track of open connections. Besides node name and port, the key holds
+ * a connection slot, which allows a backend to keep several connections to the
+ * same node in order to run multiple queries on it in parallel. Most callers
+ * simply use slot zero.
  */
 typedef struct NodeConnectionKey
 {
 	char nodeName[MAX_NODE_LENGTH + 1]; /* hostname of host to connect to */
 	int32 nodePort;                     /* port of host to connect to */
+	int32 connectionSlot;               /* index among connections to the node */
 } NodeConnectionKey;
 
 
-/* NodeConnectionEntry keeps track of connections themselves. */
+/*
+ * CachedStatement describes a statement prepared on a remote session for a
+ * parameterized shard query, which later queries of the same shape execute
+ * rather than send their query text again.
+ */
+typedef struct CachedStatement
+{
+	char statementName[NAMEDATALEN]; /* name of the remote prepared statement */
+	char *queryString;               /* query the statement was prepared for */
+	int parameterCount;              /* number of parameters of the query */
+	Oid *parameterTypes;             /* types the parameters were prepared with */
+	Oid relationId;                  /* distributed table the query refers to */
+} CachedStatement;
+
+
+/*
+ * NodeConnectionEntry keeps track of connections themselves. An entry without
+ * a connection records a failed attempt to connect, which is not retried until
+ * a new statement begins. Entries also note whether a query is in progress on
+ * their connection, so that such queries can be cancelled if the local query
+ * is aborted, and the statement_timeout last set on the remote session, as well
+ * as any set for the rest of the remote transaction block in progress. Last, entries keep the statements prepared on the
+ * remote session, most recently used first, as well as those evicted or
+ * invalidated but not yet deallocated.
+ */
 typedef struct NodeConnectionEntry
 {
-	NodeConnectionKey cacheKey; /* hash entry key */
-	PGconn *connection;         /* connection to remote server, if any */
+	NodeConnectionKey cacheKey;      /* hash entry key */
+	PGconn *connection;              /* connection to remote server, if any */
+	TimestampTz failedStatementTime; /* start of statement whose attempt failed */
+	bool queryInProgress;            /* whether results are still outstanding */
+	SubTransactionId querySubtransactionId; /* subtransaction query started in */
+	int remoteStatementTimeout;      /* statement_timeout set on remote session */
+	int blockStatementTimeout;       /* statement_timeout set in remote block, or -1 */
+	List *cachedStatementList;       /* statements prepared on remote session */
+	List *staleStatementList;        /* statements yet to be deallocated */
 } NodeConnectionEntry;
 
 
+/*
+ * PendingConnection tracks a single connection attempt which is in progress
+ * as part of EstablishConnections. A connection whose polling status reaches
+ * PGRES_POLLING_FAILED after its last permitted attempt is left NULL.
+ */
+typedef struct PendingConnection
+{
+	NodeConnectionKey nodeConnectionKey;      /* node to connect to */
+	PGconn *connection;                       /* connection being established */
+	PostgresPollingStatusType pollingStatus;  /* last result of PQconnectPoll */
+	TimestampTz attemptStartTime;             /* start time of current attempt */
+	int attemptCount;                         /* attempts started so far */
+} PendingConnection;
+
+
+/* config variables managed via guc.c */
+extern int MaxConnectionsPerNode;
+extern int MaxCachedStatementsPerConnection;
+
+
 /* function declarations for obtaining and using a connection */
 extern PGconn * GetConnection(char *nodeName, int32 nodePort);
+extern PGconn * GetConnectionForSlot(char *nodeName, int32 nodePort,
+									 int32 connectionSlot);
+extern void EstablishConnections(List *nodeConnectionKeyList);
 extern void PurgeConnection(PGconn *connection);
 extern void ReportRemoteError(PGconn *connection, PGresult *result);
 
+/* function declarations for sending, tracking and cancelling remote queries */
+extern bool ApplyRemoteStatementTimeout(PGconn *connection);
+extern void RemoteQueryStarted(PGconn *connection);
+extern void RemoteQueryFinished(PGconn *connection);
+extern bool RemoteQueryInProgress(char *nodeName, int32 nodePort, int32 connectionSlot);
+extern bool SendRemoteQuery(PGconn *connection, const char *queryString,
+							int parameterCount, const Oid *parameterTypes,
+							const char *const *parameterValues, Oid relationId);
+extern bool AwaitRemoteResult(PGconn *connection);
+extern PGresult * AwaitRemoteResults(PGconn *connection);
+extern int ReceiveRemoteCopyData(PGconn *connection, char **buffer);
+extern PGresult * ExecuteRemoteQuery(PGconn *connection, const char *queryString);
+extern PGresult * ExecuteRemoteQueryParams(PGconn *connection, const char *queryString,
+										   int parameterCount, const Oid *parameterTypes,
+										   const char *const *parameterValues,
+										   Oid relationId);
+extern void AbandonRemoteQuery(PGconn *connection);
+
 
 #endif /* PG_SHARD_CONNECTION_H */
@@ -33,6 +33,7 @@
 #include "catalog/namespace.h"
 #include "catalog/pg_class.h"
 #include "catalog/pg_am.h"
+#include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
@@ -48,9 +49,19 @@
 
 /* local function forward declarations */
 static void CheckHashPartitionedTable(Oid distributedTableId);
-static List * ParseWorkerNodeFile(char *workerNodeFilename);
+static void InsertMissingPlacementRows(uint64 shardId, List *workerNodeList);
+static void CreateColocatedShards(Oid distributedTableId, Oid sourceTableId,
+								  int32 shardCount, int32 replicationFactor,
+								  List *ddlParseTreeList, char shardStorageType);
+static ShardCreationRequest * CreateShardPlacements(List *shardRequestList,
+													int32 placementCount,
+													int32 minimumPlacementCount);
+static void EstablishCandidateConnections(List *shardRequestList);
+static List * AddToNodeShardBatch(List *nodeBatchList, WorkerNode *workerNode,
+								  ShardCreationRequest *shardRequest);
+static void ExecuteNodeShardBatches(List *nodeBatchList);
+static StringInfo NodeShardBatchCommand(NodeShardBatch *nodeBatch);
 static int CompareWorkerNodes(const void *leftElement, const void *rightElement);
-static bool ExecuteRemoteCommand(PGconn *connection, const char *sqlCommand);
 static text * IntegerToText(int32 value);
 static Oid SupportFunctionForColumn(Var *partitionColumn, Oid accessMethodId,
 									int16 supportFunctionNumber);
@@ -59,6 +70,7 @@ static Oid SupportFunctionForColumn(Var *partitionColumn, Oid accessMethodId,
 /* declarations for dynamic loading */
 PG_FUNCTION_INFO_V1(master_create_distributed_table);
 PG_FUNCTION_INFO_V1(master_create_worker_shards);
+PG_FUNCTION_INFO_V1(master_create_reference_table);
 
 
 /*
@@ -132,6 +144,13 @@ master_create_distributed_table(PG_FUNCTION_ARGS)
 							   "defined to use range partitioning.")));
 		}
 	}
+	else if (partitionMethod == REFERENCE_PARTITION_TYPE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("reference tables are not partitioned"),
+						errhint("Use master_create_reference_table to create "
+								"reference tables.")));
+	}
 
 	/* insert row into the partition metadata table */
 	InsertPartitionRow(distributedTableId, partitionMethod, partitionColumnText);
@@ -144,10 +163,13 @@ master_create_distributed_table(PG_FUNCTION_ARGS)
  * master_create_worker_shards creates empty shards for the given table based
  * on the specified number of initial shards. The function first gets a list of
  * candidate nodes and issues DDL commands on the nodes to create empty shard
- * placements on those nodes. The function then updates metadata on the master
- * node to make this shard (and its placements) visible. Note that the function
+ * placements on those nodes; the placements are created on all nodes at once,
+ * see CreateShardPlacements. The function then updates metadata on the master
+ * node to make these shards (and their placements) visible. Note that the function
  * assumes the table is hash partitioned and calculates the min/max hash token
- * ranges for each shard, giving them an equal split of the hash space.
+ * ranges for each shard, giving them an equal split of the hash space. If the
+ * name of another table is given to co-locate with, the shards are instead
+ * created alongside that table's shards; see CreateColocatedShards.
  */
 Datum
 master_create_worker_shards(PG_FUNCTION_ARGS)
@@ -155,14 +177,17 @@ master_create_worker_shards(PG_FUNCTION_ARGS)
 	text *tableNameText = PG_GETARG_TEXT_P(0);
 	int32 shardCount = PG_GETARG_INT32(1);
 	int32 replicationFactor = PG_GETARG_INT32(2);
+	text *colocateWithText = PG_GETARG_TEXT_P(3);
 
 	Oid distributedTableId = ResolveRelationId(tableNameText);
 	char relationKind = get_rel_relkind(distributedTableId);
 	char *tableName = text_to_cstring(tableNameText);
+	char *colocateWithName = text_to_cstring(colocateWithText);
 	char shardStorageType = '\0';
 	int32 shardIndex = 0;
 	List *workerNodeList = NIL;
 	List *ddlCommandList = NIL;
+	List *ddlParseTreeList = NIL;
 	int32 workerNodeCount = 0;
 	uint32 placementAttemptCount = 0;
 	uint32 hashTokenIncrement = 0;
@@ -204,8 +229,9 @@ master_create_worker_shards(PG_FUNCTION_ARGS)
 	/* make sure we don't process cancel signals until all shards are created */
 	HOLD_INTERRUPTS();
 
-	/* retrieve the DDL commands for the table */
+	/* retrieve the DDL commands for the table, and parse them once for all shards */
 	ddlCommandList = TableDDLCommandList(distributedTableId);
+	ddlParseTreeList = ParseDDLCommandList(ddlCommandList);
 
 	workerNodeCount = list_length(workerNodeList);
 	if (replicationFactor > workerNodeCount)
@@ -234,87 +260,656 @@ master_create_worker_shards(PG_FUNCTION_ARGS)
 		shardStorageType = SHARD_STORAGE_TABLE;
 	}
 
-	for (shardIndex = 0; shardIndex < shardCount; shardIndex++)
+	if (strncmp(colocateWithName, COLOCATE_WITH_NONE, NAMEDATALEN) != 0)
 	{
-		uint64 shardId = NextSequenceId(SHARD_ID_SEQUENCE_NAME);
-		int32 placementCount = 0;
-		uint32 placementIndex = 0;
-		uint32 roundRobinNodeIndex = shardIndex % workerNodeCount;
+		Oid sourceTableId = ResolveRelationId(colocateWithText);
+
+		CreateColocatedShards(distributedTableId, sourceTableId, shardCount,
+							  replicationFactor, ddlParseTreeList, shardStorageType);
+	}
+	else
+	{
+		List *shardRequestList = NIL;
+		List *shardIntervalList = NIL;
+		ShardCreationRequest *failedShardRequest = NULL;
+		ListCell *shardRequestCell = NULL;
+
+		/* allocate the ids of all shards up front */
+		uint64 *shardIdArray = NextSequenceIdArray(SHARD_ID_SEQUENCE_NAME, shardCount);
+
+		for (shardIndex = 0; shardIndex < shardCount; shardIndex++)
+		{
+			ShardCreationRequest *shardRequest = palloc0(sizeof(ShardCreationRequest));
+			uint64 shardId = shardIdArray[shardIndex];
+			uint32 placementIndex = 0;
+			uint32 roundRobinNodeIndex = shardIndex % workerNodeCount;
+
+			shardRequest->shardId = shardId;
+			shardRequest->ddlCommandList =
+				ExtendedParsedDDLCommandList(distributedTableId, shardId,
+											 ddlParseTreeList);
+
+			for (placementIndex = 0; placementIndex < placementAttemptCount;
+				 placementIndex++)
+			{
+				int32 candidateNodeIndex =
+					(roundRobinNodeIndex + placementIndex) % workerNodeCount;
+				WorkerNode *candidateNode = (WorkerNode *) list_nth(workerNodeList,
+																	candidateNodeIndex);
 
-		List *extendedDDLCommands = ExtendedDDLCommandList(distributedTableId, shardId,
-														   ddlCommandList);
+				shardRequest->candidateNodeList =
+					lappend(shardRequest->candidateNodeList, candidateNode);
+			}
 
-		/* initialize the hash token space for this shard */
-		text *minHashTokenText = NULL;
-		text *maxHashTokenText = NULL;
-		int32 shardMinHashToken = INT_MIN + (shardIndex * hashTokenIncrement);
-		int32 shardMaxHashToken = shardMinHashToken + hashTokenIncrement - 1;
+			shardRequestList = lappend(shardRequestList, shardRequest);
+		}
 
-		/* if we are at the last shard, make sure the max token value is INT_MAX */
-		if (shardIndex == (shardCount - 1))
+		/* create the placements of all shards, and check there are enough of them */
+		failedShardRequest = CreateShardPlacements(shardRequestList, replicationFactor,
+												   replicationFactor);
+		if (failedShardRequest != NULL)
 		{
-			shardMaxHashToken = INT_MAX;
+			ereport(ERROR, (errmsg("could not satisfy specified replication "
+								   "factor"),
+							errdetail("Created %d shard replicas, less than the "
+									  "requested replication factor of %d.",
+									  failedShardRequest->placementCount,
+									  replicationFactor)));
 		}
 
-		for (placementIndex = 0; placementIndex < placementAttemptCount; placementIndex++)
+		shardIndex = 0;
+		foreach(shardRequestCell, shardRequestList)
 		{
-			int32 candidateNodeIndex =
-				(roundRobinNodeIndex + placementIndex) % workerNodeCount;
-			WorkerNode *candidateNode = (WorkerNode *) list_nth(workerNodeList,
-																candidateNodeIndex);
-			char *nodeName = candidateNode->nodeName;
-			uint32 nodePort = candidateNode->nodePort;
-
-			bool created = ExecuteRemoteCommandList(nodeName, nodePort,
-													extendedDDLCommands);
-			if (created)
-			{
-				uint64 shardPlacementId = 0;
-				ShardState shardState = STATE_FINALIZED;
+			ShardCreationRequest *shardRequest =
+				(ShardCreationRequest *) lfirst(shardRequestCell);
+			ShardInterval *shardInterval = palloc0(sizeof(ShardInterval));
 
+			/* initialize the hash token space for this shard */
+			int32 shardMinHashToken = INT_MIN + (shardIndex * hashTokenIncrement);
+			int32 shardMaxHashToken = shardMinHashToken + hashTokenIncrement - 1;
 
-				shardPlacementId = NextSequenceId(SHARD_PLACEMENT_ID_SEQUENCE_NAME);
-				InsertShardPlacementRow(shardPlacementId, shardId, shardState,
-										nodeName, nodePort);
-				placementCount++;
-			}
-			else
+			/* if we are at the last shard, make sure max token value is INT_MAX */
+			if (shardIndex == (shardCount - 1))
 			{
-				ereport(WARNING, (errmsg("could not create shard on \"%s:%u\"",
-										 nodeName, nodePort)));
+				shardMaxHashToken = INT_MAX;
 			}
 
-			if (placementCount >= replicationFactor)
+			shardInterval->id = (int64) shardRequest->shardId;
+			shardInterval->relationId = distributedTableId;
+			shardInterval->minValue = Int32GetDatum(shardMinHashToken);
+			shardInterval->maxValue = Int32GetDatum(shardMaxHashToken);
+			shardInterval->valueTypeId = INT4OID;
+
+			shardIntervalList = lappend(shardIntervalList, shardInterval);
+			shardIndex++;
+		}
+
+		/* insert the shard metadata rows along with their min/max values */
+		InsertShardRowList(shardIntervalList, shardStorageType);
+	}
+
+	if (QueryCancelPending)
+	{
+		ereport(WARNING, (errmsg("cancel requests are ignored during shard creation")));
+		QueryCancelPending = false;
+	}
+
+	RESUME_INTERRUPTS();
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * master_create_reference_table distributes the given table as a reference
+ * table. Reference tables have a single shard which covers all hash tokens and
+ * is placed on every worker node, so that any distributed table can be joined
+ * with them on each of its shards. Nodes on which the shard cannot be created
+ * are skipped with a warning, and receive an inactive placement instead, which
+ * may be repaired later.
+ */
+Datum
+master_create_reference_table(PG_FUNCTION_ARGS)
+{
+	text *tableNameText = PG_GETARG_TEXT_P(0);
+
+	Oid distributedTableId = ResolveRelationId(tableNameText);
+	char relationKind = get_rel_relkind(distributedTableId);
+	char *tableName = text_to_cstring(tableNameText);
+	uint64 shardId = 0;
+	List *workerNodeList = NIL;
+	List *ddlCommandList = NIL;
+	ShardCreationRequest *shardRequest = NULL;
+	ShardCreationRequest *failedShardRequest = NULL;
+	text *minHashTokenText = NULL;
+	text *maxHashTokenText = NULL;
+
+	/* foreign tables cannot be written to on all of their placements */
+	if (relationKind != RELKIND_RELATION)
+	{
+		ereport(ERROR, (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+						errmsg("cannot distribute relation: %s", tableName),
+						errdetail("Reference tables must be regular tables.")));
+	}
+
+	/* reference tables have no partition column */
+	InsertPartitionRow(distributedTableId, REFERENCE_PARTITION_TYPE,
+					   cstring_to_text(""));
+
+	/* load and sort the worker node list for deterministic placement */
+	workerNodeList = ParseWorkerNodeFile(WORKER_LIST_FILENAME);
+	workerNodeList = SortList(workerNodeList, CompareWorkerNodes);
+
+	/* make sure we don't process cancel signals until the shard is created */
+	HOLD_INTERRUPTS();
+
+	ddlCommandList = TableDDLCommandList(distributedTableId);
+
+	shardId = NextSequenceId(SHARD_ID_SEQUENCE_NAME);
+	shardRequest = palloc0(sizeof(ShardCreationRequest));
+	shardRequest->shardId = shardId;
+	shardRequest->ddlCommandList = ExtendedDDLCommandList(distributedTableId, shardId,
+														  ddlCommandList);
+	shardRequest->candidateNodeList = workerNodeList;
+
+	/* attempt a placement on every node, but settle for those which succeed */
+	failedShardRequest = CreateShardPlacements(list_make1(shardRequest),
+											   list_length(workerNodeList), 1);
+	if (failedShardRequest != NULL)
+	{
+		ereport(ERROR, (errmsg("could not create shard for reference table \"%s\"",
+							   tableName),
+						errdetail("The shard could not be created on any worker "
+								  "node.")));
+	}
+
+	/* the single shard covers the entire hash space */
+	minHashTokenText = IntegerToText(INT_MIN);
+	maxHashTokenText = IntegerToText(INT_MAX);
+	InsertShardRow(distributedTableId, shardId, SHARD_STORAGE_TABLE,
+				   minHashTokenText, maxHashTokenText);
+
+	InsertMissingPlacementRows(shardId, workerNodeList);
+
+	if (QueryCancelPending)
+	{
+		ereport(WARNING, (errmsg("cancel requests are ignored during shard creation")));
+		QueryCancelPending = false;
+	}
+
+	RESUME_INTERRUPTS();
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * InsertMissingPlacementRows records an inactive placement of the given shard on
+ * each of the given nodes which has no placement of it yet, so that a repair of
+ * that placement brings the shard to the node.
+ */
+static void
+InsertMissingPlacementRows(uint64 shardId, List *workerNodeList)
+{
+	List *shardPlacementList = LoadShardPlacementList(shardId);
+	ListCell *workerNodeCell = NULL;
+
+	foreach(workerNodeCell, workerNodeList)
+	{
+		WorkerNode *workerNode = (WorkerNode *) lfirst(workerNodeCell);
+		bool placementFound = false;
+		ListCell *shardPlacementCell = NULL;
+
+		foreach(shardPlacementCell, shardPlacementList)
+		{
+			ShardPlacement *shardPlacement = lfirst(shardPlacementCell);
+
+			if (shardPlacement->nodePort == (int32) workerNode->nodePort &&
+				strncmp(shardPlacement->nodeName, workerNode->nodeName,
+						MAX_NODE_LENGTH) == 0)
 			{
+				placementFound = true;
 				break;
 			}
 		}
 
-		/* check if we created enough shard replicas */
-		if (placementCount < replicationFactor)
+		if (!placementFound)
+		{
+			uint64 shardPlacementId = NextSequenceId(SHARD_PLACEMENT_ID_SEQUENCE_NAME);
+
+			InsertShardPlacementRow(shardPlacementId, shardId, STATE_INACTIVE,
+									workerNode->nodeName, workerNode->nodePort);
+		}
+	}
+}
+
+
+/*
+ * CreateColocatedShards creates the shards of the given table so that they are
+ * co-located with the shards of the source table: each new shard covers the
+ * same range of hash tokens as one of the source table's shards, and is placed
+ * on the nodes which hold that shard's active placements. The table then joins
+ * the source table's co-location group. As co-location cannot be kept on other
+ * nodes, this function errors out rather than falling back to them if too few
+ * of these placements can be created.
+ */
+static void
+CreateColocatedShards(Oid distributedTableId, Oid sourceTableId, int32 shardCount,
+					  int32 replicationFactor, List *ddlParseTreeList,
+					  char shardStorageType)
+{
+	char *tableName = get_rel_name(distributedTableId);
+	char *sourceTableName = get_rel_name(sourceTableId);
+	Var *partitionColumn = PartitionColumn(distributedTableId);
+	Var *sourcePartitionColumn = NULL;
+	List *sourceShardList = NIL;
+	List *shardRequestList = NIL;
+	List *shardIntervalList = NIL;
+	ShardCreationRequest *failedShardRequest = NULL;
+	uint64 *shardIdArray = NULL;
+	ListCell *sourceShardCell = NULL;
+	ListCell *shardRequestCell = NULL;
+
+	/* make sure source table is hash partitioned on a column of the same type */
+	CheckHashPartitionedTable(sourceTableId);
+
+	sourcePartitionColumn = PartitionColumn(sourceTableId);
+	if (partitionColumn->vartype != sourcePartitionColumn->vartype)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("cannot co-locate table \"%s\" with table \"%s\"",
+							   tableName, sourceTableName),
+						errdetail("Partition columns of co-located tables must have "
+								  "the same type.")));
+	}
+
+	sourceShardList = LoadShardIntervalList(sourceTableId);
+	if (list_length(sourceShardList) != shardCount)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("cannot co-locate table \"%s\" with table \"%s\"",
+							   tableName, sourceTableName),
+						errdetail("Table \"%s\" has %d shards, but %d were requested.",
+								  sourceTableName, list_length(sourceShardList),
+								  shardCount)));
+	}
+
+	shardIdArray = NextSequenceIdArray(SHARD_ID_SEQUENCE_NAME, shardCount);
+
+	foreach(sourceShardCell, sourceShardList)
+	{
+		ShardInterval *sourceShardInterval = (ShardInterval *) lfirst(sourceShardCell);
+		List *sourcePlacementList =
+			LoadFinalizedShardPlacementList(sourceShardInterval->id);
+		ShardCreationRequest *shardRequest = palloc0(sizeof(ShardCreationRequest));
+		uint64 shardId = shardIdArray[list_length(shardRequestList)];
+		ListCell *sourcePlacementCell = NULL;
+
+		if (list_length(sourcePlacementList) < replicationFactor)
 		{
 			ereport(ERROR, (errmsg("could not satisfy specified replication factor"),
-							errdetail("Created %d shard replicas, less than the "
-									  "requested replication factor of %d.",
-									  placementCount, replicationFactor)));
+							errdetail("Shard " INT64_FORMAT " of table \"%s\" has %d "
+									  "active placements, less than the requested "
+									  "replication factor of %d.",
+									  sourceShardInterval->id, sourceTableName,
+									  list_length(sourcePlacementList),
+									  replicationFactor)));
+		}
+
+		shardRequest->shardId = shardId;
+		shardRequest->ddlCommandList =
+			ExtendedParsedDDLCommandList(distributedTableId, shardId, ddlParseTreeList);
+
+		/* placements may only go to nodes which hold the source shard */
+		foreach(sourcePlacementCell, sourcePlacementList)
+		{
+			ShardPlacement *sourcePlacement =
+				(ShardPlacement *) lfirst(sourcePlacementCell);
+			WorkerNode *candidateNode = (WorkerNode *) palloc0(sizeof(WorkerNode));
+
+			candidateNode->nodeName = sourcePlacement->nodeName;
+			candidateNode->nodePort = (uint32) sourcePlacement->nodePort;
+
+			shardRequest->candidateNodeList =
+				lappend(shardRequest->candidateNodeList, candidateNode);
 		}
 
-		/* insert the shard metadata row along with its min/max values */
-		minHashTokenText = IntegerToText(shardMinHashToken);
-		maxHashTokenText = IntegerToText(shardMaxHashToken);
-		InsertShardRow(distributedTableId, shardId, shardStorageType,
-					   minHashTokenText, maxHashTokenText);
+		shardRequestList = lappend(shardRequestList, shardRequest);
 	}
 
-	if (QueryCancelPending)
+	failedShardRequest = CreateShardPlacements(shardRequestList, replicationFactor,
+											   replicationFactor);
+	if (failedShardRequest != NULL)
 	{
-		ereport(WARNING, (errmsg("cancel requests are ignored during shard creation")));
-		QueryCancelPending = false;
+		ereport(ERROR, (errmsg("could not satisfy specified replication factor"),
+						errdetail("Created %d co-located shard replicas, less than "
+								  "the requested replication factor of %d.",
+								  failedShardRequest->placementCount,
+								  replicationFactor)));
 	}
 
-	RESUME_INTERRUPTS();
+	/* the new shards cover the same hash tokens as their source shards */
+	forboth(sourceShardCell, sourceShardList, shardRequestCell, shardRequestList)
+	{
+		ShardInterval *sourceShardInterval = (ShardInterval *) lfirst(sourceShardCell);
+		ShardCreationRequest *shardRequest =
+			(ShardCreationRequest *) lfirst(shardRequestCell);
+		ShardInterval *shardInterval = (ShardInterval *) palloc0(sizeof(ShardInterval));
 
-	PG_RETURN_VOID();
+		*shardInterval = *sourceShardInterval;
+		shardInterval->id = (int64) shardRequest->shardId;
+		shardInterval->relationId = distributedTableId;
+
+		shardIntervalList = lappend(shardIntervalList, shardInterval);
+	}
+
+	InsertShardRowList(shardIntervalList, shardStorageType);
+
+	UpdateColocationId(distributedTableId, ColocationId(sourceTableId));
+}
+
+
+/*
+ * CreateShardPlacements creates placements for each of the given new shards,
+ * attempting them on the shard's candidate nodes in order until the shard has
+ * the given number of placements, and records them in the metadata. Rather
+ * than creating one placement after another, all placements assigned to a node
+ * are created by a single transaction on that node, and the transactions on
+ * all nodes run at the same time. Nodes which cannot be reached or on which the
+ * transaction fails are skipped with a warning, and the affected shards move on
+ * to their next candidate nodes in another round.
+ *
+ * The function stops and returns the first shard found to be left with too few
+ * candidate nodes to reach the given minimum number of placements. Unreachable
+ * nodes are already known before the first round starts, so in most cases this
+ * happens before any placement has been created. Otherwise, the function
+ * returns NULL.
+ */
+static ShardCreationRequest *
+CreateShardPlacements(List *shardRequestList, int32 placementCount,
+					  int32 minimumPlacementCount)
+{
+	/* connect to all candidate nodes at once, rather than one after another */
+	EstablishCandidateConnections(shardRequestList);
+
+	for (;;)
+	{
+		List *nodeBatchList = NIL;
+		ListCell *shardRequestCell = NULL;
+
+		foreach(shardRequestCell, shardRequestList)
+		{
+			ShardCreationRequest *shardRequest =
+				(ShardCreationRequest *) lfirst(shardRequestCell);
+			List *candidateNodeList = shardRequest->candidateNodeList;
+			int32 assignedCount = 0;
+
+			while (shardRequest->placementCount + assignedCount < placementCount &&
+				   shardRequest->candidateIndex < list_length(candidateNodeList))
+			{
+				WorkerNode *candidateNode =
+					(WorkerNode *) list_nth(candidateNodeList,
+											shardRequest->candidateIndex);
+				char *nodeName = candidateNode->nodeName;
+				uint32 nodePort = candidateNode->nodePort;
+
+				PGconn *connection = GetConnection(nodeName, nodePort);
+
+				shardRequest->candidateIndex++;
+				if (connection == NULL)
+				{
+					ereport(WARNING, (errmsg("could not create shard on \"%s:%u\"",
+											 nodeName, nodePort)));
+					continue;
+				}
+
+				nodeBatchList = AddToNodeShardBatch(nodeBatchList, candidateNode,
+													shardRequest);
+				assignedCount++;
+			}
+
+			if (shardRequest->placementCount + assignedCount < minimumPlacementCount)
+			{
+				return shardRequest;
+			}
+		}
+
+		/* all shards have their placements, or have run out of candidates */
+		if (nodeBatchList == NIL)
+		{
+			break;
+		}
+
+		ExecuteNodeShardBatches(nodeBatchList);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * EstablishCandidateConnections concurrently opens connections to all candidate
+ * nodes of the given shards. Later calls to GetConnection then find either the
+ * connection or the failure to connect, without waiting on the node again.
+ */
+static void
+EstablishCandidateConnections(List *shardRequestList)
+{
+	List *nodeConnectionKeyList = NIL;
+	ListCell *shardRequestCell = NULL;
+
+	foreach(shardRequestCell, shardRequestList)
+	{
+		ShardCreationRequest *shardRequest =
+			(ShardCreationRequest *) lfirst(shardRequestCell);
+		ListCell *candidateNodeCell = NULL;
+
+		foreach(candidateNodeCell, shardRequest->candidateNodeList)
+		{
+			WorkerNode *candidateNode = (WorkerNode *) lfirst(candidateNodeCell);
+			NodeConnectionKey *nodeConnectionKey = palloc0(sizeof(NodeConnectionKey));
+
+			strncpy(nodeConnectionKey->nodeName, candidateNode->nodeName,
+					MAX_NODE_LENGTH);
+			nodeConnectionKey->nodePort = candidateNode->nodePort;
+
+			nodeConnectionKeyList = lappend(nodeConnectionKeyList, nodeConnectionKey);
+		}
+	}
+
+	EstablishConnections(nodeConnectionKeyList);
+}
+
+
+/*
+ * AddToNodeShardBatch adds the given shard to the batch of shards to be placed
+ * on the given node, and returns the list of batches. A new batch is added to
+ * the list if the node has none yet.
+ */
+static List *
+AddToNodeShardBatch(List *nodeBatchList, WorkerNode *workerNode,
+					ShardCreationRequest *shardRequest)
+{
+	NodeShardBatch *nodeBatch = NULL;
+	ListCell *nodeBatchCell = NULL;
+
+	foreach(nodeBatchCell, nodeBatchList)
+	{
+		NodeShardBatch *existingBatch = (NodeShardBatch *) lfirst(nodeBatchCell);
+		WorkerNode *batchNode = existingBatch->workerNode;
+
+		if (strncmp(batchNode->nodeName, workerNode->nodeName, MAX_NODE_LENGTH) == 0 &&
+			batchNode->nodePort == workerNode->nodePort)
+		{
+			nodeBatch = existingBatch;
+			break;
+		}
+	}
+
+	if (nodeBatch == NULL)
+	{
+		nodeBatch = (NodeShardBatch *) palloc0(sizeof(NodeShardBatch));
+		nodeBatch->workerNode = workerNode;
+
+		nodeBatchList = lappend(nodeBatchList, nodeBatch);
+	}
+
+	nodeBatch->shardRequestList = lappend(nodeBatch->shardRequestList, shardRequest);
+
+	return nodeBatchList;
+}
+
+
+/*
+ * ExecuteNodeShardBatches sends each of the given batches to its node, and only
+ * then waits for the nodes to finish, so that all nodes create their placements
+ * at the same time. The placements of all batches which commit are then recorded
+ * in the metadata at once; the shards of the other batches are warned about.
+ * Progress is reported in a notice as each node finishes.
+ */
+static void
+ExecuteNodeShardBatches(List *nodeBatchList)
+{
+	ListCell *nodeBatchCell = NULL;
+	int32 nodeBatchCount = list_length(nodeBatchList);
+	int32 finishedBatchCount = 0;
+	List *shardPlacementList = NIL;
+	ListCell *shardPlacementCell = NULL;
+	uint64 *shardPlacementIdArray = NULL;
+	int32 placementIndex = 0;
+
+	foreach(nodeBatchCell, nodeBatchList)
+	{
+		NodeShardBatch *nodeBatch = (NodeShardBatch *) lfirst(nodeBatchCell);
+		WorkerNode *workerNode = nodeBatch->workerNode;
+		StringInfo batchCommand = NodeShardBatchCommand(nodeBatch);
+		bool querySent = false;
+
+		PGconn *connection = GetConnection(workerNode->nodeName, workerNode->nodePort);
+		if (connection == NULL)
+		{
+			continue;
+		}
+
+		querySent = (ApplyRemoteStatementTimeout(connection) &&
+					 SendRemoteQuery(connection, batchCommand->data, 0, NULL, NULL,
+									 InvalidOid));
+		if (!querySent)
+		{
+			ReportRemoteError(connection, NULL);
+			continue;
+		}
+
+		nodeBatch->connection = connection;
+	}
+
+	foreach(nodeBatchCell, nodeBatchList)
+	{
+		NodeShardBatch *nodeBatch = (NodeShardBatch *) lfirst(nodeBatchCell);
+		WorkerNode *workerNode = nodeBatch->workerNode;
+		PGconn *connection = nodeBatch->connection;
+		bool batchCommitted = false;
+		ListCell *shardRequestCell = NULL;
+
+		if (connection != NULL)
+		{
+			PGresult *result = AwaitRemoteResults(connection);
+			if (PQresultStatus(result) == PGRES_COMMAND_OK)
+			{
+				batchCommitted = true;
+			}
+			else
+			{
+				ReportRemoteError(connection, result);
+
+				/* leave the failed transaction block, if the connection survived */
+				PQclear(ExecuteRemoteQuery(connection, ROLLBACK_COMMAND));
+			}
+
+			PQclear(result);
+		}
+
+		foreach(shardRequestCell, nodeBatch->shardRequestList)
+		{
+			ShardCreationRequest *shardRequest =
+				(ShardCreationRequest *) lfirst(shardRequestCell);
+
+			if (batchCommitted)
+			{
+				ShardPlacement *shardPlacement = palloc0(sizeof(ShardPlacement));
+				shardPlacement->shardId = (int64) shardRequest->shardId;
+				shardPlacement->shardState = STATE_FINALIZED;
+				shardPlacement->nodeName = workerNode->nodeName;
+				shardPlacement->nodePort = (int32) workerNode->nodePort;
+
+				shardPlacementList = lappend(shardPlacementList, shardPlacement);
+				shardRequest->placementCount++;
+			}
+			else
+			{
+				ereport(WARNING, (errmsg("could not create shard on \"%s:%u\"",
+										 workerNode->nodeName, workerNode->nodePort)));
+			}
+		}
+
+		finishedBatchCount++;
+		ereport(NOTICE, (errmsg_plural("finished creating %d shard placement on "
+									   "\"%s:%u\" (%d of %d nodes)",
+									   "finished creating %d shard placements on "
+									   "\"%s:%u\" (%d of %d nodes)",
+									   list_length(nodeBatch->shardRequestList),
+									   list_length(nodeBatch->shardRequestList),
+									   workerNode->nodeName, workerNode->nodePort,
+									   finishedBatchCount, nodeBatchCount)));
+	}
+
+	if (shardPlacementList == NIL)
+	{
+		return;
+	}
+
+	/* record all created placements at once */
+	shardPlacementIdArray = NextSequenceIdArray(SHARD_PLACEMENT_ID_SEQUENCE_NAME,
+												list_length(shardPlacementList));
+	foreach(shardPlacementCell, shardPlacementList)
+	{
+		ShardPlacement *shardPlacement = (ShardPlacement *) lfirst(shardPlacementCell);
+		shardPlacement->id = (int64) shardPlacementIdArray[placementIndex++];
+	}
+
+	InsertShardPlacementRowList(shardPlacementList);
+}
+
+
+/*
+ * NodeShardBatchCommand returns a single command string which creates all shards
+ * in the given batch within one transaction.
+ */
+static StringInfo
+NodeShardBatchCommand(NodeShardBatch *nodeBatch)
+{
+	StringInfo batchCommand = makeStringInfo();
+	ListCell *shardRequestCell = NULL;
+
+	appendStringInfo(batchCommand, "%s;", BEGIN_COMMAND);
+
+	foreach(shardRequestCell, nodeBatch->shardRequestList)
+	{
+		ShardCreationRequest *shardRequest =
+			(ShardCreationRequest *) lfirst(shardRequestCell);
+		ListCell *ddlCommandCell = NULL;
+
+		foreach(ddlCommandCell, shardRequest->ddlCommandList)
+		{
+			char *ddlCommand = (char *) lfirst(ddlCommandCell);
+
+			appendStringInfo(batchCommand, " %s;", ddlCommand);
+		}
+	}
+
+	appendStringInfo(batchCommand, " %s", COMMIT_COMMAND);
+
+	return batchCommand;
 }
 
 
@@ -358,7 +953,7 @@ CheckHashPartitionedTable(Oid distributedTableId)
  * specified configuration file. The function relies on the file being at the
  * top level in the data directory.
  */
-static List *
+List *
 ParseWorkerNodeFile(char *workerNodeFilename)
 {
 	FILE *workerFileStream = NULL;
@@ -474,6 +1069,56 @@ SortList(List *pointerList, int (*ComparisonFunction)(const void *, const void *
 }
 
 
+/* Helper function to compare two shard intervals using their shardIds. */
+int
+CompareShardIntervalsById(const void *leftElement, const void *rightElement)
+{
+	const ShardInterval *leftInterval = *((const ShardInterval **) leftElement);
+	const ShardInterval *rightInterval = *((const ShardInterval **) rightElement);
+	int64 leftShardId = leftInterval->id;
+	int64 rightShardId = rightInterval->id;
+
+	/* we compare 64-bit integers, instead of casting their difference to int */
+	if (leftShardId > rightShardId)
+	{
+		return 1;
+	}
+	else if (leftShardId < rightShardId)
+	{
+		return -1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+
+/* Helper function to compare two shard placements using their ids. */
+int
+ComparePlacementsById(const void *leftElement, const void *rightElement)
+{
+	const ShardPlacement *leftPlacement = *((const ShardPlacement **) leftElement);
+	const ShardPlacement *rightPlacement = *((const ShardPlacement **) rightElement);
+	int64 leftPlacementId = leftPlacement->id;
+	int64 rightPlacementId = rightPlacement->id;
+
+	/* we compare 64-bit integers, instead of casting their difference to int */
+	if (leftPlacementId > rightPlacementId)
+	{
+		return 1;
+	}
+	else if (leftPlacementId < rightPlacementId)
+	{
+		return -1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+
 /* Helper function to compare two workers by their node name and port number. */
 static int
 CompareWorkerNodes(const void *leftElement, const void *rightElement)
@@ -555,10 +1200,10 @@ ExecuteRemoteCommandList(char *nodeName, uint32 nodePort, List *sqlCommandList)
  * return tuples, but they are not inspected: this function simply reflects
  * whether the command succeeded or failed.
  */
-static bool
+bool
 ExecuteRemoteCommand(PGconn *connection, const char *sqlCommand)
 {
-	PGresult *result = PQexec(connection, sqlCommand);
+	PGresult *result = ExecuteRemoteQuery(connection, sqlCommand);
 	bool commandSuccessful = true;
 
 	if (PQresultStatus(result) != PGRES_COMMAND_OK &&
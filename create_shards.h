@@ -16,6 +16,7 @@
 #include "postgres.h"
 #include "c.h"
 #include "fmgr.h"
+#include "libpq-fe.h"
 #include "postgres_ext.h"
 
 #include "nodes/pg_list.h"
@@ -24,6 +25,9 @@
 /* name for the file containing worker node and port information */
 #define WORKER_LIST_FILENAME "pg_worker_list.conf"
 
+/* value of master_create_worker_shards' colocate_with for a new co-location group */
+#define COLOCATE_WITH_NONE "none"
+
 /* transaction related commands used in talking to the worker nodes */
 #define BEGIN_COMMAND "BEGIN"
 #define COMMIT_COMMAND "COMMIT"
@@ -38,14 +42,47 @@ typedef struct WorkerNode
 } WorkerNode;
 
 
+/*
+ * ShardCreationRequest describes a new shard whose placements are yet to be
+ * created: the commands which create the shard on a node, and the nodes to
+ * attempt its placements on, in order of preference. The request also tracks
+ * the next candidate node to attempt and the placements created so far.
+ */
+typedef struct ShardCreationRequest
+{
+	uint64 shardId;           /* id of the new shard */
+	List *ddlCommandList;     /* commands creating the shard on a node */
+	List *candidateNodeList;  /* nodes to attempt placements on, in order */
+	int32 candidateIndex;     /* index of next candidate node to attempt */
+	int32 placementCount;     /* placements created so far */
+} ShardCreationRequest;
+
+
+/*
+ * NodeShardBatch collects the shards to be placed on a single worker node. The
+ * commands creating them are sent to the node at once, as a single transaction.
+ */
+typedef struct NodeShardBatch
+{
+	WorkerNode *workerNode;   /* node to create the placements on */
+	List *shardRequestList;   /* shards to place on the node */
+	PGconn *connection;       /* connection the batch was sent on, if it was */
+} NodeShardBatch;
+
+
 /* utility functions declaration shared within this module */
 extern List * SortList(List *pointerList,
 					   int (*ComparisonFunction)(const void *, const void *));
+extern int CompareShardIntervalsById(const void *leftElement, const void *rightElement);
+extern int ComparePlacementsById(const void *leftElement, const void *rightElement);
 extern Oid ResolveRelationId(text *relationName);
+extern List * ParseWorkerNodeFile(char *workerNodeFilename);
+extern bool ExecuteRemoteCommand(PGconn *connection, const char *sqlCommand);
 
 /* function declarations for initializing a distributed table */
 extern Datum master_create_distributed_table(PG_FUNCTION_ARGS);
 extern Datum master_create_worker_shards(PG_FUNCTION_ARGS);
+extern Datum master_create_reference_table(PG_FUNCTION_ARGS);
 
 
 #endif /* PG_SHARD_CREATE_SHARDS_H */
@@ -27,9 +27,14 @@
 
 /* function declarations to extend DDL commands with shard IDs */
 extern List * TableDDLCommandList(Oid relationId);
+extern List * TableSchemaDDLCommandList(Oid relationId);
+extern List * TableIndexDDLCommandList(Oid relationId);
 extern void AppendOptionListToString(StringInfo stringBuffer, List *optionList);
 extern List * ExtendedDDLCommandList(Oid masterRelationId, uint64 shardId,
 									 List *sqlCommandList);
+extern List * ParseDDLCommandList(List *ddlCommandList);
+extern List * ExtendedParsedDDLCommandList(Oid masterRelationId, uint64 shardId,
+										   List *parseTreeList);
 extern void AppendShardIdToName(char **name, uint64 shardId);
 extern bool ExecuteRemoteCommandList(char *nodeName, uint32 nodePort,
 									 List *sqlCommandList);
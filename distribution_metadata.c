@@ -38,15 +38,18 @@
 #include "nodes/pg_list.h"
 #include "nodes/primnodes.h"
 #include "storage/lock.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/errcodes.h"
 #include "utils/fmgroids.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/palloc.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
+#include "utils/snapmgr.h"
 #include "utils/tqual.h"
 
 
@@ -56,18 +59,30 @@
  */
 static List *ShardIntervalListCache = NIL;
 
+/* whether the callback which invalidates cached shard interval lists is set up */
+static bool ShardIntervalListCacheCallbackRegistered = false;
+
 
 /* local function forward declarations */
+static List * ScanShardIntervalList(Oid distributedTableId, bool shardsToDelete);
+static List * ShardIdListMarkedForDeletion(void);
+static bool ShardIdListMember(List *shardIdList, int64 shardId);
+static List * ScanPlacementListByState(int32 shardState, bool stateMatches);
+static List * ScanShardPlacementList(int64 shardId);
 static void LoadShardIntervalRow(int64 shardId, Oid *relationId,
 								 char **minValue, char **maxValue);
 static ShardPlacement * TupleToShardPlacement(HeapTuple heapTuple,
 											  TupleDesc tupleDescriptor);
+static ShardRepairLogEntry * TupleToShardRepairLogEntry(HeapTuple heapTuple,
+														TupleDesc tupleDescriptor);
+static void InvalidateShardIntervalListCache(Datum argument, Oid relationId);
 
 
 /*
  * LookupShardIntervalList is wrapper around LoadShardIntervalList that uses a
  * cache to avoid multiple lookups of a distributed table's shards within a
- * single session.
+ * single session. Operations which change a table's shards invalidate its
+ * relation cache entry, which drops the table's cached shards as well.
  */
 List *
 LookupShardIntervalList(Oid distributedTableId)
@@ -75,6 +90,12 @@ LookupShardIntervalList(Oid distributedTableId)
 	ShardIntervalListCacheEntry *matchingCacheEntry = NULL;
 	ListCell *cacheEntryCell = NULL;
 
+	if (!ShardIntervalListCacheCallbackRegistered)
+	{
+		CacheRegisterRelcacheCallback(InvalidateShardIntervalListCache, (Datum) 0);
+		ShardIntervalListCacheCallbackRegistered = true;
+	}
+
 	/* search the cache */
 	foreach(cacheEntryCell, ShardIntervalListCache)
 	{
@@ -117,13 +138,69 @@ LookupShardIntervalList(Oid distributedTableId)
 }
 
 
+/*
+ * InvalidateShardIntervalListCache is called whenever the relation cache entry
+ * of the given relation, or of all relations if given InvalidOid, is
+ * invalidated. The cached shard intervals of such relations are dropped, to be
+ * loaded again on their next lookup. The intervals themselves are not freed, as
+ * callers may still be using them.
+ */
+static void
+InvalidateShardIntervalListCache(Datum argument, Oid relationId)
+{
+	List *validCacheEntryList = NIL;
+	ListCell *cacheEntryCell = NULL;
+	MemoryContext oldContext = MemoryContextSwitchTo(CacheMemoryContext);
+
+	foreach(cacheEntryCell, ShardIntervalListCache)
+	{
+		ShardIntervalListCacheEntry *cacheEntry = lfirst(cacheEntryCell);
+
+		if (relationId != InvalidOid && cacheEntry->distributedTableId != relationId)
+		{
+			validCacheEntryList = lappend(validCacheEntryList, cacheEntry);
+		}
+	}
+
+	list_free(ShardIntervalListCache);
+	ShardIntervalListCache = validCacheEntryList;
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
 /*
  * LoadShardIntervalList returns a list of shard intervals related for a given
  * distributed table. The function returns an empty list if no shards can be
- * found for the given relation.
+ * found for the given relation. Shards which have been split, and whose
+ * placements are only kept until they are dropped, are left out.
  */
 List *
 LoadShardIntervalList(Oid distributedTableId)
+{
+	return ScanShardIntervalList(distributedTableId, false);
+}
+
+
+/*
+ * LoadShardIntervalListToDelete returns a list of the shard intervals of the
+ * given distributed table which have been split, and all of whose placements
+ * are therefore marked for deletion.
+ */
+List *
+LoadShardIntervalListToDelete(Oid distributedTableId)
+{
+	return ScanShardIntervalList(distributedTableId, true);
+}
+
+
+/*
+ * ScanShardIntervalList returns a list of shard intervals of the given
+ * distributed table, keeping either the shards all of whose placements are
+ * marked for deletion or all other shards.
+ */
+static List *
+ScanShardIntervalList(Oid distributedTableId, bool shardsToDelete)
 {
 	List *shardIntervalList = NIL;
 	RangeVar *heapRangeVar = NULL;
@@ -134,6 +211,7 @@ LoadShardIntervalList(Oid distributedTableId)
 	const int scanKeyCount = 1;
 	ScanKeyData scanKey[scanKeyCount];
 	HeapTuple heapTuple = NULL;
+	List *deletedShardIdList = ShardIdListMarkedForDeletion();
 
 	heapRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_TABLE_NAME, -1);
 	indexRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_RELATION_INDEX_NAME, -1);
@@ -158,9 +236,14 @@ LoadShardIntervalList(Oid distributedTableId)
 										  tupleDescriptor, &isNull);
 
 		int64 shardId = DatumGetInt64(shardIdDatum);
-		ShardInterval *shardInterval = LoadShardInterval(shardId);
+		bool markedForDeletion = ShardIdListMember(deletedShardIdList, shardId);
+
+		if (markedForDeletion == shardsToDelete)
+		{
+			ShardInterval *shardInterval = LoadShardInterval(shardId);
 
-		shardIntervalList = lappend(shardIntervalList, shardInterval);
+			shardIntervalList = lappend(shardIntervalList, shardInterval);
+		}
 
 		heapTuple = index_getnext(indexScanDesc, ForwardScanDirection);
 	}
@@ -173,6 +256,130 @@ LoadShardIntervalList(Oid distributedTableId)
 }
 
 
+/*
+ * ShardIdListMarkedForDeletion returns the identifiers of all shards which have
+ * placements, all of which are marked for deletion. A split shard is kept in
+ * this state after it was replaced by its new shards, until its placements are
+ * dropped. Rather than scanning each shard's placements, the function scans the
+ * placements marked for deletion, and only if there are any, scans the other
+ * placements to rule out their shards.
+ */
+static List *
+ShardIdListMarkedForDeletion(void)
+{
+	List *deletedShardIdList = NIL;
+	List *deletedPlacementList = ScanPlacementListByState(STATE_TO_DELETE, true);
+	List *otherPlacementList = NIL;
+	ListCell *placementCell = NULL;
+
+	if (deletedPlacementList == NIL)
+	{
+		return NIL;
+	}
+
+	otherPlacementList = ScanPlacementListByState(STATE_TO_DELETE, false);
+
+	foreach(placementCell, deletedPlacementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		ListCell *otherPlacementCell = NULL;
+		bool shardKept = false;
+
+		if (ShardIdListMember(deletedShardIdList, placement->shardId))
+		{
+			continue;
+		}
+
+		foreach(otherPlacementCell, otherPlacementList)
+		{
+			ShardPlacement *otherPlacement = lfirst(otherPlacementCell);
+
+			if (otherPlacement->shardId == placement->shardId)
+			{
+				shardKept = true;
+				break;
+			}
+		}
+
+		if (!shardKept)
+		{
+			int64 *shardIdPointer = (int64 *) palloc0(sizeof(int64));
+
+			*shardIdPointer = (int64) placement->shardId;
+			deletedShardIdList = lappend(deletedShardIdList, shardIdPointer);
+		}
+	}
+
+	return deletedShardIdList;
+}
+
+
+/*
+ * ShardIdListMember returns whether the given list of pointers to shard
+ * identifiers contains the given shard identifier.
+ */
+static bool
+ShardIdListMember(List *shardIdList, int64 shardId)
+{
+	ListCell *shardIdCell = NULL;
+
+	foreach(shardIdCell, shardIdList)
+	{
+		int64 *shardIdPointer = (int64 *) lfirst(shardIdCell);
+
+		if (*shardIdPointer == shardId)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * ScanPlacementListByState returns all placements which are in the given state
+ * if stateMatches is true, or all placements which are in any other state if it
+ * is false, using a single scan of the placement table.
+ */
+static List *
+ScanPlacementListByState(int32 shardState, bool stateMatches)
+{
+	List *placementList = NIL;
+	RangeVar *heapRangeVar = NULL;
+	Relation heapRelation = NULL;
+	HeapScanDesc scanDesc = NULL;
+	const int scanKeyCount = 1;
+	ScanKeyData scanKey[scanKeyCount];
+	HeapTuple heapTuple = NULL;
+	RegProcedure comparisonProcedure = stateMatches ? F_INT4EQ : F_INT4NE;
+
+	heapRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_PLACEMENT_TABLE_NAME, -1);
+	heapRelation = relation_openrv(heapRangeVar, AccessShareLock);
+
+	ScanKeyInit(&scanKey[0], ATTR_NUM_SHARD_PLACEMENT_SHARD_STATE, InvalidStrategy,
+				comparisonProcedure, Int32GetDatum(shardState));
+
+	scanDesc = heap_beginscan(heapRelation, SnapshotSelf, scanKeyCount, scanKey);
+
+	heapTuple = heap_getnext(scanDesc, ForwardScanDirection);
+	while (HeapTupleIsValid(heapTuple))
+	{
+		TupleDesc tupleDescriptor = RelationGetDescr(heapRelation);
+		ShardPlacement *shardPlacement = TupleToShardPlacement(heapTuple,
+															   tupleDescriptor);
+		placementList = lappend(placementList, shardPlacement);
+
+		heapTuple = heap_getnext(scanDesc, ForwardScanDirection);
+	}
+
+	heap_endscan(scanDesc);
+	relation_close(heapRelation, AccessShareLock);
+
+	return placementList;
+}
+
+
 /*
  * LoadShardInterval collects metadata for a specified shard in a ShardInterval
  * and returns a pointer to that structure. The function throws an error if no
@@ -198,7 +405,7 @@ LoadShardInterval(int64 shardId)
 
 	/* then find min/max values' actual types */
 	partitionType = PartitionType(relationId);
-	if (partitionType == HASH_PARTITION_TYPE)
+	if (partitionType == HASH_PARTITION_TYPE || partitionType == REFERENCE_PARTITION_TYPE)
 	{
 		intervalTypeId = INT4OID;
 	}
@@ -260,6 +467,27 @@ LoadFinalizedShardPlacementList(uint64 shardId)
  */
 List *
 LoadShardPlacementList(int64 shardId)
+{
+	List *shardPlacementList = ScanShardPlacementList(shardId);
+
+	/* if no shard placements are found, error out */
+	if (shardPlacementList == NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_NO_DATA),
+						errmsg("no placements exist for shard with ID "
+							   INT64_FORMAT, shardId)));
+	}
+
+	return shardPlacementList;
+}
+
+
+/*
+ * ScanShardPlacementList returns a list of ShardPlacements for every placement
+ * of the given shard, which is empty if the shard has not been placed.
+ */
+static List *
+ScanShardPlacementList(int64 shardId)
 {
 	List *shardPlacementList = NIL;
 	RangeVar *heapRangeVar = NULL;
@@ -299,22 +527,27 @@ LoadShardPlacementList(int64 shardId)
 	index_close(indexRelation, AccessShareLock);
 	relation_close(heapRelation, AccessShareLock);
 
-	/* if no shard placements are found, error out */
-	if (shardPlacementList == NIL)
-	{
-		ereport(ERROR, (errcode(ERRCODE_NO_DATA),
-						errmsg("no placements exist for shard with ID "
-							   INT64_FORMAT, shardId)));
-	}
-
 	return shardPlacementList;
 }
 
 
+/*
+ * LoadInactiveShardPlacementList gathers metadata for every placement of any
+ * shard which is in the inactive state, and returns a list of ShardPlacements
+ * containing that metadata. The list is empty if no placement is inactive.
+ */
+List *
+LoadInactiveShardPlacementList(void)
+{
+	return ScanPlacementListByState(STATE_INACTIVE, true);
+}
+
+
 /*
  * PartitionColumn looks up the column used to partition a given distributed
- * table and returns a reference to a Var representing that column. If no entry
- * can be found using the provided identifer, this function throws an error.
+ * table and returns a reference to a Var representing that column. Reference
+ * tables are not partitioned, and NULL is returned for them. If no entry can be
+ * found using the provided identifer, this function throws an error.
  */
 Var *
 PartitionColumn(Oid distributedTableId)
@@ -341,11 +574,18 @@ PartitionColumn(Oid distributedTableId)
 		TupleDesc tupleDescriptor = RelationGetDescr(heapRelation);
 		bool isNull = false;
 
+		Datum partitionTypeDatum = heap_getattr(heapTuple, ATTR_NUM_PARTITION_TYPE,
+												tupleDescriptor, &isNull);
 		Datum keyDatum = heap_getattr(heapTuple, ATTR_NUM_PARTITION_KEY,
 									  tupleDescriptor, &isNull);
-		char *partitionColumnName = TextDatumGetCString(keyDatum);
 
-		partitionColumn = ColumnNameToColumn(distributedTableId, partitionColumnName);
+		if (DatumGetChar(partitionTypeDatum) != REFERENCE_PARTITION_TYPE)
+		{
+			char *partitionColumnName = TextDatumGetCString(keyDatum);
+
+			partitionColumn = ColumnNameToColumn(distributedTableId,
+												 partitionColumnName);
+		}
 	}
 	else
 	{
@@ -413,6 +653,104 @@ PartitionType(Oid distributedTableId)
 }
 
 
+/*
+ * ColocationId looks up the co-location group of a given distributed table.
+ * Tables in the same group have identical shard ranges, and the shards which
+ * cover the same range are placed on the same nodes. If no entry can be found
+ * using the provided identifer, this function throws an error.
+ */
+uint32
+ColocationId(Oid distributedTableId)
+{
+	uint32 colocationId = 0;
+	RangeVar *heapRangeVar = NULL;
+	Relation heapRelation = NULL;
+	HeapScanDesc scanDesc = NULL;
+	const int scanKeyCount = 1;
+	ScanKeyData scanKey[scanKeyCount];
+	HeapTuple heapTuple = NULL;
+
+	heapRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, PARTITION_TABLE_NAME, -1);
+	heapRelation = relation_openrv(heapRangeVar, AccessShareLock);
+
+	ScanKeyInit(&scanKey[0], ATTR_NUM_PARTITION_RELATION_ID, InvalidStrategy,
+				F_OIDEQ, ObjectIdGetDatum(distributedTableId));
+
+	scanDesc = heap_beginscan(heapRelation, SnapshotSelf, scanKeyCount, scanKey);
+
+	heapTuple = heap_getnext(scanDesc, ForwardScanDirection);
+	if (HeapTupleIsValid(heapTuple))
+	{
+		TupleDesc tupleDescriptor = RelationGetDescr(heapRelation);
+		bool isNull = false;
+
+		Datum colocationIdDatum = heap_getattr(heapTuple,
+											   ATTR_NUM_PARTITION_COLOCATION_ID,
+											   tupleDescriptor, &isNull);
+		colocationId = (uint32) DatumGetInt32(colocationIdDatum);
+	}
+	else
+	{
+		char *relationName = get_rel_name(distributedTableId);
+
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("no co-location ID is defined for relation \"%s\"",
+							   relationName)));
+	}
+
+	heap_endscan(scanDesc);
+	relation_close(heapRelation, AccessShareLock);
+
+	return colocationId;
+}
+
+
+/*
+ * ColocatedTableList returns the identifiers of all distributed tables in the
+ * same co-location group as the given table, including the table itself.
+ */
+List *
+ColocatedTableList(Oid distributedTableId)
+{
+	List *colocatedTableList = NIL;
+	uint32 colocationId = ColocationId(distributedTableId);
+	RangeVar *heapRangeVar = NULL;
+	Relation heapRelation = NULL;
+	HeapScanDesc scanDesc = NULL;
+	const int scanKeyCount = 1;
+	ScanKeyData scanKey[scanKeyCount];
+	HeapTuple heapTuple = NULL;
+
+	heapRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, PARTITION_TABLE_NAME, -1);
+	heapRelation = relation_openrv(heapRangeVar, AccessShareLock);
+
+	ScanKeyInit(&scanKey[0], ATTR_NUM_PARTITION_COLOCATION_ID, InvalidStrategy,
+				F_INT4EQ, Int32GetDatum((int32) colocationId));
+
+	scanDesc = heap_beginscan(heapRelation, SnapshotSelf, scanKeyCount, scanKey);
+
+	heapTuple = heap_getnext(scanDesc, ForwardScanDirection);
+	while (HeapTupleIsValid(heapTuple))
+	{
+		TupleDesc tupleDescriptor = RelationGetDescr(heapRelation);
+		bool isNull = false;
+
+		Datum relationIdDatum = heap_getattr(heapTuple, ATTR_NUM_PARTITION_RELATION_ID,
+											 tupleDescriptor, &isNull);
+
+		colocatedTableList = lappend_oid(colocatedTableList,
+										 DatumGetObjectId(relationIdDatum));
+
+		heapTuple = heap_getnext(scanDesc, ForwardScanDirection);
+	}
+
+	heap_endscan(scanDesc);
+	relation_close(heapRelation, AccessShareLock);
+
+	return colocatedTableList;
+}
+
+
 /*
  * IsDistributedTable simply returns whether the specified table is distributed.
  */
@@ -616,9 +954,81 @@ TupleToShardPlacement(HeapTuple heapTuple, TupleDesc tupleDescriptor)
 }
 
 
+/*
+ * TupleToShardRepairLogEntry populates a ShardRepairLogEntry using values from a
+ * row of the repair log table and returns a pointer to that struct.
+ */
+static ShardRepairLogEntry *
+TupleToShardRepairLogEntry(HeapTuple heapTuple, TupleDesc tupleDescriptor)
+{
+	ShardRepairLogEntry *logEntry = NULL;
+	ArrayType *typeArray = NULL;
+	ArrayType *valueArray = NULL;
+	Datum *typeDatumArray = NULL;
+	Datum *valueDatumArray = NULL;
+	bool *valueNullArray = NULL;
+	int typeCount = 0;
+	int valueCount = 0;
+	int parameterIndex = 0;
+	bool isNull = false;
+
+	Datum idDatum = heap_getattr(heapTuple, ATTR_NUM_SHARD_REPAIR_LOG_ID,
+								 tupleDescriptor, &isNull);
+	Datum shardIdDatum = heap_getattr(heapTuple, ATTR_NUM_SHARD_REPAIR_LOG_SHARD_ID,
+									  tupleDescriptor, &isNull);
+	Datum queryDatum = heap_getattr(heapTuple, ATTR_NUM_SHARD_REPAIR_LOG_QUERY,
+									tupleDescriptor, &isNull);
+	Datum typesDatum = heap_getattr(heapTuple, ATTR_NUM_SHARD_REPAIR_LOG_PARAMETER_TYPES,
+									tupleDescriptor, &isNull);
+	Datum valuesDatum = heap_getattr(heapTuple,
+									 ATTR_NUM_SHARD_REPAIR_LOG_PARAMETER_VALUES,
+									 tupleDescriptor, &isNull);
+	bool queryTreeIsNull = false;
+	Datum queryTreeDatum = heap_getattr(heapTuple, ATTR_NUM_SHARD_REPAIR_LOG_QUERY_TREE,
+										tupleDescriptor, &queryTreeIsNull);
+
+	typeArray = DatumGetArrayTypeP(typesDatum);
+	valueArray = DatumGetArrayTypeP(valuesDatum);
+
+	deconstruct_array(typeArray, OIDOID, sizeof(Oid), true, 'i', &typeDatumArray,
+					  NULL, &typeCount);
+	deconstruct_array(valueArray, TEXTOID, -1, false, 'i', &valueDatumArray,
+					  &valueNullArray, &valueCount);
+
+	Assert(typeCount == valueCount);
+
+	logEntry = palloc0(sizeof(ShardRepairLogEntry));
+	logEntry->id = DatumGetInt64(idDatum);
+	logEntry->shardId = DatumGetInt64(shardIdDatum);
+	logEntry->queryString = TextDatumGetCString(queryDatum);
+	logEntry->parameterCount = typeCount;
+	logEntry->parameterTypes = palloc0((typeCount + 1) * sizeof(Oid));
+	logEntry->parameterValues = palloc0((typeCount + 1) * sizeof(char *));
+
+	for (parameterIndex = 0; parameterIndex < typeCount; parameterIndex++)
+	{
+		logEntry->parameterTypes[parameterIndex] =
+			DatumGetObjectId(typeDatumArray[parameterIndex]);
+
+		if (!valueNullArray[parameterIndex])
+		{
+			logEntry->parameterValues[parameterIndex] =
+				TextDatumGetCString(valueDatumArray[parameterIndex]);
+		}
+	}
+
+	if (!queryTreeIsNull)
+	{
+		logEntry->queryTree = TextDatumGetCString(queryTreeDatum);
+	}
+
+	return logEntry;
+}
+
+
 /*
  * InsertPartitionRow opens the partition metadata table and inserts a new row
- * with the given values.
+ * with the given values. The table is placed in a new co-location group.
  */
 void
 InsertPartitionRow(Oid distributedTableId, char partitionType, text *partitionKeyText)
@@ -627,6 +1037,7 @@ InsertPartitionRow(Oid distributedTableId, char partitionType, text *partitionKe
 	RangeVar *partitionRangeVar = NULL;
 	TupleDesc tupleDescriptor = NULL;
 	HeapTuple heapTuple = NULL;
+	uint32 colocationId = 0;
 	Datum values[PARTITION_TABLE_ATTRIBUTE_COUNT];
 	bool isNulls[PARTITION_TABLE_ATTRIBUTE_COUNT];
 
@@ -638,6 +1049,10 @@ InsertPartitionRow(Oid distributedTableId, char partitionType, text *partitionKe
 	values[ATTR_NUM_PARTITION_TYPE - 1] = CharGetDatum(partitionType);
 	values[ATTR_NUM_PARTITION_KEY - 1] = PointerGetDatum(partitionKeyText);
 
+	/* each table starts out in a co-location group of its own */
+	colocationId = (uint32) NextSequenceId(COLOCATION_ID_SEQUENCE_NAME);
+	values[ATTR_NUM_PARTITION_COLOCATION_ID - 1] = Int32GetDatum((int32) colocationId);
+
 	/* open the partition relation and insert new tuple */
 	partitionRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, PARTITION_TABLE_NAME, -1);
 	partitionRelation = heap_openrv(partitionRangeVar, RowExclusiveLock);
@@ -655,53 +1070,165 @@ InsertPartitionRow(Oid distributedTableId, char partitionType, text *partitionKe
 
 
 /*
- * InsertShardRow opens the shard metadata table and inserts a new row with
- * the given values into that table. Note that we allow the user to pass in
- * null min/max values.
+ * UpdateColocationId moves the given distributed table into the co-location
+ * group with the given identifier.
  */
 void
-InsertShardRow(Oid distributedTableId, uint64 shardId, char shardStorage,
-			   text *shardMinValue, text *shardMaxValue)
+UpdateColocationId(Oid distributedTableId, uint32 colocationId)
 {
-	Relation shardRelation = NULL;
-	RangeVar *shardRangeVar = NULL;
-	TupleDesc tupleDescriptor = NULL;
+	RangeVar *heapRangeVar = NULL;
+	Relation heapRelation = NULL;
+	HeapScanDesc scanDesc = NULL;
+	const int scanKeyCount = 1;
+	ScanKeyData scanKey[scanKeyCount];
 	HeapTuple heapTuple = NULL;
-	Datum values[SHARD_TABLE_ATTRIBUTE_COUNT];
-	bool isNulls[SHARD_TABLE_ATTRIBUTE_COUNT];
+	HeapTuple newHeapTuple = NULL;
+	TupleDesc tupleDescriptor = NULL;
+	Datum values[PARTITION_TABLE_ATTRIBUTE_COUNT];
+	bool isNulls[PARTITION_TABLE_ATTRIBUTE_COUNT];
+	bool replace[PARTITION_TABLE_ATTRIBUTE_COUNT];
 
-	/* form new shard tuple */
-	memset(values, 0, sizeof(values));
-	memset(isNulls, false, sizeof(isNulls));
+	heapRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, PARTITION_TABLE_NAME, -1);
+	heapRelation = heap_openrv(heapRangeVar, RowExclusiveLock);
+	tupleDescriptor = RelationGetDescr(heapRelation);
 
-	values[ATTR_NUM_SHARD_ID - 1] = Int64GetDatum(shardId);
-	values[ATTR_NUM_SHARD_RELATION_ID - 1] = ObjectIdGetDatum(distributedTableId);
-	values[ATTR_NUM_SHARD_STORAGE - 1] = CharGetDatum(shardStorage);
+	ScanKeyInit(&scanKey[0], ATTR_NUM_PARTITION_RELATION_ID, InvalidStrategy,
+				F_OIDEQ, ObjectIdGetDatum(distributedTableId));
 
-	/* check if shard min/max values are null */
-	if (shardMinValue != NULL && shardMaxValue != NULL)
+	scanDesc = heap_beginscan(heapRelation, SnapshotSelf, scanKeyCount, scanKey);
+
+	heapTuple = heap_getnext(scanDesc, ForwardScanDirection);
+	if (!HeapTupleIsValid(heapTuple))
 	{
-		values[ATTR_NUM_SHARD_MIN_VALUE - 1] = PointerGetDatum(shardMinValue);
-		values[ATTR_NUM_SHARD_MAX_VALUE - 1] = PointerGetDatum(shardMaxValue);
+		char *relationName = get_rel_name(distributedTableId);
+
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("no partition column is defined for relation \"%s\"",
+							   relationName)));
 	}
-	else
+
+	/* replace only the co-location group of the table */
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
+	memset(replace, false, sizeof(replace));
+
+	values[ATTR_NUM_PARTITION_COLOCATION_ID - 1] = Int32GetDatum((int32) colocationId);
+	replace[ATTR_NUM_PARTITION_COLOCATION_ID - 1] = true;
+
+	newHeapTuple = heap_modify_tuple(heapTuple, tupleDescriptor, values, isNulls,
+									 replace);
+
+	simple_heap_update(heapRelation, &(heapTuple->t_self), newHeapTuple);
+	CatalogUpdateIndexes(heapRelation, newHeapTuple);
+	CommandCounterIncrement();
+
+	heap_endscan(scanDesc);
+	heap_close(heapRelation, RowExclusiveLock);
+}
+
+
+/*
+ * InsertShardRow inserts a row for a new shard with the given values into the
+ * shard metadata table. Note that we allow the user to pass in null min/max
+ * values. The row is inserted by InsertShardRowList, which also invalidates the
+ * relation cache entry of the distributed table.
+ */
+void
+InsertShardRow(Oid distributedTableId, uint64 shardId, char shardStorage,
+			   text *shardMinValue, text *shardMaxValue)
+{
+	ShardInterval *shardInterval = palloc0(sizeof(ShardInterval));
+
+	shardInterval->id = (int64) shardId;
+	shardInterval->relationId = distributedTableId;
+
+	/* check if shard min/max values are null */
+	if (shardMinValue != NULL && shardMaxValue != NULL)
 	{
-		isNulls[ATTR_NUM_SHARD_MIN_VALUE - 1] = true;
-		isNulls[ATTR_NUM_SHARD_MAX_VALUE - 1] = true;
+		shardInterval->minValue = PointerGetDatum(shardMinValue);
+		shardInterval->maxValue = PointerGetDatum(shardMaxValue);
+		shardInterval->valueTypeId = TEXTOID;
 	}
 
-	/* open shard relation and insert new tuple */
+	InsertShardRowList(list_make1(shardInterval), shardStorage);
+}
+
+
+/*
+ * InsertShardRowList opens the shard metadata table once and inserts a row for
+ * each of the given shard intervals, all of which must belong to a table with
+ * the given storage type. The intervals' min/max values are stored in their
+ * textual form, or as nulls for intervals without a value type. Indexes are
+ * likewise opened only once, and the command counter is advanced after all rows
+ * have been inserted. The relation cache entries of the shards' tables are
+ * invalidated, which drops what is cached about the tables' shards.
+ */
+void
+InsertShardRowList(List *shardIntervalList, char shardStorage)
+{
+	Relation shardRelation = NULL;
+	RangeVar *shardRangeVar = NULL;
+	TupleDesc tupleDescriptor = NULL;
+	CatalogIndexState indexState = NULL;
+	ListCell *shardIntervalCell = NULL;
+	Datum values[SHARD_TABLE_ATTRIBUTE_COUNT];
+	bool isNulls[SHARD_TABLE_ATTRIBUTE_COUNT];
+
 	shardRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_TABLE_NAME, -1);
 	shardRelation = heap_openrv(shardRangeVar, RowExclusiveLock);
-
 	tupleDescriptor = RelationGetDescr(shardRelation);
-	heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
+	indexState = CatalogOpenIndexes(shardRelation);
+
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		Oid outputFunctionId = InvalidOid;
+		bool typeIsVarlena = false;
+		char *minValueString = NULL;
+		char *maxValueString = NULL;
+		HeapTuple heapTuple = NULL;
+
+		/* form new shard tuple */
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[ATTR_NUM_SHARD_ID - 1] = Int64GetDatum(shardInterval->id);
+		values[ATTR_NUM_SHARD_RELATION_ID - 1] =
+			ObjectIdGetDatum(shardInterval->relationId);
+		values[ATTR_NUM_SHARD_STORAGE - 1] = CharGetDatum(shardStorage);
+
+		if (OidIsValid(shardInterval->valueTypeId))
+		{
+			getTypeOutputInfo(shardInterval->valueTypeId, &outputFunctionId,
+							  &typeIsVarlena);
+			minValueString = OidOutputFunctionCall(outputFunctionId,
+												   shardInterval->minValue);
+			maxValueString = OidOutputFunctionCall(outputFunctionId,
+												   shardInterval->maxValue);
+
+			values[ATTR_NUM_SHARD_MIN_VALUE - 1] = CStringGetTextDatum(minValueString);
+			values[ATTR_NUM_SHARD_MAX_VALUE - 1] = CStringGetTextDatum(maxValueString);
+		}
+		else
+		{
+			isNulls[ATTR_NUM_SHARD_MIN_VALUE - 1] = true;
+			isNulls[ATTR_NUM_SHARD_MAX_VALUE - 1] = true;
+		}
+
+		heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
+
+		simple_heap_insert(shardRelation, heapTuple);
+		CatalogIndexInsert(indexState, heapTuple);
+
+		heap_freetuple(heapTuple);
+
+		CacheInvalidateRelcacheByRelid(shardInterval->relationId);
+	}
 
-	simple_heap_insert(shardRelation, heapTuple);
-	CatalogUpdateIndexes(shardRelation, heapTuple);
 	CommandCounterIncrement();
 
-	/* close relation */
+	/* close indexes and relation */
+	CatalogCloseIndexes(indexState);
 	heap_close(shardRelation, RowExclusiveLock);
 }
 
@@ -713,41 +1240,131 @@ InsertShardRow(Oid distributedTableId, uint64 shardId, char shardStorage,
 void
 InsertShardPlacementRow(uint64 shardPlacementId, uint64 shardId,
 						ShardState shardState, char *nodeName, uint32 nodePort)
+{
+	ShardPlacement *shardPlacement = palloc0(sizeof(ShardPlacement));
+	shardPlacement->id = (int64) shardPlacementId;
+	shardPlacement->shardId = (int64) shardId;
+	shardPlacement->shardState = shardState;
+	shardPlacement->nodeName = nodeName;
+	shardPlacement->nodePort = (int32) nodePort;
+
+	InsertShardPlacementRowList(list_make1(shardPlacement));
+}
+
+
+/*
+ * InsertShardPlacementRowList opens the shard placement metadata table and its
+ * indexes once, inserts a row for each of the given shard placements, and then
+ * advances the command counter a single time.
+ */
+void
+InsertShardPlacementRowList(List *shardPlacementList)
 {
 	Relation shardPlacementRelation = NULL;
 	RangeVar *shardPlacementRangeVar = NULL;
 	TupleDesc tupleDescriptor = NULL;
-	HeapTuple heapTuple = NULL;
+	CatalogIndexState indexState = NULL;
+	ListCell *shardPlacementCell = NULL;
 	Datum values[SHARD_PLACEMENT_TABLE_ATTRIBUTE_COUNT];
 	bool isNulls[SHARD_PLACEMENT_TABLE_ATTRIBUTE_COUNT];
 
-	/* form new shard placement tuple */
-	memset(values, 0, sizeof(values));
-	memset(isNulls, false, sizeof(isNulls));
-
-	values[ATTR_NUM_SHARD_PLACEMENT_ID - 1] = Int64GetDatum(shardPlacementId);
-	values[ATTR_NUM_SHARD_PLACEMENT_SHARD_ID - 1] = Int64GetDatum(shardId);
-	values[ATTR_NUM_SHARD_PLACEMENT_SHARD_STATE - 1] = UInt32GetDatum(shardState);
-	values[ATTR_NUM_SHARD_PLACEMENT_NODE_NAME - 1] = CStringGetTextDatum(nodeName);
-	values[ATTR_NUM_SHARD_PLACEMENT_NODE_PORT - 1] = UInt32GetDatum(nodePort);
-
-	/* open shard placement relation and insert new tuple */
+	/* open shard placement relation and its indexes */
 	shardPlacementRangeVar = makeRangeVar(METADATA_SCHEMA_NAME,
 										  SHARD_PLACEMENT_TABLE_NAME, -1);
 	shardPlacementRelation = heap_openrv(shardPlacementRangeVar, RowExclusiveLock);
-
 	tupleDescriptor = RelationGetDescr(shardPlacementRelation);
-	heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
+	indexState = CatalogOpenIndexes(shardPlacementRelation);
+
+	foreach(shardPlacementCell, shardPlacementList)
+	{
+		ShardPlacement *shardPlacement = (ShardPlacement *) lfirst(shardPlacementCell);
+		HeapTuple heapTuple = NULL;
+
+		/* form new shard placement tuple */
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[ATTR_NUM_SHARD_PLACEMENT_ID - 1] = Int64GetDatum(shardPlacement->id);
+		values[ATTR_NUM_SHARD_PLACEMENT_SHARD_ID - 1] =
+			Int64GetDatum(shardPlacement->shardId);
+		values[ATTR_NUM_SHARD_PLACEMENT_SHARD_STATE - 1] =
+			UInt32GetDatum(shardPlacement->shardState);
+		values[ATTR_NUM_SHARD_PLACEMENT_NODE_NAME - 1] =
+			CStringGetTextDatum(shardPlacement->nodeName);
+		values[ATTR_NUM_SHARD_PLACEMENT_NODE_PORT - 1] =
+			UInt32GetDatum(shardPlacement->nodePort);
+
+		heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
+
+		simple_heap_insert(shardPlacementRelation, heapTuple);
+		CatalogIndexInsert(indexState, heapTuple);
+
+		heap_freetuple(heapTuple);
+	}
 
-	simple_heap_insert(shardPlacementRelation, heapTuple);
-	CatalogUpdateIndexes(shardPlacementRelation, heapTuple);
 	CommandCounterIncrement();
 
-	/* close relation */
+	/* close indexes and relation */
+	CatalogCloseIndexes(indexState);
 	heap_close(shardPlacementRelation, RowExclusiveLock);
 }
 
 
+/*
+ * DeleteShardRow removes the row corresponding to the provided shard identifier,
+ * erroring out if it cannot find such a row. The shard's placements should be
+ * removed first. The relation cache entry of the shard's table is invalidated.
+ */
+void
+DeleteShardRow(uint64 shardId)
+{
+	RangeVar *heapRangeVar = NULL;
+	RangeVar *indexRangeVar = NULL;
+	Relation heapRelation = NULL;
+	Relation indexRelation = NULL;
+	IndexScanDesc indexScanDesc = NULL;
+	const int scanKeyCount = 1;
+	ScanKeyData scanKey[scanKeyCount];
+	HeapTuple heapTuple = NULL;
+	Datum relationIdDatum = 0;
+	bool relationIdIsNull = false;
+
+	heapRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_TABLE_NAME, -1);
+	indexRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_PKEY_INDEX_NAME, -1);
+
+	heapRelation = relation_openrv(heapRangeVar, RowExclusiveLock);
+	indexRelation = relation_openrv(indexRangeVar, AccessShareLock);
+
+	ScanKeyInit(&scanKey[0], 1, BTEqualStrategyNumber, F_INT8EQ,
+				Int64GetDatum(shardId));
+
+	indexScanDesc = index_beginscan(heapRelation, indexRelation, SnapshotSelf,
+									scanKeyCount, 0);
+	index_rescan(indexScanDesc, scanKey, scanKeyCount, NULL, 0);
+
+	heapTuple = index_getnext(indexScanDesc, ForwardScanDirection);
+	if (HeapTupleIsValid(heapTuple))
+	{
+		relationIdDatum = heap_getattr(heapTuple, ATTR_NUM_SHARD_RELATION_ID,
+									   RelationGetDescr(heapRelation),
+									   &relationIdIsNull);
+
+		simple_heap_delete(heapRelation, &heapTuple->t_self);
+		CacheInvalidateRelcacheByRelid(DatumGetObjectId(relationIdDatum));
+	}
+	else
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("shard with ID " INT64_FORMAT " does not exist",
+							   shardId)));
+	}
+
+	index_endscan(indexScanDesc);
+	index_close(indexRelation, AccessShareLock);
+	relation_close(heapRelation, RowExclusiveLock);
+}
+
+
 /*
  * DeleteShardPlacementRow removes the row corresponding to the provided shard
  * placement identifier, erroring out if it cannot find such a row.
@@ -796,6 +1413,204 @@ DeleteShardPlacementRow(uint64 shardPlacementId)
 }
 
 
+/*
+ * InsertShardRepairLogRow logs the given modification of a shard, so that it can
+ * later be replayed on a placement of the shard which is being repaired online.
+ * The serialized query of the modification is logged along with it if given.
+ * The new log entry takes its id from the repair log's sequence.
+ */
+void
+InsertShardRepairLogRow(int64 shardId, char *queryString, int parameterCount,
+						Oid *parameterTypes, const char **parameterValues,
+						char *queryTree)
+{
+	Relation repairLogRelation = NULL;
+	RangeVar *repairLogRangeVar = NULL;
+	TupleDesc tupleDescriptor = NULL;
+	CatalogIndexState indexState = NULL;
+	HeapTuple heapTuple = NULL;
+	Datum *typeDatumArray = palloc0((parameterCount + 1) * sizeof(Datum));
+	Datum *valueDatumArray = palloc0((parameterCount + 1) * sizeof(Datum));
+	bool *valueNullArray = palloc0((parameterCount + 1) * sizeof(bool));
+	ArrayType *typeArray = NULL;
+	ArrayType *valueArray = NULL;
+	int arrayDimensions[1] = { parameterCount };
+	int arrayLowerBounds[1] = { 1 };
+	int parameterIndex = 0;
+	uint64 logEntryId = 0;
+	Datum values[SHARD_REPAIR_LOG_TABLE_ATTRIBUTE_COUNT];
+	bool isNulls[SHARD_REPAIR_LOG_TABLE_ATTRIBUTE_COUNT];
+
+	for (parameterIndex = 0; parameterIndex < parameterCount; parameterIndex++)
+	{
+		const char *parameterValue = parameterValues[parameterIndex];
+
+		typeDatumArray[parameterIndex] = ObjectIdGetDatum(parameterTypes[parameterIndex]);
+
+		if (parameterValue == NULL)
+		{
+			valueNullArray[parameterIndex] = true;
+		}
+		else
+		{
+			valueDatumArray[parameterIndex] = CStringGetTextDatum(parameterValue);
+		}
+	}
+
+	typeArray = construct_md_array(typeDatumArray, NULL, 1, arrayDimensions,
+								   arrayLowerBounds, OIDOID, sizeof(Oid), true, 'i');
+	valueArray = construct_md_array(valueDatumArray, valueNullArray, 1,
+									arrayDimensions, arrayLowerBounds, TEXTOID, -1,
+									false, 'i');
+
+	logEntryId = NextSequenceId(SHARD_REPAIR_LOG_ID_SEQUENCE_NAME);
+
+	/* form new repair log tuple */
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
+
+	values[ATTR_NUM_SHARD_REPAIR_LOG_ID - 1] = Int64GetDatum(logEntryId);
+	values[ATTR_NUM_SHARD_REPAIR_LOG_SHARD_ID - 1] = Int64GetDatum(shardId);
+	values[ATTR_NUM_SHARD_REPAIR_LOG_QUERY - 1] = CStringGetTextDatum(queryString);
+	values[ATTR_NUM_SHARD_REPAIR_LOG_PARAMETER_TYPES - 1] = PointerGetDatum(typeArray);
+	values[ATTR_NUM_SHARD_REPAIR_LOG_PARAMETER_VALUES - 1] =
+		PointerGetDatum(valueArray);
+
+	if (queryTree != NULL)
+	{
+		values[ATTR_NUM_SHARD_REPAIR_LOG_QUERY_TREE - 1] = CStringGetTextDatum(queryTree);
+	}
+	else
+	{
+		isNulls[ATTR_NUM_SHARD_REPAIR_LOG_QUERY_TREE - 1] = true;
+	}
+
+	/* open repair log relation and insert new tuple */
+	repairLogRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_REPAIR_LOG_TABLE_NAME,
+									 -1);
+	repairLogRelation = heap_openrv(repairLogRangeVar, RowExclusiveLock);
+
+	tupleDescriptor = RelationGetDescr(repairLogRelation);
+	heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
+
+	simple_heap_insert(repairLogRelation, heapTuple);
+
+	indexState = CatalogOpenIndexes(repairLogRelation);
+	CatalogIndexInsert(indexState, heapTuple);
+	CatalogCloseIndexes(indexState);
+
+	CommandCounterIncrement();
+
+	/* close relation */
+	heap_close(repairLogRelation, RowExclusiveLock);
+}
+
+
+/*
+ * TakeShardRepairLogEntries removes up to the given number of the oldest entries
+ * from the repair log of the given shard, and returns them in the order they
+ * were logged. Entries are read using a fresh snapshot, so that the function
+ * only returns entries logged by committed transactions and sees the removals
+ * made by its earlier calls.
+ */
+List *
+TakeShardRepairLogEntries(int64 shardId, int maxEntryCount)
+{
+	List *logEntryList = NIL;
+	RangeVar *heapRangeVar = NULL;
+	RangeVar *indexRangeVar = NULL;
+	Relation heapRelation = NULL;
+	Relation indexRelation = NULL;
+	IndexScanDesc indexScanDesc = NULL;
+	const int scanKeyCount = 1;
+	ScanKeyData scanKey[scanKeyCount];
+	HeapTuple heapTuple = NULL;
+	Snapshot logSnapshot = RegisterSnapshot(GetLatestSnapshot());
+
+	heapRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_REPAIR_LOG_TABLE_NAME, -1);
+	indexRangeVar = makeRangeVar(METADATA_SCHEMA_NAME,
+								 SHARD_REPAIR_LOG_SHARD_INDEX_NAME, -1);
+
+	heapRelation = relation_openrv(heapRangeVar, RowExclusiveLock);
+	indexRelation = relation_openrv(indexRangeVar, AccessShareLock);
+
+	ScanKeyInit(&scanKey[0], 1, BTEqualStrategyNumber, F_INT8EQ, Int64GetDatum(shardId));
+
+	/* the index is on (shard_id, id), so entries are returned in order of their ids */
+	indexScanDesc = index_beginscan(heapRelation, indexRelation, logSnapshot,
+									scanKeyCount, 0);
+	index_rescan(indexScanDesc, scanKey, scanKeyCount, NULL, 0);
+
+	heapTuple = index_getnext(indexScanDesc, ForwardScanDirection);
+	while (HeapTupleIsValid(heapTuple) && list_length(logEntryList) < maxEntryCount)
+	{
+		TupleDesc tupleDescriptor = RelationGetDescr(heapRelation);
+		ShardRepairLogEntry *logEntry = TupleToShardRepairLogEntry(heapTuple,
+																   tupleDescriptor);
+		logEntryList = lappend(logEntryList, logEntry);
+
+		simple_heap_delete(heapRelation, &heapTuple->t_self);
+
+		heapTuple = index_getnext(indexScanDesc, ForwardScanDirection);
+	}
+
+	index_endscan(indexScanDesc);
+	index_close(indexRelation, AccessShareLock);
+	relation_close(heapRelation, RowExclusiveLock);
+
+	UnregisterSnapshot(logSnapshot);
+
+	CommandCounterIncrement();
+
+	return logEntryList;
+}
+
+
+/*
+ * DeleteShardRepairLogRows removes all entries from the repair log of the given
+ * shard, such as those left behind by an online repair which failed.
+ */
+void
+DeleteShardRepairLogRows(int64 shardId)
+{
+	RangeVar *heapRangeVar = NULL;
+	RangeVar *indexRangeVar = NULL;
+	Relation heapRelation = NULL;
+	Relation indexRelation = NULL;
+	IndexScanDesc indexScanDesc = NULL;
+	const int scanKeyCount = 1;
+	ScanKeyData scanKey[scanKeyCount];
+	HeapTuple heapTuple = NULL;
+
+	heapRangeVar = makeRangeVar(METADATA_SCHEMA_NAME, SHARD_REPAIR_LOG_TABLE_NAME, -1);
+	indexRangeVar = makeRangeVar(METADATA_SCHEMA_NAME,
+								 SHARD_REPAIR_LOG_SHARD_INDEX_NAME, -1);
+
+	heapRelation = relation_openrv(heapRangeVar, RowExclusiveLock);
+	indexRelation = relation_openrv(indexRangeVar, AccessShareLock);
+
+	ScanKeyInit(&scanKey[0], 1, BTEqualStrategyNumber, F_INT8EQ, Int64GetDatum(shardId));
+
+	indexScanDesc = index_beginscan(heapRelation, indexRelation, SnapshotSelf,
+									scanKeyCount, 0);
+	index_rescan(indexScanDesc, scanKey, scanKeyCount, NULL, 0);
+
+	heapTuple = index_getnext(indexScanDesc, ForwardScanDirection);
+	while (HeapTupleIsValid(heapTuple))
+	{
+		simple_heap_delete(heapRelation, &heapTuple->t_self);
+
+		heapTuple = index_getnext(indexScanDesc, ForwardScanDirection);
+	}
+
+	index_endscan(indexScanDesc);
+	index_close(indexRelation, AccessShareLock);
+	relation_close(heapRelation, RowExclusiveLock);
+
+	CommandCounterIncrement();
+}
+
+
 /*
  * NextSequenceId allocates and returns a new unique id generated from the given
  * sequence name.
@@ -817,6 +1632,33 @@ NextSequenceId(char *sequenceName)
 }
 
 
+/*
+ * NextSequenceIdArray allocates the given number of new unique ids from the
+ * given sequence, and returns them in an array. The sequence is only looked up
+ * once for all ids.
+ */
+uint64 *
+NextSequenceIdArray(char *sequenceName, int idCount)
+{
+	uint64 *sequenceIdArray = palloc0(idCount * sizeof(uint64));
+	RangeVar *sequenceRangeVar = makeRangeVar(METADATA_SCHEMA_NAME,
+											  sequenceName, -1);
+	bool failOk = false;
+	Oid sequenceRelationId = RangeVarGetRelid(sequenceRangeVar, NoLock, failOk);
+	Datum sequenceRelationIdDatum = ObjectIdGetDatum(sequenceRelationId);
+	int idIndex = 0;
+
+	for (idIndex = 0; idIndex < idCount; idIndex++)
+	{
+		Datum sequenceIdDatum = DirectFunctionCall1(nextval_oid,
+													sequenceRelationIdDatum);
+		sequenceIdArray[idIndex] = (uint64) DatumGetInt64(sequenceIdDatum);
+	}
+
+	return sequenceIdArray;
+}
+
+
 /*
  * LockShard returns after acquiring a lock for the specified shard, blocking
  * indefinitely if required. Only the ExclusiveLock and ShareLock modes are
@@ -848,3 +1690,57 @@ LockShard(int64 shardId, LOCKMODE lockMode)
 						errmsg("lockMode must be one of: ExclusiveLock, ShareLock")));
 	}
 }
+
+
+/*
+ * ConditionalLockShard acquires a lock for the specified shard like LockShard,
+ * but returns false rather than waiting if the lock is not immediately
+ * available. Otherwise, it returns true once the lock has been acquired.
+ */
+bool
+ConditionalLockShard(int64 shardId, LOCKMODE lockMode)
+{
+	/* locks use 32-bit identifier fields, so split shardId */
+	uint32 keyUpperHalf = (uint32) (shardId >> 32);
+	uint32 keyLowerHalf = (uint32) shardId;
+	bool sessionLock = false;   /* we want a transaction lock */
+	bool dontWait = true;       /* give up if the lock is held elsewhere */
+	LockAcquireResult lockResult = LOCKACQUIRE_NOT_AVAIL;
+
+	LOCKTAG lockTag;
+	memset(&lockTag, 0, sizeof(LOCKTAG));
+
+	SET_LOCKTAG_ADVISORY(lockTag, MyDatabaseId, keyUpperHalf, keyLowerHalf, 0);
+
+	if (lockMode != ExclusiveLock && lockMode != ShareLock)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("lockMode must be one of: ExclusiveLock, ShareLock")));
+	}
+
+	lockResult = LockAcquire(&lockTag, lockMode, sessionLock, dontWait);
+
+	return (lockResult != LOCKACQUIRE_NOT_AVAIL);
+}
+
+
+/*
+ * UnlockShard releases a lock on the specified shard which was acquired earlier
+ * in the transaction using LockShard with the same mode. This allows a lock to
+ * be given up before the end of the transaction.
+ */
+void
+UnlockShard(int64 shardId, LOCKMODE lockMode)
+{
+	/* locks use 32-bit identifier fields, so split shardId */
+	uint32 keyUpperHalf = (uint32) (shardId >> 32);
+	uint32 keyLowerHalf = (uint32) shardId;
+	bool sessionLock = false;
+
+	LOCKTAG lockTag;
+	memset(&lockTag, 0, sizeof(LOCKTAG));
+
+	SET_LOCKTAG_ADVISORY(lockTag, MyDatabaseId, keyUpperHalf, keyLowerHalf, 0);
+
+	(void) LockRelease(&lockTag, lockMode, sessionLock);
+}
@@ -29,6 +29,9 @@
 #define SHARD_PKEY_INDEX_NAME "shard_pkey"
 #define SHARD_RELATION_INDEX_NAME "shard_relation_index"
 
+/* shard identifiers are positive, so zero never names a shard */
+#define INVALID_SHARD_ID 0
+
 /* denotes storage type of the underlying shard */
 #define SHARD_STORAGE_TABLE 't'
 #define SHARD_STORAGE_FOREIGN 'f'
@@ -61,15 +64,34 @@
 #define HASH_PARTITION_TYPE 'h'
 #define RANGE_PARTITION_TYPE 'r'
 
+/* reference tables have a single shard, which is replicated to all workers */
+#define REFERENCE_PARTITION_TYPE 'n'
+
 /* human-readable names for addressing columns of partition table */
-#define PARTITION_TABLE_ATTRIBUTE_COUNT 3
+#define PARTITION_TABLE_ATTRIBUTE_COUNT 4
 #define ATTR_NUM_PARTITION_RELATION_ID 1
 #define ATTR_NUM_PARTITION_TYPE 2
 #define ATTR_NUM_PARTITION_KEY 3
-
-/* sequence names to generate new shard id and shard placement id */
+#define ATTR_NUM_PARTITION_COLOCATION_ID 4
+
+/* table and index names for modifications logged during online shard repair */
+#define SHARD_REPAIR_LOG_TABLE_NAME "shard_repair_log"
+#define SHARD_REPAIR_LOG_SHARD_INDEX_NAME "shard_repair_log_shard_index"
+
+/* human-readable names for addressing columns of shard repair log table */
+#define SHARD_REPAIR_LOG_TABLE_ATTRIBUTE_COUNT 6
+#define ATTR_NUM_SHARD_REPAIR_LOG_ID 1
+#define ATTR_NUM_SHARD_REPAIR_LOG_SHARD_ID 2
+#define ATTR_NUM_SHARD_REPAIR_LOG_QUERY 3
+#define ATTR_NUM_SHARD_REPAIR_LOG_PARAMETER_TYPES 4
+#define ATTR_NUM_SHARD_REPAIR_LOG_PARAMETER_VALUES 5
+#define ATTR_NUM_SHARD_REPAIR_LOG_QUERY_TREE 6
+
+/* sequence names to generate new shard, shard placement and co-location ids */
 #define SHARD_ID_SEQUENCE_NAME "shard_id_sequence"
 #define SHARD_PLACEMENT_ID_SEQUENCE_NAME "shard_placement_id_sequence"
+#define COLOCATION_ID_SEQUENCE_NAME "colocation_id_sequence"
+#define SHARD_REPAIR_LOG_ID_SEQUENCE_NAME "shard_repair_log_id_sequence"
 
 
 /* ShardState represents the last known state of a shard on a given node */
@@ -119,6 +141,26 @@ typedef struct ShardPlacement
 } ShardPlacement;
 
 
+/*
+ * ShardRepairLogEntry represents a modification of a shard which was made while
+ * one of the shard's placements was being repaired online, and which is still
+ * to be replayed on that placement. Entries are replayed in order of their ids.
+ * Parameter values are in text format, and are NULL for null parameters. While
+ * a shard is being split, the modification's query is also kept, so that it can
+ * be replayed on the shards it is split into.
+ */
+typedef struct ShardRepairLogEntry
+{
+	int64 id;                   /* unique identifier for the log entry */
+	int64 shardId;              /* identifies shard which was modified */
+	char *queryString;          /* modification as sent to the shard's placements */
+	int parameterCount;         /* number of parameters referenced as $n, if any */
+	Oid *parameterTypes;        /* types of parameters, zero to let node infer them */
+	const char **parameterValues; /* parameter values in text format */
+	char *queryTree;            /* serialized query of the modification, or NULL */
+} ShardRepairLogEntry;
+
+
 /*
  * ShardIntervalListCacheEntry contains the information for a cache entry in
  * shard interval list cache entry.
@@ -133,24 +175,40 @@ typedef struct ShardIntervalListCacheEntry
 /* function declarations to access and manipulate the metadata */
 extern List * LookupShardIntervalList(Oid distributedTableId);
 extern List * LoadShardIntervalList(Oid distributedTableId);
+extern List * LoadShardIntervalListToDelete(Oid distributedTableId);
 extern ShardInterval * LoadShardInterval(int64 shardId);
 extern List * LoadFinalizedShardPlacementList(uint64 shardId);
 extern List * LoadShardPlacementList(int64 shardId);
+extern List * LoadInactiveShardPlacementList(void);
 extern Var * PartitionColumn(Oid distributedTableId);
 extern char PartitionType(Oid distributedTableId);
+extern uint32 ColocationId(Oid distributedTableId);
+extern List * ColocatedTableList(Oid distributedTableId);
 extern bool IsDistributedTable(Oid tableId);
 extern bool DistributedTablesExist(void);
 extern Var * ColumnNameToColumn(Oid relationId, char *columnName);
 extern void InsertPartitionRow(Oid distributedTableId, char partitionType,
 							   text *partitionKeyText);
+extern void UpdateColocationId(Oid distributedTableId, uint32 colocationId);
 extern void InsertShardRow(Oid distributedTableId, uint64 shardId, char shardStorage,
 						   text *shardMinValue, text *shardMaxValue);
+extern void InsertShardRowList(List *shardIntervalList, char shardStorage);
 extern void InsertShardPlacementRow(uint64 shardPlacementId, uint64 shardId,
 									ShardState shardState, char *nodeName,
 									uint32 nodePort);
+extern void InsertShardPlacementRowList(List *shardPlacementList);
+extern void DeleteShardRow(uint64 shardId);
 extern void DeleteShardPlacementRow(uint64 shardPlacementId);
+extern void InsertShardRepairLogRow(int64 shardId, char *queryString,
+									int parameterCount, Oid *parameterTypes,
+									const char **parameterValues, char *queryTree);
+extern List * TakeShardRepairLogEntries(int64 shardId, int maxEntryCount);
+extern void DeleteShardRepairLogRows(int64 shardId);
 extern uint64 NextSequenceId(char *sequenceName);
+extern uint64 * NextSequenceIdArray(char *sequenceName, int idCount);
 extern void LockShard(int64 shardId, LOCKMODE lockMode);
+extern bool ConditionalLockShard(int64 shardId, LOCKMODE lockMode);
+extern void UnlockShard(int64 shardId, LOCKMODE lockMode);
 
 
 #endif /* PG_SHARD_DISTRIBUTION_METADATA_H */
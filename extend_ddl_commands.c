@@ -65,21 +65,62 @@ static char * DeparseIndexStmt(IndexStmt *indexStmt, Oid masterRelationId);
  * ExtendedDDLCommandList takes in a list of ddl commands and parses them. The
  * function then extends table, index, and constraint names in each DDL
  * command's parse tree by appending the given shard id. The function then
- * deparses the extended parse node back into a SQL string.
+ * deparses the extended parse node back into a SQL string. Callers extending
+ * the same commands for many shards should instead parse them once, using
+ * ParseDDLCommandList, and pass the parse trees to ExtendedParsedDDLCommandList.
  */
 List *
 ExtendedDDLCommandList(Oid masterRelationId, uint64 shardId, List *ddlCommandList)
 {
-	List *extendedDDLCommandList = NIL;
+	List *parseTreeList = ParseDDLCommandList(ddlCommandList);
+
+	return ExtendedParsedDDLCommandList(masterRelationId, shardId, parseTreeList);
+}
+
+
+/*
+ * ParseDDLCommandList parses each of the given ddl commands, and returns the
+ * list of their parse trees.
+ */
+List *
+ParseDDLCommandList(List *ddlCommandList)
+{
+	List *parseTreeList = NIL;
 	ListCell *ddlCommandCell = NULL;
 
 	foreach(ddlCommandCell, ddlCommandList)
 	{
 		char *ddlCommand = (char *) lfirst(ddlCommandCell);
+		Node *ddlCommandNode = ParseTreeNode(ddlCommand);
+
+		parseTreeList = lappend(parseTreeList, ddlCommandNode);
+	}
+
+	return parseTreeList;
+}
+
+
+/*
+ * ExtendedParsedDDLCommandList extends table, index, and constraint names in
+ * the given parse trees by appending the given shard id, and deparses them back
+ * into SQL strings. As extending names modifies a parse tree, each tree is
+ * copied first; the given trees are left untouched, and may be reused to extend
+ * the commands for another shard.
+ */
+List *
+ExtendedParsedDDLCommandList(Oid masterRelationId, uint64 shardId,
+							 List *parseTreeList)
+{
+	List *extendedDDLCommandList = NIL;
+	ListCell *parseTreeCell = NULL;
+
+	foreach(parseTreeCell, parseTreeList)
+	{
+		Node *parseTree = (Node *) lfirst(parseTreeCell);
 		char *extendedDDLCommand = NULL;
 
-		/* extend names in ddl command and apply extended command */
-		Node *ddlCommandNode = ParseTreeNode(ddlCommand);
+		/* extend names in a copy of the parse tree and deparse it */
+		Node *ddlCommandNode = copyObject(parseTree);
 		ExtendDDLCommand(ddlCommandNode, shardId);
 
 		extendedDDLCommand = DeparseDDLCommand(ddlCommandNode, masterRelationId);
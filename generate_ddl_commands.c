@@ -65,26 +65,58 @@ static char * pg_shard_get_indexclusterdef_string(Oid indexRelationId);
 List *
 TableDDLCommandList(Oid relationId)
 {
-	List *tableDDLCommandList = NIL;
+	List *tableDDLCommandList = TableSchemaDDLCommandList(relationId);
+	List *indexDDLCommandList = TableIndexDDLCommandList(relationId);
+
+	tableDDLCommandList = list_concat(tableDDLCommandList, indexDDLCommandList);
+
+	return tableDDLCommandList;
+}
+
+
+/*
+ * TableSchemaDDLCommandList returns the DDL commands which create the given
+ * table without any of its indexes: the table's schema definition, and its
+ * optional column storage and statistics definitions.
+ */
+List *
+TableSchemaDDLCommandList(Oid relationId)
+{
+	List *schemaDDLCommandList = NIL;
 	char *tableSchemaDef = NULL;
 	char *tableColumnOptionsDef = NULL;
 
-	Relation pgIndex = NULL;
-	SysScanDesc scanDescriptor = NULL;
-	ScanKeyData scanKey[1];
-	int scanKeyCount = 1;
-	HeapTuple heapTuple = NULL;
-
 	/* fetch table schema and column option definitions */
 	tableSchemaDef = pg_shard_get_tableschemadef_string(relationId);
 	tableColumnOptionsDef = pg_shard_get_tablecolumnoptionsdef_string(relationId);
 
-	tableDDLCommandList = lappend(tableDDLCommandList, tableSchemaDef);
+	schemaDDLCommandList = lappend(schemaDDLCommandList, tableSchemaDef);
 	if (tableColumnOptionsDef != NULL)
 	{
-		tableDDLCommandList = lappend(tableDDLCommandList, tableColumnOptionsDef);
+		schemaDDLCommandList = lappend(schemaDDLCommandList, tableColumnOptionsDef);
 	}
 
+	return schemaDDLCommandList;
+}
+
+
+/*
+ * TableIndexDDLCommandList returns the DDL commands which create the indexes of
+ * the given table, along with the constraints backed by indexes and the table's
+ * clustering on one of them. Running these commands once a table has been
+ * loaded with data is much faster than maintaining the indexes while loading.
+ */
+List *
+TableIndexDDLCommandList(Oid relationId)
+{
+	List *indexDDLCommandList = NIL;
+
+	Relation pgIndex = NULL;
+	SysScanDesc scanDescriptor = NULL;
+	ScanKeyData scanKey[1];
+	int scanKeyCount = 1;
+	HeapTuple heapTuple = NULL;
+
 	/* open system catalog and scan all indexes that belong to this table */
 	pgIndex = heap_open(IndexRelationId, AccessShareLock);
 
@@ -137,7 +169,7 @@ TableDDLCommandList(Oid relationId)
 		}
 
 		/* append found constraint or index definition to the list */
-		tableDDLCommandList = lappend(tableDDLCommandList, statementDef);
+		indexDDLCommandList = lappend(indexDDLCommandList, statementDef);
 
 		/* if table is clustered on this index, append definition to the list */
 		if (indexForm->indisclustered)
@@ -145,7 +177,7 @@ TableDDLCommandList(Oid relationId)
 			char *clusteredDef = pg_shard_get_indexclusterdef_string(indexId);
 			Assert(clusteredDef != NULL);
 
-			tableDDLCommandList = lappend(tableDDLCommandList, clusteredDef);
+			indexDDLCommandList = lappend(indexDDLCommandList, clusteredDef);
 		}
 
 		heapTuple = systable_getnext(scanDescriptor);
@@ -155,7 +187,7 @@ TableDDLCommandList(Oid relationId)
 	systable_endscan(scanDescriptor);
 	heap_close(pgIndex, AccessShareLock);
 
-	return tableDDLCommandList;
+	return indexDDLCommandList;
 }
 
 
@@ -0,0 +1,534 @@
+/*-------------------------------------------------------------------------
+ *
+ * node_health.c
+ *
+ * This file contains functions to track the health of worker nodes. Nodes to
+ * which connections recently failed are skipped for a backoff period which
+ * doubles on each consecutive failure. When pg_shard is loaded through the
+ * shared_preload_libraries setting, this information lives in shared memory so
+ * that all backends benefit from a failure observed by any one of them, and a
+ * background worker probes unavailable nodes so that recovered nodes are put
+ * back into use without any query having to wait on them. Otherwise, each
+ * backend tracks node health on its own.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h" /* IWYU pragma: keep */
+#include "c.h"
+#include "libpq-fe.h"
+#include "miscadmin.h"
+
+#include "node_health.h"
+#include "connection.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lib/stringinfo.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/elog.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/palloc.h"
+#include "utils/timestamp.h"
+
+
+/* backoff applied after a node's first connection failure, in milliseconds */
+int InitialNodeBackoff = 1000;
+
+/* upper bound on the backoff applied to a failing node, in milliseconds */
+int MaximumNodeBackoff = 60000;
+
+
+/*
+ * NodeHealthControl and NodeHealthHash point to the node health state. If the
+ * state lives in shared memory, both are set up by NodeHealthShmemStartup. If
+ * it doesn't, NodeHealthHash is instead created in local memory on first use
+ * and NodeHealthControl remains NULL.
+ */
+static NodeHealthControlData *NodeHealthControl = NULL;
+static HTAB *NodeHealthHash = NULL;
+
+/* saved hook value in case of unload */
+static shmem_startup_hook_type PreviousShmemStartupHook = NULL;
+
+/* flags set by signal handlers of the health checker */
+static volatile sig_atomic_t GotSigterm = false;
+static volatile sig_atomic_t GotSighup = false;
+
+
+/* local function forward declarations */
+static Size NodeHealthShmemSize(void);
+static void NodeHealthShmemStartup(void);
+static void LockNodeHealth(LWLockMode lockMode);
+static void UnlockNodeHealth(void);
+static void BuildNodeHealthKey(NodeConnectionKey *connectionKey,
+							   NodeConnectionKey *nodeHealthKey);
+static void NodeHealthCheckerMain(Datum mainArgument);
+static void NodeHealthCheckerSigterm(SIGNAL_ARGS);
+static void NodeHealthCheckerSighup(SIGNAL_ARGS);
+static List * ClaimNodesToProbe(void);
+static bool ProbeNode(NodeConnectionKey *nodeKey);
+
+
+/*
+ * InitializeNodeHealth requests the shared memory and lock needed to share
+ * node health among all backends, and registers the background worker which
+ * probes unavailable nodes. Both are only possible while shared preload
+ * libraries are being loaded; at any other time this function does nothing
+ * and node health is tracked per backend instead.
+ */
+void
+InitializeNodeHealth(void)
+{
+	BackgroundWorker healthChecker;
+
+	if (!process_shared_preload_libraries_in_progress)
+	{
+		return;
+	}
+
+	RequestAddinShmemSpace(NodeHealthShmemSize());
+	RequestAddinLWLocks(1);
+
+	PreviousShmemStartupHook = shmem_startup_hook;
+	shmem_startup_hook = NodeHealthShmemStartup;
+
+	memset(&healthChecker, 0, sizeof(healthChecker));
+	healthChecker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	healthChecker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	healthChecker.bgw_restart_time = HEALTH_CHECKER_RESTART_SECONDS;
+	healthChecker.bgw_main = NodeHealthCheckerMain;
+	healthChecker.bgw_main_arg = (Datum) 0;
+#if (PG_VERSION_NUM >= 90400)
+	snprintf(healthChecker.bgw_name, BGW_MAXLEN, "pg_shard node health checker");
+#else
+	healthChecker.bgw_name = "pg_shard node health checker";
+#endif
+
+	RegisterBackgroundWorker(&healthChecker);
+}
+
+
+/*
+ * NodeAvailable returns whether a new connection to the given node should be
+ * attempted. This is the case unless the node recently failed and its backoff
+ * period has not yet passed. After the backoff period, the first caller to ask
+ * claims the right to probe the node and receives true; other callers continue
+ * to receive false until that probe is recorded as a success or failure, or is
+ * abandoned.
+ */
+bool
+NodeAvailable(NodeConnectionKey *nodeKey)
+{
+	NodeHealthEntry *nodeHealthEntry = NULL;
+	NodeConnectionKey nodeHealthKey;
+	TimestampTz currentTime = GetCurrentTimestamp();
+	bool entryFound = false;
+	bool nodeAvailable = true;
+
+	BuildNodeHealthKey(nodeKey, &nodeHealthKey);
+
+	LockNodeHealth(LW_EXCLUSIVE);
+
+	nodeHealthEntry = hash_search(NodeHealthHash, &nodeHealthKey, HASH_FIND,
+								  &entryFound);
+	if (entryFound)
+	{
+		bool probeInProgress = false;
+
+		if (nodeHealthEntry->probeStartTime != 0)
+		{
+			probeInProgress = !TimestampDifferenceExceeds(nodeHealthEntry->probeStartTime,
+														  currentTime,
+														  NODE_PROBE_TIMEOUT_MSECS);
+		}
+
+		if (currentTime < nodeHealthEntry->retryTime || probeInProgress)
+		{
+			nodeAvailable = false;
+		}
+		else
+		{
+			nodeHealthEntry->probeStartTime = currentTime;
+		}
+	}
+
+	UnlockNodeHealth();
+
+	return nodeAvailable;
+}
+
+
+/*
+ * RecordNodeSuccess notes that a connection to the given node succeeded, which
+ * clears any failures previously recorded for it.
+ */
+void
+RecordNodeSuccess(NodeConnectionKey *nodeKey)
+{
+	NodeConnectionKey nodeHealthKey;
+	bool entryFound = false;
+
+	BuildNodeHealthKey(nodeKey, &nodeHealthKey);
+
+	LockNodeHealth(LW_SHARED);
+	hash_search(NodeHealthHash, &nodeHealthKey, HASH_FIND, &entryFound);
+	UnlockNodeHealth();
+
+	/* healthy nodes have no entries, so avoid the exclusive lock if possible */
+	if (!entryFound)
+	{
+		return;
+	}
+
+	LockNodeHealth(LW_EXCLUSIVE);
+	hash_search(NodeHealthHash, &nodeHealthKey, HASH_REMOVE, &entryFound);
+	UnlockNodeHealth();
+}
+
+
+/*
+ * RecordNodeFailure notes that connecting to the given node failed, and starts
+ * a backoff period during which no further connections to the node are tried.
+ * Each consecutive failure doubles the length of this period, up to the limit
+ * set by the max_node_backoff setting. If the health table is full, the failure
+ * is not recorded.
+ */
+void
+RecordNodeFailure(NodeConnectionKey *nodeKey)
+{
+	NodeHealthEntry *nodeHealthEntry = NULL;
+	NodeConnectionKey nodeHealthKey;
+	TimestampTz currentTime = GetCurrentTimestamp();
+	bool entryFound = false;
+	uint32 backoffDoublings = 0;
+	int64 backoffMsecs = 0;
+
+	BuildNodeHealthKey(nodeKey, &nodeHealthKey);
+
+	LockNodeHealth(LW_EXCLUSIVE);
+
+	nodeHealthEntry = hash_search(NodeHealthHash, &nodeHealthKey, HASH_ENTER_NULL,
+								  &entryFound);
+	if (nodeHealthEntry != NULL)
+	{
+		if (!entryFound)
+		{
+			nodeHealthEntry->failureCount = 0;
+		}
+
+		nodeHealthEntry->failureCount++;
+
+		backoffDoublings = Min(nodeHealthEntry->failureCount - 1, MAX_BACKOFF_DOUBLINGS);
+		backoffMsecs = ((int64) InitialNodeBackoff) << backoffDoublings;
+		backoffMsecs = Min(backoffMsecs, (int64) MaximumNodeBackoff);
+
+		nodeHealthEntry->retryTime = TimestampTzPlusMilliseconds(currentTime,
+																 backoffMsecs);
+		nodeHealthEntry->probeStartTime = 0;
+	}
+
+	UnlockNodeHealth();
+}
+
+
+/*
+ * NodeHealthShmemSize returns the amount of shared memory needed to track the
+ * health of up to MAX_TRACKED_NODE_COUNT nodes.
+ */
+static Size
+NodeHealthShmemSize(void)
+{
+	Size shmemSize = MAXALIGN(sizeof(NodeHealthControlData));
+	shmemSize = add_size(shmemSize, hash_estimate_size(MAX_TRACKED_NODE_COUNT,
+													   sizeof(NodeHealthEntry)));
+
+	return shmemSize;
+}
+
+
+/*
+ * NodeHealthShmemStartup creates or attaches to the shared node health state.
+ */
+static void
+NodeHealthShmemStartup(void)
+{
+	HASHCTL info;
+	bool alreadyInitialized = false;
+
+	if (PreviousShmemStartupHook != NULL)
+	{
+		PreviousShmemStartupHook();
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	NodeHealthControl = ShmemInitStruct("pg_shard node health",
+										sizeof(NodeHealthControlData),
+										&alreadyInitialized);
+	if (!alreadyInitialized)
+	{
+		NodeHealthControl->lock = LWLockAssign();
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(NodeConnectionKey);
+	info.entrysize = sizeof(NodeHealthEntry);
+	info.hash = tag_hash;
+
+	NodeHealthHash = ShmemInitHash("pg_shard node health hash",
+								   MAX_TRACKED_NODE_COUNT, MAX_TRACKED_NODE_COUNT,
+								   &info, HASH_ELEM | HASH_FUNCTION);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * LockNodeHealth acquires the lock protecting the node health hash in the
+ * given mode. If node health is not in shared memory, no lock is needed, but
+ * the backend-local hash is created on first use.
+ */
+static void
+LockNodeHealth(LWLockMode lockMode)
+{
+	if (NodeHealthControl != NULL)
+	{
+		LWLockAcquire(NodeHealthControl->lock, lockMode);
+		return;
+	}
+
+	if (NodeHealthHash == NULL)
+	{
+		HASHCTL info;
+		int hashFlags = 0;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(NodeConnectionKey);
+		info.entrysize = sizeof(NodeHealthEntry);
+		info.hash = tag_hash;
+		info.hcxt = CacheMemoryContext;
+		hashFlags = (HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+		NodeHealthHash = hash_create("pg_shard node health", 32, &info, hashFlags);
+	}
+}
+
+
+/* UnlockNodeHealth releases the lock taken by LockNodeHealth, if any. */
+static void
+UnlockNodeHealth(void)
+{
+	if (NodeHealthControl != NULL)
+	{
+		LWLockRelease(NodeHealthControl->lock);
+	}
+}
+
+
+/*
+ * BuildNodeHealthKey fills in the key used to look up the given connection's
+ * node in the health hash. Health is tracked per node rather than per
+ * connection, so the connection slot is always left at zero.
+ */
+static void
+BuildNodeHealthKey(NodeConnectionKey *connectionKey, NodeConnectionKey *nodeHealthKey)
+{
+	memset(nodeHealthKey, 0, sizeof(NodeConnectionKey));
+	strncpy(nodeHealthKey->nodeName, connectionKey->nodeName, MAX_NODE_LENGTH);
+	nodeHealthKey->nodePort = connectionKey->nodePort;
+}
+
+
+/*
+ * NodeHealthCheckerMain is the entry point of the background worker which
+ * periodically probes nodes whose backoff period has passed. Nodes responding
+ * to a probe are made available again; others have their backoff extended.
+ * This keeps queries from ever waiting on a node that is still down.
+ */
+static void
+NodeHealthCheckerMain(Datum mainArgument)
+{
+	MemoryContext probeContext = NULL;
+
+	pqsignal(SIGTERM, NodeHealthCheckerSigterm);
+	pqsignal(SIGHUP, NodeHealthCheckerSighup);
+	BackgroundWorkerUnblockSignals();
+
+	probeContext = AllocSetContextCreate(TopMemoryContext, "Node Health Probes",
+										 ALLOCSET_DEFAULT_MINSIZE,
+										 ALLOCSET_DEFAULT_INITSIZE,
+										 ALLOCSET_DEFAULT_MAXSIZE);
+
+	while (!GotSigterm)
+	{
+		List *nodeKeyList = NIL;
+		ListCell *nodeKeyCell = NULL;
+		MemoryContext oldContext = NULL;
+		int latchResult = 0;
+
+		latchResult = WaitLatch(&MyProc->procLatch,
+								WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+								HEALTH_CHECK_INTERVAL_MSECS);
+		ResetLatch(&MyProc->procLatch);
+
+		if (latchResult & WL_POSTMASTER_DEATH)
+		{
+			proc_exit(1);
+		}
+
+		if (GotSighup)
+		{
+			GotSighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		oldContext = MemoryContextSwitchTo(probeContext);
+
+		nodeKeyList = ClaimNodesToProbe();
+		foreach(nodeKeyCell, nodeKeyList)
+		{
+			NodeConnectionKey *nodeKey = (NodeConnectionKey *) lfirst(nodeKeyCell);
+
+			if (GotSigterm)
+			{
+				break;
+			}
+
+			if (ProbeNode(nodeKey))
+			{
+				RecordNodeSuccess(nodeKey);
+			}
+			else
+			{
+				RecordNodeFailure(nodeKey);
+			}
+		}
+
+		MemoryContextSwitchTo(oldContext);
+		MemoryContextReset(probeContext);
+	}
+
+	proc_exit(0);
+}
+
+
+/* NodeHealthCheckerSigterm asks the health checker to exit. */
+static void
+NodeHealthCheckerSigterm(SIGNAL_ARGS)
+{
+	int savedErrno = errno;
+
+	GotSigterm = true;
+	if (MyProc != NULL)
+	{
+		SetLatch(&MyProc->procLatch);
+	}
+
+	errno = savedErrno;
+}
+
+
+/* NodeHealthCheckerSighup asks the health checker to reload its settings. */
+static void
+NodeHealthCheckerSighup(SIGNAL_ARGS)
+{
+	int savedErrno = errno;
+
+	GotSighup = true;
+	if (MyProc != NULL)
+	{
+		SetLatch(&MyProc->procLatch);
+	}
+
+	errno = savedErrno;
+}
+
+
+/*
+ * ClaimNodesToProbe claims the right to probe every node whose backoff period
+ * has passed and which no one else is probing, and returns the keys of these
+ * nodes. The keys are copied so that probes may run without holding the lock.
+ */
+static List *
+ClaimNodesToProbe(void)
+{
+	List *nodeKeyList = NIL;
+	HASH_SEQ_STATUS status;
+	NodeHealthEntry *nodeHealthEntry = NULL;
+	TimestampTz currentTime = GetCurrentTimestamp();
+
+	LockNodeHealth(LW_EXCLUSIVE);
+
+	hash_seq_init(&status, NodeHealthHash);
+	while ((nodeHealthEntry = (NodeHealthEntry *) hash_seq_search(&status)) != NULL)
+	{
+		NodeConnectionKey *nodeKey = NULL;
+		bool probeInProgress = false;
+
+		if (nodeHealthEntry->probeStartTime != 0)
+		{
+			probeInProgress = !TimestampDifferenceExceeds(nodeHealthEntry->probeStartTime,
+														  currentTime,
+														  NODE_PROBE_TIMEOUT_MSECS);
+		}
+
+		if (currentTime < nodeHealthEntry->retryTime || probeInProgress)
+		{
+			continue;
+		}
+
+		nodeHealthEntry->probeStartTime = currentTime;
+
+		nodeKey = (NodeConnectionKey *) palloc0(sizeof(NodeConnectionKey));
+		memcpy(nodeKey, &nodeHealthEntry->nodeKey, sizeof(NodeConnectionKey));
+
+		nodeKeyList = lappend(nodeKeyList, nodeKey);
+	}
+
+	UnlockNodeHealth();
+
+	return nodeKeyList;
+}
+
+
+/*
+ * ProbeNode checks whether the given node accepts connections. Since the probe
+ * uses PQping, no database or credentials are needed; the server only has to
+ * answer. A server which answers but rejects connections, for instance because
+ * it is still starting up, is not considered available.
+ */
+static bool
+ProbeNode(NodeConnectionKey *nodeKey)
+{
+	StringInfo nodePortString = makeStringInfo();
+	PGPing pingStatus = PQPING_NO_RESPONSE;
+
+	const char *keywordArray[] = {
+		"host", "port", "fallback_application_name", "connect_timeout", NULL
+	};
+	const char *valueArray[] = {
+		nodeKey->nodeName, NULL, "pg_shard", CLIENT_CONNECT_TIMEOUT_SECONDS, NULL
+	};
+
+	Assert(sizeof(keywordArray) == sizeof(valueArray));
+
+	appendStringInfo(nodePortString, "%d", nodeKey->nodePort);
+	valueArray[1] = nodePortString->data;
+
+	pingStatus = PQpingParams(keywordArray, valueArray, false);
+
+	return (pingStatus == PQPING_OK);
+}
@@ -0,0 +1,80 @@
+/*-------------------------------------------------------------------------
+ *
+ * node_health.h
+ *
+ * Declarations for public functions and types related to tracking the health
+ * of worker nodes.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_NODE_HEALTH_H
+#define PG_SHARD_NODE_HEALTH_H
+
+#include "c.h"
+
+#include "connection.h"
+
+#include "datatype/timestamp.h"
+#include "storage/lwlock.h"
+
+
+/* maximum number of nodes whose health can be tracked in shared memory */
+#define MAX_TRACKED_NODE_COUNT 1024
+
+/* interval between rounds of background health checks */
+#define HEALTH_CHECK_INTERVAL_MSECS 1000
+
+/* seconds after which a crashed health checker is restarted */
+#define HEALTH_CHECKER_RESTART_SECONDS 10
+
+/* a probe that has not reported back after this long is considered abandoned */
+#define NODE_PROBE_TIMEOUT_MSECS (CLIENT_CONNECT_TIMEOUT_MSECS * MAX_CONNECT_ATTEMPTS * 2)
+
+/* upper bound on the exponent used when doubling a node's backoff */
+#define MAX_BACKOFF_DOUBLINGS 16
+
+
+/*
+ * NodeHealthEntry records recent connection failures for a single node. Only
+ * nodes which have failed at least once have entries: a successful connection
+ * removes the node's entry altogether. While the current time is before the
+ * retry time, new connections to the node are not attempted. Once the retry
+ * time has passed, a single process at a time may claim the right to probe the
+ * node by setting its probe start time.
+ */
+typedef struct NodeHealthEntry
+{
+	NodeConnectionKey nodeKey;      /* node name and port (slot zero); hash key */
+	uint32 failureCount;            /* consecutive failed connection attempts */
+	TimestampTz retryTime;          /* time before which node is skipped */
+	TimestampTz probeStartTime;     /* start of in-progress probe, or zero */
+} NodeHealthEntry;
+
+
+/* NodeHealthControlData holds the state protecting the shared health hash. */
+typedef struct NodeHealthControlData
+{
+#if (PG_VERSION_NUM >= 90400)
+	LWLock *lock;                   /* protects all node health entries */
+#else
+	LWLockId lock;                  /* protects all node health entries */
+#endif
+} NodeHealthControlData;
+
+
+/* config variables managed via guc.c */
+extern int InitialNodeBackoff;
+extern int MaximumNodeBackoff;
+
+
+/* function declarations for tracking and consulting node health */
+extern void InitializeNodeHealth(void);
+extern bool NodeAvailable(NodeConnectionKey *nodeKey);
+extern void RecordNodeSuccess(NodeConnectionKey *nodeKey);
+extern void RecordNodeFailure(NodeConnectionKey *nodeKey);
+
+
+#endif /* PG_SHARD_NODE_HEALTH_H */
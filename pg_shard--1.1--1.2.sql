@@ -0,0 +1,96 @@
+-- each distributed table belongs to a co-location group, whose tables are sharded
+-- alike so that they may be joined on their partition columns
+CREATE SEQUENCE pgs_distribution_metadata.colocation_id_sequence NO CYCLE;
+
+-- co-location groups are referred to by id, so pg_dump must preserve their sequence
+SELECT pg_catalog.pg_extension_config_dump(
+	'pgs_distribution_metadata.colocation_id_sequence', '');
+
+ALTER TABLE pgs_distribution_metadata.partition ADD COLUMN colocation_id integer;
+
+-- existing tables start out in groups of their own
+UPDATE pgs_distribution_metadata.partition
+SET    colocation_id = nextval('pgs_distribution_metadata.colocation_id_sequence');
+
+ALTER TABLE pgs_distribution_metadata.partition
+	ALTER COLUMN colocation_id SET NOT NULL,
+	ALTER COLUMN colocation_id
+		SET DEFAULT nextval('pgs_distribution_metadata.colocation_id_sequence');
+
+CREATE INDEX partition_colocation_id_index
+	ON pgs_distribution_metadata.partition (colocation_id);
+
+-- shards may now be created alongside those of an existing table
+DROP FUNCTION master_create_worker_shards(text, integer, integer);
+
+CREATE FUNCTION master_create_worker_shards(table_name text, shard_count integer,
+											replication_factor integer DEFAULT 2,
+											colocate_with text DEFAULT 'none')
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- small tables may be replicated to all workers, to be joined with any table
+CREATE FUNCTION master_create_reference_table(table_name text)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- shards may be repaired while modifications continue, which are logged meanwhile
+CREATE TABLE pgs_distribution_metadata.shard_repair_log (
+	id bigint primary key,
+	shard_id bigint not null,
+	query text not null,
+	parameter_types oid[] not null,
+	parameter_values text[] not null,
+	query_tree text
+);
+
+CREATE INDEX shard_repair_log_shard_index
+	ON pgs_distribution_metadata.shard_repair_log (shard_id, id);
+
+CREATE SEQUENCE pgs_distribution_metadata.shard_repair_log_id_sequence NO CYCLE;
+
+DROP FUNCTION master_copy_shard_placement(bigint, text, integer, text, integer);
+
+CREATE FUNCTION master_copy_shard_placement(shard_id bigint,
+											source_node_name text,
+											source_node_port integer,
+											target_node_name text,
+											target_node_port integer,
+											online boolean DEFAULT false)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- placements which missed few modifications may be resynced rather than recreated
+CREATE FUNCTION master_resync_shard_placement(shard_id bigint,
+											  source_node_name text,
+											  source_node_port integer,
+											  target_node_name text,
+											  target_node_port integer)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- all inactive placements of a table may be repaired at once, in parallel
+CREATE FUNCTION master_repair_all_placements(table_name text,
+											 max_parallel integer DEFAULT 2)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- shard placements of a table may be spread evenly across the worker nodes
+CREATE FUNCTION master_rebalance_table_shards(table_name text,
+											  rebalance_by text DEFAULT 'count',
+											  max_parallel integer DEFAULT 2,
+											  max_moves integer DEFAULT 0)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- a shard's hash range may be split across several new shards
+CREATE FUNCTION master_split_shard(shard_id bigint, split_count integer DEFAULT 2)
+RETURNS bigint[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
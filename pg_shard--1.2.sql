@@ -1,4 +1,4 @@
-/* pg_shard--1.1.sql */
+/* pg_shard--1.2.sql */
 
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION pg_shard" to load this file. \quit
@@ -24,11 +24,23 @@ CREATE SCHEMA pgs_distribution_metadata
 		node_port integer not null
 	)
 
-	-- partition lists a partition key for each distributed table
+	-- shard_repair_log holds modifications made while a shard is repaired online
+	CREATE TABLE shard_repair_log (
+		id bigint primary key,
+		shard_id bigint not null,
+		query text not null,
+		parameter_types oid[] not null,
+		parameter_values text[] not null,
+		query_tree text
+	)
+
+	-- partition lists a partition key and co-location group for each distributed table
 	CREATE TABLE partition (
 		relation_id oid unique not null,
 		partition_method "char" not null,
-		key text not null
+		key text not null,
+		colocation_id integer not null
+			default nextval('pgs_distribution_metadata.colocation_id_sequence')
 	)
 
 	-- make a few more indexes for fast access
@@ -36,10 +48,14 @@ CREATE SCHEMA pgs_distribution_metadata
 	CREATE INDEX shard_placement_node_name_node_port_index
 		ON shard_placement (node_name, node_port)
 	CREATE INDEX shard_placement_shard_index ON shard_placement (shard_id)
+	CREATE INDEX partition_colocation_id_index ON partition (colocation_id)
+	CREATE INDEX shard_repair_log_shard_index ON shard_repair_log (shard_id, id)
 
-	-- make sequences for shards and placements
+	-- make sequences for shards, placements, co-location groups and repair logs
 	CREATE SEQUENCE shard_id_sequence MINVALUE 10000 NO CYCLE
-	CREATE SEQUENCE shard_placement_id_sequence NO CYCLE;
+	CREATE SEQUENCE shard_placement_id_sequence NO CYCLE
+	CREATE SEQUENCE colocation_id_sequence NO CYCLE
+	CREATE SEQUENCE shard_repair_log_id_sequence NO CYCLE;
 
 -- mark each of the above as config tables to have pg_dump preserve them
 SELECT pg_catalog.pg_extension_config_dump(
@@ -49,6 +65,10 @@ SELECT pg_catalog.pg_extension_config_dump(
 SELECT pg_catalog.pg_extension_config_dump(
 	'pgs_distribution_metadata.partition', '');
 
+-- co-location groups are referred to by id, so pg_dump must preserve their sequence
+SELECT pg_catalog.pg_extension_config_dump(
+	'pgs_distribution_metadata.colocation_id_sequence', '');
+
 -- define the table distribution functions
 CREATE FUNCTION master_create_distributed_table(table_name text, partition_column text,
 												partition_method "char" DEFAULT 'h')
@@ -57,7 +77,13 @@ AS 'MODULE_PATHNAME'
 LANGUAGE C STRICT;
 
 CREATE FUNCTION master_create_worker_shards(table_name text, shard_count integer,
-											replication_factor integer DEFAULT 2)
+											replication_factor integer DEFAULT 2,
+											colocate_with text DEFAULT 'none')
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION master_create_reference_table(table_name text)
 RETURNS void
 AS 'MODULE_PATHNAME'
 LANGUAGE C STRICT;
@@ -67,11 +93,40 @@ CREATE FUNCTION master_copy_shard_placement(shard_id bigint,
 											source_node_name text,
 											source_node_port integer,
 											target_node_name text,
-											target_node_port integer)
+											target_node_port integer,
+											online boolean DEFAULT false)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION master_resync_shard_placement(shard_id bigint,
+											  source_node_name text,
+											  source_node_port integer,
+											  target_node_name text,
+											  target_node_port integer)
 RETURNS void
 AS 'MODULE_PATHNAME'
 LANGUAGE C STRICT;
 
+CREATE FUNCTION master_repair_all_placements(table_name text,
+											 max_parallel integer DEFAULT 2)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION master_rebalance_table_shards(table_name text,
+											  rebalance_by text DEFAULT 'count',
+											  max_parallel integer DEFAULT 2,
+											  max_moves integer DEFAULT 0)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION master_split_shard(shard_id bigint, split_count integer DEFAULT 2)
+RETURNS bigint[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
 CREATE FUNCTION worker_copy_shard_placement(table_name text, source_node_name text,
 											source_node_port integer)
 RETURNS void
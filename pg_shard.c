@@ -22,10 +22,17 @@
 #include "pg_shard.h"
 #include "connection.h"
 #include "create_shards.h"
+#include "ddl_commands.h"
 #include "distribution_metadata.h"
+#include "node_health.h"
 #include "prune_shard_list.h"
+#include "repair_shards.h"
+#include "repair_worker.h"
 #include "ruleutils.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <stddef.h>
 #include <string.h>
 
@@ -34,15 +41,18 @@
 #include "access/htup.h"
 #include "access/sdir.h"
 #include "access/skey.h"
+#include "access/transam.h"
 #include "access/tupdesc.h"
 #include "access/xact.h"
 #include "catalog/namespace.h"
 #include "catalog/pg_class.h"
 #include "catalog/pg_type.h"
 #include "commands/extension.h"
+#include "commands/prepare.h"
 #include "executor/execdesc.h"
 #include "executor/executor.h"
 #include "executor/instrument.h"
+#include "executor/tstoreReceiver.h"
 #include "executor/tuptable.h"
 #include "nodes/execnodes.h"
 #include "nodes/makefuncs.h"
@@ -54,24 +64,29 @@
 #include "nodes/pg_list.h"
 #include "nodes/plannodes.h"
 #include "nodes/primnodes.h"
+#include "nodes/relation.h"
+#include "nodes/value.h"
 #include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/planner.h"
+#include "optimizer/prep.h"
 #include "optimizer/var.h"
-#include "parser/analyze.h"
-#include "parser/parse_node.h"
+#include "parser/parse_clause.h"
 #include "parser/parsetree.h"
-#include "parser/parse_type.h"
+#include "postmaster/postmaster.h"
+#include "rewrite/rewriteManip.h"
 #include "storage/lock.h"
 #include "tcop/dest.h"
 #include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/elog.h"
 #include "utils/errcodes.h"
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
 #include "utils/palloc.h"
+#include "utils/plancache.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
 #include "utils/snapmgr.h"
@@ -88,15 +103,55 @@ bool UseCitusDBSelectLogic = false;
 /* logs each statement used in a distributed plan */
 bool LogDistributedStatements = false;
 
+/* connects to all worker nodes before the first distributed query */
+bool PrewarmConnections = false;
+
+/* combines a node's multi-shard SELECT queries into one query per connection */
+bool GroupTasksByNode = false;
+
+/* whether this backend has already pre-warmed its worker connections */
+static bool WorkerConnectionsPrewarmed = false;
+
 
 /* planner functions forward declarations */
 static PlannedStmt * PgShardPlanner(Query *parse, int cursorOptions,
 									ParamListInfo boundParams);
+static PlannedStmt * PlanPlaceholderStatement(Query *query, int cursorOptions);
+static List * DistributedPlaceholderList(Plan *plan);
+static PlannedStmt * PlanDistributedExecution(PlannedStmt *plannedStatement,
+											  ParamListInfo boundParams);
+static PlannedStmt * PlanDistributedQuery(PlannedStmt *plannedStatement,
+										  Query *originalQuery, Query *normalizedQuery,
+										  int cursorOptions, ParamListInfo boundParams);
+static void ExecuteMasterEvaluableFunctions(Query *query, ParamListInfo boundParams);
+static Node * EvaluateMutableExpressions(Node *expression, ParamListInfo boundParams);
+static bool RowDependentNodeWalker(Node *node, void *context);
+static Const * EvaluateExpression(Expr *expression, ParamListInfo boundParams);
+static bool QueryHasExternalParams(Query *query);
+static bool ExternalParamWalker(Node *node, void *context);
+static Node * ResolveExternalParams(Node *node, ParamListInfo boundParams);
+static ParamExternData * FetchExternalParam(ParamListInfo boundParams, int paramId);
+static void SetTaskParameters(Task *task, ParamListInfo boundParams);
+static bool InsertSelectQuery(Query *query);
+static RangeTblEntry * InsertSelectRangeTableEntry(Query *query);
+static DistributedPlan * PlanInsertSelectQuery(Query *query);
+static void ErrorIfInsertSelectNotSupported(Query *query);
+static List * InsertSelectSourceLockTaskList(Query *query);
+static List * ColocatedInsertSelectTaskList(Query *query, bool *colocated);
+static bool InsertSelectPushdownSupported(Query *query);
+static bool PlacementsColocated(List *placementList, List *sourcePlacementList);
 static PlannerType DeterminePlannerType(Query *query);
+static void ErrorIfCursorOptionsNotSupported(int cursorOptions);
 static void ErrorIfQueryNotSupported(Query *queryTree);
+static bool CurrentOfExprWalker(Node *node, void *context);
+static void ErrorIfJoinNotSupported(Query *queryTree);
+static bool ReferenceRowsPreserved(Node *joinTreeNode, Relids referenceRelationIds);
+static List * JoinTreeQualList(Node *joinTreeNode, bool includeOuterJoinQuals);
+static bool PartitionColumnJoinClause(Node *clause, List *rangeTableList);
 static Oid ExtractFirstDistributedTableId(Query *query);
 static bool ExtractRangeTableEntryWalker(Node *node, List **rangeTableList);
 static List * DistributedQueryShardList(Query *query);
+static List * LoadDistributedTableShardList(Oid distributedTableId);
 static bool SelectFromMultipleShards(Query *query, List *queryShardList);
 static void ClassifyRestrictions(List *queryRestrictList, List **remoteRestrictList,
 								 List **localRestrictList);
@@ -105,33 +160,109 @@ static Query * RowAndColumnFilterQuery(Query *query, List *remoteRestrictList,
 static Query * BuildLocalQuery(Query *query, List *localRestrictList);
 static PlannedStmt * PlanSequentialScan(Query *query, int cursorOptions,
 										ParamListInfo boundParams);
-static List * QueryRestrictList(Query *query);
 static Const * ExtractPartitionValue(Query *query, Var *partitionColumn);
 static bool ExtractFromExpressionWalker(Node *node, List **qualifierList);
 static List * QueryFromList(List *rangeTableList);
 static List * TargetEntryList(List *expressionList);
 static CreateStmt * CreateTemporaryTableLikeStmt(Oid sourceRelationId);
+static RangeVar * TemporaryTableRangeVar(void);
 static DistributedPlan * BuildDistributedPlan(Query *query, List *shardIntervalList);
+static bool QueryHasSubqueries(Query *query);
+static List * RouterShardGroup(Query *query);
+static bool RouterShardIntervalWalker(Node *node, List **shardIntervalList);
+static bool QueryShardIntervals(Query *query, List **shardIntervalList);
+static bool JoinQuery(Query *query);
+static DistributedPlan * PlanColocatedJoinQuery(Query *query, int cursorOptions);
+static List * ColocatedJoinShardGroupList(Query *query);
+static bool ReferenceRelationShardListMember(List *relationShardList, Oid relationId);
+static Relids NullableRelids(Node *joinTreeNode);
+static List * RelationRestrictList(List *restrictClauseList, Index rangeTableIndex);
+static List * JoinRequiredColumnList(Query *query);
+static Query * JoinColumnFilterQuery(Query *query, List *columnList);
+static Query * JoinLocalQuery(Query *query, List *columnList,
+							  CreateStmt *createIntermediateTableStmt);
+static Node * IntermediateColumnMutator(Node *node, List *columnList);
+static CreateStmt * CreateIntermediateTableStmt(List *columnList);
+static DistributedPlan * BuildJoinDistributedPlan(Query *query, List *shardGroupList);
+static void PrepareJoinTreeForDeparse(Node *joinTreeNode);
+static List * JoinTaskPlacementList(List *shardGroup);
+static void PrewarmWorkerConnections(void);
 
 /* executor functions forward declarations */
 static void PgShardExecutorStart(QueryDesc *queryDesc, int eflags);
+static void InitDistributedPlanState(QueryDesc *queryDesc,
+									 DistributedPlan *distributedPlan, int eflags);
 static bool IsPgShardPlan(PlannedStmt *plannedStmt);
 static void NextExecutorStartHook(QueryDesc *queryDesc, int eflags);
 static LOCKMODE CommutativityRuleToLockMode(CmdType commandType);
 static void AcquireExecutorShardLocks(List *taskList, LOCKMODE lockMode);
 static int CompareTasksByShardId(const void *leftElement, const void *rightElement);
+static void EstablishPlacementConnections(List *placementList);
 static void ExecuteMultipleShardSelect(DistributedPlan *distributedPlan,
 									   RangeVar *intermediateTable);
-static bool SendQueryInSingleRowMode(PGconn *connection, StringInfo query);
+static List * GroupTaskExecutionsByNode(List *taskExecutionList);
+static TaskExecution * GroupedTaskExecution(List *taskExecutionList);
+static List * SplitGroupedTaskExecution(TaskExecution *groupedExecution);
+static char * TaskListShardIdString(List *taskList);
+static void ExecuteTaskListConcurrently(List *taskExecutionList, List *targetList,
+										TupleDesc tupleDescriptor,
+										RangeVar *intermediateTable);
+static void StartTaskExecution(TaskExecution *taskExecution, List *taskExecutionList);
+static int32 FreeConnectionSlot(ShardPlacement *placement, List *taskExecutionList);
+static bool ReceiveTaskResults(TaskExecution *taskExecution,
+							   AttInMetadata *attributeInputMetadata,
+							   MemoryContext ioContext);
+static void FailTaskPlacement(TaskExecution *taskExecution);
+static bool SendQueryInSingleRowMode(PGconn *connection, Task *task);
 static bool StoreQueryResult(PGconn *connection, TupleDesc tupleDescriptor,
 							 Tuplestorestate *tupleStore);
+static void StoreQueryResultRows(PGresult *result,
+								 AttInMetadata *attributeInputMetadata,
+								 MemoryContext ioContext, Tuplestorestate *tupleStore);
+static HeapTuple BuildRemoteResultTuple(PGresult *result, uint32 rowIndex,
+										AttInMetadata *attributeInputMetadata,
+										MemoryContext ioContext);
 static void TupleStoreToTable(RangeVar *tableRangeVar, List *remoteTargetList,
 							  TupleDesc storeTupleDescriptor, Tuplestorestate *store);
 static void PgShardExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count);
-static int32 ExecuteDistributedModify(DistributedPlan *distributedPlan);
+static List * ReloadTaskPlacementList(Task *task);
+static int32 ExecuteDistributedModify(DistributedPlan *distributedPlan,
+									  TupleDesc returningDescriptor,
+									  DestReceiver *destination);
+static void MarkPlacementsInactiveOnMaster(List *placementList);
+static void ExecuteModificationsConcurrently(List *taskExecutionList,
+											 TupleDesc returningDescriptor,
+											 DestReceiver *destination);
+static void StartModification(TaskExecution *taskExecution, List *taskExecutionList);
+static void ReceiveModificationResults(TaskExecution *taskExecution,
+									   List *taskExecutionList,
+									   TupleDesc returningDescriptor,
+									   DestReceiver *destination);
+static bool ModificationResultReceived(Task *task, List *taskExecutionList);
+static int32 ExecuteInsertSelectViaMaster(DistributedPlan *plan,
+										  ParamListInfo boundParams,
+										  const char *queryString);
+static Tuplestorestate * ExecuteSelectIntoTupleStore(Query *selectQuery,
+													 ParamListInfo boundParams,
+													 const char *queryString,
+													 TupleDesc *tupleDescriptor);
+static Const * InsertSelectColumnValue(TargetEntry *targetEntry,
+									   TupleTableSlot *selectSlot,
+									   ParamListInfo boundParams);
+static Node * ReplaceSelectColumns(Node *node, TupleTableSlot *selectSlot);
+static int32 ExecuteInsertBatch(List *batchTaskList);
+static void SendQueryResultRows(PGresult *result, TupleDesc tupleDescriptor,
+								DestReceiver *destination);
 static void ExecuteSingleShardSelect(DistributedPlan *distributedPlan,
+									 RemoteSelectState *selectState,
 									 EState *executorState, TupleDesc tupleDescriptor,
-									 DestReceiver *destination);
+									 DestReceiver *destination, long count);
+static void StreamRemoteRows(Task *task, RemoteSelectState *selectState,
+							 EState *executorState, TupleDesc tupleDescriptor,
+							 DestReceiver *destination, long count);
+static void StartRemoteSelect(Task *task, RemoteSelectState *selectState);
+static int32 FreeCursorConnectionSlot(ShardPlacement *placement);
+static void FailRemoteSelectPlacement(RemoteSelectState *selectState);
 static void PgShardExecutorFinish(QueryDesc *queryDesc);
 static void PgShardExecutorEnd(QueryDesc *queryDesc);
 static void PgShardProcessUtility(Node *parsetree, const char *queryString,
@@ -194,7 +325,75 @@ _PG_init(void)
 							 &LogDistributedStatements, false, PGC_USERSET, 0, NULL,
 							 NULL, NULL);
 
+	DefineCustomBoolVariable("pg_shard.prewarm_connections",
+							 "Connects to all worker nodes before a session's first "
+							 "distributed query", NULL,
+							 &PrewarmConnections, false, PGC_USERSET, 0, NULL,
+							 NULL, NULL);
+
+	DefineCustomBoolVariable("pg_shard.group_tasks_by_node",
+							 "Combines the shard queries of a multi-shard SELECT which "
+							 "run on the same node into a single query",
+							 "Each connection to a node then receives one UNION ALL "
+							 "query, rather than one query per shard.",
+							 &GroupTasksByNode, false, PGC_USERSET, 0, NULL,
+							 NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.max_connections_per_node",
+							"Sets the number of connections a session may hold to "
+							"each worker node",
+							"Multi-shard queries use these connections to run tasks "
+							"on the same node in parallel.",
+							&MaxConnectionsPerNode, 1, 1, MAX_CONNECTIONS_PER_NODE_LIMIT,
+							PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.max_cached_statements_per_connection",
+							"Sets the number of statements kept prepared on each "
+							"connection to a worker node",
+							"Parameterized single-shard queries are prepared on the "
+							"worker on first use, and executed by name from then on. "
+							"Zero disables preparing statements on workers.",
+							&MaxCachedStatementsPerConnection, 64, 0, INT_MAX,
+							PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.initial_node_backoff",
+							"Sets how long a node is skipped after a connection "
+							"failure", "Each consecutive failure doubles this time.",
+							&InitialNodeBackoff, 1000, 0, INT_MAX, PGC_SIGHUP,
+							GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.max_node_backoff",
+							"Sets the longest time a failing node is skipped", NULL,
+							&MaximumNodeBackoff, 60000, 0, INT_MAX, PGC_SIGHUP,
+							GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pg_shard.repair_worker_database",
+							   "Sets the database whose inactive placements are "
+							   "repaired in the background",
+							   "An empty string disables the background repair worker.",
+							   &RepairWorkerDatabase, "", PGC_POSTMASTER, 0, NULL,
+							   NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.repair_worker_interval",
+							"Sets the time between background repairs of inactive "
+							"placements", "At most one placement is repaired each "
+							"time. The time doubles while repairs are deferred or "
+							"fail.",
+							&RepairWorkerInterval, 10000, 1, INT_MAX, PGC_SIGHUP,
+							GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.repair_worker_max_active_backends",
+							"Sets the number of busy backends above which background "
+							"repairs are deferred", NULL,
+							&RepairWorkerMaxActiveBackends, 8, 0, INT_MAX, PGC_SIGHUP,
+							0, NULL, NULL, NULL);
+
 	EmitWarningsOnPlaceholders("pg_shard");
+
+	/* set up shared node health and online repair tracking, if being preloaded */
+	InitializeNodeHealth();
+	InitializeOnlineRepair();
+	InitializeRepairWorker();
 }
 
 
@@ -216,10 +415,11 @@ _PG_fini(void)
 
 /*
  * PgShardPlanner implements custom planner logic to plan queries involving
- * distributed tables. It first calls the standard planner to perform common
- * mutations and normalizations on the query and retrieve the "normal" planned
- * statement for the query. Further functions actually produce the distributed
- * plan should one be necessary.
+ * distributed tables. The shards such queries touch depend on the values of
+ * their parameters, and on shard metadata which may change while a plan is
+ * cached. Their distributed plans are thus only built when the query is
+ * executed; until then, PlanPlaceholderStatement stands in for them. Other
+ * queries are passed on to the previous or standard planner.
  */
 static PlannedStmt *
 PgShardPlanner(Query *query, int cursorOptions, ParamListInfo boundParams)
@@ -229,71 +429,7 @@ PgShardPlanner(Query *query, int cursorOptions, ParamListInfo boundParams)
 
 	if (plannerType == PLANNER_TYPE_PG_SHARD)
 	{
-		DistributedPlan *distributedPlan = NULL;
-		Query *distributedQuery = copyObject(query);
-		List *queryShardList = NIL;
-		bool selectFromMultipleShards = false;
-		CreateStmt *createTemporaryTableStmt = NULL;
-
-		/* call standard planner first to have Query transformations performed */
-		plannedStatement = standard_planner(distributedQuery, cursorOptions,
-											boundParams);
-
-		ErrorIfQueryNotSupported(distributedQuery);
-
-		/*
-		 * Compute the list of shards this query needs to access.
-		 * Error out if there are no existing shards for the table.
-		 */
-		queryShardList = DistributedQueryShardList(distributedQuery);
-
-		/*
-		 * If a select query touches multiple shards, we don't push down the
-		 * query as-is, and instead only push down the filter clauses and select
-		 * needed columns. We then copy those results to a local temporary table
-		 * and then modify the original PostgreSQL plan to perform a sequential
-		 * scan on that temporary table.
-		 * XXX: This approach is limited as we cannot handle index or foreign
-		 * scans. We will revisit this by potentially using another type of scan
-		 * node instead of a sequential scan.
-		 */
-		selectFromMultipleShards = SelectFromMultipleShards(query, queryShardList);
-		if (selectFromMultipleShards)
-		{
-			Oid distributedTableId = InvalidOid;
-			Query *localQuery = NULL;
-			List *queryRestrictList = QueryRestrictList(distributedQuery);
-			List *remoteRestrictList = NIL;
-			List *localRestrictList = NIL;
-
-			/* partition restrictions into remote and local lists */
-			ClassifyRestrictions(queryRestrictList, &remoteRestrictList,
-								 &localRestrictList);
-
-			/* build local and distributed query */
-			distributedQuery = RowAndColumnFilterQuery(distributedQuery,
-													   remoteRestrictList,
-													   localRestrictList);
-			localQuery = BuildLocalQuery(query, localRestrictList);
-
-			/*
-			 * Force a sequential scan as we change the underlying table to
-			 * point to our intermediate temporary table which contains the
-			 * fetched data.
-			 */
-			plannedStatement = PlanSequentialScan(localQuery, cursorOptions, boundParams);
-
-			/* construct a CreateStmt to clone the existing table */
-			distributedTableId = ExtractFirstDistributedTableId(distributedQuery);
-			createTemporaryTableStmt = CreateTemporaryTableLikeStmt(distributedTableId);
-		}
-
-		distributedPlan = BuildDistributedPlan(distributedQuery, queryShardList);
-		distributedPlan->originalPlan = plannedStatement->planTree;
-		distributedPlan->selectFromMultipleShards = selectFromMultipleShards;
-		distributedPlan->createTemporaryTableStmt = createTemporaryTableStmt;
-
-		plannedStatement->planTree = (Plan *) distributedPlan;
+		plannedStatement = PlanPlaceholderStatement(query, cursorOptions);
 	}
 	else if (plannerType == PLANNER_TYPE_CITUSDB)
 	{
@@ -331,763 +467,876 @@ PgShardPlanner(Query *query, int cursorOptions, ParamListInfo boundParams)
 
 
 /*
- * DeterminePlannerType chooses the appropriate planner to use in order to plan
- * the given query.
+ * PlanPlaceholderStatement calls the standard planner to perform common
+ * mutations and normalizations on a copy of the given query, and to retrieve
+ * the "normal" planned statement for the query. It then swaps in a placeholder
+ * plan, which holds on to the query, both as given and as normalized, and to
+ * the standard plan. Bound parameter values are not passed on, so that the
+ * normalized query keeps its parameters: this lets the plan cache keep a single
+ * generic plan for the statement, so that planning happens only once. As the
+ * placeholder consists of standard nodes only, the plan cache may copy it.
  */
-static PlannerType
-DeterminePlannerType(Query *query)
+static PlannedStmt *
+PlanPlaceholderStatement(Query *query, int cursorOptions)
 {
-	PlannerType plannerType = PLANNER_INVALID_FIRST;
-	CmdType commandType = query->commandType;
+	PlannedStmt *plannedStatement = NULL;
+	Query *originalQuery = copyObject(query);
+	Query *normalizedQuery = copyObject(query);
+	Result *placeholderPlan = makeNode(Result);
+	Plan *originalPlan = NULL;
 
-	/* if the extension isn't created, we always use the postgres planner */
-	bool missingOK = true;
-	Oid extensionOid = get_extension_oid(PG_SHARD_EXTENSION_NAME, missingOK);
-	if (extensionOid == InvalidOid)
-	{
-		return PLANNER_TYPE_POSTGRES;
-	}
+	/* cursor options are checked now, as they do not depend on parameters */
+	ErrorIfCursorOptionsNotSupported(cursorOptions);
 
-	if (commandType == CMD_SELECT && UseCitusDBSelectLogic)
+	plannedStatement = standard_planner(normalizedQuery, cursorOptions, NULL);
+	originalPlan = plannedStatement->planTree;
+
+	/* portals describe rows returned by modifications using the plan's target list */
+	placeholderPlan->plan.targetlist = originalPlan->targetlist;
+	placeholderPlan->resconstantqual =
+		(Node *) list_make5(makeString(pstrdup(DISTRIBUTED_PLAN_MARKER)),
+							originalQuery, normalizedQuery, originalPlan,
+							makeInteger(cursorOptions));
+
+	plannedStatement->planTree = (Plan *) placeholderPlan;
+
+	return plannedStatement;
+}
+
+
+/*
+ * DistributedPlaceholderList returns the list held by the given plan if it is a
+ * placeholder built by PlanPlaceholderStatement, and NIL otherwise. Constant
+ * qualifiers of other Result plans never start with a string. Placeholders may
+ * only be executed by PgShardExecutorStart, which swaps in the distributed
+ * plan, so each entry point seeing planned statements checks for them: EXPLAIN
+ * is refused at executor start, and the other executor hooks error out if the
+ * placeholder is left in place.
+ */
+static List *
+DistributedPlaceholderList(Plan *plan)
+{
+	Node *constantQual = NULL;
+	Node *firstNode = NULL;
+
+	if (plan == NULL || !IsA(plan, Result))
 	{
-		plannerType = PLANNER_TYPE_CITUSDB;
+		return NIL;
 	}
-	else if (commandType == CMD_SELECT || commandType == CMD_INSERT ||
-			 commandType == CMD_UPDATE || commandType == CMD_DELETE)
+
+	constantQual = ((Result *) plan)->resconstantqual;
+	if (constantQual == NULL || !IsA(constantQual, List) ||
+		list_length((List *) constantQual) != PLACEHOLDER_LIST_LENGTH)
 	{
-		Oid distributedTableId = ExtractFirstDistributedTableId(query);
-		if (OidIsValid(distributedTableId))
-		{
-			plannerType = PLANNER_TYPE_PG_SHARD;
-		}
-		else
-		{
-			plannerType = PLANNER_TYPE_POSTGRES;
-		}
+		return NIL;
 	}
-	else
+
+	firstNode = (Node *) linitial((List *) constantQual);
+	if (!IsA(firstNode, String) ||
+		strcmp(strVal(firstNode), DISTRIBUTED_PLAN_MARKER) != 0)
 	{
-		/*
-		 * For utility statements, we need to detect if they are operating on
-		 * distributed tables. If they are, we need to warn or error out
-		 * accordingly.
-		 */
-		plannerType = PLANNER_TYPE_POSTGRES;
+		return NIL;
 	}
 
-	return plannerType;
+	return (List *) constantQual;
 }
 
 
 /*
- * ErrorIfQueryNotSupported checks if the query contains unsupported features,
- * and errors out if it does.
+ * PlanDistributedExecution builds the distributed plan for an execution of the
+ * given planned statement, whose plan tree is a placeholder, now that values
+ * are bound to the statement's parameters. The statement may be cached for
+ * reuse, so the plan is built into a new statement instead of modifying it. As
+ * shard metadata is only read now, cached statements remain valid when shards
+ * are repaired, moved, or split.
  */
-static void
-ErrorIfQueryNotSupported(Query *queryTree)
+static PlannedStmt *
+PlanDistributedExecution(PlannedStmt *plannedStatement, ParamListInfo boundParams)
 {
-	Oid distributedTableId = ExtractFirstDistributedTableId(queryTree);
-	Var *partitionColumn = PartitionColumn(distributedTableId);
-	List *rangeTableList = NIL;
-	ListCell *rangeTableCell = NULL;
-	bool hasValuesScan = false;
-	uint32 queryTableCount = 0;
-	bool hasNonConstTargetEntryExprs = false;
-	bool hasNonConstQualExprs = false;
-	bool specifiesPartitionValue = false;
+	List *placeholderList = DistributedPlaceholderList(plannedStatement->planTree);
+	Query *originalQuery = (Query *) lsecond(placeholderList);
+	Query *normalizedQuery = (Query *) lthird(placeholderList);
+	Plan *originalPlan = (Plan *) lfourth(placeholderList);
+	int cursorOptions = intVal(llast(placeholderList));
+	PlannedStmt *executionStatement = palloc(sizeof(PlannedStmt));
+	DistributedPlan *distributedPlan = NULL;
 
-	CmdType commandType = queryTree->commandType;
-	Assert(commandType == CMD_SELECT || commandType == CMD_INSERT ||
-		   commandType == CMD_UPDATE || commandType == CMD_DELETE);
+	*executionStatement = *plannedStatement;
+	executionStatement->planTree = originalPlan;
 
-	/* prevent utility statements like DECLARE CURSOR attached to selects */
-	if (commandType == CMD_SELECT && queryTree->utilityStmt != NULL)
+	/* open connections to all workers up front, if so configured */
+	PrewarmWorkerConnections();
+
+	if (InsertSelectQuery(originalQuery))
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot perform distributed planning for the given"
-							   " query"),
-						errdetail("Utility commands are not supported in distributed "
-								  "queries.")));
-	}
+		/* the SELECT's rows are evaluated one by one, so nothing is evaluated here */
+		Query *boundQuery = (Query *) ResolveExternalParams(copyObject(originalQuery),
+															boundParams);
 
-	/*
-	 * Reject subqueries which are in SELECT or WHERE clause.
-	 * Queries which include subqueries in FROM clauses are rejected below.
-	 */
-	if (queryTree->hasSubLinks == true)
+		distributedPlan = PlanInsertSelectQuery(boundQuery);
+		distributedPlan->originalPlan = originalPlan;
+		executionStatement->planTree = (Plan *) distributedPlan;
+	}
+	else
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot perform distributed planning for the given"
-							   " query"),
-						errdetail("Subqueries are not supported in distributed"
-								  " queries.")));
+		executionStatement = PlanDistributedQuery(executionStatement, originalQuery,
+												  normalizedQuery, cursorOptions,
+												  boundParams);
 	}
 
-	/* reject queries which include CommonTableExpr */
-	if (queryTree->cteList != NIL)
+	/* the executor tells cursors apart from other reads by their options */
+	distributedPlan = (DistributedPlan *) executionStatement->planTree;
+	distributedPlan->cursorOptions = cursorOptions;
+
+	return executionStatement;
+}
+
+
+/*
+ * PlanDistributedQuery builds the distributed plan of the given query, and swaps
+ * it into the given planned statement, whose plan tree holds the standard plan
+ * of the query. The query is provided both as planned and as normalized by the
+ * standard planner, with parameters intact. For modifications, stable and
+ * volatile functions are evaluated first. Shards are then pruned using a copy
+ * of the normalized query in which parameters are replaced by their values.
+ * Single-shard plans send the normalized query to the remote node with its
+ * parameters intact, along with the parameter values, so that the values need
+ * not be deparsed.
+ */
+static PlannedStmt *
+PlanDistributedQuery(PlannedStmt *plannedStatement, Query *originalQuery,
+					 Query *normalizedQuery, int cursorOptions,
+					 ParamListInfo boundParams)
+{
+	DistributedPlan *distributedPlan = NULL;
+	Plan *originalPlan = plannedStatement->planTree;
+	Query *query = (Query *) ResolveExternalParams(copyObject(originalQuery),
+												   boundParams);
+	Query *parameterizedQuery = copyObject(normalizedQuery);
+	Query *distributedQuery = NULL;
+	bool hasExternalParams = false;
+	List *queryShardList = NIL;
+	bool selectFromMultipleShards = false;
+	CreateStmt *createTemporaryTableStmt = NULL;
+
+	if (parameterizedQuery->commandType != CMD_SELECT)
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot perform distributed planning for the given"
-							   " query"),
-						errdetail("Common table expressions are not supported in"
-								  " distributed queries.")));
+		ExecuteMasterEvaluableFunctions(parameterizedQuery, boundParams);
 	}
 
-	/* extract range table entries */
-	ExtractRangeTableEntryWalker((Node *) queryTree, &rangeTableList);
+	hasExternalParams = QueryHasExternalParams(parameterizedQuery);
+	distributedQuery = copyObject(parameterizedQuery);
+	if (hasExternalParams)
+	{
+		distributedQuery = (Query *) ResolveExternalParams((Node *) distributedQuery,
+														   boundParams);
+		FoldConstantExpressions(distributedQuery);
+	}
 
-	foreach(rangeTableCell, rangeTableList)
+	/*
+	 * Subqueries and common table expressions are pushed down along with the
+	 * rest of the query if all tables they read resolve to a single shard. The
+	 * planner has replaced such constructs by plan nodes, so the original query
+	 * is deparsed instead.
+	 */
+	if (query->commandType == CMD_SELECT && QueryHasSubqueries(query))
 	{
-		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
-		if (rangeTableEntry->rtekind == RTE_RELATION)
-		{
-			queryTableCount++;
-		}
-		else if (rangeTableEntry->rtekind == RTE_VALUES)
-		{
-			hasValuesScan = true;
-		}
-		else
+		List *routerShardGroup = RouterShardGroup(query);
+		if (routerShardGroup != NIL)
 		{
-			/*
-			 * Error out for rangeTableEntries that we do not support.
-			 * We do not explicitly specify "in FROM clause" in the error detail
-			 * for the features that we do not support at all (SUBQUERY, JOIN).
-			 * We do not need to check for RTE_CTE because all common table expressions
-			 * are rejected above with queryTree->cteList check.
-			 */
-			char *rangeTableEntryErrorDetail = NULL;
-			if (rangeTableEntry->rtekind == RTE_SUBQUERY)
-			{
-				rangeTableEntryErrorDetail = "Subqueries are not supported in"
-											 " distributed queries.";
-			}
-			else if (rangeTableEntry->rtekind == RTE_JOIN)
-			{
-				rangeTableEntryErrorDetail = "Joins are not supported in distributed"
-											 " queries.";
-			}
-			else if (rangeTableEntry->rtekind == RTE_FUNCTION)
-			{
-				rangeTableEntryErrorDetail = "Functions must not appear in the FROM"
-											 " clause of a distributed query.";
-			}
-			else
-			{
-				rangeTableEntryErrorDetail = "Unrecognized range table entry.";
-			}
+			distributedPlan = BuildJoinDistributedPlan(query,
+													   list_make1(routerShardGroup));
+			distributedPlan->originalPlan = originalPlan;
+			plannedStatement->planTree = (Plan *) distributedPlan;
 
-			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							errmsg("cannot perform distributed planning for the given"
-								   " query"),
-							errdetail("%s", rangeTableEntryErrorDetail)));
+			return plannedStatement;
 		}
 	}
 
-	/* reject queries which involve joins */
-	if (queryTableCount != 1)
-	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot perform distributed planning for the given"
-							   " query"),
-						errdetail("Joins are not supported in distributed queries.")));
-	}
+	ErrorIfQueryNotSupported(distributedQuery);
 
-	/* reject queries which involve multi-row inserts */
-	if (hasValuesScan)
+	/* joins of co-located tables are pushed down shard by shard */
+	if (JoinQuery(distributedQuery))
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot perform distributed planning for the given"
-							   " query"),
-						errdetail("Multi-row INSERTs to distributed tables are not "
-								  "supported.")));
-	}
+		distributedPlan = PlanColocatedJoinQuery(distributedQuery, cursorOptions);
+		distributedPlan->originalPlan = originalPlan;
+		plannedStatement->planTree = (Plan *) distributedPlan;
 
-	/* reject queries with a returning list */
-	if (list_length(queryTree->returningList) > 0)
-	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot perform distributed planning for the given"
-							   " query"),
-						errdetail("RETURNING clauses are not supported in distributed "
-								  "queries.")));
+		return plannedStatement;
 	}
 
-	if (commandType == CMD_INSERT || commandType == CMD_UPDATE ||
-		commandType == CMD_DELETE)
+	/*
+	 * Compute the list of shards this query needs to access.
+	 * Error out if there are no existing shards for the table.
+	 */
+	queryShardList = DistributedQueryShardList(distributedQuery);
+
+	/*
+	 * If a select query touches multiple shards, we don't push down the
+	 * query as-is, and instead only push down the filter clauses and select
+	 * needed columns. We then copy those results to a local temporary table
+	 * and then modify the original PostgreSQL plan to perform a sequential
+	 * scan on that temporary table.
+	 * XXX: This approach is limited as we cannot handle index or foreign
+	 * scans. We will revisit this by potentially using another type of scan
+	 * node instead of a sequential scan.
+	 */
+	selectFromMultipleShards = SelectFromMultipleShards(query, queryShardList);
+	if (selectFromMultipleShards)
 	{
-		FromExpr *joinTree = NULL;
-		ListCell *targetEntryCell = NULL;
+		Oid distributedTableId = InvalidOid;
+		Query *localQuery = NULL;
+		List *queryRestrictList = QueryRestrictList(distributedQuery);
+		List *remoteRestrictList = NIL;
+		List *localRestrictList = NIL;
+
+		/* partition restrictions into remote and local lists */
+		ClassifyRestrictions(queryRestrictList, &remoteRestrictList,
+							 &localRestrictList);
+
+		/* build local and distributed query */
+		distributedQuery = RowAndColumnFilterQuery(distributedQuery,
+												   remoteRestrictList,
+												   localRestrictList);
+		localQuery = BuildLocalQuery(query, localRestrictList);
 
-		foreach(targetEntryCell, queryTree->targetList)
-		{
-			TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+		/*
+		 * Force a sequential scan as we change the underlying table to
+		 * point to our intermediate temporary table which contains the
+		 * fetched data.
+		 */
+		plannedStatement = PlanSequentialScan(localQuery, cursorOptions, boundParams);
+		originalPlan = plannedStatement->planTree;
 
-			/* skip resjunk entries: UPDATE adds some for ctid, etc. */
-			if (targetEntry->resjunk)
-			{
-				continue;
-			}
+		/* construct a CreateStmt to clone the existing table */
+		distributedTableId = ExtractFirstDistributedTableId(distributedQuery);
+		createTemporaryTableStmt = CreateTemporaryTableLikeStmt(distributedTableId);
+	}
 
-			if (!IsA(targetEntry->expr, Const))
-			{
-				hasNonConstTargetEntryExprs = true;
-			}
+	if (hasExternalParams && !selectFromMultipleShards)
+	{
+		ListCell *taskCell = NULL;
 
-			if (targetEntry->resno == partitionColumn->varattno)
-			{
-				specifiesPartitionValue = true;
-			}
-		}
+		distributedPlan = BuildDistributedPlan(parameterizedQuery, queryShardList);
 
-		joinTree = queryTree->jointree;
-		if (joinTree != NULL && contain_mutable_functions(joinTree->quals))
+		foreach(taskCell, distributedPlan->taskList)
 		{
-			hasNonConstQualExprs = true;
+			Task *task = (Task *) lfirst(taskCell);
+			SetTaskParameters(task, boundParams);
 		}
 	}
-
-	if (hasNonConstTargetEntryExprs || hasNonConstQualExprs)
+	else
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot plan sharded modification containing values "
-							   "which are not constants or constant expressions")));
+		distributedPlan = BuildDistributedPlan(distributedQuery, queryShardList);
 	}
 
-	if (specifiesPartitionValue && (commandType == CMD_UPDATE))
+	distributedPlan->originalPlan = originalPlan;
+	distributedPlan->selectFromMultipleShards = selectFromMultipleShards;
+	distributedPlan->createTemporaryTableStmt = createTemporaryTableStmt;
+
+	/* portals describe rows returned by modifications using the plan's target list */
+	if (plannedStatement->hasReturning)
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("modifying the partition value of rows is not allowed")));
+		distributedPlan->plan.targetlist = originalPlan->targetlist;
 	}
+
+	plannedStatement->planTree = (Plan *) distributedPlan;
+
+	return plannedStatement;
 }
 
 
 /*
- * ExtractFirstDistributedTableId takes a given query, and finds the relationId
- * for the first distributed table in that query. If the function cannot find a
- * distributed table, it returns InvalidOid.
+ * FoldConstantExpressions simplifies the values, join tree, and returned
+ * expressions of the given query once its parameters have been replaced by
+ * constants, so that casts and other immutable functions of parameter values
+ * turn into constants as well. This lets shards be pruned by these values.
  */
-static Oid
-ExtractFirstDistributedTableId(Query *query)
+void
+FoldConstantExpressions(Query *query)
 {
-	List *rangeTableList = NIL;
-	ListCell *rangeTableCell = NULL;
-	Oid distributedTableId = InvalidOid;
+	query->targetList = (List *) eval_const_expressions(NULL,
+														(Node *) query->targetList);
+	query->returningList = (List *) eval_const_expressions(NULL,
+														   (Node *) query->returningList);
+	query->jointree = (FromExpr *) eval_const_expressions(NULL,
+														  (Node *) query->jointree);
+}
 
-	/* extract range table entries */
-	ExtractRangeTableEntryWalker((Node *) query, &rangeTableList);
 
-	foreach(rangeTableCell, rangeTableList)
+/*
+ * ExecuteMasterEvaluableFunctions evaluates the stable and volatile functions
+ * in the values and qualifiers of the given modification, and replaces them
+ * with constants holding their results. Evaluating such functions once on the
+ * master, rather than on each placement, ensures that all replicas receive the
+ * same values. Functions which refer to the columns of the modified rows can't
+ * be evaluated this way, and are left in place.
+ */
+static void
+ExecuteMasterEvaluableFunctions(Query *query, ParamListInfo boundParams)
+{
+	FromExpr *joinTree = query->jointree;
+	ListCell *targetEntryCell = NULL;
+
+	foreach(targetEntryCell, query->targetList)
 	{
-		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+		Node *expression = (Node *) targetEntry->expr;
 
-		if (IsDistributedTable(rangeTableEntry->relid))
-		{
-			distributedTableId = rangeTableEntry->relid;
-			break;
-		}
+		targetEntry->expr = (Expr *) EvaluateMutableExpressions(expression,
+																boundParams);
 	}
 
-	return distributedTableId;
+	if (joinTree != NULL)
+	{
+		joinTree->quals = EvaluateMutableExpressions(joinTree->quals, boundParams);
+	}
 }
 
 
 /*
- * ExtractRangeTableEntryWalker walks over a query tree, and finds all range
- * table entries. For recursing into the query tree, this function uses the
- * query tree walker since the expression tree walker doesn't recurse into
- * sub-queries.
+ * EvaluateMutableExpressions replaces the largest subexpressions of the given
+ * expression which call stable or volatile functions, but don't depend on the
+ * row being modified, with constants holding their values.
  */
-static bool
-ExtractRangeTableEntryWalker(Node *node, List **rangeTableList)
+static Node *
+EvaluateMutableExpressions(Node *expression, ParamListInfo boundParams)
 {
-	bool walkIsComplete = false;
-	if (node == NULL)
+	if (expression == NULL || !contain_mutable_functions(expression))
 	{
-		return false;
+		return expression;
 	}
 
-	if (IsA(node, RangeTblEntry))
+	if (!IsA(expression, List) && !RowDependentNodeWalker(expression, NULL))
 	{
-		RangeTblEntry *rangeTable = (RangeTblEntry *) node;
-		(*rangeTableList) = lappend(*rangeTableList, rangeTable);
+		return (Node *) EvaluateExpression((Expr *) expression, boundParams);
 	}
-	else if (IsA(node, Query))
+
+	return expression_tree_mutator(expression, EvaluateMutableExpressions,
+								   boundParams);
+}
+
+
+/*
+ * RowDependentNodeWalker returns true on finding a node whose value depends on
+ * the row being modified, such as a column reference, and which therefore
+ * cannot be evaluated on its own.
+ */
+static bool
+RowDependentNodeWalker(Node *node, void *context)
+{
+	if (node == NULL)
 	{
-		walkIsComplete = query_tree_walker((Query *) node, ExtractRangeTableEntryWalker,
-										   rangeTableList, QTW_EXAMINE_RTES);
+		return false;
 	}
-	else
+
+	if (IsA(node, Var) || IsA(node, CaseTestExpr) || IsA(node, CoerceToDomainValue) ||
+		IsA(node, CurrentOfExpr) || IsA(node, SetToDefault) || IsA(node, Aggref) ||
+		IsA(node, WindowFunc) || IsA(node, SubLink))
 	{
-		walkIsComplete = expression_tree_walker(node, ExtractRangeTableEntryWalker,
-												rangeTableList);
+		return true;
 	}
 
-	return walkIsComplete;
+	return expression_tree_walker(node, RowDependentNodeWalker, context);
 }
 
 
 /*
- * DistributedQueryShardList prunes the shards for the table in the query based
- * on the query's restriction qualifiers, and returns this list. It is possible
- * that all shards will be pruned if a query's restrictions are unsatisfiable.
- * In that case, this function can return an empty list; however, if the table
- * being queried has no shards created whatsoever, this function errors out.
+ * EvaluateExpression evaluates the given expression, which may refer to the
+ * given parameters, and returns a constant holding its result.
  */
-static List *
-DistributedQueryShardList(Query *query)
+static Const *
+EvaluateExpression(Expr *expression, ParamListInfo boundParams)
 {
-	List *restrictClauseList = NIL;
-	List *prunedShardList = NIL;
-
-	Oid distributedTableId = ExtractFirstDistributedTableId(query);
-	List *shardIntervalList = LookupShardIntervalList(distributedTableId);
-
-	/* error out if no shards exists for the table */
-	if (shardIntervalList == NIL)
+	Oid resultTypeId = exprType((Node *) expression);
+	int32 resultTypeMod = exprTypmod((Node *) expression);
+	Oid resultCollationId = exprCollation((Node *) expression);
+	EState *executorState = CreateExecutorState();
+	ExprContext *expressionContext = NULL;
+	ExprState *expressionState = NULL;
+	int16 resultTypeLength = 0;
+	bool resultTypeByValue = false;
+	bool resultIsNull = false;
+	Datum resultValue = 0;
+
+	/* expression contexts take their parameters from the executor state */
+	executorState->es_param_list_info = boundParams;
+	expressionContext = GetPerTupleExprContext(executorState);
+
+	expressionState = ExecPrepareExpr(expression, executorState);
+	resultValue = ExecEvalExprSwitchContext(expressionState, expressionContext,
+											&resultIsNull, NULL);
+
+	/* copy the result out of the executor state's memory before freeing it */
+	get_typlenbyval(resultTypeId, &resultTypeLength, &resultTypeByValue);
+	if (!resultIsNull)
 	{
-		char *relationName = get_rel_name(distributedTableId);
-
-		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-						errmsg("could not find any shards for query"),
-						errdetail("No shards exist for distributed table \"%s\".",
-								  relationName),
-						errhint("Run master_create_worker_shards to create shards "
-								"and try again.")));
+		resultValue = datumCopy(resultValue, resultTypeByValue, resultTypeLength);
 	}
 
-	restrictClauseList = QueryRestrictList(query);
-	prunedShardList = PruneShardList(distributedTableId, restrictClauseList,
-									 shardIntervalList);
+	FreeExecutorState(executorState);
 
-	return prunedShardList;
+	return makeConst(resultTypeId, resultTypeMod, resultCollationId, resultTypeLength,
+					 resultValue, resultIsNull, resultTypeByValue);
 }
 
 
-/* Returns true if the query is a select query that reads data from multiple shards. */
+/*
+ * QueryHasExternalParams returns whether the given query references any
+ * external parameters, such as those of a prepared statement.
+ */
 static bool
-SelectFromMultipleShards(Query *query, List *queryShardList)
+QueryHasExternalParams(Query *query)
 {
-	if ((query->commandType == CMD_SELECT) && (list_length(queryShardList) > 1))
+	return ExternalParamWalker((Node *) query, NULL);
+}
+
+
+/* ExternalParamWalker returns true on finding an external parameter. */
+static bool
+ExternalParamWalker(Node *node, void *context)
+{
+	if (node == NULL)
 	{
-		return true;
+		return false;
 	}
-	else
+
+	if (IsA(node, Param))
 	{
-		return false;
+		Param *param = (Param *) node;
+		return (param->paramkind == PARAM_EXTERN);
+	}
+	else if (IsA(node, Query))
+	{
+		return query_tree_walker((Query *) node, ExternalParamWalker, context, 0);
 	}
+
+	return expression_tree_walker(node, ExternalParamWalker, context);
 }
 
 
 /*
- * ClassifyRestrictions divides a query's restriction list in two: the subset
- * of restrictions safe for remote evaluation and the subset of restrictions
- * that must be evaluated locally. remoteRestrictList and localRestrictList are
- * output parameters to receive these two subsets.
- *
- * Currently places all restrictions in the remote list and leaves the local
- * one totally empty.
+ * ResolveExternalParams replaces external parameters in the given expression
+ * or query with constants holding the values bound to them. Parameters which
+ * have no value are left as they are.
  */
-static void
-ClassifyRestrictions(List *queryRestrictList, List **remoteRestrictList,
-					 List **localRestrictList)
+static Node *
+ResolveExternalParams(Node *node, ParamListInfo boundParams)
 {
-	ListCell *restrictCell = NULL;
-
-	*remoteRestrictList = NIL;
-	*localRestrictList = NIL;
+	if (node == NULL)
+	{
+		return NULL;
+	}
 
-	foreach(restrictCell, queryRestrictList)
+	if (IsA(node, Param))
 	{
-		Node *restriction = (Node *) lfirst(restrictCell);
-		bool restrictionSafeToSend = true;
+		Param *param = (Param *) node;
+		ParamExternData *externParam = NULL;
 
-		if (restrictionSafeToSend)
+		if (param->paramkind != PARAM_EXTERN || boundParams == NULL ||
+			param->paramid <= 0 || param->paramid > boundParams->numParams)
 		{
-			*remoteRestrictList = lappend(*remoteRestrictList, restriction);
+			return node;
 		}
-		else
+
+		externParam = FetchExternalParam(boundParams, param->paramid);
+		if (OidIsValid(externParam->ptype))
 		{
-			*localRestrictList = lappend(*localRestrictList, restriction);
+			int16 typeLength = 0;
+			bool typeByValue = false;
+			Datum constValue = 0;
+
+			get_typlenbyval(param->paramtype, &typeLength, &typeByValue);
+			if (!externParam->isnull)
+			{
+				constValue = datumCopy(externParam->value, typeByValue, typeLength);
+			}
+
+			return (Node *) makeConst(param->paramtype, param->paramtypmod,
+									  param->paramcollid, typeLength, constValue,
+									  externParam->isnull, typeByValue);
 		}
+
+		return node;
 	}
+	else if (IsA(node, Query))
+	{
+		return (Node *) query_tree_mutator((Query *) node, ResolveExternalParams,
+										   boundParams, 0);
+	}
+
+	return expression_tree_mutator(node, ResolveExternalParams, boundParams);
 }
 
 
 /*
- * RowAndColumnFilterQuery builds a query which contains the filter clauses from
- * the original query and also only selects columns needed for the original
- * query. This new query can then be pushed down to the worker nodes.
+ * FetchExternalParam returns the data of the external parameter with the given
+ * ID, first asking the parameter list to fetch it if it does so lazily.
  */
-static Query *
-RowAndColumnFilterQuery(Query *query, List *remoteRestrictList, List *localRestrictList)
+static ParamExternData *
+FetchExternalParam(ParamListInfo boundParams, int paramId)
 {
-	Query *filterQuery = NULL;
-	List *rangeTableList = NIL;
-	List *whereColumnList = NIL;
-	List *projectColumnList = NIL;
-	List *havingClauseColumnList = NIL;
-	List *requiredColumnList = NIL;
-	ListCell *columnCell = NULL;
-	List *uniqueColumnList = NIL;
-	List *targetList = NIL;
-	FromExpr *fromExpr = NULL;
-	PVCAggregateBehavior aggregateBehavior = PVC_RECURSE_AGGREGATES;
-	PVCPlaceHolderBehavior placeHolderBehavior = PVC_REJECT_PLACEHOLDERS;
-
-	ExtractRangeTableEntryWalker((Node *) query, &rangeTableList);
-	Assert(list_length(rangeTableList) == 1);
-
-	/* build the expression to supply FROM/WHERE for the remote query */
-	fromExpr = makeNode(FromExpr);
-	fromExpr->quals = (Node *) make_ands_explicit((List *) remoteRestrictList);
-	fromExpr->fromlist = QueryFromList(rangeTableList);
+	ParamExternData *externParam = &boundParams->params[paramId - 1];
 
-	/* must retrieve all columns referenced by local WHERE clauses... */
-	whereColumnList = pull_var_clause((Node *) localRestrictList, aggregateBehavior,
-									  placeHolderBehavior);
+	if (!OidIsValid(externParam->ptype) && boundParams->paramFetch != NULL)
+	{
+		(*boundParams->paramFetch)(boundParams, paramId);
+	}
 
-	/* as well as any used in projections (GROUP BY, etc.) */
-	projectColumnList = pull_var_clause((Node *) query->targetList, aggregateBehavior,
-										placeHolderBehavior);
+	return externParam;
+}
 
-	/* finally, need those used in any HAVING quals */
-	havingClauseColumnList = pull_var_clause(query->havingQual, aggregateBehavior,
-											 placeHolderBehavior);
 
-	/* put them together to get list of required columns for query */
-	requiredColumnList = list_concat(requiredColumnList, whereColumnList);
-	requiredColumnList = list_concat(requiredColumnList, projectColumnList);
-	requiredColumnList = list_concat(requiredColumnList, havingClauseColumnList);
+/*
+ * SetTaskParameters converts the given parameter values to text, and stores
+ * them in the task for sending along with its query. Types of parameters are
+ * only sent for built-in types, whose OIDs are the same on all nodes; the
+ * remote node infers the types of other parameters.
+ */
+static void
+SetTaskParameters(Task *task, ParamListInfo boundParams)
+{
+	int parameterCount = 0;
+	int parameterIndex = 0;
 
-	/* ensure there are no duplicates in the list  */
-	foreach(columnCell, requiredColumnList)
+	if (boundParams == NULL || boundParams->numParams == 0)
 	{
-		Var *column = (Var *) lfirst(columnCell);
-
-		uniqueColumnList = list_append_unique(uniqueColumnList, column);
+		return;
 	}
 
-	/*
-	 * If we still have no columns, possible in a query like "SELECT count(*)",
-	 * add a NULL constant. This constant results in "SELECT NULL FROM ...".
-	 * postgres_fdw generates a similar string when no columns are selected.
-	 */
-	if (uniqueColumnList == NIL)
-	{
-		/* values for NULL const taken from parse_node.c */
-		Const *nullConst = makeConst(UNKNOWNOID, -1, InvalidOid, -2,
-									 (Datum) 0, true, false);
+	parameterCount = boundParams->numParams;
+	task->parameterCount = parameterCount;
+	task->parameterTypes = (Oid *) palloc0(parameterCount * sizeof(Oid));
+	task->parameterValues = (const char **) palloc0(parameterCount * sizeof(char *));
 
-		uniqueColumnList = lappend(uniqueColumnList, nullConst);
-	}
+	for (parameterIndex = 0; parameterIndex < parameterCount; parameterIndex++)
+	{
+		ParamExternData *externParam = FetchExternalParam(boundParams,
+														  parameterIndex + 1);
+		Oid typeId = externParam->ptype;
+		Oid outputFunctionId = InvalidOid;
+		bool typeVarLength = false;
 
-	targetList = TargetEntryList(uniqueColumnList);
+		if (typeId < FirstNormalObjectId)
+		{
+			task->parameterTypes[parameterIndex] = typeId;
+		}
 
-	filterQuery = makeNode(Query);
-	filterQuery->commandType = CMD_SELECT;
-	filterQuery->rtable = rangeTableList;
-	filterQuery->jointree = fromExpr;
-	filterQuery->targetList = targetList;
+		if (externParam->isnull || !OidIsValid(typeId))
+		{
+			task->parameterValues[parameterIndex] = NULL;
+			continue;
+		}
 
-	return filterQuery;
+		getTypeOutputInfo(typeId, &outputFunctionId, &typeVarLength);
+		task->parameterValues[parameterIndex] =
+			OidOutputFunctionCall(outputFunctionId, externParam->value);
+	}
 }
 
 
 /*
- * BuildLocalQuery returns a copy of query with its quals replaced by those
- * in localRestrictList. Expects queries with a single entry in their FROM
- * list.
+ * InsertSelectQuery returns whether the given query is an INSERT ... SELECT
+ * into a distributed table.
  */
-static Query *
-BuildLocalQuery(Query *query, List *localRestrictList)
+static bool
+InsertSelectQuery(Query *query)
 {
-	Query *localQuery = copyObject(query);
-	FromExpr *joinTree = localQuery->jointree;
+	RangeTblEntry *insertRangeTable = NULL;
 
-	Assert(joinTree != NULL);
-	Assert(list_length(joinTree->fromlist) == 1);
-	joinTree->quals = (Node *) make_ands_explicit((List *) localRestrictList);
+	if (query->commandType != CMD_INSERT || InsertSelectRangeTableEntry(query) == NULL)
+	{
+		return false;
+	}
 
-	return localQuery;
+	insertRangeTable = rt_fetch(query->resultRelation, query->rtable);
+
+	return IsDistributedTable(insertRangeTable->relid);
 }
 
 
 /*
- * PlanSequentialScan attempts to plan the given query using only a sequential
- * scan of the underlying table. The function disables index scan types and
- * plans the query. If the plan still contains a non-sequential scan plan node,
- * the function errors out. Note this function modifies the query parameter, so
- * make a copy before calling PlanSequentialScan if that is unacceptable.
+ * InsertSelectRangeTableEntry returns the range table entry holding the SELECT
+ * of an INSERT ... SELECT, or NULL if the given INSERT has no such entry.
  */
-static PlannedStmt *
-PlanSequentialScan(Query *query, int cursorOptions, ParamListInfo boundParams)
+static RangeTblEntry *
+InsertSelectRangeTableEntry(Query *query)
 {
-	PlannedStmt *sequentialScanPlan = NULL;
-	bool indexScanEnabledOldValue = false;
-	bool bitmapScanEnabledOldValue = false;
-	List *rangeTableList = NIL;
 	ListCell *rangeTableCell = NULL;
 
-	/* error out if the table is a foreign table */
-	ExtractRangeTableEntryWalker((Node *) query, &rangeTableList);
-
-	foreach(rangeTableCell, rangeTableList)
+	foreach(rangeTableCell, query->rtable)
 	{
 		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
-		if (rangeTableEntry->rtekind == RTE_RELATION)
+
+		if (rangeTableEntry->rtekind == RTE_SUBQUERY)
 		{
-			if (rangeTableEntry->relkind == RELKIND_FOREIGN_TABLE)
-			{
-				ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-								errmsg("multi-shard SELECTs from foreign tables are "
-									   "unsupported ")));
-			}
+			return rangeTableEntry;
 		}
 	}
 
-	/* disable index scan types */
-	indexScanEnabledOldValue = enable_indexscan;
-	bitmapScanEnabledOldValue = enable_bitmapscan;
-
-	enable_indexscan = false;
-	enable_bitmapscan = false;
-
-	sequentialScanPlan = standard_planner(query, cursorOptions, boundParams);
-
-	enable_indexscan = indexScanEnabledOldValue;
-	enable_bitmapscan = bitmapScanEnabledOldValue;
-
-	return sequentialScanPlan;
-}
+	return NULL;
+}
 
 
 /*
- * QueryRestrictList returns the restriction clauses for the query. For a SELECT
- * statement these are the where-clause expressions. For INSERT statements we
- * build an equality clause based on the partition-column and its supplied
- * insert value.
+ * PlanInsertSelectQuery plans an INSERT ... SELECT into a distributed table. If
+ * the SELECT reads a single distributed table which is partitioned like the
+ * table inserted into, and rows keep their partition value, then each shard's
+ * rows can be copied to the matching shard on the workers themselves; the plan
+ * then holds one such task per shard read. Otherwise, the SELECT is run on the
+ * master when the plan is executed, and its rows are routed to the shards from
+ * there; the plan's tasks then serve to lock every shard of the table, and
+ * every shard of the distributed tables the SELECT reads.
  */
-static List *
-QueryRestrictList(Query *query)
+static DistributedPlan *
+PlanInsertSelectQuery(Query *query)
 {
-	List *queryRestrictList = NIL;
-	CmdType commandType = query->commandType;
+	DistributedPlan *distributedPlan = palloc0(sizeof(DistributedPlan));
+	List *taskList = NIL;
+	bool colocated = false;
 
-	if (commandType == CMD_INSERT)
+	ErrorIfInsertSelectNotSupported(query);
+
+	taskList = ColocatedInsertSelectTaskList(query, &colocated);
+	if (!colocated)
 	{
-		/* build equality expression based on partition column value for row */
-		Oid distributedTableId = ExtractFirstDistributedTableId(query);
-		Var *partitionColumn = PartitionColumn(distributedTableId);
-		Const *partitionValue = ExtractPartitionValue(query, partitionColumn);
+		RangeTblEntry *insertRangeTable = rt_fetch(query->resultRelation, query->rtable);
+		List *shardIntervalList = LoadDistributedTableShardList(insertRangeTable->relid);
+		ListCell *shardIntervalCell = NULL;
 
-		OpExpr *equalityExpr = MakeOpExpression(partitionColumn, BTEqualStrategyNumber);
+		foreach(shardIntervalCell, shardIntervalList)
+		{
+			ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+			Task *task = (Task *) palloc0(sizeof(Task));
 
-		Node *rightOp = get_rightop((Expr *) equalityExpr);
-		Const *rightConst = (Const *) rightOp;
-		Assert(IsA(rightOp, Const));
+			task->shardId = shardInterval->id;
+			task->relationId = shardInterval->relationId;
 
-		rightConst->constvalue = partitionValue->constvalue;
-		rightConst->constisnull = partitionValue->constisnull;
-		rightConst->constbyval = partitionValue->constbyval;
+			taskList = lappend(taskList, task);
+		}
 
-		queryRestrictList = list_make1(equalityExpr);
-	}
-	else if (commandType == CMD_SELECT || commandType == CMD_UPDATE ||
-			 commandType == CMD_DELETE)
-	{
-		query_tree_walker(query, ExtractFromExpressionWalker, &queryRestrictList, 0);
+		taskList = list_concat(taskList, InsertSelectSourceLockTaskList(query));
+
+		distributedPlan->insertSelectQuery = copyObject(query);
 	}
 
-	return queryRestrictList;
+	distributedPlan->plan.type = (NodeTag) T_DistributedPlan;
+	distributedPlan->taskList = taskList;
+
+	return distributedPlan;
 }
 
 
 /*
- * ExtractPartitionValue extracts the partition column value from a the target
- * of a modification command. If a partition value is not a constant, is NULL,
- * or is missing altogether, this function throws an error.
+ * InsertSelectSourceLockTaskList returns a task for each shard of the distributed
+ * tables read by the SELECT of the given INSERT ... SELECT. These tasks only name
+ * the shard they read, so that the executor locks it against modifications when
+ * it locks the shards written; they are never executed.
  */
-static Const *
-ExtractPartitionValue(Query *query, Var *partitionColumn)
+static List *
+InsertSelectSourceLockTaskList(Query *query)
 {
-	Const *partitionValue = NULL;
-	TargetEntry *targetEntry = get_tle_by_resno(query->targetList,
-												partitionColumn->varattno);
-	if (targetEntry != NULL)
+	RangeTblEntry *subqueryRangeTable = InsertSelectRangeTableEntry(query);
+	List *rangeTableList = NIL;
+	List *sourceRelationIdList = NIL;
+	List *lockTaskList = NIL;
+	ListCell *rangeTableCell = NULL;
+	ListCell *relationIdCell = NULL;
+
+	ExtractRangeTableEntryWalker((Node *) subqueryRangeTable->subquery,
+								 &rangeTableList);
+
+	foreach(rangeTableCell, rangeTableList)
 	{
-		if (!IsA(targetEntry->expr, Const))
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+
+		if (rangeTableEntry->rtekind == RTE_RELATION &&
+			IsDistributedTable(rangeTableEntry->relid))
 		{
-			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							errmsg("cannot plan INSERT to a distributed table "
-								   "using a non-constant partition column value")));
+			sourceRelationIdList = list_append_unique_oid(sourceRelationIdList,
+														  rangeTableEntry->relid);
 		}
-
-		partitionValue = (Const *) targetEntry->expr;
 	}
 
-	if (partitionValue == NULL || partitionValue->constisnull)
+	foreach(relationIdCell, sourceRelationIdList)
 	{
-		ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
-						errmsg("cannot plan INSERT using row with NULL value "
-							   "in partition column")));
+		Oid sourceRelationId = lfirst_oid(relationIdCell);
+		List *shardIntervalList = LoadDistributedTableShardList(sourceRelationId);
+		ListCell *shardIntervalCell = NULL;
+
+		foreach(shardIntervalCell, shardIntervalList)
+		{
+			ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+			Task *lockTask = (Task *) palloc0(sizeof(Task));
+
+			lockTask->shardId = INVALID_SHARD_ID;
+			lockTask->relationId = sourceRelationId;
+			lockTask->sourceShardId = shardInterval->id;
+
+			lockTaskList = lappend(lockTaskList, lockTask);
+		}
 	}
 
-	return partitionValue;
+	return lockTaskList;
 }
 
 
 /*
- * ExtractFromExpressionWalker walks over a FROM expression, and finds all
- * explicit qualifiers in the expression.
+ * ErrorIfInsertSelectNotSupported errors out if the given INSERT ... SELECT
+ * uses features which distributed INSERT ... SELECT commands do not support.
  */
-static bool
-ExtractFromExpressionWalker(Node *node, List **qualifierList)
+static void
+ErrorIfInsertSelectNotSupported(Query *query)
 {
-	bool walkIsComplete = false;
-	if (node == NULL)
+	if (query->cteList != NIL)
 	{
-		return false;
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Common table expressions are not supported in"
+								  " distributed queries.")));
 	}
 
-	if (IsA(node, FromExpr))
+	if (query->returningList != NIL)
 	{
-		FromExpr *fromExpression = (FromExpr *) node;
-		List *fromQualifierList = (List *) fromExpression->quals;
-		(*qualifierList) = list_concat(*qualifierList, fromQualifierList);
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("RETURNING is not supported in distributed "
+								  "INSERT ... SELECT commands.")));
 	}
-
-	walkIsComplete = expression_tree_walker(node, ExtractFromExpressionWalker,
-											(void *) qualifierList);
-
-	return walkIsComplete;
 }
 
 
 /*
- * QueryFromList creates the from list construct that is used for building the
- * query's join tree. The function creates the from list by making a range table
- * reference for each entry in the given range table list.
+ * ColocatedInsertSelectTaskList builds the tasks to run the given INSERT ...
+ * SELECT shard by shard on the workers, if that is possible. This requires the
+ * SELECT to read a single distributed table which is co-located with the table
+ * inserted into, and to pass on the partition column unchanged, so that each
+ * shard's rows belong to the matching shard of the other table. Every finalized
+ * placement of a shard written must also have a finalized placement of the
+ * shard read on the same node, as placements of co-located shards may have
+ * failed independently. If these conditions hold, the colocated output parameter is
+ * set, and the function returns one task per shard the SELECT reads.
  */
 static List *
-QueryFromList(List *rangeTableList)
+ColocatedInsertSelectTaskList(Query *query, bool *colocated)
 {
-	List *fromList = NIL;
-	Index rangeTableIndex = 1;
-	uint32 rangeTableCount = (uint32) list_length(rangeTableList);
+	List *taskList = NIL;
+	RangeTblEntry *insertRangeTable = rt_fetch(query->resultRelation, query->rtable);
+	RangeTblEntry *subqueryRangeTable = InsertSelectRangeTableEntry(query);
+	Query *subquery = subqueryRangeTable->subquery;
+	Oid relationId = insertRangeTable->relid;
+	Oid sourceRelationId = InvalidOid;
+	Var *partitionColumn = PartitionColumn(relationId);
+	Var *sourcePartitionColumn = NULL;
+	TargetEntry *partitionEntry = NULL;
+	TargetEntry *sourceEntry = NULL;
+	Var *partitionValue = NULL;
+	Var *sourceColumn = NULL;
+	Query *plannedSubquery = NULL;
+	List *shardIntervalList = NIL;
+	List *sourceShardIntervalList = NIL;
+	List *prunedShardIntervalList = NIL;
+	ListCell *shardIntervalCell = NULL;
 
-	for (rangeTableIndex = 1; rangeTableIndex <= rangeTableCount; rangeTableIndex++)
-	{
-		RangeTblRef *rangeTableReference = makeNode(RangeTblRef);
-		rangeTableReference->rtindex = rangeTableIndex;
+	*colocated = false;
 
-		fromList = lappend(fromList, rangeTableReference);
+	if (!InsertSelectPushdownSupported(query))
+	{
+		return NIL;
 	}
 
-	return fromList;
-}
-
-
-/*
- * TargetEntryList creates a target entry for each expression in the given list,
- * and returns the newly created target entries in a list.
- */
-static List *
-TargetEntryList(List *expressionList)
-{
-	List *targetEntryList = NIL;
-	ListCell *expressionCell = NULL;
+	sourceRelationId = ((RangeTblEntry *) linitial(subquery->rtable))->relid;
+	sourcePartitionColumn = PartitionColumn(sourceRelationId);
 
-	foreach(expressionCell, expressionList)
+	/* only tables in the same co-location group have matching shards */
+	if (ColocationId(sourceRelationId) != ColocationId(relationId))
 	{
-		Expr *expression = (Expr *) lfirst(expressionCell);
-
-		TargetEntry *targetEntry = makeTargetEntry(expression, -1, NULL, false);
-		targetEntryList = lappend(targetEntryList, targetEntry);
+		return NIL;
 	}
 
-	return targetEntryList;
-}
-
-
-/*
- * CreateTemporaryTableLikeStmt returns a CreateStmt node which will create a
- * clone of the given relation using the CREATE TEMPORARY TABLE LIKE option.
- * Note that the function only creates the table, and doesn't copy over indexes,
- * constraints, or default values.
- */
-static CreateStmt *
-CreateTemporaryTableLikeStmt(Oid sourceRelationId)
-{
-	static unsigned long temporaryTableId = 0;
-	CreateStmt *createStmt = NULL;
-	StringInfo clonedTableName = NULL;
-	RangeVar *clonedRelation = NULL;
-
-	char *sourceTableName = get_rel_name(sourceRelationId);
-	Oid sourceSchemaId = get_rel_namespace(sourceRelationId);
-	char *sourceSchemaName = get_namespace_name(sourceSchemaId);
-	RangeVar *sourceRelation = makeRangeVar(sourceSchemaName, sourceTableName, -1);
+	/* rows of reference tables are inserted through the master */
+	if (partitionColumn == NULL || sourcePartitionColumn == NULL)
+	{
+		return NIL;
+	}
 
-	TableLikeClause *tableLikeClause = makeNode(TableLikeClause);
-	tableLikeClause->relation = sourceRelation;
-	tableLikeClause->options = 0; /* don't copy over indexes/constraints etc */
+	/* rows must keep their partition value to stay in the matching shard */
+	partitionEntry = get_tle_by_resno(query->targetList, partitionColumn->varattno);
+	if (partitionEntry == NULL || !IsA(partitionEntry->expr, Var))
+	{
+		return NIL;
+	}
 
-	/* create a unique name for the cloned table */
-	clonedTableName = makeStringInfo();
-	appendStringInfo(clonedTableName, "%s_%d_%lu", TEMPORARY_TABLE_PREFIX, MyProcPid,
-					 temporaryTableId);
-	temporaryTableId++;
+	partitionValue = (Var *) partitionEntry->expr;
+	sourceEntry = get_tle_by_resno(subquery->targetList, partitionValue->varattno);
+	if (sourceEntry == NULL || !IsA(sourceEntry->expr, Var))
+	{
+		return NIL;
+	}
 
-	clonedRelation = makeRangeVar(NULL, clonedTableName->data, -1);
-	clonedRelation->relpersistence = RELPERSISTENCE_TEMP;
+	sourceColumn = (Var *) sourceEntry->expr;
+	if (sourceColumn->varlevelsup != 0 ||
+		sourceColumn->varattno != sourcePartitionColumn->varattno ||
+		sourceColumn->vartype != partitionColumn->vartype)
+	{
+		return NIL;
+	}
 
-	createStmt = makeNode(CreateStmt);
-	createStmt->relation = clonedRelation;
-	createStmt->tableElts = list_make1(tableLikeClause);
-	createStmt->oncommit = ONCOMMIT_DROP;
+	/* groups must not span shards, so they have to include the partition column */
+	if ((subquery->groupClause != NIL || subquery->hasAggs) &&
+		!targetIsInSortList(sourceEntry, InvalidOid, subquery->groupClause))
+	{
+		return NIL;
+	}
 
-	return createStmt;
-}
+	shardIntervalList = LoadDistributedTableShardList(relationId);
+	sourceShardIntervalList = LoadDistributedTableShardList(sourceRelationId);
 
+	/* the planner simplifies the SELECT's restrictions for pruning */
+	plannedSubquery = copyObject(subquery);
+	standard_planner(plannedSubquery, 0, NULL);
 
-/*
- * BuildDistributedPlan simply creates the DistributedPlan instance from the
- * provided query and shard interval list.
- */
-static DistributedPlan *
-BuildDistributedPlan(Query *query, List *shardIntervalList)
-{
-	ListCell *shardIntervalCell = NULL;
-	List *taskList = NIL;
-	DistributedPlan *distributedPlan = palloc0(sizeof(DistributedPlan));
-	distributedPlan->plan.type = (NodeTag) T_DistributedPlan;
-	distributedPlan->targetList = query->targetList;
+	prunedShardIntervalList = PruneShardList(sourceRelationId,
+											 QueryRestrictList(plannedSubquery),
+											 sourceShardIntervalList);
 
-	foreach(shardIntervalCell, shardIntervalList)
+	foreach(shardIntervalCell, prunedShardIntervalList)
 	{
-		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
-		int64 shardId = shardInterval->id;
-		List *finalizedPlacementList = LoadFinalizedShardPlacementList(shardId);
-		Task *task = NULL;
+		ShardInterval *sourceShardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		ShardInterval *shardInterval = NULL;
+		List *placementList = NIL;
+		List *sourcePlacementList = NIL;
+		RelationShard *relationShard = NULL;
+		RelationShard *sourceRelationShard = NULL;
 		StringInfo queryString = makeStringInfo();
+		Task *task = NULL;
 
-		/*
-		 * Convert the qualifiers to an explicitly and'd clause, which is needed
-		 * before we deparse the query. This applies to SELECT, UPDATE and
-		 * DELETE statements.
-		 */
-		FromExpr *joinTree = query->jointree;
-		if ((joinTree != NULL) && (joinTree->quals != NULL))
+		shardInterval = ColocatedShardInterval(sourceShardInterval, shardIntervalList);
+		if (shardInterval == NULL)
 		{
-			Node *whereClause = joinTree->quals;
-			if (IsA(whereClause, List))
-			{
-				joinTree->quals = (Node *) make_ands_explicit((List *) whereClause);
-			}
+			return NIL;
 		}
 
-		deparse_shard_query(query, shardId, queryString);
+		placementList = LoadFinalizedShardPlacementList(shardInterval->id);
+		sourcePlacementList = LoadFinalizedShardPlacementList(sourceShardInterval->id);
+		if (!PlacementsColocated(placementList, sourcePlacementList))
+		{
+			return NIL;
+		}
+
+		relationShard = palloc0(sizeof(RelationShard));
+		relationShard->relationId = relationId;
+		relationShard->shardId = shardInterval->id;
+
+		sourceRelationShard = palloc0(sizeof(RelationShard));
+		sourceRelationShard->relationId = sourceRelationId;
+		sourceRelationShard->shardId = sourceShardInterval->id;
+
+		deparse_relation_shard_query(copyObject(query),
+									 list_make2(relationShard, sourceRelationShard),
+									 queryString);
 
 		if (LogDistributedStatements)
 		{
@@ -1096,775 +1345,4874 @@ BuildDistributedPlan(Query *query, List *shardIntervalList)
 
 		task = (Task *) palloc0(sizeof(Task));
 		task->queryString = queryString;
-		task->taskPlacementList = finalizedPlacementList;
-		task->shardId = shardId;
+		task->taskPlacementList = placementList;
+		task->shardId = shardInterval->id;
+		task->relationId = relationId;
+		task->sourceShardId = sourceShardInterval->id;
 
 		taskList = lappend(taskList, task);
 	}
 
-	distributedPlan->taskList = taskList;
+	*colocated = true;
 
-	return distributedPlan;
+	return taskList;
 }
 
 
 /*
- * PgShardExecutorStart sets up the executor state and queryDesc for pgShard
- * executed statements. The function also handles multi-shard selects
- * differently by fetching the remote data and modifying the existing plan to
- * scan that data.
+ * InsertSelectPushdownSupported returns whether the SELECT of the given INSERT
+ * ... SELECT has a form which can be run shard by shard: it must read a single
+ * distributed table, and may not combine rows from different shards, such as
+ * by a LIMIT, DISTINCT or window functions. The command must not call stable or
+ * volatile functions either, as these could yield different values on each
+ * placement of a shard.
  */
-static void
-PgShardExecutorStart(QueryDesc *queryDesc, int eflags)
+static bool
+InsertSelectPushdownSupported(Query *query)
 {
-	PlannedStmt *plannedStatement = queryDesc->plannedstmt;
-	bool pgShardExecution = IsPgShardPlan(plannedStatement);
+	RangeTblEntry *subqueryRangeTable = InsertSelectRangeTableEntry(query);
+	Query *subquery = subqueryRangeTable->subquery;
+	RangeTblEntry *sourceRangeTable = NULL;
 
-	if (pgShardExecution)
+	if (list_length(subquery->rtable) != 1)
 	{
-		DistributedPlan *distributedPlan = (DistributedPlan *) plannedStatement->planTree;
-		bool selectFromMultipleShards = distributedPlan->selectFromMultipleShards;
-		bool zeroShardQuery = (list_length(distributedPlan->taskList) == 0);
+		return false;
+	}
 
-		if (zeroShardQuery)
-		{
-			/* if zero shards are involved, let query hit local table */
-			Plan *originalPlan = distributedPlan->originalPlan;
-			plannedStatement->planTree = originalPlan;
+	sourceRangeTable = (RangeTblEntry *) linitial(subquery->rtable);
+	if (sourceRangeTable->rtekind != RTE_RELATION ||
+		!IsDistributedTable(sourceRangeTable->relid))
+	{
+		return false;
+	}
 
-			NextExecutorStartHook(queryDesc, eflags);
-		}
-		else if (!selectFromMultipleShards)
-		{
-			bool topLevel = true;
-			LOCKMODE lockMode = NoLock;
-			EState *executorState = NULL;
+	if (subquery->hasSubLinks || subquery->cteList != NIL ||
+		subquery->setOperations != NULL || subquery->hasWindowFuncs ||
+		subquery->distinctClause != NIL || subquery->limitCount != NULL ||
+		subquery->limitOffset != NULL || subquery->rowMarks != NIL)
+	{
+		return false;
+	}
 
-			/* disallow transactions and triggers during distributed commands */
-			PreventTransactionChain(topLevel, "distributed commands");
-			eflags |= EXEC_FLAG_SKIP_TRIGGERS;
+	if (contain_mutable_functions((Node *) query))
+	{
+		return false;
+	}
 
-			/* build empty executor state to obtain per-query memory context */
-			executorState = CreateExecutorState();
-			executorState->es_top_eflags = eflags;
-			executorState->es_instrument = queryDesc->instrument_options;
+	return true;
+}
 
-			queryDesc->estate = executorState;
 
-			lockMode = CommutativityRuleToLockMode(plannedStatement->commandType);
-			if (lockMode != NoLock)
-			{
-				AcquireExecutorShardLocks(distributedPlan->taskList, lockMode);
-			}
-		}
-		else
-		{
+/*
+ * ColocatedShardInterval returns the shard in the given list which covers the
+ * same range of partition values as the given shard, or NULL if there is none.
+ */
+ShardInterval *
+ColocatedShardInterval(ShardInterval *shardInterval, List *shardIntervalList)
+{
+	ListCell *shardIntervalCell = NULL;
+	int16 typeLength = 0;
+	bool typeByValue = false;
+
+	get_typlenbyval(shardInterval->valueTypeId, &typeLength, &typeByValue);
+
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		ShardInterval *otherShardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+
+		if (otherShardInterval->valueTypeId == shardInterval->valueTypeId &&
+			datumIsEqual(otherShardInterval->minValue, shardInterval->minValue,
+						 typeByValue, typeLength) &&
+			datumIsEqual(otherShardInterval->maxValue, shardInterval->maxValue,
+						 typeByValue, typeLength))
+		{
+			return otherShardInterval;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * PlacementsColocated returns whether each of the given placements has one of
+ * the given source placements on its node. Shards of co-located tables start
+ * out on the same nodes, but a placement of either may since have failed.
+ */
+static bool
+PlacementsColocated(List *placementList, List *sourcePlacementList)
+{
+	ListCell *placementCell = NULL;
+
+	foreach(placementCell, placementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		bool sourcePlacementFound = false;
+		ListCell *sourcePlacementCell = NULL;
+
+		foreach(sourcePlacementCell, sourcePlacementList)
+		{
+			ShardPlacement *sourcePlacement = lfirst(sourcePlacementCell);
+
+			if (sourcePlacement->nodePort == placement->nodePort &&
+				strncmp(sourcePlacement->nodeName, placement->nodeName,
+						MAX_NODE_LENGTH) == 0)
+			{
+				sourcePlacementFound = true;
+				break;
+			}
+		}
+
+		if (!sourcePlacementFound)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * DeterminePlannerType chooses the appropriate planner to use in order to plan
+ * the given query.
+ */
+static PlannerType
+DeterminePlannerType(Query *query)
+{
+	PlannerType plannerType = PLANNER_INVALID_FIRST;
+	CmdType commandType = query->commandType;
+
+	/* if the extension isn't created, we always use the postgres planner */
+	bool missingOK = true;
+	Oid extensionOid = get_extension_oid(PG_SHARD_EXTENSION_NAME, missingOK);
+	if (extensionOid == InvalidOid)
+	{
+		return PLANNER_TYPE_POSTGRES;
+	}
+
+	if (commandType == CMD_SELECT && UseCitusDBSelectLogic)
+	{
+		plannerType = PLANNER_TYPE_CITUSDB;
+	}
+	else if (commandType == CMD_SELECT || commandType == CMD_INSERT ||
+			 commandType == CMD_UPDATE || commandType == CMD_DELETE)
+	{
+		Oid distributedTableId = ExtractFirstDistributedTableId(query);
+		if (OidIsValid(distributedTableId))
+		{
+			plannerType = PLANNER_TYPE_PG_SHARD;
+		}
+		else
+		{
+			plannerType = PLANNER_TYPE_POSTGRES;
+		}
+	}
+	else
+	{
+		/*
+		 * For utility statements, we need to detect if they are operating on
+		 * distributed tables. If they are, we need to warn or error out
+		 * accordingly.
+		 */
+		plannerType = PLANNER_TYPE_POSTGRES;
+	}
+
+	return plannerType;
+}
+
+
+/*
+ * ErrorIfCursorOptionsNotSupported errors out if the given cursor options ask
+ * for a cursor which distributed queries cannot provide. Cursors on distributed
+ * tables can only be read once, front to back.
+ */
+static void
+ErrorIfCursorOptionsNotSupported(int cursorOptions)
+{
+	if (cursorOptions & CURSOR_OPT_SCROLL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("scrollable cursors on distributed tables are "
+							   "unsupported")));
+	}
+
+	if (cursorOptions & CURSOR_OPT_HOLD)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("holdable cursors on distributed tables are "
+							   "unsupported")));
+	}
+}
+
+
+/*
+ * ErrorIfQueryNotSupported checks if the query contains unsupported features,
+ * and errors out if it does.
+ */
+static void
+ErrorIfQueryNotSupported(Query *queryTree)
+{
+	Oid distributedTableId = ExtractFirstDistributedTableId(queryTree);
+	Var *partitionColumn = PartitionColumn(distributedTableId);
+	List *rangeTableList = NIL;
+	ListCell *rangeTableCell = NULL;
+	bool hasValuesScan = false;
+	uint32 queryTableCount = 0;
+	bool hasNonConstTargetEntryExprs = false;
+	bool hasNonConstQualExprs = false;
+	bool specifiesPartitionValue = false;
+
+	CmdType commandType = queryTree->commandType;
+	Assert(commandType == CMD_SELECT || commandType == CMD_INSERT ||
+		   commandType == CMD_UPDATE || commandType == CMD_DELETE);
+
+	/* prevent utility statements other than DECLARE CURSOR attached to selects */
+	if (commandType == CMD_SELECT && queryTree->utilityStmt != NULL &&
+		!IsA(queryTree->utilityStmt, DeclareCursorStmt))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Utility commands are not supported in distributed "
+								  "queries.")));
+	}
+
+	/*
+	 * Reject subqueries which are in SELECT or WHERE clause.
+	 * Queries which include subqueries in FROM clauses are rejected below.
+	 */
+	if (queryTree->hasSubLinks == true)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Subqueries are not supported in distributed"
+								  " queries.")));
+	}
+
+	/* reject queries which include CommonTableExpr */
+	if (queryTree->cteList != NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Common table expressions are not supported in"
+								  " distributed queries.")));
+	}
+
+	/* extract range table entries */
+	ExtractRangeTableEntryWalker((Node *) queryTree, &rangeTableList);
+
+	foreach(rangeTableCell, rangeTableList)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		if (rangeTableEntry->rtekind == RTE_RELATION)
+		{
+			queryTableCount++;
+		}
+		else if (rangeTableEntry->rtekind == RTE_VALUES)
+		{
+			hasValuesScan = true;
+		}
+		else if (rangeTableEntry->rtekind == RTE_JOIN && commandType == CMD_SELECT)
+		{
+			/* the tables being joined are checked below */
+		}
+		else
+		{
 			/*
-			 * If its a SELECT query over multiple shards, we fetch the relevant
-			 * data from the remote nodes and insert it into a temp table. We then
-			 * point the existing plan to scan this temp table instead of the
-			 * original one.
+			 * Error out for rangeTableEntries that we do not support.
+			 * We do not explicitly specify "in FROM clause" in the error detail
+			 * for the features that we do not support at all (SUBQUERY, JOIN).
+			 * We do not need to check for RTE_CTE because all common table expressions
+			 * are rejected above with queryTree->cteList check.
 			 */
-			Plan *originalPlan = NULL;
-			RangeTblEntry *sequentialScanRangeTable = NULL;
-			Oid intermediateResultTableId = InvalidOid;
-			bool missingOK = false;
+			char *rangeTableEntryErrorDetail = NULL;
+			if (rangeTableEntry->rtekind == RTE_SUBQUERY)
+			{
+				rangeTableEntryErrorDetail = "Subqueries are not supported in"
+											 " distributed queries.";
+			}
+			else if (rangeTableEntry->rtekind == RTE_JOIN)
+			{
+				rangeTableEntryErrorDetail = "Joins are not supported in distributed"
+											 " queries.";
+			}
+			else if (rangeTableEntry->rtekind == RTE_FUNCTION)
+			{
+				rangeTableEntryErrorDetail = "Functions must not appear in the FROM"
+											 " clause of a distributed query.";
+			}
+			else
+			{
+				rangeTableEntryErrorDetail = "Unrecognized range table entry.";
+			}
 
-			/* execute the previously created statement to create a temp table */
-			CreateStmt *createStmt = distributedPlan->createTemporaryTableStmt;
-			const char *queryDescription = "create temp table like";
-			RangeVar *intermediateResultTable = createStmt->relation;
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot perform distributed planning for the given"
+								   " query"),
+							errdetail("%s", rangeTableEntryErrorDetail)));
+		}
+	}
 
-			ProcessUtility((Node *) createStmt, queryDescription,
-						   PROCESS_UTILITY_TOPLEVEL, NULL, None_Receiver, NULL);
+	/* only SELECT queries may join tables, which must be co-located */
+	if (queryTableCount > 1 && commandType == CMD_SELECT)
+	{
+		ErrorIfJoinNotSupported(queryTree);
+	}
+	else if (queryTableCount != 1)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Joins are not supported in distributed queries.")));
+	}
 
-			/* execute select queries and fetch results into the temp table */
-			ExecuteMultipleShardSelect(distributedPlan, intermediateResultTable);
+	/* reject queries which involve multi-row inserts */
+	if (hasValuesScan)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Multi-row INSERTs to distributed tables are not "
+								  "supported.")));
+	}
 
-			/* update the query descriptor snapshot so results are visible */
-			UnregisterSnapshot(queryDesc->snapshot);
-			UpdateActiveSnapshotCommandId();
-			queryDesc->snapshot = RegisterSnapshot(GetActiveSnapshot());
+	if (commandType == CMD_INSERT || commandType == CMD_UPDATE ||
+		commandType == CMD_DELETE)
+	{
+		FromExpr *joinTree = NULL;
+		ListCell *targetEntryCell = NULL;
 
-			/* update sequential scan's table entry to point to intermediate table */
-			intermediateResultTableId = RangeVarGetRelid(intermediateResultTable,
-														 NoLock, missingOK);
+		foreach(targetEntryCell, queryTree->targetList)
+		{
+			TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+
+			/* skip resjunk entries: UPDATE adds some for ctid, etc. */
+			if (targetEntry->resjunk)
+			{
+				continue;
+			}
+
+			/* master-evaluable functions are gone, but others may remain */
+			if (contain_mutable_functions((Node *) targetEntry->expr))
+			{
+				hasNonConstTargetEntryExprs = true;
+			}
+
+			/* reference tables have no partition column */
+			if (partitionColumn != NULL &&
+				targetEntry->resno == partitionColumn->varattno)
+			{
+				specifiesPartitionValue = true;
+			}
+		}
+
+		joinTree = queryTree->jointree;
+		if (joinTree != NULL && contain_mutable_functions(joinTree->quals))
+		{
+			hasNonConstQualExprs = true;
+		}
+
+		/* the cursor lives on the master, so its current row has no meaning remotely */
+		if (joinTree != NULL && CurrentOfExprWalker(joinTree->quals, NULL))
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot perform distributed planning for the given "
+								   "query"),
+							errdetail("WHERE CURRENT OF is not supported in distributed "
+									  "modifications.")));
+		}
+	}
+
+	if (hasNonConstTargetEntryExprs || hasNonConstQualExprs)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot plan sharded modification containing values "
+							   "which are not constants or constant expressions"),
+						errdetail("Stable and volatile functions may not refer to "
+								  "columns of the modified table.")));
+	}
+
+	if (specifiesPartitionValue && (commandType == CMD_UPDATE))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("modifying the partition value of rows is not allowed")));
+	}
+}
+
+
+/*
+ * CurrentOfExprWalker returns true if the given expression tree contains a
+ * WHERE CURRENT OF expression.
+ */
+static bool
+CurrentOfExprWalker(Node *node, void *context)
+{
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	if (IsA(node, CurrentOfExpr))
+	{
+		return true;
+	}
+
+	return expression_tree_walker(node, CurrentOfExprWalker, context);
+}
+
+
+/*
+ * ErrorIfJoinNotSupported checks that the tables joined by the given SELECT can
+ * be joined shard by shard, and errors out if they cannot. All joined tables
+ * must be distributed and belong to the same co-location group, so that rows
+ * which join with each other live in shards covering the same range. For the
+ * same reason, the query's join clauses must connect all tables to each other
+ * through equalities of their partition columns. Reference tables are exempt
+ * from both rules, as all of their rows are found alongside every shard.
+ */
+static void
+ErrorIfJoinNotSupported(Query *queryTree)
+{
+	List *rangeTableList = queryTree->rtable;
+	ListCell *rangeTableCell = NULL;
+	List *joinClauseList = NIL;
+	List *partitionClauseList = NIL;
+	ListCell *joinClauseCell = NULL;
+	Relids relationIds = NULL;
+	Relids referenceRelationIds = NULL;
+	Relids joinedRelationIds = NULL;
+	bool joinedRelationsGrew = true;
+	Index rangeTableIndex = 0;
+	uint32 colocationId = 0;
+
+	foreach(rangeTableCell, rangeTableList)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		uint32 relationColocationId = 0;
+
+		rangeTableIndex++;
+		if (rangeTableEntry->rtekind != RTE_RELATION)
+		{
+			continue;
+		}
+
+		if (!IsDistributedTable(rangeTableEntry->relid))
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot perform distributed planning for the given"
+								   " query"),
+							errdetail("Joins with local tables are not supported in"
+									  " distributed queries.")));
+		}
+
+		if (PartitionType(rangeTableEntry->relid) == REFERENCE_PARTITION_TYPE)
+		{
+			referenceRelationIds = bms_add_member(referenceRelationIds,
+												  rangeTableIndex);
+			continue;
+		}
+
+		relationColocationId = ColocationId(rangeTableEntry->relid);
+		if (relationIds == NULL)
+		{
+			colocationId = relationColocationId;
+			joinedRelationIds = bms_make_singleton(rangeTableIndex);
+		}
+		else if (relationColocationId != colocationId)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot perform distributed planning for the given"
+								   " query"),
+							errdetail("Only co-located tables may be joined in"
+									  " distributed queries."),
+							errhint("Use the colocate_with argument of "
+									"master_create_worker_shards to co-locate "
+									"tables.")));
+		}
+
+		relationIds = bms_add_member(relationIds, rangeTableIndex);
+	}
+
+	if (queryTree->rowMarks != NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("FOR UPDATE and FOR SHARE are not supported in"
+								  " distributed joins.")));
+	}
+
+	if (ReferenceRowsPreserved((Node *) queryTree->jointree, referenceRelationIds))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Outer joins with distributed tables may not"
+								  " preserve the rows of reference tables.")));
+	}
+
+	joinClauseList = JoinTreeQualList((Node *) queryTree->jointree, true);
+	foreach(joinClauseCell, joinClauseList)
+	{
+		Node *joinClause = (Node *) lfirst(joinClauseCell);
+
+		if (PartitionColumnJoinClause(joinClause, rangeTableList))
+		{
+			partitionClauseList = lappend(partitionClauseList, joinClause);
+		}
+	}
+
+	/* starting from the first table, follow partition column equalities */
+	while (joinedRelationsGrew)
+	{
+		joinedRelationsGrew = false;
+
+		foreach(joinClauseCell, partitionClauseList)
+		{
+			Node *partitionClause = (Node *) lfirst(joinClauseCell);
+			Relids clauseRelationIds = pull_varnos(partitionClause);
+
+			if (bms_overlap(clauseRelationIds, joinedRelationIds) &&
+				!bms_is_subset(clauseRelationIds, joinedRelationIds))
+			{
+				joinedRelationIds = bms_add_members(joinedRelationIds,
+													clauseRelationIds);
+				joinedRelationsGrew = true;
+			}
+		}
+	}
+
+	if (!bms_equal(joinedRelationIds, relationIds))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Distributed tables must be joined on equality of"
+								  " their partition columns.")));
+	}
+}
+
+
+/*
+ * ReferenceRowsPreserved returns whether an outer join in the given join tree
+ * preserves the rows of a side holding only reference tables, while its other
+ * side holds distributed tables. As the join runs once for each shard of these
+ * tables, the preserved rows would be returned once for every shard.
+ */
+static bool
+ReferenceRowsPreserved(Node *joinTreeNode, Relids referenceRelationIds)
+{
+	bool referenceRowsPreserved = false;
+
+	if (joinTreeNode == NULL)
+	{
+		return false;
+	}
+
+	if (IsA(joinTreeNode, FromExpr))
+	{
+		FromExpr *fromExpr = (FromExpr *) joinTreeNode;
+		ListCell *fromCell = NULL;
+
+		foreach(fromCell, fromExpr->fromlist)
+		{
+			Node *fromNode = (Node *) lfirst(fromCell);
+
+			if (ReferenceRowsPreserved(fromNode, referenceRelationIds))
+			{
+				referenceRowsPreserved = true;
+				break;
+			}
+		}
+	}
+	else if (IsA(joinTreeNode, JoinExpr))
+	{
+		JoinExpr *joinExpr = (JoinExpr *) joinTreeNode;
+		Relids leftRelationIds = get_relids_in_jointree(joinExpr->larg, false);
+		Relids rightRelationIds = get_relids_in_jointree(joinExpr->rarg, false);
+		bool leftReferenceOnly = bms_is_subset(leftRelationIds, referenceRelationIds);
+		bool rightReferenceOnly = bms_is_subset(rightRelationIds, referenceRelationIds);
+
+		switch (joinExpr->jointype)
+		{
+			case JOIN_LEFT:
+			case JOIN_ANTI:
+			{
+				referenceRowsPreserved = (leftReferenceOnly && !rightReferenceOnly);
+				break;
+			}
+
+			case JOIN_RIGHT:
+			{
+				referenceRowsPreserved = (rightReferenceOnly && !leftReferenceOnly);
+				break;
+			}
+
+			case JOIN_FULL:
+			{
+				referenceRowsPreserved = (leftReferenceOnly != rightReferenceOnly);
+				break;
+			}
+
+			default:
+			{
+				break;
+			}
+		}
+
+		if (!referenceRowsPreserved)
+		{
+			referenceRowsPreserved =
+				ReferenceRowsPreserved(joinExpr->larg, referenceRelationIds) ||
+				ReferenceRowsPreserved(joinExpr->rarg, referenceRelationIds);
+		}
+	}
+
+	return referenceRowsPreserved;
+}
+
+
+/*
+ * JoinTreeQualList returns a new list of the top-level conjuncts of all quals
+ * found in the given join tree. The quals of outer joins are only included if
+ * asked for: these do not restrict the rows of the join's outer side, and so
+ * cannot be used to prune that side's shards.
+ */
+static List *
+JoinTreeQualList(Node *joinTreeNode, bool includeOuterJoinQuals)
+{
+	List *qualList = NIL;
+	List *childNodeList = NIL;
+	ListCell *childNodeCell = NULL;
+	Node *quals = NULL;
+
+	if (joinTreeNode == NULL)
+	{
+		return NIL;
+	}
+
+	if (IsA(joinTreeNode, FromExpr))
+	{
+		FromExpr *fromExpr = (FromExpr *) joinTreeNode;
+
+		quals = fromExpr->quals;
+		childNodeList = fromExpr->fromlist;
+	}
+	else if (IsA(joinTreeNode, JoinExpr))
+	{
+		JoinExpr *joinExpr = (JoinExpr *) joinTreeNode;
+
+		if (joinExpr->jointype == JOIN_INNER || includeOuterJoinQuals)
+		{
+			quals = joinExpr->quals;
+		}
+
+		childNodeList = list_make2(joinExpr->larg, joinExpr->rarg);
+	}
+
+	/* the planner leaves quals as implicitly and'd lists, but accept either form */
+	if (quals != NULL && IsA(quals, List))
+	{
+		qualList = list_copy((List *) quals);
+	}
+	else if (quals != NULL)
+	{
+		qualList = list_copy(make_ands_implicit((Expr *) quals));
+	}
+
+	foreach(childNodeCell, childNodeList)
+	{
+		Node *childNode = (Node *) lfirst(childNodeCell);
+		List *childQualList = JoinTreeQualList(childNode, includeOuterJoinQuals);
+
+		qualList = list_concat(qualList, childQualList);
+	}
+
+	return qualList;
+}
+
+
+/*
+ * PartitionColumnJoinClause returns whether the given clause is an equality
+ * between the partition columns of two different tables.
+ */
+static bool
+PartitionColumnJoinClause(Node *clause, List *rangeTableList)
+{
+	OpExpr *operatorExpression = NULL;
+	Node *leftOperand = NULL;
+	Node *rightOperand = NULL;
+	Var *leftColumn = NULL;
+	Var *rightColumn = NULL;
+	RangeTblEntry *leftRangeTable = NULL;
+	RangeTblEntry *rightRangeTable = NULL;
+	Var *leftPartitionColumn = NULL;
+	Var *rightPartitionColumn = NULL;
+	OpExpr *equalityExpression = NULL;
+
+	if (!IsA(clause, OpExpr) || list_length(((OpExpr *) clause)->args) != 2)
+	{
+		return false;
+	}
+
+	operatorExpression = (OpExpr *) clause;
+	leftOperand = strip_implicit_coercions(linitial(operatorExpression->args));
+	rightOperand = strip_implicit_coercions(lsecond(operatorExpression->args));
+	if (!IsA(leftOperand, Var) || !IsA(rightOperand, Var))
+	{
+		return false;
+	}
+
+	leftColumn = (Var *) leftOperand;
+	rightColumn = (Var *) rightOperand;
+	if (leftColumn->varlevelsup != 0 || rightColumn->varlevelsup != 0 ||
+		leftColumn->varno == rightColumn->varno)
+	{
+		return false;
+	}
+
+	leftRangeTable = rt_fetch(leftColumn->varno, rangeTableList);
+	rightRangeTable = rt_fetch(rightColumn->varno, rangeTableList);
+	if (leftRangeTable->rtekind != RTE_RELATION ||
+		rightRangeTable->rtekind != RTE_RELATION)
+	{
+		return false;
+	}
+
+	/* reference tables have no partition column */
+	leftPartitionColumn = PartitionColumn(leftRangeTable->relid);
+	rightPartitionColumn = PartitionColumn(rightRangeTable->relid);
+	if (leftPartitionColumn == NULL || rightPartitionColumn == NULL)
+	{
+		return false;
+	}
+
+	if (leftColumn->varattno != leftPartitionColumn->varattno ||
+		rightColumn->varattno != rightPartitionColumn->varattno)
+	{
+		return false;
+	}
+
+	/* co-located tables have partition columns of the same type */
+	equalityExpression = MakeOpExpression(leftPartitionColumn, BTEqualStrategyNumber);
+
+	return (operatorExpression->opno == equalityExpression->opno);
+}
+
+
+/*
+ * ExtractFirstDistributedTableId takes a given query, and finds the relationId
+ * for the first distributed table in that query. If the function cannot find a
+ * distributed table, it returns InvalidOid.
+ */
+static Oid
+ExtractFirstDistributedTableId(Query *query)
+{
+	List *rangeTableList = NIL;
+	ListCell *rangeTableCell = NULL;
+	Oid distributedTableId = InvalidOid;
+
+	/* extract range table entries */
+	ExtractRangeTableEntryWalker((Node *) query, &rangeTableList);
+
+	foreach(rangeTableCell, rangeTableList)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+
+		if (IsDistributedTable(rangeTableEntry->relid))
+		{
+			distributedTableId = rangeTableEntry->relid;
+			break;
+		}
+	}
+
+	return distributedTableId;
+}
+
+
+/*
+ * ExtractRangeTableEntryWalker walks over a query tree, and finds all range
+ * table entries. For recursing into the query tree, this function uses the
+ * query tree walker since the expression tree walker doesn't recurse into
+ * sub-queries.
+ */
+static bool
+ExtractRangeTableEntryWalker(Node *node, List **rangeTableList)
+{
+	bool walkIsComplete = false;
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	if (IsA(node, RangeTblEntry))
+	{
+		RangeTblEntry *rangeTable = (RangeTblEntry *) node;
+		(*rangeTableList) = lappend(*rangeTableList, rangeTable);
+	}
+	else if (IsA(node, Query))
+	{
+		walkIsComplete = query_tree_walker((Query *) node, ExtractRangeTableEntryWalker,
+										   rangeTableList, QTW_EXAMINE_RTES);
+	}
+	else
+	{
+		walkIsComplete = expression_tree_walker(node, ExtractRangeTableEntryWalker,
+												rangeTableList);
+	}
+
+	return walkIsComplete;
+}
+
+
+/*
+ * DistributedQueryShardList prunes the shards for the table in the query based
+ * on the query's restriction qualifiers, and returns this list. It is possible
+ * that all shards will be pruned if a query's restrictions are unsatisfiable.
+ * In that case, this function can return an empty list; however, if the table
+ * being queried has no shards created whatsoever, this function errors out.
+ */
+static List *
+DistributedQueryShardList(Query *query)
+{
+	List *restrictClauseList = NIL;
+	List *prunedShardList = NIL;
+
+	Oid distributedTableId = ExtractFirstDistributedTableId(query);
+	List *shardIntervalList = LoadDistributedTableShardList(distributedTableId);
+
+	restrictClauseList = QueryRestrictList(query);
+	prunedShardList = PruneShardList(distributedTableId, restrictClauseList,
+									 shardIntervalList);
+
+	return prunedShardList;
+}
+
+
+/*
+ * LoadDistributedTableShardList returns the shard intervals of the given
+ * distributed table, and errors out if the table has no shards whatsoever.
+ */
+static List *
+LoadDistributedTableShardList(Oid distributedTableId)
+{
+	List *shardIntervalList = LookupShardIntervalList(distributedTableId);
+
+	/* error out if no shards exists for the table */
+	if (shardIntervalList == NIL)
+	{
+		char *relationName = get_rel_name(distributedTableId);
+
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("could not find any shards for query"),
+						errdetail("No shards exist for distributed table \"%s\".",
+								  relationName),
+						errhint("Run master_create_worker_shards to create shards "
+								"and try again.")));
+	}
+
+	return shardIntervalList;
+}
+
+
+/* Returns true if the query is a select query that reads data from multiple shards. */
+static bool
+SelectFromMultipleShards(Query *query, List *queryShardList)
+{
+	if ((query->commandType == CMD_SELECT) && (list_length(queryShardList) > 1))
+	{
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+
+/*
+ * ClassifyRestrictions divides a query's restriction list in two: the subset
+ * of restrictions safe for remote evaluation and the subset of restrictions
+ * that must be evaluated locally. remoteRestrictList and localRestrictList are
+ * output parameters to receive these two subsets.
+ *
+ * Currently places all restrictions in the remote list and leaves the local
+ * one totally empty.
+ */
+static void
+ClassifyRestrictions(List *queryRestrictList, List **remoteRestrictList,
+					 List **localRestrictList)
+{
+	ListCell *restrictCell = NULL;
+
+	*remoteRestrictList = NIL;
+	*localRestrictList = NIL;
+
+	foreach(restrictCell, queryRestrictList)
+	{
+		Node *restriction = (Node *) lfirst(restrictCell);
+		bool restrictionSafeToSend = true;
+
+		if (restrictionSafeToSend)
+		{
+			*remoteRestrictList = lappend(*remoteRestrictList, restriction);
+		}
+		else
+		{
+			*localRestrictList = lappend(*localRestrictList, restriction);
+		}
+	}
+}
+
+
+/*
+ * RowAndColumnFilterQuery builds a query which contains the filter clauses from
+ * the original query and also only selects columns needed for the original
+ * query. This new query can then be pushed down to the worker nodes.
+ */
+static Query *
+RowAndColumnFilterQuery(Query *query, List *remoteRestrictList, List *localRestrictList)
+{
+	Query *filterQuery = NULL;
+	List *rangeTableList = NIL;
+	List *whereColumnList = NIL;
+	List *projectColumnList = NIL;
+	List *havingClauseColumnList = NIL;
+	List *requiredColumnList = NIL;
+	ListCell *columnCell = NULL;
+	List *uniqueColumnList = NIL;
+	List *targetList = NIL;
+	FromExpr *fromExpr = NULL;
+	PVCAggregateBehavior aggregateBehavior = PVC_RECURSE_AGGREGATES;
+	PVCPlaceHolderBehavior placeHolderBehavior = PVC_REJECT_PLACEHOLDERS;
+
+	ExtractRangeTableEntryWalker((Node *) query, &rangeTableList);
+	Assert(list_length(rangeTableList) == 1);
+
+	/* build the expression to supply FROM/WHERE for the remote query */
+	fromExpr = makeNode(FromExpr);
+	fromExpr->quals = (Node *) make_ands_explicit((List *) remoteRestrictList);
+	fromExpr->fromlist = QueryFromList(rangeTableList);
+
+	/* must retrieve all columns referenced by local WHERE clauses... */
+	whereColumnList = pull_var_clause((Node *) localRestrictList, aggregateBehavior,
+									  placeHolderBehavior);
+
+	/* as well as any used in projections (GROUP BY, etc.) */
+	projectColumnList = pull_var_clause((Node *) query->targetList, aggregateBehavior,
+										placeHolderBehavior);
+
+	/* finally, need those used in any HAVING quals */
+	havingClauseColumnList = pull_var_clause(query->havingQual, aggregateBehavior,
+											 placeHolderBehavior);
+
+	/* put them together to get list of required columns for query */
+	requiredColumnList = list_concat(requiredColumnList, whereColumnList);
+	requiredColumnList = list_concat(requiredColumnList, projectColumnList);
+	requiredColumnList = list_concat(requiredColumnList, havingClauseColumnList);
+
+	/* ensure there are no duplicates in the list  */
+	foreach(columnCell, requiredColumnList)
+	{
+		Var *column = (Var *) lfirst(columnCell);
+
+		uniqueColumnList = list_append_unique(uniqueColumnList, column);
+	}
+
+	/*
+	 * If we still have no columns, possible in a query like "SELECT count(*)",
+	 * add a NULL constant. This constant results in "SELECT NULL FROM ...".
+	 * postgres_fdw generates a similar string when no columns are selected.
+	 */
+	if (uniqueColumnList == NIL)
+	{
+		/* values for NULL const taken from parse_node.c */
+		Const *nullConst = makeConst(UNKNOWNOID, -1, InvalidOid, -2,
+									 (Datum) 0, true, false);
+
+		uniqueColumnList = lappend(uniqueColumnList, nullConst);
+	}
+
+	targetList = TargetEntryList(uniqueColumnList);
+
+	filterQuery = makeNode(Query);
+	filterQuery->commandType = CMD_SELECT;
+	filterQuery->rtable = rangeTableList;
+	filterQuery->jointree = fromExpr;
+	filterQuery->targetList = targetList;
+
+	return filterQuery;
+}
+
+
+/*
+ * BuildLocalQuery returns a copy of query with its quals replaced by those
+ * in localRestrictList. Expects queries with a single entry in their FROM
+ * list.
+ */
+static Query *
+BuildLocalQuery(Query *query, List *localRestrictList)
+{
+	Query *localQuery = copyObject(query);
+	FromExpr *joinTree = localQuery->jointree;
+
+	Assert(joinTree != NULL);
+	Assert(list_length(joinTree->fromlist) == 1);
+	joinTree->quals = (Node *) make_ands_explicit((List *) localRestrictList);
+
+	return localQuery;
+}
+
+
+/*
+ * PlanSequentialScan attempts to plan the given query using only a sequential
+ * scan of the underlying table. The function disables index scan types and
+ * plans the query. If the plan still contains a non-sequential scan plan node,
+ * the function errors out. Note this function modifies the query parameter, so
+ * make a copy before calling PlanSequentialScan if that is unacceptable.
+ */
+static PlannedStmt *
+PlanSequentialScan(Query *query, int cursorOptions, ParamListInfo boundParams)
+{
+	PlannedStmt *sequentialScanPlan = NULL;
+	bool indexScanEnabledOldValue = false;
+	bool bitmapScanEnabledOldValue = false;
+	List *rangeTableList = NIL;
+	ListCell *rangeTableCell = NULL;
+
+	/* error out if the table is a foreign table */
+	ExtractRangeTableEntryWalker((Node *) query, &rangeTableList);
+
+	foreach(rangeTableCell, rangeTableList)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		if (rangeTableEntry->rtekind == RTE_RELATION)
+		{
+			if (rangeTableEntry->relkind == RELKIND_FOREIGN_TABLE)
+			{
+				ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+								errmsg("multi-shard SELECTs from foreign tables are "
+									   "unsupported ")));
+			}
+		}
+	}
+
+	/* disable index scan types */
+	indexScanEnabledOldValue = enable_indexscan;
+	bitmapScanEnabledOldValue = enable_bitmapscan;
+
+	enable_indexscan = false;
+	enable_bitmapscan = false;
+
+	sequentialScanPlan = standard_planner(query, cursorOptions, boundParams);
+
+	enable_indexscan = indexScanEnabledOldValue;
+	enable_bitmapscan = bitmapScanEnabledOldValue;
+
+	return sequentialScanPlan;
+}
+
+
+/*
+ * QueryRestrictList returns the restriction clauses for the query. For a SELECT
+ * statement these are the where-clause expressions. For INSERT statements we
+ * build an equality clause based on the partition-column and its supplied
+ * insert value.
+ */
+List *
+QueryRestrictList(Query *query)
+{
+	List *queryRestrictList = NIL;
+	CmdType commandType = query->commandType;
+
+	if (commandType == CMD_INSERT)
+	{
+		/* build equality expression based on partition column value for row */
+		Oid distributedTableId = ExtractFirstDistributedTableId(query);
+		Var *partitionColumn = PartitionColumn(distributedTableId);
+		Const *partitionValue = NULL;
+		OpExpr *equalityExpr = NULL;
+		Node *rightOp = NULL;
+		Const *rightConst = NULL;
+
+		/* rows of reference tables go to their only shard */
+		if (partitionColumn == NULL)
+		{
+			return NIL;
+		}
+
+		partitionValue = ExtractPartitionValue(query, partitionColumn);
+		equalityExpr = MakeOpExpression(partitionColumn, BTEqualStrategyNumber);
+
+		rightOp = get_rightop((Expr *) equalityExpr);
+		rightConst = (Const *) rightOp;
+		Assert(IsA(rightOp, Const));
+
+		rightConst->constvalue = partitionValue->constvalue;
+		rightConst->constisnull = partitionValue->constisnull;
+		rightConst->constbyval = partitionValue->constbyval;
+
+		queryRestrictList = list_make1(equalityExpr);
+	}
+	else if (commandType == CMD_SELECT || commandType == CMD_UPDATE ||
+			 commandType == CMD_DELETE)
+	{
+		query_tree_walker(query, ExtractFromExpressionWalker, &queryRestrictList, 0);
+	}
+
+	return queryRestrictList;
+}
+
+
+/*
+ * ExtractPartitionValue extracts the partition column value from a the target
+ * of a modification command. If a partition value is not a constant, is NULL,
+ * or is missing altogether, this function throws an error.
+ */
+static Const *
+ExtractPartitionValue(Query *query, Var *partitionColumn)
+{
+	Const *partitionValue = NULL;
+	TargetEntry *targetEntry = get_tle_by_resno(query->targetList,
+												partitionColumn->varattno);
+	if (targetEntry != NULL)
+	{
+		if (!IsA(targetEntry->expr, Const))
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot plan INSERT to a distributed table "
+								   "using a non-constant partition column value")));
+		}
+
+		partitionValue = (Const *) targetEntry->expr;
+	}
+
+	if (partitionValue == NULL || partitionValue->constisnull)
+	{
+		ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+						errmsg("cannot plan INSERT using row with NULL value "
+							   "in partition column")));
+	}
+
+	return partitionValue;
+}
+
+
+/*
+ * ExtractFromExpressionWalker walks over a FROM expression, and finds all
+ * explicit qualifiers in the expression.
+ */
+static bool
+ExtractFromExpressionWalker(Node *node, List **qualifierList)
+{
+	bool walkIsComplete = false;
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	if (IsA(node, FromExpr))
+	{
+		FromExpr *fromExpression = (FromExpr *) node;
+		List *fromQualifierList = (List *) fromExpression->quals;
+		(*qualifierList) = list_concat(*qualifierList, fromQualifierList);
+	}
+
+	walkIsComplete = expression_tree_walker(node, ExtractFromExpressionWalker,
+											(void *) qualifierList);
+
+	return walkIsComplete;
+}
+
+
+/*
+ * QueryFromList creates the from list construct that is used for building the
+ * query's join tree. The function creates the from list by making a range table
+ * reference for each entry in the given range table list.
+ */
+static List *
+QueryFromList(List *rangeTableList)
+{
+	List *fromList = NIL;
+	Index rangeTableIndex = 1;
+	uint32 rangeTableCount = (uint32) list_length(rangeTableList);
+
+	for (rangeTableIndex = 1; rangeTableIndex <= rangeTableCount; rangeTableIndex++)
+	{
+		RangeTblRef *rangeTableReference = makeNode(RangeTblRef);
+		rangeTableReference->rtindex = rangeTableIndex;
+
+		fromList = lappend(fromList, rangeTableReference);
+	}
+
+	return fromList;
+}
+
+
+/*
+ * TargetEntryList creates a target entry for each expression in the given list,
+ * and returns the newly created target entries in a list.
+ */
+static List *
+TargetEntryList(List *expressionList)
+{
+	List *targetEntryList = NIL;
+	ListCell *expressionCell = NULL;
+
+	foreach(expressionCell, expressionList)
+	{
+		Expr *expression = (Expr *) lfirst(expressionCell);
+
+		TargetEntry *targetEntry = makeTargetEntry(expression, -1, NULL, false);
+		targetEntryList = lappend(targetEntryList, targetEntry);
+	}
+
+	return targetEntryList;
+}
+
+
+/*
+ * CreateTemporaryTableLikeStmt returns a CreateStmt node which will create a
+ * clone of the given relation using the CREATE TEMPORARY TABLE LIKE option.
+ * Note that the function only creates the table, and doesn't copy over indexes,
+ * constraints, or default values.
+ */
+static CreateStmt *
+CreateTemporaryTableLikeStmt(Oid sourceRelationId)
+{
+	CreateStmt *createStmt = NULL;
+	RangeVar *clonedRelation = NULL;
+
+	char *sourceTableName = get_rel_name(sourceRelationId);
+	Oid sourceSchemaId = get_rel_namespace(sourceRelationId);
+	char *sourceSchemaName = get_namespace_name(sourceSchemaId);
+	RangeVar *sourceRelation = makeRangeVar(sourceSchemaName, sourceTableName, -1);
+
+	TableLikeClause *tableLikeClause = makeNode(TableLikeClause);
+	tableLikeClause->relation = sourceRelation;
+	tableLikeClause->options = 0; /* don't copy over indexes/constraints etc */
+
+	clonedRelation = TemporaryTableRangeVar();
+
+	createStmt = makeNode(CreateStmt);
+	createStmt->relation = clonedRelation;
+	createStmt->tableElts = list_make1(tableLikeClause);
+	createStmt->oncommit = ONCOMMIT_DROP;
+
+	return createStmt;
+}
+
+
+/*
+ * TemporaryTableRangeVar returns a range variable naming a new temporary table,
+ * whose name is unique within this backend.
+ */
+static RangeVar *
+TemporaryTableRangeVar(void)
+{
+	static unsigned long temporaryTableId = 0;
+	StringInfo temporaryTableName = makeStringInfo();
+	RangeVar *temporaryTable = NULL;
+
+	appendStringInfo(temporaryTableName, "%s_%d_%lu", TEMPORARY_TABLE_PREFIX,
+					 MyProcPid, temporaryTableId);
+	temporaryTableId++;
+
+	temporaryTable = makeRangeVar(NULL, temporaryTableName->data, -1);
+	temporaryTable->relpersistence = RELPERSISTENCE_TEMP;
+
+	return temporaryTable;
+}
+
+
+/*
+ * BuildDistributedPlan simply creates the DistributedPlan instance from the
+ * provided query and shard interval list.
+ */
+static DistributedPlan *
+BuildDistributedPlan(Query *query, List *shardIntervalList)
+{
+	ListCell *shardIntervalCell = NULL;
+	List *taskList = NIL;
+	DistributedPlan *distributedPlan = palloc0(sizeof(DistributedPlan));
+	distributedPlan->plan.type = (NodeTag) T_DistributedPlan;
+	distributedPlan->targetList = query->targetList;
+
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		int64 shardId = shardInterval->id;
+		List *finalizedPlacementList = LoadFinalizedShardPlacementList(shardId);
+		Task *task = NULL;
+		StringInfo queryString = makeStringInfo();
+
+		/*
+		 * Convert the qualifiers to an explicitly and'd clause, which is needed
+		 * before we deparse the query. This applies to SELECT, UPDATE and
+		 * DELETE statements.
+		 */
+		FromExpr *joinTree = query->jointree;
+		if ((joinTree != NULL) && (joinTree->quals != NULL))
+		{
+			Node *whereClause = joinTree->quals;
+			if (IsA(whereClause, List))
+			{
+				joinTree->quals = (Node *) make_ands_explicit((List *) whereClause);
+			}
+		}
+
+		deparse_shard_query(query, shardId, queryString);
+
+		if (LogDistributedStatements)
+		{
+			ereport(LOG, (errmsg("distributed statement: %s", queryString->data)));
+		}
+
+		task = (Task *) palloc0(sizeof(Task));
+		task->queryString = queryString;
+		task->taskPlacementList = finalizedPlacementList;
+		task->shardId = shardId;
+		task->relationId = shardInterval->relationId;
+		task->query = query;
+
+		taskList = lappend(taskList, task);
+	}
+
+	distributedPlan->taskList = taskList;
+
+	return distributedPlan;
+}
+
+
+/*
+ * QueryHasSubqueries returns whether the given query contains subqueries, be it
+ * in its FROM clause or its expressions, or common table expressions.
+ */
+static bool
+QueryHasSubqueries(Query *query)
+{
+	ListCell *rangeTableCell = NULL;
+
+	if (query->hasSubLinks || query->cteList != NIL)
+	{
+		return true;
+	}
+
+	foreach(rangeTableCell, query->rtable)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		if (rangeTableEntry->rtekind == RTE_SUBQUERY)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * RouterShardGroup returns the shards which the given query reads, across all
+ * of its subqueries and common table expressions, as a list of RelationShards.
+ * A query may only be routed to a single node if each table it reads resolves
+ * to a single shard, and if these shards are co-located; reference tables may
+ * be read alongside any shard. If this is not the case, the function returns
+ * NIL.
+ */
+static List *
+RouterShardGroup(Query *query)
+{
+	List *shardIntervalList = NIL;
+	List *shardGroup = NIL;
+	List *referenceShardGroup = NIL;
+	ShardInterval *firstShardInterval = NULL;
+	ListCell *shardIntervalCell = NULL;
+
+	if (RouterShardIntervalWalker((Node *) query, &shardIntervalList))
+	{
+		return NIL;
+	}
+
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		Oid relationId = shardInterval->relationId;
+		RelationShard *relationShard = palloc0(sizeof(RelationShard));
+
+		relationShard->relationId = relationId;
+		relationShard->shardId = shardInterval->id;
+
+		if (PartitionType(relationId) == REFERENCE_PARTITION_TYPE)
+		{
+			referenceShardGroup = lappend(referenceShardGroup, relationShard);
+			continue;
+		}
+
+		if (firstShardInterval == NULL)
+		{
+			firstShardInterval = shardInterval;
+		}
+		else if (ColocationId(relationId) !=
+				 ColocationId(firstShardInterval->relationId) ||
+				 ColocatedShardInterval(firstShardInterval,
+										list_make1(shardInterval)) == NULL)
+		{
+			return NIL;
+		}
+
+		shardGroup = lappend(shardGroup, relationShard);
+	}
+
+	return list_concat(shardGroup, referenceShardGroup);
+}
+
+
+/*
+ * RouterShardIntervalWalker walks over the given query tree, and adds the shard
+ * each table in it resolves to into the given list, once per table. The walk is
+ * ended early, and the function returns true, as soon as a table is found which
+ * does not resolve to a single shard.
+ */
+static bool
+RouterShardIntervalWalker(Node *node, List **shardIntervalList)
+{
+	bool walkIsComplete = false;
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	if (IsA(node, Query))
+	{
+		Query *query = (Query *) node;
+
+		if (!QueryShardIntervals(query, shardIntervalList))
+		{
+			return true;
+		}
+
+		walkIsComplete = query_tree_walker(query, RouterShardIntervalWalker,
+										   shardIntervalList, 0);
+	}
+	else
+	{
+		walkIsComplete = expression_tree_walker(node, RouterShardIntervalWalker,
+												shardIntervalList);
+	}
+
+	return walkIsComplete;
+}
+
+
+/*
+ * QueryShardIntervals prunes the shards of each table in the given query's own
+ * range table, and adds the single shard remaining for a table into the given
+ * list. Only the query's WHERE clause and inner join conditions are used to
+ * prune shards. The function returns false if the query is a modification, if
+ * it reads a local table, or if any table resolves to no shard or to several
+ * shards, including tables which are also read elsewhere with another shard.
+ */
+static bool
+QueryShardIntervals(Query *query, List **shardIntervalList)
+{
+	List *qualList = JoinTreeQualList((Node *) query->jointree, false);
+	List *restrictClauseList = NIL;
+	ListCell *qualCell = NULL;
+	ListCell *rangeTableCell = NULL;
+	Index rangeTableIndex = 0;
+
+	if (query->commandType != CMD_SELECT)
+	{
+		return false;
+	}
+
+	/* clauses with subqueries cannot restrict the shards read */
+	foreach(qualCell, qualList)
+	{
+		Node *qual = (Node *) lfirst(qualCell);
+		if (!contain_subplans(qual))
+		{
+			restrictClauseList = lappend(restrictClauseList, qual);
+		}
+	}
+
+	foreach(rangeTableCell, query->rtable)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		Oid relationId = rangeTableEntry->relid;
+		List *relationRestrictList = NIL;
+		List *prunedShardList = NIL;
+		ShardInterval *shardInterval = NULL;
+		ListCell *shardIntervalCell = NULL;
+		bool shardListed = false;
+
+		rangeTableIndex++;
+		if (rangeTableEntry->rtekind != RTE_RELATION)
+		{
+			continue;
+		}
+
+		if (!IsDistributedTable(relationId))
+		{
+			return false;
+		}
+
+		relationRestrictList = RelationRestrictList(restrictClauseList, rangeTableIndex);
+		prunedShardList = PruneShardList(relationId, relationRestrictList,
+										 LoadDistributedTableShardList(relationId));
+		if (list_length(prunedShardList) != 1)
+		{
+			return false;
+		}
+
+		shardInterval = (ShardInterval *) linitial(prunedShardList);
+
+		/* shard names are assigned per table, so a table may only read one shard */
+		foreach(shardIntervalCell, *shardIntervalList)
+		{
+			ShardInterval *listedShardInterval =
+				(ShardInterval *) lfirst(shardIntervalCell);
+
+			if (listedShardInterval->relationId != relationId)
+			{
+				continue;
+			}
+
+			if (listedShardInterval->id != shardInterval->id)
+			{
+				return false;
+			}
+
+			shardListed = true;
+		}
+
+		if (!shardListed)
+		{
+			(*shardIntervalList) = lappend(*shardIntervalList, shardInterval);
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * JoinQuery returns whether the given query reads from more than one table. As
+ * such queries passed ErrorIfJoinNotSupported, they join co-located tables.
+ */
+static bool
+JoinQuery(Query *query)
+{
+	ListCell *rangeTableCell = NULL;
+	uint32 queryTableCount = 0;
+
+	foreach(rangeTableCell, query->rtable)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		if (rangeTableEntry->rtekind == RTE_RELATION)
+		{
+			queryTableCount++;
+		}
+	}
+
+	return (queryTableCount > 1);
+}
+
+
+/*
+ * PlanColocatedJoinQuery plans a SELECT which joins co-located tables. Every
+ * group of co-located shards the query reads is joined on a node holding all
+ * of the group's shards. If a single group is read, the query is pushed down
+ * as it is. Otherwise, only the join itself is pushed down: the joined rows of
+ * all groups are fetched into a temporary table, over which the rest of the
+ * query, such as its aggregates and sorting, is planned at executor start.
+ */
+static DistributedPlan *
+PlanColocatedJoinQuery(Query *query, int cursorOptions)
+{
+	DistributedPlan *distributedPlan = NULL;
+	List *shardGroupList = ColocatedJoinShardGroupList(query);
+
+	if (list_length(shardGroupList) <= 1)
+	{
+		distributedPlan = BuildJoinDistributedPlan(query, shardGroupList);
+	}
+	else
+	{
+		List *columnList = JoinRequiredColumnList(query);
+		Query *filterQuery = JoinColumnFilterQuery(query, columnList);
+		CreateStmt *createStmt = CreateIntermediateTableStmt(columnList);
+		Query *localQuery = JoinLocalQuery(query, columnList, createStmt);
+
+		distributedPlan = BuildJoinDistributedPlan(filterQuery, shardGroupList);
+
+		/* joined rows are stored in the intermediate table's columns, in order */
+		if (columnList != NIL)
+		{
+			List *intermediateColumnList =
+				(List *) IntermediateColumnMutator((Node *) columnList, columnList);
+
+			distributedPlan->targetList = TargetEntryList(intermediateColumnList);
+		}
+
+		distributedPlan->selectFromMultipleShards = true;
+		distributedPlan->createTemporaryTableStmt = createStmt;
+		distributedPlan->localQuery = localQuery;
+		distributedPlan->cursorOptions = cursorOptions;
+	}
+
+	return distributedPlan;
+}
+
+
+/*
+ * ColocatedJoinShardGroupList returns the groups of co-located shards which the
+ * given join reads, each as a list naming one RelationShard per joined table.
+ * As tables are joined on their partition columns, a group is only needed if
+ * none of its shards are pruned away by their table's restrictions. Tables on
+ * the nullable side of outer joins do not take part in pruning, though: the
+ * joined rows remain even if these tables have no matching rows. Last, the only
+ * shard of each reference table joins every group, following the shards of the
+ * distributed tables.
+ */
+static List *
+ColocatedJoinShardGroupList(Query *query)
+{
+	List *shardGroupList = NIL;
+	List *restrictClauseList = JoinTreeQualList((Node *) query->jointree, false);
+	Relids nullableRelationIds = NullableRelids((Node *) query->jointree);
+	List *relationIdList = NIL;
+	List *relationShardIntervalLists = NIL;
+	List *referenceRelationShardList = NIL;
+	List *candidateShardList = NIL;
+	ListCell *rangeTableCell = NULL;
+	ListCell *candidateShardCell = NULL;
+	Index rangeTableIndex = 0;
+
+	foreach(rangeTableCell, query->rtable)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		Oid relationId = rangeTableEntry->relid;
+		List *shardIntervalList = NIL;
+		List *relationRestrictList = NIL;
+		List *prunedShardList = NIL;
+		List *remainingShardList = NIL;
+
+		rangeTableIndex++;
+		if (rangeTableEntry->rtekind != RTE_RELATION)
+		{
+			continue;
+		}
+
+		shardIntervalList = LoadDistributedTableShardList(relationId);
+		if (PartitionType(relationId) == REFERENCE_PARTITION_TYPE)
+		{
+			ShardInterval *referenceShard = (ShardInterval *) linitial(shardIntervalList);
+
+			if (!ReferenceRelationShardListMember(referenceRelationShardList,
+												  relationId))
+			{
+				RelationShard *relationShard = palloc0(sizeof(RelationShard));
+				relationShard->relationId = relationId;
+				relationShard->shardId = referenceShard->id;
+
+				referenceRelationShardList = lappend(referenceRelationShardList,
+													 relationShard);
+			}
+
+			continue;
+		}
+
+		if (relationIdList == NIL)
+		{
+			candidateShardList = shardIntervalList;
+		}
+
+		if (!list_member_oid(relationIdList, relationId))
+		{
+			relationIdList = lappend_oid(relationIdList, relationId);
+			relationShardIntervalLists = lappend(relationShardIntervalLists,
+												 shardIntervalList);
+		}
+
+		if (bms_is_member(rangeTableIndex, nullableRelationIds))
+		{
+			continue;
+		}
+
+		relationRestrictList = RelationRestrictList(restrictClauseList, rangeTableIndex);
+		prunedShardList = PruneShardList(relationId, relationRestrictList,
+										 shardIntervalList);
+
+		foreach(candidateShardCell, candidateShardList)
+		{
+			ShardInterval *candidateShard = (ShardInterval *) lfirst(candidateShardCell);
+
+			if (ColocatedShardInterval(candidateShard, prunedShardList) != NULL)
+			{
+				remainingShardList = lappend(remainingShardList, candidateShard);
+			}
+		}
+
+		candidateShardList = remainingShardList;
+	}
+
+	foreach(candidateShardCell, candidateShardList)
+	{
+		ShardInterval *candidateShard = (ShardInterval *) lfirst(candidateShardCell);
+		List *shardGroup = NIL;
+		ListCell *relationIdCell = NULL;
+		ListCell *shardIntervalListCell = NULL;
+
+		forboth(relationIdCell, relationIdList,
+				shardIntervalListCell, relationShardIntervalLists)
+		{
+			Oid relationId = lfirst_oid(relationIdCell);
+			List *shardIntervalList = (List *) lfirst(shardIntervalListCell);
+			ShardInterval *shardInterval = NULL;
+			RelationShard *relationShard = NULL;
+
+			shardInterval = ColocatedShardInterval(candidateShard, shardIntervalList);
+			if (shardInterval == NULL)
+			{
+				char *relationName = get_rel_name(relationId);
+
+				ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+								errmsg("could not find shard of \"%s\" co-located "
+									   "with shard " INT64_FORMAT, relationName,
+									   candidateShard->id)));
+			}
+
+			relationShard = palloc0(sizeof(RelationShard));
+			relationShard->relationId = relationId;
+			relationShard->shardId = shardInterval->id;
+
+			shardGroup = lappend(shardGroup, relationShard);
+		}
+
+		shardGroup = list_concat(shardGroup, list_copy(referenceRelationShardList));
+		shardGroupList = lappend(shardGroupList, shardGroup);
+	}
+
+	/* a join of reference tables alone reads a single group */
+	if (relationIdList == NIL)
+	{
+		shardGroupList = list_make1(referenceRelationShardList);
+	}
+
+	return shardGroupList;
+}
+
+
+/*
+ * ReferenceRelationShardListMember returns whether the given list of relation
+ * shards already holds the shard of the given reference table.
+ */
+static bool
+ReferenceRelationShardListMember(List *relationShardList, Oid relationId)
+{
+	ListCell *relationShardCell = NULL;
+
+	foreach(relationShardCell, relationShardList)
+	{
+		RelationShard *relationShard = (RelationShard *) lfirst(relationShardCell);
+
+		if (relationShard->relationId == relationId)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * NullableRelids returns the range table indexes of all tables which are on the
+ * nullable side of an outer join within the given join tree.
+ */
+static Relids
+NullableRelids(Node *joinTreeNode)
+{
+	Relids nullableRelationIds = NULL;
+
+	if (joinTreeNode == NULL)
+	{
+		return NULL;
+	}
+
+	if (IsA(joinTreeNode, FromExpr))
+	{
+		FromExpr *fromExpr = (FromExpr *) joinTreeNode;
+		ListCell *fromCell = NULL;
+
+		foreach(fromCell, fromExpr->fromlist)
+		{
+			Node *fromNode = (Node *) lfirst(fromCell);
+
+			nullableRelationIds = bms_add_members(nullableRelationIds,
+												  NullableRelids(fromNode));
+		}
+	}
+	else if (IsA(joinTreeNode, JoinExpr))
+	{
+		JoinExpr *joinExpr = (JoinExpr *) joinTreeNode;
+		Relids leftRelationIds = get_relids_in_jointree(joinExpr->larg, false);
+		Relids rightRelationIds = get_relids_in_jointree(joinExpr->rarg, false);
+
+		nullableRelationIds = bms_union(NullableRelids(joinExpr->larg),
+										NullableRelids(joinExpr->rarg));
+
+		switch (joinExpr->jointype)
+		{
+			case JOIN_LEFT:
+			case JOIN_ANTI:
+			{
+				nullableRelationIds = bms_add_members(nullableRelationIds,
+													  rightRelationIds);
+				break;
+			}
+
+			case JOIN_RIGHT:
+			{
+				nullableRelationIds = bms_add_members(nullableRelationIds,
+													  leftRelationIds);
+				break;
+			}
+
+			case JOIN_FULL:
+			{
+				nullableRelationIds = bms_add_members(nullableRelationIds,
+													  leftRelationIds);
+				nullableRelationIds = bms_add_members(nullableRelationIds,
+													  rightRelationIds);
+				break;
+			}
+
+			default:
+			{
+				break;
+			}
+		}
+	}
+
+	return nullableRelationIds;
+}
+
+
+/*
+ * RelationRestrictList returns copies of those of the given restrictions which
+ * only refer to the table at the given range table index. Shard pruning expects
+ * columns of the first range table entry, so the copies refer to that instead.
+ */
+static List *
+RelationRestrictList(List *restrictClauseList, Index rangeTableIndex)
+{
+	List *relationRestrictList = NIL;
+	ListCell *restrictClauseCell = NULL;
+
+	foreach(restrictClauseCell, restrictClauseList)
+	{
+		Node *restrictClause = (Node *) lfirst(restrictClauseCell);
+		Relids clauseRelationIds = pull_varnos(restrictClause);
+		Node *relationRestrictClause = NULL;
+
+		if (bms_membership(clauseRelationIds) != BMS_SINGLETON ||
+			!bms_is_member(rangeTableIndex, clauseRelationIds))
+		{
+			continue;
+		}
+
+		relationRestrictClause = copyObject(restrictClause);
+		ChangeVarNodes(relationRestrictClause, rangeTableIndex, 1, 0);
+
+		relationRestrictList = lappend(relationRestrictList, relationRestrictClause);
+	}
+
+	return relationRestrictList;
+}
+
+
+/*
+ * JoinRequiredColumnList returns the distinct columns the given join query's
+ * target list and HAVING clause refer to. Of a join's rows, only these need to
+ * be fetched to evaluate the rest of the query on the master.
+ */
+static List *
+JoinRequiredColumnList(Query *query)
+{
+	List *requiredColumnList = NIL;
+	List *uniqueColumnList = NIL;
+	ListCell *columnCell = NULL;
+	PVCAggregateBehavior aggregateBehavior = PVC_RECURSE_AGGREGATES;
+	PVCPlaceHolderBehavior placeHolderBehavior = PVC_REJECT_PLACEHOLDERS;
+
+	List *projectColumnList = pull_var_clause((Node *) query->targetList,
+											  aggregateBehavior, placeHolderBehavior);
+	List *havingClauseColumnList = pull_var_clause(query->havingQual, aggregateBehavior,
+												   placeHolderBehavior);
+
+	requiredColumnList = list_concat(requiredColumnList, projectColumnList);
+	requiredColumnList = list_concat(requiredColumnList, havingClauseColumnList);
+
+	foreach(columnCell, requiredColumnList)
+	{
+		Var *column = (Var *) lfirst(columnCell);
+
+		uniqueColumnList = list_append_unique(uniqueColumnList, column);
+	}
+
+	return uniqueColumnList;
+}
+
+
+/*
+ * JoinColumnFilterQuery returns a copy of the given join query which selects
+ * the given columns of the joined rows, and leaves out everything that must be
+ * evaluated over the rows of all shards, such as grouping, sorting or limits.
+ */
+static Query *
+JoinColumnFilterQuery(Query *query, List *columnList)
+{
+	Query *filterQuery = copyObject(query);
+	List *targetColumnList = copyObject(columnList);
+
+	/* as for multi-shard scans, select a NULL constant if no columns are needed */
+	if (targetColumnList == NIL)
+	{
+		Const *nullConst = makeConst(UNKNOWNOID, -1, InvalidOid, -2,
+									 (Datum) 0, true, false);
+
+		targetColumnList = list_make1(nullConst);
+	}
+
+	filterQuery->targetList = TargetEntryList(targetColumnList);
+	filterQuery->groupClause = NIL;
+	filterQuery->havingQual = NULL;
+	filterQuery->hasAggs = false;
+	filterQuery->windowClause = NIL;
+	filterQuery->hasWindowFuncs = false;
+	filterQuery->distinctClause = NIL;
+	filterQuery->hasDistinctOn = false;
+	filterQuery->sortClause = NIL;
+	filterQuery->limitOffset = NULL;
+	filterQuery->limitCount = NULL;
+
+	return filterQuery;
+}
+
+
+/*
+ * JoinLocalQuery returns a copy of the given join query which reads the joined
+ * rows from the intermediate table the given statement creates instead. The
+ * query's references to the given columns are replaced with references to the
+ * intermediate table's columns. The table's id is only known once the executor
+ * has created it, and is filled in then.
+ */
+static Query *
+JoinLocalQuery(Query *query, List *columnList, CreateStmt *createIntermediateTableStmt)
+{
+	Query *localQuery = copyObject(query);
+	RangeVar *intermediateTable = createIntermediateTableStmt->relation;
+	RangeTblEntry *intermediateRangeTable = makeNode(RangeTblEntry);
+	RangeTblRef *intermediateTableReference = makeNode(RangeTblRef);
+	List *columnNameList = NIL;
+	ListCell *columnDefinitionCell = NULL;
+	List *targetList = NIL;
+	Node *havingQual = NULL;
+
+	foreach(columnDefinitionCell, createIntermediateTableStmt->tableElts)
+	{
+		ColumnDef *columnDefinition = (ColumnDef *) lfirst(columnDefinitionCell);
+
+		columnNameList = lappend(columnNameList, makeString(columnDefinition->colname));
+	}
+
+	intermediateRangeTable->rtekind = RTE_RELATION;
+	intermediateRangeTable->relid = InvalidOid;
+	intermediateRangeTable->relkind = RELKIND_RELATION;
+	intermediateRangeTable->eref = makeAlias(intermediateTable->relname, columnNameList);
+	intermediateRangeTable->inFromCl = true;
+
+	intermediateTableReference->rtindex = 1;
+
+	targetList = (List *) IntermediateColumnMutator((Node *) localQuery->targetList,
+													columnList);
+
+	/* the planner has left the HAVING clause as an implicitly and'd list */
+	havingQual = IntermediateColumnMutator(localQuery->havingQual, columnList);
+	if (havingQual != NULL && IsA(havingQual, List))
+	{
+		havingQual = (Node *) make_ands_explicit((List *) havingQual);
+	}
+
+	localQuery->targetList = targetList;
+	localQuery->havingQual = havingQual;
+	localQuery->rtable = list_make1(intermediateRangeTable);
+	localQuery->jointree = makeFromExpr(list_make1(intermediateTableReference), NULL);
+
+	return localQuery;
+}
+
+
+/*
+ * IntermediateColumnMutator replaces each of the given columns found in the
+ * given expression with the intermediate table's column at the same position.
+ */
+static Node *
+IntermediateColumnMutator(Node *node, List *columnList)
+{
+	if (node == NULL)
+	{
+		return NULL;
+	}
+
+	if (IsA(node, Var))
+	{
+		Var *column = (Var *) node;
+		ListCell *columnCell = NULL;
+		AttrNumber columnIndex = 0;
+
+		foreach(columnCell, columnList)
+		{
+			columnIndex++;
+
+			if (equal(column, lfirst(columnCell)))
+			{
+				return (Node *) makeVar(1, columnIndex, column->vartype,
+										column->vartypmod, column->varcollid, 0);
+			}
+		}
+	}
+
+	return expression_tree_mutator(node, IntermediateColumnMutator, (void *) columnList);
+}
+
+
+/*
+ * CreateIntermediateTableStmt returns a CreateStmt node which creates a new
+ * temporary table with one column for each of the given columns, of the same
+ * type. Rows of multi-shard joins are stored in such tables.
+ */
+static CreateStmt *
+CreateIntermediateTableStmt(List *columnList)
+{
+	CreateStmt *createStmt = makeNode(CreateStmt);
+	List *columnDefinitionList = NIL;
+	ListCell *columnCell = NULL;
+	uint32 columnIndex = 0;
+
+	foreach(columnCell, columnList)
+	{
+		Var *column = (Var *) lfirst(columnCell);
+		ColumnDef *columnDefinition = makeNode(ColumnDef);
+		StringInfo columnName = makeStringInfo();
+
+		columnIndex++;
+		appendStringInfo(columnName, "%s%u", INTERMEDIATE_COLUMN_PREFIX, columnIndex);
+
+		columnDefinition->colname = columnName->data;
+		columnDefinition->typeName = makeTypeNameFromOid(column->vartype,
+														 column->vartypmod);
+		columnDefinition->collOid = column->varcollid;
+		columnDefinition->is_local = true;
+
+		columnDefinitionList = lappend(columnDefinitionList, columnDefinition);
+	}
+
+	createStmt->relation = TemporaryTableRangeVar();
+	createStmt->tableElts = columnDefinitionList;
+	createStmt->oncommit = ONCOMMIT_DROP;
+
+	return createStmt;
+}
+
+
+/*
+ * BuildJoinDistributedPlan creates the DistributedPlan instance for the given
+ * join query, with one task for each of the given groups of co-located shards.
+ * A group's task runs on the nodes which hold all of the group's shards.
+ */
+static DistributedPlan *
+BuildJoinDistributedPlan(Query *query, List *shardGroupList)
+{
+	ListCell *shardGroupCell = NULL;
+	List *taskList = NIL;
+	DistributedPlan *distributedPlan = palloc0(sizeof(DistributedPlan));
+	distributedPlan->plan.type = (NodeTag) T_DistributedPlan;
+	distributedPlan->targetList = query->targetList;
+
+	PrepareJoinTreeForDeparse((Node *) query->jointree);
+
+	foreach(shardGroupCell, shardGroupList)
+	{
+		List *shardGroup = (List *) lfirst(shardGroupCell);
+		RelationShard *firstRelationShard = (RelationShard *) linitial(shardGroup);
+		StringInfo queryString = makeStringInfo();
+		Task *task = NULL;
+
+		deparse_relation_shard_query(query, shardGroup, queryString);
+
+		if (LogDistributedStatements)
+		{
+			ereport(LOG, (errmsg("distributed statement: %s", queryString->data)));
+		}
+
+		task = (Task *) palloc0(sizeof(Task));
+		task->queryString = queryString;
+		task->taskPlacementList = JoinTaskPlacementList(shardGroup);
+		task->shardId = firstRelationShard->shardId;
+		task->relationId = firstRelationShard->relationId;
+
+		taskList = lappend(taskList, task);
+	}
+
+	distributedPlan->taskList = taskList;
+
+	return distributedPlan;
+}
+
+
+/*
+ * PrepareJoinTreeForDeparse readies a join tree the planner has been over for
+ * deparsing. It converts the tree's quals back to explicitly and'd clauses, and
+ * turns anti joins which the planner derived from left joins back into these.
+ * The quals the anti joins were derived from remain in place, so the left joins
+ * return the same rows.
+ */
+static void
+PrepareJoinTreeForDeparse(Node *joinTreeNode)
+{
+	if (joinTreeNode == NULL)
+	{
+		return;
+	}
+
+	if (IsA(joinTreeNode, FromExpr))
+	{
+		FromExpr *fromExpr = (FromExpr *) joinTreeNode;
+		ListCell *fromCell = NULL;
+
+		if (fromExpr->quals != NULL && IsA(fromExpr->quals, List))
+		{
+			fromExpr->quals = (Node *) make_ands_explicit((List *) fromExpr->quals);
+		}
+
+		foreach(fromCell, fromExpr->fromlist)
+		{
+			PrepareJoinTreeForDeparse((Node *) lfirst(fromCell));
+		}
+	}
+	else if (IsA(joinTreeNode, JoinExpr))
+	{
+		JoinExpr *joinExpr = (JoinExpr *) joinTreeNode;
+
+		if (joinExpr->quals != NULL && IsA(joinExpr->quals, List))
+		{
+			joinExpr->quals = (Node *) make_ands_explicit((List *) joinExpr->quals);
+		}
+
+		if (joinExpr->jointype == JOIN_ANTI)
+		{
+			joinExpr->jointype = JOIN_LEFT;
+		}
+
+		PrepareJoinTreeForDeparse(joinExpr->larg);
+		PrepareJoinTreeForDeparse(joinExpr->rarg);
+	}
+}
+
+
+/*
+ * JoinTaskPlacementList returns those healthy placements of the first shard in
+ * the given group whose nodes also hold healthy placements of all other shards
+ * in the group, and errors out if there are none.
+ */
+static List *
+JoinTaskPlacementList(List *shardGroup)
+{
+	RelationShard *firstRelationShard = (RelationShard *) linitial(shardGroup);
+	List *firstPlacementList =
+		LoadFinalizedShardPlacementList(firstRelationShard->shardId);
+	List *taskPlacementList = NIL;
+	ListCell *placementCell = NULL;
+
+	foreach(placementCell, firstPlacementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		List *placementList = list_make1(placement);
+		bool placementColocated = true;
+		ListCell *relationShardCell = NULL;
+
+		foreach(relationShardCell, shardGroup)
+		{
+			RelationShard *relationShard = (RelationShard *) lfirst(relationShardCell);
+			List *colocatedPlacementList =
+				LoadFinalizedShardPlacementList(relationShard->shardId);
+
+			if (!PlacementsColocated(placementList, colocatedPlacementList))
+			{
+				placementColocated = false;
+				break;
+			}
+		}
+
+		if (placementColocated)
+		{
+			taskPlacementList = lappend(taskPlacementList, placement);
+		}
+	}
+
+	if (taskPlacementList == NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("could not find a node holding all shards joined with "
+							   "shard " INT64_FORMAT, firstRelationShard->shardId),
+						errdetail("Co-located shards must have healthy placements on"
+								  " the same node to be joined.")));
+	}
+
+	return taskPlacementList;
+}
+
+
+/*
+ * PrewarmWorkerConnections concurrently opens connections to every node listed
+ * in the worker list file if the prewarm_connections setting is enabled. This
+ * happens at most once per backend, before the first distributed query is
+ * planned, so that even the first query of a session finds its connections
+ * already established.
+ */
+static void
+PrewarmWorkerConnections(void)
+{
+	List *workerNodeList = NIL;
+	List *nodeConnectionKeyList = NIL;
+	ListCell *workerNodeCell = NULL;
+
+	if (!PrewarmConnections || WorkerConnectionsPrewarmed)
+	{
+		return;
+	}
+
+	/* only try once, even if some nodes are unreachable */
+	WorkerConnectionsPrewarmed = true;
+
+	workerNodeList = ParseWorkerNodeFile(WORKER_LIST_FILENAME);
+	foreach(workerNodeCell, workerNodeList)
+	{
+		WorkerNode *workerNode = (WorkerNode *) lfirst(workerNodeCell);
+		NodeConnectionKey *nodeConnectionKey = palloc0(sizeof(NodeConnectionKey));
+
+		strncpy(nodeConnectionKey->nodeName, workerNode->nodeName, MAX_NODE_LENGTH);
+		nodeConnectionKey->nodePort = workerNode->nodePort;
+
+		nodeConnectionKeyList = lappend(nodeConnectionKeyList, nodeConnectionKey);
+	}
+
+	EstablishConnections(nodeConnectionKeyList);
+}
+
+
+/*
+ * PgShardExecutorStart sets up the executor state and queryDesc for pgShard
+ * executed statements. The function first builds the statement's distributed
+ * plan, which takes the place of the planned statement in the queryDesc. It
+ * also handles multi-shard selects differently by fetching the remote data and
+ * modifying the existing plan to scan that data.
+ */
+static void
+PgShardExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	PlannedStmt *plannedStatement = queryDesc->plannedstmt;
+	List *placeholderList = DistributedPlaceholderList(plannedStatement->planTree);
+
+	if (placeholderList != NIL)
+	{
+		DistributedPlan *distributedPlan = NULL;
+		bool selectFromMultipleShards = false;
+		bool zeroShardQuery = false;
+
+		/* EXPLAIN is refused up front, but may still reach plans cached earlier */
+		if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("EXPLAIN commands on distributed tables "
+								   "are unsupported")));
+		}
+
+		plannedStatement = PlanDistributedExecution(plannedStatement, queryDesc->params);
+		distributedPlan = (DistributedPlan *) plannedStatement->planTree;
+
+		queryDesc->plannedstmt = plannedStatement;
+
+		selectFromMultipleShards = distributedPlan->selectFromMultipleShards;
+		zeroShardQuery = (list_length(distributedPlan->taskList) == 0);
+
+		if (zeroShardQuery)
+		{
+			/* if zero shards are involved, let query hit local table */
+			Plan *originalPlan = distributedPlan->originalPlan;
+			plannedStatement->planTree = originalPlan;
+
+			NextExecutorStartHook(queryDesc, eflags);
+		}
+		else if (!selectFromMultipleShards)
+		{
+			bool topLevel = true;
+			LOCKMODE lockMode = NoLock;
+			EState *executorState = NULL;
+
+			/*
+			 * Disallow transactions and triggers during distributed commands.
+			 * Cursors are allowed in transaction blocks, as they require them.
+			 */
+			if (plannedStatement->commandType != CMD_SELECT ||
+				distributedPlan->cursorOptions == 0)
+			{
+				PreventTransactionChain(topLevel, "distributed commands");
+			}
+			eflags |= EXEC_FLAG_SKIP_TRIGGERS;
+
+			/* build empty executor state to obtain per-query memory context */
+			executorState = CreateExecutorState();
+			executorState->es_top_eflags = eflags;
+			executorState->es_instrument = queryDesc->instrument_options;
+
+			queryDesc->estate = executorState;
+
+			InitDistributedPlanState(queryDesc, distributedPlan, eflags);
+
+			lockMode = CommutativityRuleToLockMode(plannedStatement->commandType);
+			if (lockMode != NoLock)
+			{
+				AcquireExecutorShardLocks(distributedPlan->taskList, lockMode);
+			}
+
+			/*
+			 * Shards may have been moved or split while their locks were awaited,
+			 * so load the placements to modify anew. A split shard has none left,
+			 * so its modifications error out rather than go to a placement not
+			 * read. Tasks which only stand in for shard locks are left alone.
+			 */
+			if (plannedStatement->commandType != CMD_SELECT)
+			{
+				ListCell *taskCell = NULL;
+
+				foreach(taskCell, distributedPlan->taskList)
+				{
+					Task *task = (Task *) lfirst(taskCell);
+
+					if (task->queryString == NULL)
+					{
+						continue;
+					}
+
+					task->taskPlacementList = ReloadTaskPlacementList(task);
+				}
+			}
+		}
+		else
+		{
+			/*
+			 * If its a SELECT query over multiple shards, we fetch the relevant
+			 * data from the remote nodes and insert it into a temp table. We then
+			 * point the existing plan to scan this temp table instead of the
+			 * original one. Joins instead plan their local query over it.
+			 */
+			Plan *originalPlan = NULL;
+			RangeTblEntry *sequentialScanRangeTable = NULL;
+			Oid intermediateResultTableId = InvalidOid;
+			bool missingOK = false;
+
+			/* execute the previously created statement to create a temp table */
+			CreateStmt *createStmt = distributedPlan->createTemporaryTableStmt;
+			const char *queryDescription = "create temp table like";
+			RangeVar *intermediateResultTable = createStmt->relation;
+
+			ProcessUtility((Node *) createStmt, queryDescription,
+						   PROCESS_UTILITY_TOPLEVEL, NULL, None_Receiver, NULL);
+
+			/* execute select queries and fetch results into the temp table */
+			ExecuteMultipleShardSelect(distributedPlan, intermediateResultTable);
+
+			/* update the query descriptor snapshot so results are visible */
+			UnregisterSnapshot(queryDesc->snapshot);
+			UpdateActiveSnapshotCommandId();
+			queryDesc->snapshot = RegisterSnapshot(GetActiveSnapshot());
+
+			intermediateResultTableId = RangeVarGetRelid(intermediateResultTable,
+														 NoLock, missingOK);
+
+			if (distributedPlan->localQuery != NULL)
+			{
+				/* plan the rest of a multi-shard join over the joined rows */
+				Query *localQuery = copyObject(distributedPlan->localQuery);
+				RangeTblEntry *intermediateRangeTable = linitial(localQuery->rtable);
+
+				intermediateRangeTable->relid = intermediateResultTableId;
+
+				queryDesc->plannedstmt = standard_planner(localQuery,
+														  distributedPlan->cursorOptions,
+														  queryDesc->params);
+			}
+			else
+			{
+				/* update sequential scan's table entry to point to intermediate table */
+				Assert(list_length(plannedStatement->rtable) == 1);
+				sequentialScanRangeTable = linitial(plannedStatement->rtable);
+				Assert(sequentialScanRangeTable->rtekind == RTE_RELATION);
+				sequentialScanRangeTable->relid = intermediateResultTableId;
+
+				/* swap in modified (local) plan for compatibility with standard hook */
+				originalPlan = distributedPlan->originalPlan;
+				plannedStatement->planTree = originalPlan;
+			}
+
+			NextExecutorStartHook(queryDesc, eflags);
+		}
+	}
+	else
+	{
+		NextExecutorStartHook(queryDesc, eflags);
+	}
+}
+
+
+/*
+ * InitDistributedPlanState sets up the plan state and result descriptor of a
+ * single-shard distributed plan. Rows are produced by the remote node, so the
+ * plan state is that of an empty Result plan which is never run; this lets code
+ * walking the plan state tree, such as EXPLAIN, treat the plan like any other.
+ * The Result plan has no target list, as the target list of a remote query may
+ * hold aggregates, which only Agg plans may evaluate. Single-shard SELECTs also
+ * get the state their rows are streamed with.
+ */
+static void
+InitDistributedPlanState(QueryDesc *queryDesc, DistributedPlan *distributedPlan,
+						 int eflags)
+{
+	EState *executorState = queryDesc->estate;
+	Result *resultPlan = makeNode(Result);
+	List *targetList = distributedPlan->plan.targetlist;
+	MemoryContext oldContext = MemoryContextSwitchTo(executorState->es_query_cxt);
+
+	if (queryDesc->operation == CMD_SELECT)
+	{
+		targetList = distributedPlan->targetList;
+		distributedPlan->selectState = palloc0(sizeof(RemoteSelectState));
+	}
+
+	queryDesc->planstate = ExecInitNode((Plan *) resultPlan, executorState, eflags);
+	queryDesc->tupDesc = ExecCleanTypeFromTL(targetList, false);
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * IsPgShardPlan determines whether the provided plannedStmt contains a plan
+ * suitable for execution by PgShard. Such plans are only built at executor
+ * start, where they replace the placeholder planned by PgShardPlanner. The
+ * function errors out if the placeholder is still in place, as the statement
+ * was then started by another executor hook, which bypassed pg_shard's.
+ */
+static bool
+IsPgShardPlan(PlannedStmt *plannedStmt)
+{
+	Plan *plan = plannedStmt->planTree;
+	NodeTag nodeTag = nodeTag(plan);
+	bool isPgShardPlan = ((DistributedNodeTag) nodeTag == T_DistributedPlan);
+
+	if (DistributedPlaceholderList(plan) != NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("distributed plan was not built at executor start"),
+						errhint("Load pg_shard after any other extensions which "
+								"set executor hooks.")));
+	}
+
+	return isPgShardPlan;
+}
+
+
+/*
+ * NextExecutorStartHook simply encapsulates the common logic of calling the
+ * next executor start hook in the chain or the standard executor start hook
+ * if no other hooks are present.
+ */
+static void
+NextExecutorStartHook(QueryDesc *queryDesc, int eflags)
+{
+	/* call into the standard executor start, or hook if set */
+	if (PreviousExecutorStartHook != NULL)
+	{
+		PreviousExecutorStartHook(queryDesc, eflags);
+	}
+	else
+	{
+		standard_ExecutorStart(queryDesc, eflags);
+	}
+}
+
+
+/*
+ * CommutativityRuleToLockMode determines the commutativity rule for the given
+ * command and returns the appropriate lock mode to enforce that rule. The
+ * function assumes a SELECT doesn't modify state and therefore is commutative
+ * with all other commands. The function also assumes that an INSERT commutes
+ * with another INSERT, but not with an UPDATE/DELETE; and an UPDATE/DELETE
+ * doesn't commute with an INSERT, UPDATE, or DELETE.
+ *
+ * The above mapping is overridden entirely when all_modifications_commutative
+ * is set to true. In that case, all commands just claim a shared lock. This
+ * allows the shard repair logic to lock out modifications while permitting all
+ * commands to otherwise commute.
+ */
+static LOCKMODE
+CommutativityRuleToLockMode(CmdType commandType)
+{
+	LOCKMODE lockMode = NoLock;
+
+	/* bypass commutativity checks when flag enabled */
+	if (AllModificationsCommutative)
+	{
+		return ShareLock;
+	}
+
+	if (commandType == CMD_SELECT)
+	{
+		lockMode = NoLock;
+	}
+	else if (commandType == CMD_INSERT)
+	{
+		lockMode = ShareLock;
+	}
+	else if (commandType == CMD_UPDATE || commandType == CMD_DELETE)
+	{
+		lockMode = ExclusiveLock;
+	}
+	else
+	{
+		ereport(ERROR, (errmsg("unrecognized operation code: %d", (int) commandType)));
+	}
+
+	return lockMode;
+}
+
+
+/*
+ * AcquireExecutorShardLocks: acquire shard locks needed for execution of tasks
+ * within a distributed plan. Shards which tasks read from, as INSERT ... SELECT
+ * tasks do, are locked against modifications as well, so that all placements
+ * of the shard written read the same rows. Tasks which only name a shard they
+ * read have no shard of their own to lock. All locks are taken in shard order.
+ */
+static void
+AcquireExecutorShardLocks(List *taskList, LOCKMODE lockMode)
+{
+	List *lockTaskList = list_copy(taskList);
+	List *shardIdSortedTaskList = NIL;
+	LOCKMODE sourceLockMode = CommutativityRuleToLockMode(CMD_UPDATE);
+	ListCell *taskCell = NULL;
+
+	foreach(taskCell, taskList)
+	{
+		Task *task = (Task *) lfirst(taskCell);
+		Task *sourceTask = NULL;
+
+		if (task->sourceShardId == INVALID_SHARD_ID)
+		{
+			continue;
+		}
+
+		/* a task standing in for the shard read, only used for sorting */
+		sourceTask = (Task *) palloc0(sizeof(Task));
+		sourceTask->shardId = task->sourceShardId;
+
+		lockTaskList = lappend(lockTaskList, sourceTask);
+	}
+
+	shardIdSortedTaskList = SortList(lockTaskList, CompareTasksByShardId);
+
+	foreach(taskCell, shardIdSortedTaskList)
+	{
+		Task *task = (Task *) lfirst(taskCell);
+		int64 shardId = task->shardId;
+
+		if (list_member_ptr(taskList, task))
+		{
+			if (shardId != INVALID_SHARD_ID)
+			{
+				LockShard(shardId, lockMode);
+			}
+		}
+		else
+		{
+			LockShard(shardId, sourceLockMode);
+		}
+	}
+}
+
+
+/* Helper function to compare two tasks using their shardIds. */
+static int
+CompareTasksByShardId(const void *leftElement, const void *rightElement)
+{
+	const Task *leftTask = *((const Task **) leftElement);
+	const Task *rightTask = *((const Task **) rightElement);
+	int64 leftShardId = leftTask->shardId;
+	int64 rightShardId = rightTask->shardId;
+
+	/* we compare 64-bit integers, instead of casting their difference to int */
+	if (leftShardId > rightShardId)
+	{
+		return 1;
+	}
+	else if (leftShardId < rightShardId)
+	{
+		return -1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+
+/*
+ * EstablishPlacementConnections opens connections to the nodes of all provided
+ * shard placements at once, rather than one after another as each placement is
+ * first used. If several placements share a node, up to max_connections_per_node
+ * connections to that node are opened so that they can be used in parallel.
+ * Such additional connections are only opened once the first connection to a
+ * node has succeeded. Connections which already exist are simply reused.
+ */
+static void
+EstablishPlacementConnections(List *placementList)
+{
+	List *firstSlotKeyList = NIL;
+	List *additionalSlotKeyList = NIL;
+	List *nodeConnectionKeyList = NIL;
+	ListCell *placementCell = NULL;
+
+	foreach(placementCell, placementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		NodeConnectionKey *nodeConnectionKey = NULL;
+		ListCell *nodeConnectionKeyCell = NULL;
+		int32 connectionSlot = 0;
+
+		/* use the next slot for each further placement on the same node */
+		foreach(nodeConnectionKeyCell, nodeConnectionKeyList)
+		{
+			NodeConnectionKey *existingKey = lfirst(nodeConnectionKeyCell);
+
+			if (existingKey->nodePort == placement->nodePort &&
+				strncmp(existingKey->nodeName, placement->nodeName,
+						MAX_NODE_LENGTH) == 0)
+			{
+				connectionSlot++;
+			}
+		}
+
+		if (connectionSlot >= MaxConnectionsPerNode)
+		{
+			continue;
+		}
+
+		nodeConnectionKey = palloc0(sizeof(NodeConnectionKey));
+		strncpy(nodeConnectionKey->nodeName, placement->nodeName, MAX_NODE_LENGTH);
+		nodeConnectionKey->nodePort = placement->nodePort;
+		nodeConnectionKey->connectionSlot = connectionSlot;
+
+		nodeConnectionKeyList = lappend(nodeConnectionKeyList, nodeConnectionKey);
+		if (connectionSlot == 0)
+		{
+			firstSlotKeyList = lappend(firstSlotKeyList, nodeConnectionKey);
+		}
+		else
+		{
+			additionalSlotKeyList = lappend(additionalSlotKeyList, nodeConnectionKey);
+		}
+	}
+
+	EstablishConnections(firstSlotKeyList);
+	EstablishConnections(additionalSlotKeyList);
+}
+
+
+/*
+ * ExecuteMultipleShardSelect executes the SELECT queries in the distributed
+ * plan and inserts the returned rows into the given tableId. The queries run
+ * concurrently: each node receives as many of them at a time as the session
+ * holds connections to it.
+ */
+static void
+ExecuteMultipleShardSelect(DistributedPlan *distributedPlan,
+						   RangeVar *intermediateTable)
+{
+	List *taskList = distributedPlan->taskList;
+	List *targetList = distributedPlan->targetList;
+
+	/* ExecType instead of ExecCleanType so we don't ignore junk columns */
+	TupleDesc tupleStoreDescriptor = ExecTypeFromTL(targetList, false);
+	List *firstPlacementList = NIL;
+	List *taskExecutionList = NIL;
+
+	ListCell *taskCell = NULL;
+	foreach(taskCell, taskList)
+	{
+		Task *task = (Task *) lfirst(taskCell);
+		TaskExecution *taskExecution = palloc0(sizeof(TaskExecution));
+
+		taskExecution->task = task;
+		taskExecution->status = TASK_STATUS_PENDING;
+		taskExecution->placementIndex = 0;
+		taskExecution->connectionSlot = -1;
+
+		taskExecutionList = lappend(taskExecutionList, taskExecution);
+
+		if (task->taskPlacementList != NIL)
+		{
+			firstPlacementList = lappend(firstPlacementList,
+										 linitial(task->taskPlacementList));
+		}
+	}
+
+	/* connect to the first placement of every task concurrently */
+	EstablishPlacementConnections(firstPlacementList);
+
+	if (GroupTasksByNode)
+	{
+		taskExecutionList = GroupTaskExecutionsByNode(taskExecutionList);
+	}
+
+	ExecuteTaskListConcurrently(taskExecutionList, targetList, tupleStoreDescriptor,
+								intermediateTable);
+}
+
+
+/*
+ * GroupTaskExecutionsByNode combines the given task executions into as few
+ * executions as possible, so that each connection to a node receives a single
+ * query. Tasks are grouped by the node of their first placement, and each node's
+ * tasks are spread over as many groups as the session may hold connections to
+ * the node. Groups holding a single task are left as they are, as are tasks
+ * without any placements.
+ */
+static List *
+GroupTaskExecutionsByNode(List *taskExecutionList)
+{
+	List *groupedExecutionList = NIL;
+	List *nodePlacementList = NIL;
+	List *nodeGroupListList = NIL;
+	ListCell *taskExecutionCell = NULL;
+	ListCell *nodeGroupListCell = NULL;
+
+	foreach(taskExecutionCell, taskExecutionList)
+	{
+		TaskExecution *taskExecution = lfirst(taskExecutionCell);
+		List *taskPlacementList = taskExecution->task->taskPlacementList;
+		ShardPlacement *firstPlacement = NULL;
+		ListCell *nodePlacementCell = NULL;
+		int32 nodeIndex = 0;
+		bool nodeFound = false;
+
+		if (taskPlacementList == NIL)
+		{
+			groupedExecutionList = lappend(groupedExecutionList, taskExecution);
+			continue;
+		}
+
+		firstPlacement = (ShardPlacement *) linitial(taskPlacementList);
+
+		foreach(nodePlacementCell, nodePlacementList)
+		{
+			ShardPlacement *nodePlacement = lfirst(nodePlacementCell);
+
+			if (nodePlacement->nodePort == firstPlacement->nodePort &&
+				strncmp(nodePlacement->nodeName, firstPlacement->nodeName,
+						MAX_NODE_LENGTH) == 0)
+			{
+				nodeFound = true;
+				break;
+			}
+
+			nodeIndex++;
+		}
+
+		if (nodeFound)
+		{
+			ListCell *nodeTaskCell = list_nth_cell(nodeGroupListList, nodeIndex);
+			List *nodeTaskList = (List *) lfirst(nodeTaskCell);
+
+			lfirst(nodeTaskCell) = lappend(nodeTaskList, taskExecution);
+		}
+		else
+		{
+			nodePlacementList = lappend(nodePlacementList, firstPlacement);
+			nodeGroupListList = lappend(nodeGroupListList, list_make1(taskExecution));
+		}
+	}
+
+	foreach(nodeGroupListCell, nodeGroupListList)
+	{
+		List *nodeTaskList = (List *) lfirst(nodeGroupListCell);
+		int32 nodeTaskCount = list_length(nodeTaskList);
+		int32 groupCount = Min(nodeTaskCount, MaxConnectionsPerNode);
+		int32 groupIndex = 0;
+
+		for (groupIndex = 0; groupIndex < groupCount; groupIndex++)
+		{
+			List *groupTaskList = NIL;
+			int32 taskIndex = 0;
+
+			/* deal the node's tasks out to its groups in turn */
+			for (taskIndex = groupIndex; taskIndex < nodeTaskCount;
+				 taskIndex += groupCount)
+			{
+				groupTaskList = lappend(groupTaskList, list_nth(nodeTaskList, taskIndex));
+			}
+
+			if (list_length(groupTaskList) == 1)
+			{
+				groupedExecutionList = list_concat(groupedExecutionList, groupTaskList);
+			}
+			else
+			{
+				TaskExecution *groupedExecution = GroupedTaskExecution(groupTaskList);
+				groupedExecutionList = lappend(groupedExecutionList, groupedExecution);
+			}
+		}
+	}
+
+	return groupedExecutionList;
+}
+
+
+/*
+ * GroupedTaskExecution creates an execution for a task which combines the
+ * queries of all given task executions using UNION ALL. Such a task only runs
+ * on the node of the tasks' first placement. As all rows end up in the same
+ * intermediate table, they need not be told apart by task.
+ */
+static TaskExecution *
+GroupedTaskExecution(List *taskExecutionList)
+{
+	TaskExecution *firstExecution = (TaskExecution *) linitial(taskExecutionList);
+	Task *firstTask = firstExecution->task;
+	Task *groupedTask = (Task *) palloc0(sizeof(Task));
+	TaskExecution *groupedExecution = (TaskExecution *) palloc0(sizeof(TaskExecution));
+	StringInfo queryString = makeStringInfo();
+	List *groupedTaskList = NIL;
+	ListCell *taskExecutionCell = NULL;
+
+	foreach(taskExecutionCell, taskExecutionList)
+	{
+		TaskExecution *taskExecution = lfirst(taskExecutionCell);
+		Task *task = taskExecution->task;
+
+		if (queryString->len > 0)
+		{
+			appendStringInfoString(queryString, " UNION ALL ");
+		}
+
+		appendStringInfo(queryString, "(%s)", task->queryString->data);
+		groupedTaskList = lappend(groupedTaskList, task);
+	}
+
+	groupedTask->queryString = queryString;
+	groupedTask->taskPlacementList = list_make1(linitial(firstTask->taskPlacementList));
+	groupedTask->shardId = firstTask->shardId;
+
+	groupedExecution->task = groupedTask;
+	groupedExecution->status = TASK_STATUS_PENDING;
+	groupedExecution->placementIndex = 0;
+	groupedExecution->connectionSlot = -1;
+	groupedExecution->groupedTaskList = groupedTaskList;
+
+	return groupedExecution;
+}
+
+
+/*
+ * SplitGroupedTaskExecution is called once a grouped task has failed on its
+ * node. The function marks the grouped execution as finished, and returns new
+ * executions for each of the tasks it combined. Those start over on their first
+ * placement: if the node is down, they quickly move on to their next one.
+ */
+static List *
+SplitGroupedTaskExecution(TaskExecution *groupedExecution)
+{
+	List *taskExecutionList = NIL;
+	ListCell *taskCell = NULL;
+
+	foreach(taskCell, groupedExecution->groupedTaskList)
+	{
+		Task *task = (Task *) lfirst(taskCell);
+		TaskExecution *taskExecution = palloc0(sizeof(TaskExecution));
+
+		taskExecution->task = task;
+		taskExecution->status = TASK_STATUS_PENDING;
+		taskExecution->placementIndex = 0;
+		taskExecution->connectionSlot = -1;
+
+		taskExecutionList = lappend(taskExecutionList, taskExecution);
+	}
+
+	groupedExecution->status = TASK_STATUS_FINISHED;
+
+	return taskExecutionList;
+}
+
+
+/*
+ * TaskListShardIdString returns the shard identifiers of the given tasks as a
+ * comma-separated string, for use in log messages.
+ */
+static char *
+TaskListShardIdString(List *taskList)
+{
+	StringInfo shardIdString = makeStringInfo();
+	ListCell *taskCell = NULL;
+
+	foreach(taskCell, taskList)
+	{
+		Task *task = (Task *) lfirst(taskCell);
+
+		if (shardIdString->len > 0)
+		{
+			appendStringInfoString(shardIdString, ", ");
+		}
+
+		appendStringInfo(shardIdString, INT64_FORMAT, task->shardId);
+	}
+
+	return shardIdString->data;
+}
+
+
+/*
+ * ExecuteTaskListConcurrently runs the provided task executions until all of
+ * them finish. Tasks are started whenever a connection to their placement's
+ * node is free, and a single poll loop receives results from all running tasks.
+ * Each task's rows are collected in a tuplestore of their own and only copied
+ * into the intermediate table once the task completes, so that rows from a
+ * placement which fails partway through are never seen. If a task runs out of
+ * placements to try, the function errors out.
+ */
+static void
+ExecuteTaskListConcurrently(List *taskExecutionList, List *targetList,
+							TupleDesc tupleDescriptor, RangeVar *intermediateTable)
+{
+	int32 pollArraySize = Max(list_length(taskExecutionList), 1);
+	int32 finishedTaskCount = 0;
+	struct pollfd *pollDescriptorArray = palloc0(pollArraySize * sizeof(struct pollfd));
+	TaskExecution **pollExecutionArray = palloc0(pollArraySize *
+												 sizeof(TaskExecution *));
+	AttInMetadata *attributeInputMetadata = TupleDescGetAttInMetadata(tupleDescriptor);
+	MemoryContext ioContext = AllocSetContextCreate(CurrentMemoryContext,
+													"ExecuteTaskListConcurrently",
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
+
+	while (finishedTaskCount < list_length(taskExecutionList))
+	{
+		ListCell *taskExecutionCell = NULL;
+		int32 pollDescriptorCount = 0;
+		int32 pollIndex = 0;
+		int pollResult = 0;
+
+		foreach(taskExecutionCell, taskExecutionList)
+		{
+			TaskExecution *taskExecution = lfirst(taskExecutionCell);
+
+			if (taskExecution->status == TASK_STATUS_PENDING)
+			{
+				StartTaskExecution(taskExecution, taskExecutionList);
+			}
+
+			/* new executions are appended, so this loop still visits them */
+			if (taskExecution->status == TASK_STATUS_PENDING &&
+				taskExecution->groupedTaskList != NIL &&
+				taskExecution->placementIndex > 0)
+			{
+				List *splitExecutionList = SplitGroupedTaskExecution(taskExecution);
+
+				taskExecutionList = list_concat(taskExecutionList,
+												splitExecutionList);
+				finishedTaskCount++;
+			}
+
+			if (taskExecution->status == TASK_STATUS_RUNNING)
+			{
+				struct pollfd *pollDescriptor = NULL;
+
+				if (pollDescriptorCount >= pollArraySize)
+				{
+					pollArraySize *= 2;
+					pollDescriptorArray = repalloc(pollDescriptorArray, pollArraySize *
+												   sizeof(struct pollfd));
+					pollExecutionArray = repalloc(pollExecutionArray, pollArraySize *
+												  sizeof(TaskExecution *));
+				}
+
+				pollDescriptor = &pollDescriptorArray[pollDescriptorCount];
+
+				pollDescriptor->fd = PQsocket(taskExecution->connection);
+				pollDescriptor->events = POLLIN;
+				pollDescriptor->revents = 0;
+
+				pollExecutionArray[pollDescriptorCount] = taskExecution;
+				pollDescriptorCount++;
+			}
+		}
+
+		/* pending tasks always find a free slot when nothing is running */
+		Assert(pollDescriptorCount > 0);
+
+		pollResult = poll(pollDescriptorArray, pollDescriptorCount,
+						  EXECUTOR_POLL_TIMEOUT_MSECS);
+		if (pollResult < 0 && errno != EINTR && errno != EAGAIN)
+		{
+			ereport(ERROR, (errcode_for_socket_access(),
+							errmsg("poll() failed: %m")));
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (pollIndex = 0; pollIndex < pollDescriptorCount && pollResult > 0;
+			 pollIndex++)
+		{
+			TaskExecution *taskExecution = pollExecutionArray[pollIndex];
+			bool taskFinished = false;
+
+			if (pollDescriptorArray[pollIndex].revents == 0)
+			{
+				continue;
+			}
+
+			taskFinished = ReceiveTaskResults(taskExecution, attributeInputMetadata,
+											  ioContext);
+			if (taskFinished)
+			{
+				/* move the task's results from its tuplestore into the table */
+				TupleStoreToTable(intermediateTable, targetList, tupleDescriptor,
+								  taskExecution->tupleStore);
+
+				tuplestore_end(taskExecution->tupleStore);
+				taskExecution->tupleStore = NULL;
+				taskExecution->connection = NULL;
+				taskExecution->status = TASK_STATUS_FINISHED;
+
+				finishedTaskCount++;
+			}
+		}
+	}
+
+	MemoryContextDelete(ioContext);
+	pfree(pollDescriptorArray);
+	pfree(pollExecutionArray);
+}
+
+
+/*
+ * StartTaskExecution tries to send the query of a pending task to the node of
+ * its current placement, using a connection which no other running task holds.
+ * If the placement's node cannot be reached, the task moves on to its next
+ * placement. If all connections to the node are busy, or an additional one
+ * cannot be opened, the task remains pending until a connection frees up. The
+ * function errors out once the task has run out of placements.
+ */
+static void
+StartTaskExecution(TaskExecution *taskExecution, List *taskExecutionList)
+{
+	Task *task = taskExecution->task;
+	List *taskPlacementList = task->taskPlacementList;
+
+	while (taskExecution->status == TASK_STATUS_PENDING)
+	{
+		ShardPlacement *taskPlacement = NULL;
+		PGconn *connection = NULL;
+		int32 connectionSlot = 0;
+		bool queryOK = false;
+
+		if (taskExecution->placementIndex >= list_length(taskPlacementList))
+		{
+			/* grouped tasks are split up rather than failed */
+			if (taskExecution->groupedTaskList != NIL)
+			{
+				break;
+			}
+
+			ereport(ERROR, (errmsg("could not receive query results")));
+		}
+
+		taskPlacement = (ShardPlacement *) list_nth(taskPlacementList,
+													taskExecution->placementIndex);
+
+		connectionSlot = FreeConnectionSlot(taskPlacement, taskExecutionList);
+		if (connectionSlot < 0)
+		{
+			break;
+		}
+
+		connection = GetConnectionForSlot(taskPlacement->nodeName,
+										  taskPlacement->nodePort, connectionSlot);
+		if (connection == NULL)
+		{
+			/* only give up on the node if even its first connection failed */
+			if (connectionSlot == 0)
+			{
+				taskExecution->placementIndex++;
+				continue;
+			}
+
+			break;
+		}
+
+		queryOK = SendQueryInSingleRowMode(connection, task);
+		if (!queryOK)
+		{
+			PurgeConnection(connection);
+			taskExecution->placementIndex++;
+			continue;
+		}
+
+		if (LogDistributedStatements && taskExecution->groupedTaskList != NIL)
+		{
+			ereport(LOG, (errmsg("running query on shards %s over connection %d "
+								 "to %s",
+								 TaskListShardIdString(taskExecution->groupedTaskList),
+								 connectionSlot, taskPlacement->nodeName)));
+		}
+		else if (LogDistributedStatements)
+		{
+			ereport(LOG, (errmsg("running query on shard " INT64_FORMAT " over "
+								 "connection %d to %s", task->shardId, connectionSlot,
+								 taskPlacement->nodeName)));
+		}
+
+		taskExecution->status = TASK_STATUS_RUNNING;
+		taskExecution->connectionSlot = connectionSlot;
+		taskExecution->connection = connection;
+		taskExecution->tupleStore = tuplestore_begin_heap(false, false, work_mem);
+	}
+}
+
+
+/*
+ * FreeConnectionSlot returns the lowest connection slot to the given placement's
+ * node which no running task currently uses. If all slots the session may use
+ * for the node are busy, the function returns -1.
+ */
+static int32
+FreeConnectionSlot(ShardPlacement *placement, List *taskExecutionList)
+{
+	int32 connectionSlot = 0;
+
+	for (connectionSlot = 0; connectionSlot < MaxConnectionsPerNode; connectionSlot++)
+	{
+		bool slotInUse = false;
+		ListCell *taskExecutionCell = NULL;
+
+		foreach(taskExecutionCell, taskExecutionList)
+		{
+			TaskExecution *taskExecution = lfirst(taskExecutionCell);
+			ShardPlacement *runningPlacement = NULL;
+
+			if (taskExecution->status != TASK_STATUS_RUNNING ||
+				taskExecution->connectionSlot != connectionSlot)
+			{
+				continue;
+			}
+
+			runningPlacement = list_nth(taskExecution->task->taskPlacementList,
+										taskExecution->placementIndex);
+			if (runningPlacement->nodePort == placement->nodePort &&
+				strncmp(runningPlacement->nodeName, placement->nodeName,
+						MAX_NODE_LENGTH) == 0)
+			{
+				slotInUse = true;
+				break;
+			}
+		}
+
+		if (!slotInUse)
+		{
+			return connectionSlot;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * ReceiveTaskResults consumes whatever input is available on a running task's
+ * connection and stores any rows received in the task's tuplestore, without
+ * blocking. The function returns true once all of the task's results have been
+ * received. If the query fails, the task is sent back to pending on its next
+ * placement and false is returned.
+ */
+static bool
+ReceiveTaskResults(TaskExecution *taskExecution, AttInMetadata *attributeInputMetadata,
+				   MemoryContext ioContext)
+{
+	PGconn *connection = taskExecution->connection;
+
+	int inputConsumed = PQconsumeInput(connection);
+	if (inputConsumed == 0)
+	{
+		ReportRemoteError(connection, NULL);
+		FailTaskPlacement(taskExecution);
+
+		return false;
+	}
+
+	while (PQisBusy(connection) == 0)
+	{
+		ExecStatusType resultStatus = 0;
+
+		PGresult *result = PQgetResult(connection);
+		if (result == NULL)
+		{
+			RemoteQueryFinished(connection);
+			return true;
+		}
+
+		resultStatus = PQresultStatus(result);
+		if ((resultStatus != PGRES_SINGLE_TUPLE) && (resultStatus != PGRES_TUPLES_OK))
+		{
+			ReportRemoteError(connection, result);
+			PQclear(result);
+			FailTaskPlacement(taskExecution);
+
+			return false;
+		}
+
+		StoreQueryResultRows(result, attributeInputMetadata, ioContext,
+							 taskExecution->tupleStore);
+
+		PQclear(result);
+	}
+
+	return false;
+}
+
+
+/*
+ * FailTaskPlacement discards the results a running task has received so far,
+ * closes its connection and makes the task pending again on its next placement.
+ */
+static void
+FailTaskPlacement(TaskExecution *taskExecution)
+{
+	PurgeConnection(taskExecution->connection);
+	tuplestore_end(taskExecution->tupleStore);
+
+	taskExecution->status = TASK_STATUS_PENDING;
+	taskExecution->placementIndex++;
+	taskExecution->connectionSlot = -1;
+	taskExecution->connection = NULL;
+	taskExecution->tupleStore = NULL;
+}
+
+
+/*
+ * ExecuteTaskAndStoreResults executes the task on the remote node, retrieves
+ * the results and stores them in the given tuple store. If the task fails on
+ * one of the placements, the function retries it on other placements.
+ */
+bool
+ExecuteTaskAndStoreResults(Task *task, TupleDesc tupleDescriptor,
+						   Tuplestorestate *tupleStore)
+{
+	bool resultsOK = false;
+	List *taskPlacementList = task->taskPlacementList;
+	ListCell *taskPlacementCell = NULL;
+
+	/*
+	 * Try to run the query to completion on one placement. If the query fails
+	 * attempt the query on the next placement.
+	 */
+	foreach(taskPlacementCell, taskPlacementList)
+	{
+		ShardPlacement *taskPlacement = (ShardPlacement *) lfirst(taskPlacementCell);
+		char *nodeName = taskPlacement->nodeName;
+		int32 nodePort = taskPlacement->nodePort;
+		bool queryOK = false;
+		bool storedOK = false;
+
+		PGconn *connection = GetConnection(nodeName, nodePort);
+		if (connection == NULL)
+		{
+			continue;
+		}
+
+		queryOK = SendQueryInSingleRowMode(connection, task);
+		if (!queryOK)
+		{
+			PurgeConnection(connection);
+			continue;
+		}
+
+		storedOK = StoreQueryResult(connection, tupleDescriptor, tupleStore);
+		if (storedOK)
+		{
+			resultsOK = true;
+			break;
+		}
+		else
+		{
+			tuplestore_clear(tupleStore);
+			PurgeConnection(connection);
+		}
+	}
+
+	return resultsOK;
+}
+
+
+/*
+ * SendQueryInSingleRowMode sends the given task's query on the connection in
+ * an asynchronous way, along with the task's parameter values if it has any;
+ * see SendRemoteQuery. The function also sets the single-row mode on the
+ * connection so that we receive results a row at a time. Until all results are
+ * received, the query is tracked as in progress so that it is cancelled should
+ * the local query abort.
+ */
+static bool
+SendQueryInSingleRowMode(PGconn *connection, Task *task)
+{
+	bool querySent = false;
+	int singleRowMode = 0;
+	bool timeoutApplied = false;
+
+	timeoutApplied = ApplyRemoteStatementTimeout(connection);
+	if (!timeoutApplied)
+	{
+		ReportRemoteError(connection, NULL);
+		return false;
+	}
+
+	querySent = SendRemoteQuery(connection, task->queryString->data,
+								task->parameterCount, task->parameterTypes,
+								task->parameterValues, task->relationId);
+	if (!querySent)
+	{
+		ReportRemoteError(connection, NULL);
+		return false;
+	}
+
+	singleRowMode = PQsetSingleRowMode(connection);
+	if (singleRowMode == 0)
+	{
+		ReportRemoteError(connection, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * StoreQueryResult gets the query results from the given connection, builds
+ * tuples from the results and stores them in the given tuple-store. If the
+ * function can't receive query results, it returns false. Note that this
+ * function assumes the query has already been sent on the connection and the
+ * tuplestore has earlier been initialized.
+ */
+static bool
+StoreQueryResult(PGconn *connection, TupleDesc tupleDescriptor,
+				 Tuplestorestate *tupleStore)
+{
+	AttInMetadata *attributeInputMetadata = TupleDescGetAttInMetadata(tupleDescriptor);
+	MemoryContext ioContext = AllocSetContextCreate(CurrentMemoryContext,
+													"StoreQueryResult",
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
+
+	Assert(tupleStore != NULL);
+
+	for (;;)
+	{
+		ExecStatusType resultStatus = 0;
+		PGresult *result = NULL;
+
+		/* wait for results without blocking interrupts */
+		bool resultReady = AwaitRemoteResult(connection);
+		if (!resultReady)
+		{
+			ReportRemoteError(connection, NULL);
+			return false;
+		}
+
+		result = PQgetResult(connection);
+		if (result == NULL)
+		{
+			RemoteQueryFinished(connection);
+			break;
+		}
+
+		resultStatus = PQresultStatus(result);
+		if ((resultStatus != PGRES_SINGLE_TUPLE) && (resultStatus != PGRES_TUPLES_OK))
+		{
+			ReportRemoteError(connection, result);
+			PQclear(result);
+
+			return false;
+		}
+
+		StoreQueryResultRows(result, attributeInputMetadata, ioContext, tupleStore);
+
+		PQclear(result);
+	}
+
+	MemoryContextDelete(ioContext);
+
+	return true;
+}
+
+
+/*
+ * StoreQueryResultRows builds tuples from the rows of the given result and
+ * stores them in the given tuple-store. The provided memory context is used
+ * for the I/O functions which convert the text values, and is reset after
+ * each tuple.
+ */
+static void
+StoreQueryResultRows(PGresult *result, AttInMetadata *attributeInputMetadata,
+					 MemoryContext ioContext, Tuplestorestate *tupleStore)
+{
+	uint32 rowIndex = 0;
+	uint32 rowCount = PQntuples(result);
+
+	for (rowIndex = 0; rowIndex < rowCount; rowIndex++)
+	{
+		HeapTuple heapTuple = BuildRemoteResultTuple(result, rowIndex,
+													 attributeInputMetadata, ioContext);
+
+		tuplestore_puttuple(tupleStore, heapTuple);
+		MemoryContextReset(ioContext);
+	}
+}
+
+
+/*
+ * BuildRemoteResultTuple builds a tuple from the given row of the given result.
+ * The tuple is built in the provided memory context, which callers reset once
+ * they are done with the tuple. This protects us from any memory leaks that
+ * might be present in the I/O functions which convert the text values.
+ */
+static HeapTuple
+BuildRemoteResultTuple(PGresult *result, uint32 rowIndex,
+					   AttInMetadata *attributeInputMetadata, MemoryContext ioContext)
+{
+	HeapTuple heapTuple = NULL;
+	uint32 columnIndex = 0;
+	uint32 columnCount = PQnfields(result);
+	MemoryContext oldContext = MemoryContextSwitchTo(ioContext);
+	char **columnArray = (char **) palloc0(columnCount * sizeof(char *));
+
+	Assert(columnCount == (uint32) attributeInputMetadata->tupdesc->natts);
+
+	for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+	{
+		if (PQgetisnull(result, rowIndex, columnIndex))
+		{
+			columnArray[columnIndex] = NULL;
+		}
+		else
+		{
+			columnArray[columnIndex] = PQgetvalue(result, rowIndex, columnIndex);
+		}
+	}
+
+	heapTuple = BuildTupleFromCStrings(attributeInputMetadata, columnArray);
+
+	MemoryContextSwitchTo(oldContext);
+
+	return heapTuple;
+}
+
+
+/*
+ * TupleStoreToTable inserts the tuples from the given tupleStore into the given
+ * table. Before doing so, the function extracts the values from the tuple and
+ * sets the right attributes for the given table based on the column attribute
+ * numbers.
+ */
+static void
+TupleStoreToTable(RangeVar *tableRangeVar, List *storeToTableColumnList,
+				  TupleDesc storeTupleDescriptor, Tuplestorestate *store)
+{
+	Relation table = heap_openrv(tableRangeVar, RowExclusiveLock);
+	TupleDesc tableTupleDescriptor = RelationGetDescr(table);
+
+	int tableColumnCount = tableTupleDescriptor->natts;
+	Datum *tableTupleValues = palloc0(tableColumnCount * sizeof(Datum));
+	bool *tableTupleNulls = palloc0(tableColumnCount * sizeof(bool));
+
+	int storeColumnCount = storeTupleDescriptor->natts;
+	Datum *storeTupleValues = palloc0(storeColumnCount * sizeof(Datum));
+	bool *storeTupleNulls = palloc0(storeColumnCount * sizeof(bool));
+	TupleTableSlot *storeTableSlot = MakeSingleTupleTableSlot(storeTupleDescriptor);
+
+	for (;;)
+	{
+		HeapTuple storeTuple = NULL;
+		HeapTuple tableTuple = NULL;
+		int storeColumnIndex = 0;
+
+		bool nextTuple = tuplestore_gettupleslot(store, true, false, storeTableSlot);
+		if (!nextTuple)
+		{
+			break;
+		}
+
+		storeTuple = ExecFetchSlotTuple(storeTableSlot);
+		heap_deform_tuple(storeTuple, storeTupleDescriptor,
+						  storeTupleValues, storeTupleNulls);
+
+		/* set all values to null for the table tuple */
+		memset(tableTupleNulls, true, tableColumnCount * sizeof(bool));
+
+		/*
+		 * Extract values from the returned tuple and set them in the right
+		 * attribute location for the new table. We determine this attribute
+		 * location based on the attribute number in the column from the remote
+		 * query's target list.
+		 */
+		for (storeColumnIndex = 0; storeColumnIndex < storeColumnCount;
+			 storeColumnIndex++)
+		{
+			TargetEntry *tableEntry = (TargetEntry *) list_nth(storeToTableColumnList,
+															   storeColumnIndex);
+			Expr *tableExpression = tableEntry->expr;
+			Var *tableColumn = NULL;
+			int tableColumnId = 0;
+
+			/* special case for count(*) as we expect a NULL const */
+			if (IsA(tableExpression, Const))
+			{
+				Const *constValue PG_USED_FOR_ASSERTS_ONLY = (Const *) tableExpression;
+				Assert(constValue->consttype == UNKNOWNOID);
+
+				/* skip over the null consts */
+				continue;
+			}
+
+			Assert(IsA(tableExpression, Var));
+			tableColumn = (Var *) tableExpression;
+			tableColumnId = tableColumn->varattno;
+
+			tableTupleValues[tableColumnId - 1] = storeTupleValues[storeColumnIndex];
+			tableTupleNulls[tableColumnId - 1] = storeTupleNulls[storeColumnIndex];
+		}
+
+		tableTuple = heap_form_tuple(tableTupleDescriptor,
+									 tableTupleValues, tableTupleNulls);
+
+		simple_heap_insert(table, tableTuple);
+		CommandCounterIncrement();
+
+		ExecClearTuple(storeTableSlot);
+		heap_freetuple(tableTuple);
+	}
+
+	ExecDropSingleTupleTableSlot(storeTableSlot);
+	heap_close(table, RowExclusiveLock);
+}
+
+
+/*
+ * PgShardExecutorRun actually runs a distributed plan, if any.
+ */
+static void
+PgShardExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count)
+{
+	PlannedStmt *plannedStatement = queryDesc->plannedstmt;
+	bool pgShardExecution = IsPgShardPlan(plannedStatement);
+
+	if (pgShardExecution)
+	{
+		EState *estate = queryDesc->estate;
+		CmdType operation = queryDesc->operation;
+		DistributedPlan *plan = (DistributedPlan *) plannedStatement->planTree;
+		MemoryContext oldcontext = NULL;
+
+		Assert(estate != NULL);
+		Assert(!(estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY));
+
+		/* we only support the default scan direction */
+		if (!ScanDirectionIsForward(direction))
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("scan directions other than forward scans "
+								   "are unsupported")));
+		}
+
+		oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+
+		/* like the standard executor, count only rows processed by this call */
+		estate->es_processed = 0;
+
+		if (queryDesc->totaltime != NULL)
+		{
+			InstrStartNode(queryDesc->totaltime);
+		}
+
+		if (operation == CMD_INSERT || operation == CMD_UPDATE ||
+			operation == CMD_DELETE)
+		{
+			DestReceiver *destination = queryDesc->dest;
+			TupleDesc returningDescriptor = NULL;
+			int32 affectedRowCount = 0;
+
+			if (plannedStatement->hasReturning)
+			{
+				returningDescriptor = queryDesc->tupDesc;
+				(*destination->rStartup)(destination, operation, returningDescriptor);
+			}
+
+			if (plan->insertSelectQuery != NULL)
+			{
+				affectedRowCount = ExecuteInsertSelectViaMaster(plan, queryDesc->params,
+																queryDesc->sourceText);
+			}
+			else
+			{
+				affectedRowCount = ExecuteDistributedModify(plan, returningDescriptor,
+															destination);
+			}
+			estate->es_processed = affectedRowCount;
 
-			Assert(list_length(plannedStatement->rtable) == 1);
-			sequentialScanRangeTable = linitial(plannedStatement->rtable);
-			Assert(sequentialScanRangeTable->rtekind == RTE_RELATION);
-			sequentialScanRangeTable->relid = intermediateResultTableId;
+			if (plannedStatement->hasReturning)
+			{
+				(*destination->rShutdown)(destination);
+			}
+		}
+		else if (operation == CMD_SELECT)
+		{
+			DestReceiver *destination = queryDesc->dest;
+			RemoteSelectState *selectState = plan->selectState;
+			TupleDesc tupleDescriptor = queryDesc->tupDesc;
 
-			/* swap in modified (local) plan for compatibility with standard start hook */
-			originalPlan = distributedPlan->originalPlan;
-			plannedStatement->planTree = originalPlan;
+			ExecuteSingleShardSelect(plan, selectState, estate, tupleDescriptor,
+									 destination, count);
+		}
+		else
+		{
+			ereport(ERROR, (errmsg("unrecognized operation code: %d",
+								   (int) operation)));
+		}
 
-			NextExecutorStartHook(queryDesc, eflags);
+		if (queryDesc->totaltime != NULL)
+		{
+			InstrStopNode(queryDesc->totaltime, estate->es_processed);
 		}
+
+		MemoryContextSwitchTo(oldcontext);
 	}
 	else
 	{
-		NextExecutorStartHook(queryDesc, eflags);
+		/* this isn't a query pg_shard handles: use previous hook or standard */
+		if (PreviousExecutorRunHook != NULL)
+		{
+			PreviousExecutorRunHook(queryDesc, direction, count);
+		}
+		else
+		{
+			standard_ExecutorRun(queryDesc, direction, count);
+		}
 	}
 }
 
 
 /*
- * IsPgShardPlan determines whether the provided plannedStmt contains a plan
- * suitable for execution by PgShard.
+ * ReloadTaskPlacementList loads the finalized placements of the given task's
+ * shard anew, after the shard's lock has been acquired. If the shard has no
+ * finalized placements left, it was split or moved away while the lock was
+ * awaited, and the function errors out rather than letting the task fail on
+ * placements that no longer exist.
  */
-static bool
-IsPgShardPlan(PlannedStmt *plannedStmt)
+static List *
+ReloadTaskPlacementList(Task *task)
 {
-	Plan *plan = plannedStmt->planTree;
-	NodeTag nodeTag = nodeTag(plan);
-	bool isPgShardPlan = ((DistributedNodeTag) nodeTag == T_DistributedPlan);
+	List *placementList = LoadFinalizedShardPlacementList(task->shardId);
 
-	return isPgShardPlan;
+	if (placementList == NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_T_R_SERIALIZATION_FAILURE),
+						errmsg("could not find any active placements of shard "
+							   INT64_FORMAT, task->shardId),
+						errdetail("The shard was split or moved while the command "
+								  "waited for its lock."),
+						errhint("Retry the command.")));
+	}
+
+	return placementList;
 }
 
 
 /*
- * NextExecutorStartHook simply encapsulates the common logic of calling the
- * next executor start hook in the chain or the standard executor start hook
- * if no other hooks are present.
+ * ExecuteDistributedModify is the main entry point for modifying distributed
+ * tables. The modification is sent to all placements of all shards it touches
+ * at once, and their results are then awaited concurrently. A shard's
+ * modification is successful if any of its placements is successful, and the
+ * shard's failed placements are then marked as inactive. The function returns
+ * the total number of rows modified across shards, and generates warnings for
+ * individual placement failures. If the modification has a RETURNING clause, a
+ * descriptor of the returned rows is provided, and the rows returned by the
+ * first successful placement of each shard are sent to the destination.
+ *
+ * Workers commit each modification on their own, so a modification of several
+ * shards may be committed on some shards and fail on all placements of others.
+ * The function then errors out, but the failed placements of the modified
+ * shards are stale nonetheless. Since erroring out rolls back the local
+ * transaction, they are marked as inactive through a separate connection to
+ * the master; see MarkPlacementsInactiveOnMaster.
  */
-static void
-NextExecutorStartHook(QueryDesc *queryDesc, int eflags)
+static int32
+ExecuteDistributedModify(DistributedPlan *plan, TupleDesc returningDescriptor,
+						 DestReceiver *destination)
 {
-	/* call into the standard executor start, or hook if set */
-	if (PreviousExecutorStartHook != NULL)
+	int32 affectedTupleCount = 0;
+	List *taskExecutionList = NIL;
+	List *placementList = NIL;
+	ListCell *taskCell = NULL;
+	List *modifiedTaskList = NIL;
+	List *failedTaskList = NIL;
+	List *failedPlacementList = NIL;
+	ListCell *failedPlacementCell = NULL;
+
+	foreach(taskCell, plan->taskList)
 	{
-		PreviousExecutorStartHook(queryDesc, eflags);
+		Task *task = (Task *) lfirst(taskCell);
+		int32 placementIndex = 0;
+
+		for (placementIndex = 0; placementIndex < list_length(task->taskPlacementList);
+			 placementIndex++)
+		{
+			TaskExecution *taskExecution = palloc0(sizeof(TaskExecution));
+			taskExecution->task = task;
+			taskExecution->status = TASK_STATUS_PENDING;
+			taskExecution->placementIndex = placementIndex;
+			taskExecution->connectionSlot = -1;
+			taskExecution->affectedRowCount = -1;
+
+			taskExecutionList = lappend(taskExecutionList, taskExecution);
+		}
+
+		placementList = list_concat(placementList, list_copy(task->taskPlacementList));
 	}
-	else
+
+	/*
+	 * Log modifications of shards being repaired online, to replay them later.
+	 * Workers commit modifications on their own, so they're logged beforehand.
+	 */
+	foreach(taskCell, plan->taskList)
 	{
-		standard_ExecutorStart(queryDesc, eflags);
+		Task *task = (Task *) lfirst(taskCell);
+
+		CaptureShardModification(task);
+	}
+
+	/* connect to all replicas at once rather than as each is modified */
+	EstablishPlacementConnections(placementList);
+
+	ExecuteModificationsConcurrently(taskExecutionList, returningDescriptor,
+									 destination);
+
+	foreach(taskCell, plan->taskList)
+	{
+		Task *task = (Task *) lfirst(taskCell);
+		int32 taskAffectedTupleCount = -1;
+		List *taskFailedPlacementList = NIL;
+		ListCell *taskExecutionCell = NULL;
+
+		foreach(taskExecutionCell, taskExecutionList)
+		{
+			TaskExecution *taskExecution = lfirst(taskExecutionCell);
+			ShardPlacement *taskPlacement = NULL;
+			int32 currentAffectedTupleCount = taskExecution->affectedRowCount;
+
+			if (taskExecution->task != task)
+			{
+				continue;
+			}
+
+			taskPlacement = list_nth(task->taskPlacementList,
+									 taskExecution->placementIndex);
+
+			Assert(taskPlacement->shardState == STATE_FINALIZED);
+
+			if (taskExecution->status != TASK_STATUS_FINISHED)
+			{
+				taskFailedPlacementList = lappend(taskFailedPlacementList,
+												  taskPlacement);
+			}
+			else if (taskAffectedTupleCount == -1)
+			{
+				taskAffectedTupleCount = currentAffectedTupleCount;
+			}
+			else if (taskAffectedTupleCount == currentAffectedTupleCount)
+			{
+				/* placement modified as many rows as the first one did */
+			}
+			else
+			{
+				ereport(WARNING, (errmsg("modified %d tuples, but expected to modify %d",
+										 currentAffectedTupleCount,
+										 taskAffectedTupleCount),
+								  errdetail("modified placement on %s:%d",
+											taskPlacement->nodeName,
+											taskPlacement->nodePort)));
+			}
+		}
+
+		/* placements of a shard which could not be modified at all aren't stale */
+		if (taskAffectedTupleCount == -1)
+		{
+			failedTaskList = lappend(failedTaskList, task);
+			continue;
+		}
+
+		modifiedTaskList = lappend(modifiedTaskList, task);
+		failedPlacementList = list_concat(failedPlacementList, taskFailedPlacementList);
+		affectedTupleCount += taskAffectedTupleCount;
+	}
+
+	/* if no shard could be modified, error out */
+	if (modifiedTaskList == NIL)
+	{
+		ereport(ERROR, (errmsg("could not modify any active placements")));
+	}
+
+	/* other shards' modifications are committed, but the statement errors out */
+	if (failedTaskList != NIL)
+	{
+		Task *failedTask = (Task *) linitial(failedTaskList);
+
+		/* the modifications were logged, but cannot be replayed */
+		foreach(taskCell, failedTaskList)
+		{
+			Task *task = (Task *) lfirst(taskCell);
+
+			FailModificationCapture(task->shardId);
+		}
+
+		MarkPlacementsInactiveOnMaster(failedPlacementList);
+
+		ereport(ERROR, (errmsg("could not modify any active placements of shard "
+							   INT64_FORMAT, failedTask->shardId),
+						errdetail("Modifications of the other shards were committed.")));
 	}
+
+	/* mark failed placements of modified shards as inactive: they're stale */
+	foreach(failedPlacementCell, failedPlacementList)
+	{
+		ShardPlacement *failedPlacement = (ShardPlacement *) lfirst(failedPlacementCell);
+
+		DeleteShardPlacementRow(failedPlacement->id);
+		InsertShardPlacementRow(failedPlacement->id, failedPlacement->shardId,
+								STATE_INACTIVE, failedPlacement->nodeName,
+								failedPlacement->nodePort);
+	}
+
+	return affectedTupleCount;
 }
 
 
 /*
- * CommutativityRuleToLockMode determines the commutativity rule for the given
- * command and returns the appropriate lock mode to enforce that rule. The
- * function assumes a SELECT doesn't modify state and therefore is commutative
- * with all other commands. The function also assumes that an INSERT commutes
- * with another INSERT, but not with an UPDATE/DELETE; and an UPDATE/DELETE
- * doesn't commute with an INSERT, UPDATE, or DELETE.
- *
- * The above mapping is overridden entirely when all_modifications_commutative
- * is set to true. In that case, all commands just claim a shared lock. This
- * allows the shard repair logic to lock out modifications while permitting all
- * commands to otherwise commute.
+ * MarkPlacementsInactiveOnMaster marks the given placements as inactive in a
+ * transaction of their own, which remains committed when the local transaction
+ * is rolled back. The metadata is updated through a connection to the master
+ * itself on localhost. If the placements' rows are locked by the local
+ * transaction, or the update fails for any other reason, the function warns
+ * that the placements may be stale instead.
  */
-static LOCKMODE
-CommutativityRuleToLockMode(CmdType commandType)
+static void
+MarkPlacementsInactiveOnMaster(List *placementList)
 {
-	LOCKMODE lockMode = NoLock;
+	PGconn *connection = NULL;
+	StringInfo updateCommand = NULL;
+	ListCell *placementCell = NULL;
+	bool placementsMarked = false;
 
-	/* bypass commutativity checks when flag enabled */
-	if (AllModificationsCommutative)
+	if (placementList == NIL)
 	{
-		return ShareLock;
+		return;
 	}
 
-	if (commandType == CMD_SELECT)
+	updateCommand = makeStringInfo();
+	appendStringInfo(updateCommand, "UPDATE %s.%s SET shard_state = %d WHERE id IN "
+					 "(SELECT id FROM %s.%s WHERE id IN (", METADATA_SCHEMA_NAME,
+					 SHARD_PLACEMENT_TABLE_NAME, STATE_INACTIVE, METADATA_SCHEMA_NAME,
+					 SHARD_PLACEMENT_TABLE_NAME);
+
+	foreach(placementCell, placementList)
 	{
-		lockMode = NoLock;
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+
+		if (placementCell != list_head(placementList))
+		{
+			appendStringInfoString(updateCommand, ", ");
+		}
+
+		appendStringInfo(updateCommand, INT64_FORMAT, placement->id);
 	}
-	else if (commandType == CMD_INSERT)
+
+	/* the local transaction might hold locks on the rows: don't wait for it */
+	appendStringInfoString(updateCommand, ") FOR UPDATE NOWAIT)");
+
+	connection = GetConnection(MASTER_NODE_NAME, PostPortNumber);
+	if (connection != NULL)
 	{
-		lockMode = ShareLock;
+		placementsMarked = ExecuteRemoteCommand(connection, updateCommand->data);
 	}
-	else if (commandType == CMD_UPDATE || commandType == CMD_DELETE)
+
+	if (!placementsMarked)
 	{
-		lockMode = ExclusiveLock;
+		foreach(placementCell, placementList)
+		{
+			ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+
+			ereport(WARNING, (errmsg("could not mark placement of shard " INT64_FORMAT
+									 " on \"%s:%u\" as inactive", placement->shardId,
+									 placement->nodeName, placement->nodePort),
+							  errhint("The placement may be stale. Repair it using "
+									  "master_copy_shard_placement.")));
+		}
 	}
-	else
+}
+
+
+/*
+ * ExecuteModificationsConcurrently sends the modification of each execution to
+ * its placement and awaits the results of all of them, polling their sockets
+ * rather than waiting on each in turn. Placements on the same node share the
+ * node's connections, so an execution may need to wait for a free connection
+ * before it can start. The function returns once every execution has either
+ * finished or failed.
+ */
+static void
+ExecuteModificationsConcurrently(List *taskExecutionList, TupleDesc returningDescriptor,
+								 DestReceiver *destination)
+{
+	int32 executionCount = list_length(taskExecutionList);
+	int32 completedExecutionCount = 0;
+	struct pollfd *pollDescriptorArray = palloc0(executionCount * sizeof(struct pollfd));
+	TaskExecution **pollExecutionArray = palloc0(executionCount *
+												 sizeof(TaskExecution *));
+
+	while (completedExecutionCount < executionCount)
 	{
-		ereport(ERROR, (errmsg("unrecognized operation code: %d", (int) commandType)));
+		ListCell *taskExecutionCell = NULL;
+		int32 pollDescriptorCount = 0;
+		int32 pollIndex = 0;
+		int pollResult = 0;
+
+		foreach(taskExecutionCell, taskExecutionList)
+		{
+			TaskExecution *taskExecution = lfirst(taskExecutionCell);
+
+			if (taskExecution->status == TASK_STATUS_PENDING)
+			{
+				StartModification(taskExecution, taskExecutionList);
+
+				if (taskExecution->status == TASK_STATUS_FAILED)
+				{
+					completedExecutionCount++;
+				}
+			}
+
+			if (taskExecution->status == TASK_STATUS_RUNNING)
+			{
+				struct pollfd *pollDescriptor = &pollDescriptorArray[pollDescriptorCount];
+
+				pollDescriptor->fd = PQsocket(taskExecution->connection);
+				pollDescriptor->events = POLLIN;
+				pollDescriptor->revents = 0;
+
+				pollExecutionArray[pollDescriptorCount] = taskExecution;
+				pollDescriptorCount++;
+			}
+		}
+
+		/* executions may all have failed to start */
+		if (pollDescriptorCount == 0)
+		{
+			continue;
+		}
+
+		pollResult = poll(pollDescriptorArray, pollDescriptorCount,
+						  EXECUTOR_POLL_TIMEOUT_MSECS);
+		if (pollResult < 0 && errno != EINTR && errno != EAGAIN)
+		{
+			ereport(ERROR, (errcode_for_socket_access(),
+							errmsg("poll() failed: %m")));
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (pollIndex = 0; pollIndex < pollDescriptorCount && pollResult > 0;
+			 pollIndex++)
+		{
+			TaskExecution *taskExecution = pollExecutionArray[pollIndex];
+
+			if (pollDescriptorArray[pollIndex].revents == 0)
+			{
+				continue;
+			}
+
+			ReceiveModificationResults(taskExecution, taskExecutionList,
+									   returningDescriptor, destination);
+
+			if (taskExecution->status != TASK_STATUS_RUNNING)
+			{
+				completedExecutionCount++;
+			}
+		}
 	}
 
-	return lockMode;
+	pfree(pollDescriptorArray);
+	pfree(pollExecutionArray);
 }
 
 
 /*
- * AcquireExecutorShardLocks: acquire shard locks needed for execution of tasks
- * within a distributed plan.
+ * StartModification tries to send the modification of a pending execution to
+ * its placement, using a connection which no other running execution holds. If
+ * the placement's node cannot be reached or the modification cannot be sent,
+ * the execution fails. If all connections to the node are busy, or an
+ * additional one cannot be opened, it remains pending.
  */
 static void
-AcquireExecutorShardLocks(List *taskList, LOCKMODE lockMode)
+StartModification(TaskExecution *taskExecution, List *taskExecutionList)
 {
-	List *shardIdSortedTaskList = SortList(taskList, CompareTasksByShardId);
-	ListCell *taskCell = NULL;
+	Task *task = taskExecution->task;
+	ShardPlacement *taskPlacement = list_nth(task->taskPlacementList,
+											 taskExecution->placementIndex);
+	PGconn *connection = NULL;
+	int32 connectionSlot = 0;
+	bool timeoutApplied = false;
+	bool querySent = false;
+
+	connectionSlot = FreeConnectionSlot(taskPlacement, taskExecutionList);
+	if (connectionSlot < 0)
+	{
+		return;
+	}
 
-	foreach(taskCell, shardIdSortedTaskList)
+	connection = GetConnectionForSlot(taskPlacement->nodeName, taskPlacement->nodePort,
+									  connectionSlot);
+	if (connection == NULL)
 	{
-		Task *task = (Task *) lfirst(taskCell);
-		int64 shardId = task->shardId;
+		/* only give up on the node if even its first connection failed */
+		if (connectionSlot == 0)
+		{
+			taskExecution->status = TASK_STATUS_FAILED;
+		}
+
+		return;
+	}
+
+	timeoutApplied = ApplyRemoteStatementTimeout(connection);
+	if (timeoutApplied)
+	{
+		querySent = SendRemoteQuery(connection, task->queryString->data,
+									task->parameterCount, task->parameterTypes,
+									task->parameterValues, task->relationId);
+	}
+
+	if (!querySent)
+	{
+		ReportRemoteError(connection, NULL);
+		PurgeConnection(connection);
 
-		LockShard(shardId, lockMode);
+		taskExecution->status = TASK_STATUS_FAILED;
+		return;
 	}
+
+	taskExecution->status = TASK_STATUS_RUNNING;
+	taskExecution->connectionSlot = connectionSlot;
+	taskExecution->connection = connection;
 }
 
 
-/* Helper function to compare two tasks using their shardIds. */
-static int
-CompareTasksByShardId(const void *leftElement, const void *rightElement)
+/*
+ * ReceiveModificationResults consumes whatever input is available on a running
+ * execution's connection without blocking. Once the modification's result has
+ * arrived, the execution records the number of rows it modified. If it is the
+ * first placement of its shard to succeed, any rows it returns are sent to the
+ * destination. After all results have been received, the execution finishes;
+ * if the modification fails, its connection is closed and the execution fails.
+ */
+static void
+ReceiveModificationResults(TaskExecution *taskExecution, List *taskExecutionList,
+						   TupleDesc returningDescriptor, DestReceiver *destination)
 {
-	const Task *leftTask = *((const Task **) leftElement);
-	const Task *rightTask = *((const Task **) rightElement);
-	int64 leftShardId = leftTask->shardId;
-	int64 rightShardId = rightTask->shardId;
+	PGconn *connection = taskExecution->connection;
+	ExecStatusType expectedStatus = PGRES_COMMAND_OK;
+	bool modificationFailed = false;
 
-	/* we compare 64-bit integers, instead of casting their difference to int */
-	if (leftShardId > rightShardId)
+	/* modifications with a RETURNING clause return rows like queries do */
+	if (returningDescriptor != NULL)
 	{
-		return 1;
+		expectedStatus = PGRES_TUPLES_OK;
 	}
-	else if (leftShardId < rightShardId)
+
+	if (PQconsumeInput(connection) == 0)
 	{
-		return -1;
+		ReportRemoteError(connection, NULL);
+		modificationFailed = true;
+	}
+
+	while (!modificationFailed && PQisBusy(connection) == 0)
+	{
+		PGresult *result = PQgetResult(connection);
+		if (result == NULL)
+		{
+			RemoteQueryFinished(connection);
+
+			taskExecution->status = TASK_STATUS_FINISHED;
+			taskExecution->connectionSlot = -1;
+			taskExecution->connection = NULL;
+			return;
+		}
+
+		if (PQresultStatus(result) != expectedStatus)
+		{
+			ReportRemoteError(connection, result);
+			PQclear(result);
+
+			modificationFailed = true;
+			break;
+		}
+
+		/* other placements should return the same rows, so send them once */
+		if (returningDescriptor != NULL &&
+			!ModificationResultReceived(taskExecution->task, taskExecutionList))
+		{
+			SendQueryResultRows(result, returningDescriptor, destination);
+		}
+
+		taskExecution->affectedRowCount = pg_atoi(PQcmdTuples(result), sizeof(int32), 0);
+
+		PQclear(result);
 	}
-	else
+
+	if (modificationFailed)
 	{
-		return 0;
+		PurgeConnection(connection);
+
+		taskExecution->status = TASK_STATUS_FAILED;
+		taskExecution->connectionSlot = -1;
+		taskExecution->connection = NULL;
 	}
 }
 
 
 /*
- * ExecuteMultipleShardSelect executes the SELECT queries in the distributed
- * plan and inserts the returned rows into the given tableId.
+ * ModificationResultReceived returns whether the result of the given task's
+ * modification has already been received from any of its placements.
  */
-static void
-ExecuteMultipleShardSelect(DistributedPlan *distributedPlan,
-						   RangeVar *intermediateTable)
+static bool
+ModificationResultReceived(Task *task, List *taskExecutionList)
 {
-	List *taskList = distributedPlan->taskList;
-	List *targetList = distributedPlan->targetList;
-
-	/* ExecType instead of ExecCleanType so we don't ignore junk columns */
-	TupleDesc tupleStoreDescriptor = ExecTypeFromTL(targetList, false);
+	ListCell *taskExecutionCell = NULL;
 
-	ListCell *taskCell = NULL;
-	foreach(taskCell, taskList)
+	foreach(taskExecutionCell, taskExecutionList)
 	{
-		Task *task = (Task *) lfirst(taskCell);
-		Tuplestorestate *tupleStore = tuplestore_begin_heap(false, false, work_mem);
-		bool resultsOK = false;
+		TaskExecution *taskExecution = lfirst(taskExecutionCell);
 
-		resultsOK = ExecuteTaskAndStoreResults(task, tupleStoreDescriptor, tupleStore);
-		if (!resultsOK)
+		if (taskExecution->task == task && taskExecution->affectedRowCount >= 0)
 		{
-			ereport(ERROR, (errmsg("could not receive query results")));
+			return true;
 		}
-
-		/*
-		 * We successfully fetched data into local tuplestore. Now move results from
-		 * the tupleStore into the table.
-		 */
-		Assert(tupleStore != NULL);
-		TupleStoreToTable(intermediateTable, targetList, tupleStoreDescriptor,
-						  tupleStore);
-
-		tuplestore_end(tupleStore);
 	}
+
+	return false;
 }
 
 
 /*
- * ExecuteTaskAndStoreResults executes the task on the remote node, retrieves
- * the results and stores them in the given tuple store. If the task fails on
- * one of the placements, the function retries it on other placements.
+ * ExecuteInsertSelectViaMaster executes an INSERT ... SELECT whose rows cannot
+ * be copied between shards on the workers. The SELECT is run on the master, and
+ * its results are stored in a tuplestore, which spills to disk if needed. The
+ * values of each row are then computed and the row is routed to its shard by
+ * its partition value. Rows are sent in batches: each batch becomes one multi-
+ * row INSERT per shard, and these INSERTs are executed concurrently like other
+ * multi-shard modifications. If a batch cannot be inserted into any placement of
+ * one of its shards, the function errors out; rows of earlier batches and of the
+ * batch's other shards remain inserted. The function returns the number of rows
+ * inserted.
  */
-bool
-ExecuteTaskAndStoreResults(Task *task, TupleDesc tupleDescriptor,
-						   Tuplestorestate *tupleStore)
+static int32
+ExecuteInsertSelectViaMaster(DistributedPlan *plan, ParamListInfo boundParams,
+							 const char *queryString)
 {
-	bool resultsOK = false;
-	List *taskPlacementList = task->taskPlacementList;
-	ListCell *taskPlacementCell = NULL;
+	Query *insertSelectQuery = plan->insertSelectQuery;
+	RangeTblEntry *insertRangeTable = rt_fetch(insertSelectQuery->resultRelation,
+											   insertSelectQuery->rtable);
+	RangeTblEntry *subqueryRangeTable = InsertSelectRangeTableEntry(insertSelectQuery);
+	Oid relationId = insertRangeTable->relid;
+	char *relationName = get_rel_name(relationId);
+	Var *partitionColumn = PartitionColumn(relationId);
+	List *shardIntervalList = LookupShardIntervalList(relationId);
+	OpExpr *equalityExpr = NULL;
+	Const *partitionValue = NULL;
+	List *restrictClauseList = NIL;
+	List *columnEntryList = NIL;
+	StringInfo columnNames = makeStringInfo();
+	int32 partitionColumnIndex = -1;
+	int32 columnCount = 0;
+	int32 columnIndex = 0;
+	FmgrInfo *outputFunctionArray = NULL;
+	Tuplestorestate *selectStore = NULL;
+	TupleDesc selectDescriptor = NULL;
+	TupleTableSlot *selectSlot = NULL;
+	List *batchTaskList = NIL;
+	int32 batchRowCount = 0;
+	int32 affectedRowCount = 0;
+	ListCell *targetEntryCell = NULL;
+
+	MemoryContext batchContext = AllocSetContextCreate(CurrentMemoryContext,
+													   "ExecuteInsertSelectViaMaster",
+													   ALLOCSET_DEFAULT_MINSIZE,
+													   ALLOCSET_DEFAULT_INITSIZE,
+													   ALLOCSET_DEFAULT_MAXSIZE);
+
+	/* rows are routed by their partition value, except for reference tables */
+	if (partitionColumn != NULL)
+	{
+		equalityExpr = MakeOpExpression(partitionColumn, BTEqualStrategyNumber);
+		partitionValue = (Const *) get_rightop((Expr *) equalityExpr);
+		restrictClauseList = list_make1(equalityExpr);
+	}
 
-	/*
-	 * Try to run the query to completion on one placement. If the query fails
-	 * attempt the query on the next placement.
-	 */
-	foreach(taskPlacementCell, taskPlacementList)
+	foreach(targetEntryCell, insertSelectQuery->targetList)
 	{
-		ShardPlacement *taskPlacement = (ShardPlacement *) lfirst(taskPlacementCell);
-		char *nodeName = taskPlacement->nodeName;
-		int32 nodePort = taskPlacement->nodePort;
-		bool queryOK = false;
-		bool storedOK = false;
+		TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+		char *columnName = NULL;
 
-		PGconn *connection = GetConnection(nodeName, nodePort);
-		if (connection == NULL)
+		if (targetEntry->resjunk)
 		{
 			continue;
 		}
 
-		queryOK = SendQueryInSingleRowMode(connection, task->queryString);
-		if (!queryOK)
+		if (partitionColumn != NULL && targetEntry->resno == partitionColumn->varattno)
 		{
-			PurgeConnection(connection);
-			continue;
+			partitionColumnIndex = list_length(columnEntryList);
 		}
 
-		storedOK = StoreQueryResult(connection, tupleDescriptor, tupleStore);
-		if (storedOK)
-		{
-			resultsOK = true;
-			break;
-		}
-		else
+		if (columnEntryList != NIL)
 		{
-			tuplestore_clear(tupleStore);
-			PurgeConnection(connection);
+			appendStringInfoString(columnNames, ", ");
 		}
-	}
 
-	return resultsOK;
-}
+		columnName = get_relid_attribute_name(relationId, targetEntry->resno);
+		appendStringInfoString(columnNames, quote_identifier(columnName));
 
+		columnEntryList = lappend(columnEntryList, targetEntry);
+	}
 
-/*
- * SendQueryInSingleRowMode sends the given query on the connection in an
- * asynchronous way. The function also sets the single-row mode on the
- * connection so that we receive results a row at a time.
- */
-static bool
-SendQueryInSingleRowMode(PGconn *connection, StringInfo query)
-{
-	int querySent = 0;
-	int singleRowMode = 0;
+	columnCount = list_length(columnEntryList);
+	outputFunctionArray = (FmgrInfo *) palloc0(columnCount * sizeof(FmgrInfo));
 
-	querySent = PQsendQuery(connection, query->data);
-	if (querySent == 0)
+	foreach(targetEntryCell, columnEntryList)
 	{
-		ReportRemoteError(connection, NULL);
-		return false;
+		TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+		Oid outputFunctionId = InvalidOid;
+		bool typeVarLength = false;
+
+		getTypeOutputInfo(exprType((Node *) targetEntry->expr), &outputFunctionId,
+						  &typeVarLength);
+		fmgr_info(outputFunctionId, &outputFunctionArray[columnIndex]);
+
+		columnIndex++;
 	}
 
-	singleRowMode = PQsetSingleRowMode(connection);
-	if (singleRowMode == 0)
+	selectStore = ExecuteSelectIntoTupleStore(subqueryRangeTable->subquery,
+											  boundParams, queryString,
+											  &selectDescriptor);
+	selectSlot = MakeSingleTupleTableSlot(selectDescriptor);
+
+	while (tuplestore_gettupleslot(selectStore, true, false, selectSlot))
 	{
-		ReportRemoteError(connection, NULL);
-		return false;
-	}
+		MemoryContext oldContext = MemoryContextSwitchTo(batchContext);
+		Const **valueArray = (Const **) palloc0(columnCount * sizeof(Const *));
+		List *prunedShardList = NIL;
+		ShardInterval *shardInterval = NULL;
+		Task *task = NULL;
+		ListCell *taskCell = NULL;
 
-	return true;
-}
+		slot_getallattrs(selectSlot);
 
+		columnIndex = 0;
+		foreach(targetEntryCell, columnEntryList)
+		{
+			TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
 
-/*
- * StoreQueryResult gets the query results from the given connection, builds
- * tuples from the results and stores them in the given tuple-store. If the
- * function can't receive query results, it returns false. Note that this
- * function assumes the query has already been sent on the connection and the
- * tuplestore has earlier been initialized.
- */
-static bool
-StoreQueryResult(PGconn *connection, TupleDesc tupleDescriptor,
-				 Tuplestorestate *tupleStore)
-{
-	AttInMetadata *attributeInputMetadata = TupleDescGetAttInMetadata(tupleDescriptor);
-	uint32 expectedColumnCount = tupleDescriptor->natts;
-	char **columnArray = (char **) palloc0(expectedColumnCount * sizeof(char *));
-	MemoryContext ioContext = AllocSetContextCreate(CurrentMemoryContext,
-													"StoreQueryResult",
-													ALLOCSET_DEFAULT_MINSIZE,
-													ALLOCSET_DEFAULT_INITSIZE,
-													ALLOCSET_DEFAULT_MAXSIZE);
+			valueArray[columnIndex] = InsertSelectColumnValue(targetEntry, selectSlot,
+															  boundParams);
+			columnIndex++;
+		}
 
-	Assert(tupleStore != NULL);
+		if (partitionColumn == NULL)
+		{
+			/* reference tables have a single shard */
+			prunedShardList = shardIntervalList;
+		}
+		else
+		{
+			if (partitionColumnIndex < 0 ||
+				valueArray[partitionColumnIndex]->constisnull)
+			{
+				ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+								errmsg("cannot plan INSERT using row with NULL value "
+									   "in partition column")));
+			}
 
-	for (;;)
-	{
-		uint32 rowIndex = 0;
-		uint32 columnIndex = 0;
-		uint32 rowCount = 0;
-		uint32 columnCount = 0;
-		ExecStatusType resultStatus = 0;
+			partitionValue->constvalue = valueArray[partitionColumnIndex]->constvalue;
+			partitionValue->constisnull = false;
 
-		PGresult *result = PQgetResult(connection);
-		if (result == NULL)
+			prunedShardList = PruneShardList(relationId, restrictClauseList,
+											 shardIntervalList);
+		}
+
+		if (list_length(prunedShardList) != 1)
 		{
-			break;
+			ereport(ERROR, (errmsg("could not find the shard for a row inserted into "
+								   "\"%s\"", relationName)));
 		}
 
-		resultStatus = PQresultStatus(result);
-		if ((resultStatus != PGRES_SINGLE_TUPLE) && (resultStatus != PGRES_TUPLES_OK))
+		shardInterval = (ShardInterval *) linitial(prunedShardList);
+
+		foreach(taskCell, batchTaskList)
 		{
-			ReportRemoteError(connection, result);
-			PQclear(result);
+			Task *batchTask = (Task *) lfirst(taskCell);
 
-			return false;
+			if (batchTask->shardId == shardInterval->id)
+			{
+				task = batchTask;
+				break;
+			}
 		}
 
-		rowCount = PQntuples(result);
-		columnCount = PQnfields(result);
-		Assert(columnCount == expectedColumnCount);
+		if (task == NULL)
+		{
+			char *shardName = pstrdup(relationName);
 
-		for (rowIndex = 0; rowIndex < rowCount; rowIndex++)
+			AppendShardIdToName(&shardName, shardInterval->id);
+
+			task = (Task *) palloc0(sizeof(Task));
+			task->queryString = makeStringInfo();
+			task->shardId = shardInterval->id;
+			task->relationId = relationId;
+
+			appendStringInfo(task->queryString, "INSERT INTO %s (%s) VALUES ",
+							 quote_identifier(shardName), columnNames->data);
+
+			batchTaskList = lappend(batchTaskList, task);
+		}
+		else
+		{
+			appendStringInfoString(task->queryString, ", ");
+		}
+
+		appendStringInfoChar(task->queryString, '(');
+
+		for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
 		{
-			HeapTuple heapTuple = NULL;
-			MemoryContext oldContext = NULL;
-			memset(columnArray, 0, columnCount * sizeof(char *));
+			Const *columnValue = valueArray[columnIndex];
 
-			for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+			if (columnIndex > 0)
 			{
-				if (PQgetisnull(result, rowIndex, columnIndex))
-				{
-					columnArray[columnIndex] = NULL;
-				}
-				else
-				{
-					columnArray[columnIndex] = PQgetvalue(result, rowIndex, columnIndex);
-				}
+				appendStringInfoString(task->queryString, ", ");
 			}
 
-			/*
-			 * Switch to a temporary memory context that we reset after each tuple. This
-			 * protects us from any memory leaks that might be present in I/O functions
-			 * called by BuildTupleFromCStrings.
-			 */
-			oldContext = MemoryContextSwitchTo(ioContext);
+			if (columnValue->constisnull)
+			{
+				appendStringInfoString(task->queryString, "NULL");
+			}
+			else
+			{
+				char *valueString = OutputFunctionCall(&outputFunctionArray[columnIndex],
+													   columnValue->constvalue);
 
-			heapTuple = BuildTupleFromCStrings(attributeInputMetadata, columnArray);
+				appendStringInfoString(task->queryString,
+									   quote_literal_cstr(valueString));
+			}
+		}
 
-			MemoryContextSwitchTo(oldContext);
+		appendStringInfoChar(task->queryString, ')');
+		batchRowCount++;
 
-			tuplestore_puttuple(tupleStore, heapTuple);
-			MemoryContextReset(ioContext);
+		if (batchRowCount >= INSERT_SELECT_BATCH_ROW_COUNT)
+		{
+			affectedRowCount += ExecuteInsertBatch(batchTaskList);
+
+			batchTaskList = NIL;
+			batchRowCount = 0;
+
+			MemoryContextSwitchTo(oldContext);
+			MemoryContextReset(batchContext);
+		}
+		else
+		{
+			MemoryContextSwitchTo(oldContext);
 		}
+	}
 
-		PQclear(result);
+	if (batchTaskList != NIL)
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(batchContext);
+
+		affectedRowCount += ExecuteInsertBatch(batchTaskList);
+
+		MemoryContextSwitchTo(oldContext);
 	}
 
-	pfree(columnArray);
+	ExecDropSingleTupleTableSlot(selectSlot);
+	tuplestore_end(selectStore);
+	MemoryContextDelete(batchContext);
 
-	return true;
+	return affectedRowCount;
 }
 
 
 /*
- * TupleStoreToTable inserts the tuples from the given tupleStore into the given
- * table. Before doing so, the function extracts the values from the tuple and
- * sets the right attributes for the given table based on the column attribute
- * numbers.
+ * ExecuteSelectIntoTupleStore plans and executes the given SELECT, and returns
+ * a tuplestore holding all of its rows. The descriptor of these rows is set in
+ * the tupleDescriptor output parameter.
  */
-static void
-TupleStoreToTable(RangeVar *tableRangeVar, List *storeToTableColumnList,
-				  TupleDesc storeTupleDescriptor, Tuplestorestate *store)
+static Tuplestorestate *
+ExecuteSelectIntoTupleStore(Query *selectQuery, ParamListInfo boundParams,
+							const char *queryString, TupleDesc *tupleDescriptor)
 {
-	Relation table = heap_openrv(tableRangeVar, RowExclusiveLock);
-	TupleDesc tableTupleDescriptor = RelationGetDescr(table);
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(false, false, work_mem);
+	DestReceiver *tupleStoreReceiver = CreateDestReceiver(DestTuplestore);
+	PlannedStmt *selectPlan = NULL;
+	QueryDesc *queryDesc = NULL;
 
-	int tableColumnCount = tableTupleDescriptor->natts;
-	Datum *tableTupleValues = palloc0(tableColumnCount * sizeof(Datum));
-	bool *tableTupleNulls = palloc0(tableColumnCount * sizeof(bool));
+	SetTuplestoreDestReceiverParams(tupleStoreReceiver, tupleStore,
+									CurrentMemoryContext, false);
 
-	int storeColumnCount = storeTupleDescriptor->natts;
-	Datum *storeTupleValues = palloc0(storeColumnCount * sizeof(Datum));
-	bool *storeTupleNulls = palloc0(storeColumnCount * sizeof(bool));
-	TupleTableSlot *storeTableSlot = MakeSingleTupleTableSlot(storeTupleDescriptor);
+	selectPlan = pg_plan_query(copyObject(selectQuery), 0, boundParams);
+	queryDesc = CreateQueryDesc(selectPlan, queryString, GetActiveSnapshot(),
+								InvalidSnapshot, tupleStoreReceiver, boundParams, 0);
 
-	for (;;)
+	ExecutorStart(queryDesc, 0);
+	ExecutorRun(queryDesc, ForwardScanDirection, 0L);
+	ExecutorFinish(queryDesc);
+
+	(*tupleDescriptor) = CreateTupleDescCopy(queryDesc->tupDesc);
+
+	ExecutorEnd(queryDesc);
+	FreeQueryDesc(queryDesc);
+
+	(*tupleStoreReceiver->rDestroy)(tupleStoreReceiver);
+
+	return tupleStore;
+}
+
+
+/*
+ * InsertSelectColumnValue computes the value the given target entry of an
+ * INSERT ... SELECT assigns to its column for the SELECT's current row. Plain
+ * columns of the SELECT are taken as they are. Other expressions, such as type
+ * coercions or column defaults, are evaluated for each row.
+ */
+static Const *
+InsertSelectColumnValue(TargetEntry *targetEntry, TupleTableSlot *selectSlot,
+						ParamListInfo boundParams)
+{
+	Node *expression = (Node *) targetEntry->expr;
+
+	if (IsA(expression, Var))
 	{
-		HeapTuple storeTuple = NULL;
-		HeapTuple tableTuple = NULL;
-		int storeColumnIndex = 0;
+		return (Const *) ReplaceSelectColumns(expression, selectSlot);
+	}
 
-		bool nextTuple = tuplestore_gettupleslot(store, true, false, storeTableSlot);
-		if (!nextTuple)
-		{
-			break;
-		}
+	expression = ReplaceSelectColumns(copyObject(expression), selectSlot);
 
-		storeTuple = ExecFetchSlotTuple(storeTableSlot);
-		heap_deform_tuple(storeTuple, storeTupleDescriptor,
-						  storeTupleValues, storeTupleNulls);
+	return EvaluateExpression((Expr *) expression, boundParams);
+}
 
-		/* set all values to null for the table tuple */
-		memset(tableTupleNulls, true, tableColumnCount * sizeof(bool));
 
-		/*
-		 * Extract values from the returned tuple and set them in the right
-		 * attribute location for the new table. We determine this attribute
-		 * location based on the attribute number in the column from the remote
-		 * query's target list.
-		 */
-		for (storeColumnIndex = 0; storeColumnIndex < storeColumnCount;
-			 storeColumnIndex++)
-		{
-			TargetEntry *tableEntry = (TargetEntry *) list_nth(storeToTableColumnList,
-															   storeColumnIndex);
-			Expr *tableExpression = tableEntry->expr;
-			Var *tableColumn = NULL;
-			int tableColumnId = 0;
+/*
+ * ReplaceSelectColumns replaces references to the columns of an INSERT ...
+ * SELECT's SELECT in the given expression with constants holding the values
+ * of the current row.
+ */
+static Node *
+ReplaceSelectColumns(Node *node, TupleTableSlot *selectSlot)
+{
+	if (node == NULL)
+	{
+		return NULL;
+	}
+
+	if (IsA(node, Var))
+	{
+		Var *column = (Var *) node;
+		int attributeIndex = column->varattno - 1;
+		int16 typeLength = 0;
+		bool typeByValue = false;
+
+		get_typlenbyval(column->vartype, &typeLength, &typeByValue);
+
+		return (Node *) makeConst(column->vartype, column->vartypmod,
+								  column->varcollid, typeLength,
+								  selectSlot->tts_values[attributeIndex],
+								  selectSlot->tts_isnull[attributeIndex], typeByValue);
+	}
+
+	return expression_tree_mutator(node, ReplaceSelectColumns, (void *) selectSlot);
+}
+
+
+/*
+ * ExecuteInsertBatch executes the given multi-row INSERT tasks, each targeting
+ * a different shard, on all finalized placements of their shards. It returns
+ * the number of rows inserted. The shards are locked like those of any other
+ * INSERT; the executor normally holds these locks already.
+ */
+static int32
+ExecuteInsertBatch(List *batchTaskList)
+{
+	DistributedPlan *batchPlan = palloc0(sizeof(DistributedPlan));
+	LOCKMODE lockMode = CommutativityRuleToLockMode(CMD_INSERT);
+	ListCell *taskCell = NULL;
 
-			/* special case for count(*) as we expect a NULL const */
-			if (IsA(tableExpression, Const))
-			{
-				Const *constValue PG_USED_FOR_ASSERTS_ONLY = (Const *) tableExpression;
-				Assert(constValue->consttype == UNKNOWNOID);
+	AcquireExecutorShardLocks(batchTaskList, lockMode);
 
-				/* skip over the null consts */
-				continue;
-			}
+	foreach(taskCell, batchTaskList)
+	{
+		Task *task = (Task *) lfirst(taskCell);
 
-			Assert(IsA(tableExpression, Var));
-			tableColumn = (Var *) tableExpression;
-			tableColumnId = tableColumn->varattno;
+		/* placements may have failed during earlier batches, so load them anew */
+		task->taskPlacementList = ReloadTaskPlacementList(task);
 
-			tableTupleValues[tableColumnId - 1] = storeTupleValues[storeColumnIndex];
-			tableTupleNulls[tableColumnId - 1] = storeTupleNulls[storeColumnIndex];
+		if (LogDistributedStatements)
+		{
+			ereport(LOG, (errmsg("distributed statement: %s", task->queryString->data)));
 		}
+	}
 
-		tableTuple = heap_form_tuple(tableTupleDescriptor,
-									 tableTupleValues, tableTupleNulls);
+	batchPlan->plan.type = (NodeTag) T_DistributedPlan;
+	batchPlan->taskList = batchTaskList;
 
-		simple_heap_insert(table, tableTuple);
-		CommandCounterIncrement();
+	return ExecuteDistributedModify(batchPlan, NULL, NULL);
+}
 
-		ExecClearTuple(storeTableSlot);
-		heap_freetuple(tableTuple);
+
+/*
+ * SendQueryResultRows builds tuples from the rows of the given result and sends
+ * them to the given destination receiver.
+ */
+static void
+SendQueryResultRows(PGresult *result, TupleDesc tupleDescriptor,
+					DestReceiver *destination)
+{
+	AttInMetadata *attributeInputMetadata = TupleDescGetAttInMetadata(tupleDescriptor);
+	TupleTableSlot *tupleTableSlot = MakeSingleTupleTableSlot(tupleDescriptor);
+	uint32 rowCount = PQntuples(result);
+	uint32 rowIndex = 0;
+
+	MemoryContext ioContext = AllocSetContextCreate(CurrentMemoryContext,
+													"SendQueryResultRows",
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
+
+	for (rowIndex = 0; rowIndex < rowCount; rowIndex++)
+	{
+		HeapTuple heapTuple = BuildRemoteResultTuple(result, rowIndex,
+													 attributeInputMetadata, ioContext);
+
+		ExecStoreTuple(heapTuple, tupleTableSlot, InvalidBuffer, false);
+		(*destination->receiveSlot)(tupleTableSlot, destination);
+
+		ExecClearTuple(tupleTableSlot);
+		MemoryContextReset(ioContext);
 	}
 
-	ExecDropSingleTupleTableSlot(storeTableSlot);
-	heap_close(table, RowExclusiveLock);
+	ExecDropSingleTupleTableSlot(tupleTableSlot);
+	MemoryContextDelete(ioContext);
 }
 
 
 /*
- * PgShardExecutorRun actually runs a distributed plan, if any.
+ * ExecuteSingleShardSelect executes the remote select query and sends the
+ * resultant tuples to the given destination receiver. If all rows are wanted
+ * at once, they are first fetched into a tuple store, and the query is retried
+ * on the task's other placements if it fails on one. Otherwise, for instance
+ * when a cursor fetches a limited number of rows, rows are streamed from the
+ * remote node on demand; see StreamRemoteRows.
  */
 static void
-PgShardExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count)
+ExecuteSingleShardSelect(DistributedPlan *distributedPlan, RemoteSelectState *selectState,
+						 EState *executorState, TupleDesc tupleDescriptor,
+						 DestReceiver *destination, long count)
 {
-	PlannedStmt *plannedStatement = queryDesc->plannedstmt;
-	bool pgShardExecution = IsPgShardPlan(plannedStatement);
+	Task *task = NULL;
+	List *taskList = distributedPlan->taskList;
+	bool streamStarted = (selectState->connection != NULL ||
+						  selectState->returnedRowCount > 0);
 
-	if (pgShardExecution)
-	{
-		EState *estate = queryDesc->estate;
-		CmdType operation = queryDesc->operation;
-		DistributedPlan *plan = (DistributedPlan *) plannedStatement->planTree;
-		MemoryContext oldcontext = NULL;
+	Assert(list_length(taskList) == 1);
+	task = (Task *) linitial(taskList);
 
-		Assert(estate != NULL);
-		Assert(!(estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY));
+	/* startup the tuple receiver */
+	(*destination->rStartup)(destination, CMD_SELECT, tupleDescriptor);
 
-		/* we only support default scan direction and row fetch count */
-		if (!ScanDirectionIsForward(direction))
-		{
-			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							errmsg("scan directions other than forward scans "
-								   "are unsupported")));
-		}
-		if (count != 0)
+	if (selectState->queryFinished)
+	{
+		/* all rows have already been returned */
+	}
+	else if (count == 0 && !streamStarted)
+	{
+		Tuplestorestate *tupleStore = tuplestore_begin_heap(false, false, work_mem);
+		TupleTableSlot *tupleTableSlot = NULL;
+
+		bool resultsOK = ExecuteTaskAndStoreResults(task, tupleDescriptor, tupleStore);
+		if (!resultsOK)
 		{
-			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							errmsg("fetching rows from a query using a cursor "
-								   "is unsupported")));
+			ereport(ERROR, (errmsg("could not receive query results")));
 		}
 
-		oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+		tupleTableSlot = MakeSingleTupleTableSlot(tupleDescriptor);
 
-		if (queryDesc->totaltime != NULL)
+		/* iterate over tuples in tuple store, and send them to destination */
+		for (;;)
 		{
-			InstrStartNode(queryDesc->totaltime);
-		}
+			bool nextTuple = tuplestore_gettupleslot(tupleStore, true, false,
+													 tupleTableSlot);
+			if (!nextTuple)
+			{
+				break;
+			}
 
-		if (operation == CMD_INSERT || operation == CMD_UPDATE ||
-			operation == CMD_DELETE)
-		{
-			int32 affectedRowCount = ExecuteDistributedModify(plan);
-			estate->es_processed = affectedRowCount;
-		}
-		else if (operation == CMD_SELECT)
-		{
-			DestReceiver *destination = queryDesc->dest;
-			List *targetList = plan->targetList;
-			TupleDesc tupleDescriptor = ExecCleanTypeFromTL(targetList, false);
+			(*destination->receiveSlot)(tupleTableSlot, destination);
+			executorState->es_processed++;
 
-			ExecuteSingleShardSelect(plan, estate, tupleDescriptor, destination);
-		}
-		else
-		{
-			ereport(ERROR, (errmsg("unrecognized operation code: %d",
-								   (int) operation)));
+			ExecClearTuple(tupleTableSlot);
 		}
 
-		if (queryDesc->totaltime != NULL)
-		{
-			InstrStopNode(queryDesc->totaltime, estate->es_processed);
-		}
+		ExecDropSingleTupleTableSlot(tupleTableSlot);
+		tuplestore_end(tupleStore);
 
-		MemoryContextSwitchTo(oldcontext);
+		selectState->returnedRowCount = executorState->es_processed;
+		selectState->queryFinished = true;
 	}
 	else
 	{
-		/* this isn't a query pg_shard handles: use previous hook or standard */
-		if (PreviousExecutorRunHook != NULL)
-		{
-			PreviousExecutorRunHook(queryDesc, direction, count);
-		}
-		else
-		{
-			standard_ExecutorRun(queryDesc, direction, count);
-		}
+		StreamRemoteRows(task, selectState, executorState, tupleDescriptor,
+						 destination, count);
 	}
+
+	/* shutdown the tuple receiver */
+	(*destination->rShutdown)(destination);
 }
 
 
 /*
- * ExecuteDistributedModify is the main entry point for modifying distributed
- * tables. A distributed modification is successful if any placement of the
- * distributed table is successful. ExecuteDistributedModify returns the number
- * of modified rows in that case and errors in all others. This function will
- * also generate warnings for individual placement failures.
+ * StreamRemoteRows sends up to count rows of the task's query to the given
+ * destination receiver, or all remaining rows if count is zero. Rows are read
+ * from the remote node in single-row mode as they are needed, so memory use is
+ * bounded by the number of rows fetched rather than by the size of the result.
+ * The query keeps running on its connection between calls. As rows which have
+ * been returned cannot be taken back, the query is only retried on another
+ * placement if it fails before returning any rows.
  */
-static int32
-ExecuteDistributedModify(DistributedPlan *plan)
+static void
+StreamRemoteRows(Task *task, RemoteSelectState *selectState, EState *executorState,
+				 TupleDesc tupleDescriptor, DestReceiver *destination, long count)
 {
-	int32 affectedTupleCount = -1;
-	Task *task = (Task *) linitial(plan->taskList);
-	ListCell *taskPlacementCell = NULL;
-	List *failedPlacementList = NIL;
-	ListCell *failedPlacementCell = NULL;
-
-	/* we only support a single modification to a single shard */
-	if (list_length(plan->taskList) != 1)
-	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot modify multiple shards during a single query")));
-	}
+	AttInMetadata *attributeInputMetadata = TupleDescGetAttInMetadata(tupleDescriptor);
+	TupleTableSlot *tupleTableSlot = MakeSingleTupleTableSlot(tupleDescriptor);
+	MemoryContext ioContext = AllocSetContextCreate(CurrentMemoryContext,
+													"StreamRemoteRows",
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
 
-	foreach(taskPlacementCell, task->taskPlacementList)
+	while (!selectState->queryFinished &&
+		   (count == 0 || executorState->es_processed < (uint32) count))
 	{
-		ShardPlacement *taskPlacement = (ShardPlacement *) lfirst(taskPlacementCell);
-		char *nodeName = taskPlacement->nodeName;
-		int32 nodePort = taskPlacement->nodePort;
-
-		PGconn *connection = NULL;
+		PGconn *connection = selectState->connection;
 		PGresult *result = NULL;
-		char *currentAffectedTupleString = NULL;
-		int32 currentAffectedTupleCount = -1;
-
-		Assert(taskPlacement->shardState == STATE_FINALIZED);
+		ExecStatusType resultStatus = 0;
+		uint32 rowIndex = 0;
+		uint32 rowCount = 0;
+		bool resultReady = false;
 
-		connection = GetConnection(nodeName, nodePort);
 		if (connection == NULL)
 		{
-			failedPlacementList = lappend(failedPlacementList, taskPlacement);
+			StartRemoteSelect(task, selectState);
 			continue;
 		}
 
-		result = PQexec(connection, task->queryString->data);
-		if (PQresultStatus(result) != PGRES_COMMAND_OK)
+		resultReady = AwaitRemoteResult(connection);
+		if (!resultReady)
 		{
-			ReportRemoteError(connection, result);
-			PQclear(result);
-
-			failedPlacementList = lappend(failedPlacementList, taskPlacement);
+			ReportRemoteError(connection, NULL);
+			FailRemoteSelectPlacement(selectState);
 			continue;
 		}
 
-		currentAffectedTupleString = PQcmdTuples(result);
-		currentAffectedTupleCount = pg_atoi(currentAffectedTupleString, sizeof(int32), 0);
-
-		if ((affectedTupleCount == -1) ||
-			(affectedTupleCount == currentAffectedTupleCount))
+		result = PQgetResult(connection);
+		if (result == NULL)
 		{
-			affectedTupleCount = currentAffectedTupleCount;
+			RemoteQueryFinished(connection);
+
+			selectState->connection = NULL;
+			selectState->queryFinished = true;
+			break;
 		}
-		else
+
+		resultStatus = PQresultStatus(result);
+		if ((resultStatus != PGRES_SINGLE_TUPLE) && (resultStatus != PGRES_TUPLES_OK))
 		{
-			ereport(WARNING, (errmsg("modified %d tuples, but expected to modify %d",
-									 currentAffectedTupleCount, affectedTupleCount),
-							  errdetail("modified placement on %s:%d",
-										nodeName, nodePort)));
+			ReportRemoteError(connection, result);
+			PQclear(result);
+
+			FailRemoteSelectPlacement(selectState);
+			continue;
 		}
 
-		PQclear(result);
-	}
+		rowCount = PQntuples(result);
+		for (rowIndex = 0; rowIndex < rowCount; rowIndex++)
+		{
+			HeapTuple heapTuple = BuildRemoteResultTuple(result, rowIndex,
+														 attributeInputMetadata,
+														 ioContext);
 
-	/* if all placements failed, error out */
-	if (list_length(failedPlacementList) == list_length(task->taskPlacementList))
-	{
-		ereport(ERROR, (errmsg("could not modify any active placements")));
-	}
+			ExecStoreTuple(heapTuple, tupleTableSlot, InvalidBuffer, false);
+			(*destination->receiveSlot)(tupleTableSlot, destination);
+			executorState->es_processed++;
+			selectState->returnedRowCount++;
 
-	/* otherwise, mark failed placements as inactive: they're stale */
-	foreach(failedPlacementCell, failedPlacementList)
-	{
-		ShardPlacement *failedPlacement = (ShardPlacement *) lfirst(failedPlacementCell);
+			ExecClearTuple(tupleTableSlot);
+			MemoryContextReset(ioContext);
+		}
 
-		DeleteShardPlacementRow(failedPlacement->id);
-		InsertShardPlacementRow(failedPlacement->id, failedPlacement->shardId,
-								STATE_INACTIVE, failedPlacement->nodeName,
-								failedPlacement->nodePort);
+		PQclear(result);
 	}
 
-	return affectedTupleCount;
+	ExecDropSingleTupleTableSlot(tupleTableSlot);
+	MemoryContextDelete(ioContext);
 }
 
 
 /*
- * ExecuteSingleShardSelect executes the remote select query and sends the
- * resultant tuples to the given destination receiver. If the query fails on a
- * given placement, the function attempts it on its replica.
+ * StartRemoteSelect sends the task's query in single-row mode to the current
+ * placement of the given select state, moving on to further placements if
+ * that fails. Each streaming query gets a connection of its own, so that other
+ * queries can run while a cursor is open. The function errors out if the task
+ * runs out of placements.
  */
 static void
-ExecuteSingleShardSelect(DistributedPlan *distributedPlan, EState *executorState,
-						 TupleDesc tupleDescriptor, DestReceiver *destination)
+StartRemoteSelect(Task *task, RemoteSelectState *selectState)
 {
-	Task *task = NULL;
-	Tuplestorestate *tupleStore = NULL;
-	bool resultsOK = false;
-	TupleTableSlot *tupleTableSlot = NULL;
+	List *taskPlacementList = task->taskPlacementList;
 
-	List *taskList = distributedPlan->taskList;
-	Assert(list_length(taskList) == 1);
+	while (selectState->connection == NULL)
+	{
+		ShardPlacement *taskPlacement = NULL;
+		PGconn *connection = NULL;
+		int32 connectionSlot = 0;
+		bool queryOK = false;
 
-	task = (Task *) linitial(taskList);
-	tupleStore = tuplestore_begin_heap(false, false, work_mem);
+		if (selectState->placementIndex >= list_length(taskPlacementList))
+		{
+			ereport(ERROR, (errmsg("could not receive query results")));
+		}
 
-	resultsOK = ExecuteTaskAndStoreResults(task, tupleDescriptor, tupleStore);
-	if (!resultsOK)
-	{
-		ereport(ERROR, (errmsg("could not receive query results")));
+		taskPlacement = (ShardPlacement *) list_nth(taskPlacementList,
+													selectState->placementIndex);
+
+		connectionSlot = FreeCursorConnectionSlot(taskPlacement);
+		connection = GetConnectionForSlot(taskPlacement->nodeName,
+										  taskPlacement->nodePort, connectionSlot);
+		if (connection == NULL)
+		{
+			selectState->placementIndex++;
+			continue;
+		}
+
+		queryOK = SendQueryInSingleRowMode(connection, task);
+		if (!queryOK)
+		{
+			PurgeConnection(connection);
+			selectState->placementIndex++;
+			continue;
+		}
+
+		selectState->connection = connection;
 	}
+}
 
-	tupleTableSlot = MakeSingleTupleTableSlot(tupleDescriptor);
 
-	/* startup the tuple receiver */
-	(*destination->rStartup)(destination, CMD_SELECT, tupleDescriptor);
+/*
+ * FreeCursorConnectionSlot returns the first connection slot reserved for
+ * cursors which is not currently streaming rows from the given placement's
+ * node. The function errors out if all such slots are in use.
+ */
+static int32
+FreeCursorConnectionSlot(ShardPlacement *placement)
+{
+	int32 slotIndex = 0;
 
-	/* iterate over tuples in tuple store, and send them to destination */
-	for (;;)
+	for (slotIndex = 0; slotIndex < MAX_CURSOR_CONNECTIONS_PER_NODE; slotIndex++)
 	{
-		bool nextTuple = tuplestore_gettupleslot(tupleStore, true, false, tupleTableSlot);
-		if (!nextTuple)
+		int32 connectionSlot = FIRST_CURSOR_CONNECTION_SLOT + slotIndex;
+		bool slotInUse = RemoteQueryInProgress(placement->nodeName,
+											   placement->nodePort, connectionSlot);
+		if (!slotInUse)
 		{
-			break;
+			return connectionSlot;
 		}
+	}
 
-		(*destination->receiveSlot)(tupleTableSlot, destination);
-		executorState->es_processed++;
+	ereport(ERROR, (errcode(ERRCODE_TOO_MANY_CONNECTIONS),
+					errmsg("too many cursors are open on node \"%s:%d\"",
+						   placement->nodeName, placement->nodePort),
+					errhint("Close some cursors and try again.")));
 
-		ExecClearTuple(tupleTableSlot);
-	}
+	return -1;
+}
 
-	/* shutdown the tuple receiver */
-	(*destination->rShutdown)(destination);
 
-	ExecDropSingleTupleTableSlot(tupleTableSlot);
+/*
+ * FailRemoteSelectPlacement closes the connection a failed streaming query ran
+ * on. If the query has not returned any rows yet, it will be retried on the
+ * next placement. Otherwise, the function errors out.
+ */
+static void
+FailRemoteSelectPlacement(RemoteSelectState *selectState)
+{
+	PurgeConnection(selectState->connection);
+	selectState->connection = NULL;
+
+	if (selectState->returnedRowCount > 0)
+	{
+		ereport(ERROR, (errmsg("could not receive query results"),
+						errdetail("The query failed after some of its rows were "
+								  "returned.")));
+	}
 
-	tuplestore_end(tupleStore);
+	selectState->placementIndex++;
 }
 
 
@@ -1913,12 +6261,27 @@ PgShardExecutorEnd(QueryDesc *queryDesc)
 	if (pgShardExecution)
 	{
 		EState *estate = queryDesc->estate;
+		DistributedPlan *distributedPlan = (DistributedPlan *) plannedStatement->planTree;
+		RemoteSelectState *selectState = distributedPlan->selectState;
 
 		Assert(estate != NULL);
 		Assert(estate->es_finished);
 
+		/* stop streaming rows if a cursor was closed before reading them all */
+		if (selectState != NULL && selectState->connection != NULL)
+		{
+			AbandonRemoteQuery(selectState->connection);
+		}
+
+		if (queryDesc->planstate != NULL)
+		{
+			ExecEndNode(queryDesc->planstate);
+			ExecResetTupleTable(estate->es_tupleTable, false);
+		}
+
 		FreeExecutorState(estate);
 		queryDesc->estate = NULL;
+		queryDesc->planstate = NULL;
 		queryDesc->totaltime = NULL;
 	}
 	else
@@ -1950,60 +6313,42 @@ PgShardProcessUtility(Node *parsetree, const char *queryString,
 	{
 		/* extract the query from the explain statement */
 		Query *query = UtilityContainsQuery(parsetree);
+		List *queryList = NIL;
+		ListCell *queryCell = NULL;
 
 		if (query != NULL)
 		{
-			PlannerType plannerType = DeterminePlannerType(query);
-			if (plannerType == PLANNER_TYPE_PG_SHARD)
-			{
-				ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-								errmsg("EXPLAIN commands on distributed tables "
-									   "are unsupported")));
-			}
+			queryList = list_make1(query);
 		}
-	}
-	else if (statementType == T_PrepareStmt)
-	{
-		PrepareStmt *prepareStatement = (PrepareStmt *) parsetree;
-		Query *parsedQuery = NULL;
-		Node *rawQuery = copyObject(prepareStatement->query);
-		int argumentCount = list_length(prepareStatement->argtypes);
-		Oid *argumentTypeArray = NULL;
-		PlannerType plannerType = PLANNER_INVALID_FIRST;
-
-		/* transform list of TypeNames to array of type OID's if they exist */
-		if (argumentCount > 0)
+		else
 		{
-			List *argumentTypeList = prepareStatement->argtypes;
-			ListCell *argumentTypeCell = NULL;
-			uint32 argumentTypeIndex = 0;
-
-			ParseState *parseState = make_parsestate(NULL);
-			parseState->p_sourcetext = queryString;
+			/* for EXPLAIN EXECUTE, look at the prepared statement's queries */
+			Query *explainedQuery = (Query *) ((ExplainStmt *) parsetree)->query;
+			Node *utilityStatement = explainedQuery->utilityStmt;
 
-			argumentTypeArray = (Oid *) palloc0(argumentCount * sizeof(Oid));
-
-			foreach(argumentTypeCell, argumentTypeList)
+			if (utilityStatement != NULL && IsA(utilityStatement, ExecuteStmt))
 			{
-				TypeName *typeName = lfirst(argumentTypeCell);
-				Oid typeId = typenameTypeId(parseState, typeName);
+				ExecuteStmt *executeStatement = (ExecuteStmt *) utilityStatement;
+				PreparedStatement *preparedStatement =
+					FetchPreparedStatement(executeStatement->name, false);
 
-				argumentTypeArray[argumentTypeIndex] = typeId;
-				argumentTypeIndex++;
+				if (preparedStatement != NULL)
+				{
+					queryList = preparedStatement->plansource->query_list;
+				}
 			}
 		}
 
-		/* analyze the statement using these parameter types */
-		parsedQuery = parse_analyze_varparams(rawQuery, queryString,
-											  &argumentTypeArray, &argumentCount);
-
-		/* determine if the query runs on a distributed table */
-		plannerType = DeterminePlannerType(parsedQuery);
-		if (plannerType == PLANNER_TYPE_PG_SHARD)
+		foreach(queryCell, queryList)
 		{
-			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							errmsg("PREPARE commands on distributed tables "
-								   "are unsupported")));
+			Query *explainedQuery = (Query *) lfirst(queryCell);
+			PlannerType plannerType = DeterminePlannerType(explainedQuery);
+			if (plannerType == PLANNER_TYPE_PG_SHARD)
+			{
+				ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+								errmsg("EXPLAIN commands on distributed tables "
+									   "are unsupported")));
+			}
 		}
 	}
 	else if (statementType == T_CopyStmt)
@@ -13,8 +13,12 @@
 #define PG_SHARD_H
 
 #include "c.h"
+#include "libpq-fe.h"
+
+#include "distribution_metadata.h"
 
 #include "access/tupdesc.h"
+#include "nodes/execnodes.h"
 #include "nodes/parsenodes.h"
 #include "nodes/pg_list.h"
 #include "nodes/plannodes.h"
@@ -25,9 +29,15 @@
 /* prefix used for temporary tables created on the master node */
 #define TEMPORARY_TABLE_PREFIX "pg_shard_temp_table"
 
+/* prefix of column names of temporary tables holding rows of distributed joins */
+#define INTERMEDIATE_COLUMN_PREFIX "intermediate_column_"
+
 /* extension name used to determine if extension has been created */
 #define PG_SHARD_EXTENSION_NAME "pg_shard"
 
+/* name through which the master connects to itself to commit metadata changes */
+#define MASTER_NODE_NAME "localhost"
+
 
 /*
  * DistributedNodeTag identifies nodes used in the planning and execution of
@@ -36,10 +46,20 @@
 typedef enum DistributedNodeTag
 {
 	/* Tags for distributed planning begin a safe distance after all other tags. */
-	T_DistributedPlan = 2100,       /* plan to be built and passed to executor */
+	T_DistributedPlan = 2100        /* plan built and run by the executor */
 } DistributedNodeTag;
 
 
+/*
+ * Distributed plans are only built at executor start. Until then, the planned
+ * statement holds a Result plan in their place, whose constant qualifier is a
+ * list of the marker below, the query as planned and as normalized, the query's
+ * standard plan, and its cursor options, in this order.
+ */
+#define DISTRIBUTED_PLAN_MARKER "pg_shard distributed plan"
+#define PLACEHOLDER_LIST_LENGTH 5
+
+
 /*
  * PlannerType identifies the type of planner which should be used for a given
  * query.
@@ -53,6 +73,21 @@ typedef enum PlannerType
 } PlannerType;
 
 
+/*
+ * RemoteSelectState keeps the state of a single-shard SELECT between calls to
+ * ExecutorRun, which allows cursors to fetch the SELECT's rows from the remote
+ * node a batch at a time. Distributed plans are built for each execution, so
+ * the state is kept in the plan.
+ */
+typedef struct RemoteSelectState
+{
+	int32 placementIndex;           /* index of the placement rows come from */
+	PGconn *connection;             /* connection streaming rows, if any */
+	uint64 returnedRowCount;        /* number of rows returned so far */
+	bool queryFinished;             /* whether all rows have been returned */
+} RemoteSelectState;
+
+
 /*
  * DistributedPlan contains a set of tasks to be executed remotely as part of a
  * distributed query.
@@ -66,6 +101,12 @@ typedef struct DistributedPlan
 
 	bool selectFromMultipleShards; /* does the select run across multiple shards? */
 	CreateStmt *createTemporaryTableStmt; /* valid for multiple shard selects */
+	Query *localQuery;  /* query over the temporary table of multi-shard joins */
+
+	int cursorOptions;  /* cursor options the query was planned with */
+
+	Query *insertSelectQuery; /* INSERT ... SELECT routed through the master, if any */
+	RemoteSelectState *selectState; /* state of a single-shard SELECT, once started */
 } DistributedPlan;
 
 
@@ -81,14 +122,68 @@ typedef struct Task
 	StringInfo queryString;     /* SQL string suitable for immediate remote execution */
 	List *taskPlacementList;    /* ShardPlacements on which the task can be executed */
 	int64 shardId;              /* Denormalized shardId of tasks for convenience */
+	Oid relationId;             /* Distributed table the task's query refers to */
+	int64 sourceShardId;        /* Shard read by an INSERT ... SELECT, if any */
+	Query *query;               /* Query deparsed into the query string, if kept */
+
+	int parameterCount;         /* number of parameters referenced as $n, if any */
+	Oid *parameterTypes;        /* types of parameters, zero to let node infer them */
+	const char **parameterValues; /* parameter values in text format, or NULL */
 } Task;
 
 
+/* longest time to block in poll while executing tasks concurrently */
+#define EXECUTOR_POLL_TIMEOUT_MSECS 100
+
+/* number of rows an INSERT ... SELECT routed through the master sends at once */
+#define INSERT_SELECT_BATCH_ROW_COUNT 1000
+
+
+/*
+ * TaskExecutionStatus represents the progress of a single task while the tasks
+ * of a multi-shard query are executed concurrently.
+ */
+typedef enum TaskExecutionStatus
+{
+	TASK_STATUS_INVALID_FIRST = 0,
+	TASK_STATUS_PENDING = 1,    /* waiting for a free connection to its placement */
+	TASK_STATUS_RUNNING = 2,    /* query sent; results are being received */
+	TASK_STATUS_FINISHED = 3,   /* all results received and stored */
+	TASK_STATUS_FAILED = 4      /* placement could not be modified */
+} TaskExecutionStatus;
+
+
+/*
+ * TaskExecution tracks the execution of one task of a multi-shard query. The
+ * task's placements are tried in order: if its query fails on one placement,
+ * any results received so far are discarded and the task goes back to waiting
+ * for a connection to the next one. An execution may also run a task which
+ * combines several tasks into a single query on one node; if that fails, the
+ * combined tasks are executed individually instead. Modifications, which must
+ * reach every placement, instead use one execution per placement of each task.
+ */
+typedef struct TaskExecution
+{
+	Task *task;                     /* task being executed */
+	TaskExecutionStatus status;     /* current state of execution */
+	int32 placementIndex;           /* index of the placement being used */
+	int32 connectionSlot;           /* slot of the connection, if running */
+	PGconn *connection;             /* connection used, if running */
+	Tuplestorestate *tupleStore;    /* results received so far, if running */
+	List *groupedTaskList;          /* tasks combined into this task, if any */
+	int32 affectedRowCount;         /* rows modified by placement, or -1 if unknown */
+} TaskExecution;
+
+
 /* function declarations for extension loading and unloading */
 extern void _PG_init(void);
 extern void _PG_fini(void);
 extern bool ExecuteTaskAndStoreResults(Task *task, TupleDesc tupleDescriptor,
 									   Tuplestorestate *tupleStore);
+extern ShardInterval * ColocatedShardInterval(ShardInterval *shardInterval,
+											  List *shardIntervalList);
+extern List * QueryRestrictList(Query *query);
+extern void FoldConstantExpressions(Query *query);
 
 
 #endif /* PG_SHARD_H */
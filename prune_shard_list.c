@@ -78,9 +78,23 @@ PruneShardList(Oid relationId, List *whereClauseList, List *shardIntervalList)
 	List *restrictInfoList = NIL;
 	Node *baseConstraint = NULL;
 
-	Var *partitionColumn = PartitionColumn(relationId);
+	Var *partitionColumn = NULL;
 	char partitionMethod = PartitionType(relationId);
 
+	/* reference tables are not partitioned, so none of their shards are pruned */
+	if (partitionMethod == REFERENCE_PARTITION_TYPE)
+	{
+		foreach(shardIntervalCell, shardIntervalList)
+		{
+			ShardInterval *shardInterval = lfirst(shardIntervalCell);
+			remainingShardList = lappend(remainingShardList, &(shardInterval->id));
+		}
+
+		return remainingShardList;
+	}
+
+	partitionColumn = PartitionColumn(relationId);
+
 	/* build the filter clause list for the partition method */
 	if (partitionMethod == DISTRIBUTE_BY_HASH)
 	{
@@ -0,0 +1,988 @@
+/*-------------------------------------------------------------------------
+ *
+ * rebalance_shards.c
+ *
+ * This file contains functions to spread the shards of a distributed table
+ * evenly across the worker nodes, for instance after new nodes were added to
+ * the worker list. Placements are moved by copying them to their new node and
+ * only then switching the metadata over to the copy.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "fmgr.h"
+#include "postgres_ext.h"
+
+#include "connection.h"
+#include "create_shards.h"
+#include "ddl_commands.h"
+#include "distribution_metadata.h"
+#include "pg_shard.h"
+#include "rebalance_shards.h"
+#include "repair_shards.h"
+
+#include <string.h>
+
+#include "catalog/pg_class.h"
+#include "lib/stringinfo.h"
+#include "nodes/pg_list.h"
+#include "utils/builtins.h"
+#include "utils/elog.h"
+#include "utils/errcodes.h"
+#include "utils/int8.h"
+#include "utils/lsyscache.h"
+#include "utils/palloc.h"
+
+
+/* local function forward declarations */
+static void CheckRebalancedTables(List *colocatedTableList);
+static int64 ShardGroupSize(ShardGroup *shardGroup);
+static List * PlanShardGroupMoves(List *shardGroupList, List *workerNodeList,
+								  int32 maxMoves, int32 maxMovedShards);
+static ShardGroupMove * PlanShardGroupMove(List *shardGroupList,
+										   NodeLoad *sourceNodeLoad,
+										   NodeLoad *targetNodeLoad);
+static List * ShardGroupMoveRepairList(ShardGroupMove *move, bool onlineMove);
+static void LockMovedShards(List *moveList);
+static void ReplayMovedShardLogs(List *repairList, int maxBatchCount);
+static bool SwitchShardGroupMove(ShardGroupMove *move, List *moveRepairList);
+static bool DropMoveTarget(ShardRepair *repair);
+static void EndMoveCaptures(List *repairList);
+static ShardPlacement * PlacementOnNode(List *shardPlacementList,
+										WorkerNode *workerNode);
+static int CompareNodeLoads(const void *leftElement, const void *rightElement);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(master_rebalance_table_shards);
+
+
+/*
+ * master_rebalance_table_shards implements a user-facing UDF to even out the
+ * load which the given table's shards put on the nodes in the worker list,
+ * measured either by the number of placements on each node or by their size.
+ * Placements are moved from the most loaded node to less loaded ones for as
+ * long as that narrows the gap between them, up to the given number of moves
+ * if one is given. Shards of co-located tables move along with the table's
+ * shards, so that they remain co-located.
+ *
+ * The placements of all groups are copied together; see MoveShardGroups. A
+ * move which fails only warns, and the other moves are kept. Moves take effect
+ * once the function returns, and reads continue throughout. If pg_shard was
+ * loaded via shared_preload_libraries, modifications continue as well, except
+ * while the moves are switched over at the end; at most MAX_ONLINE_REPAIR_COUNT
+ * shards are then moved per call. Otherwise, modifications of the moved shards
+ * are paused for the length of the call. Placements marked for deletion by an
+ * earlier rebalance or split are dropped first. The function returns the
+ * number of groups moved.
+ */
+Datum
+master_rebalance_table_shards(PG_FUNCTION_ARGS)
+{
+	text *tableNameText = PG_GETARG_TEXT_P(0);
+	char *rebalanceBy = text_to_cstring(PG_GETARG_TEXT_P(1));
+	int32 maxParallel = PG_GETARG_INT32(2);
+	int32 maxMoves = PG_GETARG_INT32(3);
+	Oid distributedTableId = ResolveRelationId(tableNameText);
+	List *colocatedTableList = NIL;
+	List *workerNodeList = NIL;
+	List *shardGroupList = NIL;
+	List *moveList = NIL;
+	bool rebalanceBySize = false;
+	int32 maxMovedShards = 0;
+	int32 movedCount = 0;
+
+	if (strcmp(rebalanceBy, REBALANCE_BY_COUNT) == 0)
+	{
+		rebalanceBySize = false;
+	}
+	else if (strcmp(rebalanceBy, REBALANCE_BY_SIZE) == 0)
+	{
+		rebalanceBySize = true;
+	}
+	else
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("rebalance_by must be one of: %s, %s",
+							   REBALANCE_BY_COUNT, REBALANCE_BY_SIZE)));
+	}
+
+	if (maxParallel < 1)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("max_parallel must be at least one")));
+	}
+
+	if (maxMoves < 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("max_moves must not be negative")));
+	}
+
+	/* every copy needs its own connection to each of its nodes */
+	maxParallel = Min(maxParallel, MaxConnectionsPerNode);
+
+	colocatedTableList = ColocatedTableList(distributedTableId);
+	CheckRebalancedTables(colocatedTableList);
+
+	DropPlacementsToDelete(colocatedTableList);
+
+	workerNodeList = ParseWorkerNodeFile(WORKER_LIST_FILENAME);
+	shardGroupList = LoadShardGroupList(distributedTableId, colocatedTableList,
+										rebalanceBySize);
+
+	/* moving shards online logs the modifications of all of them at once */
+	if (OnlineRepairAvailable())
+	{
+		maxMovedShards = MAX_ONLINE_REPAIR_COUNT;
+	}
+
+	moveList = PlanShardGroupMoves(shardGroupList, workerNodeList, maxMoves,
+								   maxMovedShards);
+
+	movedCount = MoveShardGroups(moveList, maxParallel);
+
+	PG_RETURN_INT32(movedCount);
+}
+
+
+/*
+ * CheckRebalancedTables errors out if any of the given tables cannot have its
+ * shards moved: reference tables are placed on every node anyway, and shards
+ * backed by foreign tables cannot be copied.
+ */
+static void
+CheckRebalancedTables(List *colocatedTableList)
+{
+	ListCell *colocatedTableCell = NULL;
+
+	foreach(colocatedTableCell, colocatedTableList)
+	{
+		Oid relationId = lfirst_oid(colocatedTableCell);
+
+		if (PartitionType(relationId) == REFERENCE_PARTITION_TYPE)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot rebalance reference table \"%s\"",
+								   get_rel_name(relationId))));
+		}
+
+		if (get_rel_relkind(relationId) == RELKIND_FOREIGN_TABLE)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot rebalance shards"),
+							errdetail("Moving shards backed by foreign tables is "
+									  "not supported.")));
+		}
+	}
+}
+
+
+/*
+ * DropPlacementsToDelete drops the placements of the given tables' shards which
+ * an earlier rebalance moved away or an earlier split replaced, and which were
+ * thus marked for deletion, and removes them from the metadata. Split shards
+ * are removed from the metadata as well once all of their placements have been
+ * dropped. Placements which cannot be dropped are left for the next call.
+ */
+void
+DropPlacementsToDelete(List *relationIdList)
+{
+	ListCell *relationIdCell = NULL;
+
+	foreach(relationIdCell, relationIdList)
+	{
+		Oid relationId = lfirst_oid(relationIdCell);
+		List *shardIntervalList = LoadShardIntervalList(relationId);
+		List *splitShardList = LoadShardIntervalListToDelete(relationId);
+		ListCell *shardIntervalCell = NULL;
+
+		foreach(shardIntervalCell, list_concat(shardIntervalList, splitShardList))
+		{
+			ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+			int64 shardId = shardInterval->id;
+			List *shardPlacementList = LoadShardPlacementList(shardId);
+			ListCell *shardPlacementCell = NULL;
+			bool allDropped = true;
+
+			foreach(shardPlacementCell, shardPlacementList)
+			{
+				ShardPlacement *placement = lfirst(shardPlacementCell);
+				char *relationName = NULL;
+				StringInfo dropCommand = NULL;
+				bool dropped = false;
+
+				if (placement->shardState != STATE_TO_DELETE)
+				{
+					continue;
+				}
+
+				relationName = get_rel_name(relationId);
+				AppendShardIdToName(&relationName, shardId);
+
+				dropCommand = makeStringInfo();
+				appendStringInfo(dropCommand, DROP_REGULAR_TABLE_COMMAND,
+								 quote_identifier(relationName));
+
+				dropped = ExecuteRemoteCommandList(placement->nodeName,
+												   placement->nodePort,
+												   list_make1(dropCommand->data));
+				if (!dropped)
+				{
+					ereport(WARNING, (errmsg("could not drop placement of shard "
+											 INT64_FORMAT " on \"%s:%u\"", shardId,
+											 placement->nodeName,
+											 placement->nodePort)));
+					allDropped = false;
+					continue;
+				}
+
+				DeleteShardPlacementRow(placement->id);
+			}
+
+			if (allDropped && list_member_ptr(splitShardList, shardInterval))
+			{
+				DeleteShardRow(shardId);
+			}
+		}
+	}
+}
+
+
+/*
+ * LoadShardGroupList returns the shard groups of the given table, in order of
+ * shard id. Each group holds a shard of the table and the shards of the given
+ * co-located tables which cover the same range, as well as the placements of
+ * the table's shard which are not marked for deletion. The load of each group
+ * is either one or the size of its shards, as measured on healthy placements.
+ */
+List *
+LoadShardGroupList(Oid distributedTableId, List *colocatedTableList,
+				   bool rebalanceBySize)
+{
+	List *shardGroupList = NIL;
+	List *shardIntervalList = LoadShardIntervalList(distributedTableId);
+	List *colocatedShardListList = NIL;
+	ListCell *colocatedTableCell = NULL;
+	ListCell *shardIntervalCell = NULL;
+
+	foreach(colocatedTableCell, colocatedTableList)
+	{
+		Oid relationId = lfirst_oid(colocatedTableCell);
+
+		if (relationId != distributedTableId)
+		{
+			colocatedShardListList = lappend(colocatedShardListList,
+											 LoadShardIntervalList(relationId));
+		}
+	}
+
+	shardIntervalList = SortList(shardIntervalList, CompareShardIntervalsById);
+
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		ShardGroup *shardGroup = (ShardGroup *) palloc0(sizeof(ShardGroup));
+		List *shardPlacementList = LoadShardPlacementList(shardInterval->id);
+		ListCell *colocatedShardListCell = NULL;
+		ListCell *shardPlacementCell = NULL;
+
+		shardGroup->shardIntervalList = list_make1(shardInterval);
+
+		foreach(colocatedShardListCell, colocatedShardListList)
+		{
+			List *colocatedShardList = (List *) lfirst(colocatedShardListCell);
+			ShardInterval *colocatedShard = ColocatedShardInterval(shardInterval,
+																   colocatedShardList);
+			if (colocatedShard == NULL)
+			{
+				ereport(ERROR, (errmsg("could not find shard co-located with shard "
+									   INT64_FORMAT, shardInterval->id)));
+			}
+
+			shardGroup->shardIntervalList = lappend(shardGroup->shardIntervalList,
+													colocatedShard);
+		}
+
+		foreach(shardPlacementCell, shardPlacementList)
+		{
+			ShardPlacement *placement = lfirst(shardPlacementCell);
+
+			if (placement->shardState != STATE_TO_DELETE)
+			{
+				shardGroup->placementList = lappend(shardGroup->placementList,
+													placement);
+			}
+		}
+
+		shardGroup->load = 1;
+		if (rebalanceBySize)
+		{
+			shardGroup->load = ShardGroupSize(shardGroup);
+		}
+
+		shardGroupList = lappend(shardGroupList, shardGroup);
+	}
+
+	return shardGroupList;
+}
+
+
+/*
+ * ShardGroupSize returns the total size of the given group's shards, as taken
+ * from a healthy placement of each. The function errors out if the size of a
+ * shard cannot be determined.
+ */
+static int64
+ShardGroupSize(ShardGroup *shardGroup)
+{
+	int64 shardGroupSize = 0;
+	ListCell *shardIntervalCell = NULL;
+
+	foreach(shardIntervalCell, shardGroup->shardIntervalList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		int64 shardId = shardInterval->id;
+		List *finalizedPlacementList = LoadFinalizedShardPlacementList(shardId);
+		char *relationName = get_rel_name(shardInterval->relationId);
+		StringInfo sizeQuery = makeStringInfo();
+		PGresult *result = NULL;
+		PGconn *connection = NULL;
+		ShardPlacement *placement = NULL;
+		int64 shardSize = 0;
+		bool sizeFound = false;
+
+		AppendShardIdToName(&relationName, shardId);
+		appendStringInfo(sizeQuery, SHARD_SIZE_QUERY,
+						 quote_literal_cstr(quote_identifier(relationName)));
+
+		if (finalizedPlacementList != NIL)
+		{
+			placement = (ShardPlacement *) linitial(finalizedPlacementList);
+			connection = GetConnection(placement->nodeName, placement->nodePort);
+		}
+
+		if (connection != NULL)
+		{
+			result = ExecuteRemoteQuery(connection, sizeQuery->data);
+			if (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) == 1)
+			{
+				sizeFound = scanint8(PQgetvalue(result, 0, 0), true, &shardSize);
+			}
+			else
+			{
+				ReportRemoteError(connection, result);
+			}
+
+			PQclear(result);
+		}
+
+		if (!sizeFound)
+		{
+			ereport(ERROR, (errmsg("could not determine the size of shard "
+								   INT64_FORMAT, shardId)));
+		}
+
+		shardGroupSize += shardSize;
+	}
+
+	return shardGroupSize;
+}
+
+
+/*
+ * PlanShardGroupMoves plans the moves which even out the load of the given
+ * shard groups across the given worker nodes. Each step moves a group from the
+ * most loaded node to the least loaded node which can take it, provided that
+ * the move leaves the source node less loaded than the target node was. The
+ * moves stop once no such move remains, or once the given number of moves has
+ * been planned unless that number is zero. Likewise, unless the given number
+ * of moved shards is zero, the moves stop before moving more shards than that.
+ * Each group is moved at most once, and only its healthy placements are moved.
+ */
+static List *
+PlanShardGroupMoves(List *shardGroupList, List *workerNodeList, int32 maxMoves,
+					int32 maxMovedShards)
+{
+	List *moveList = NIL;
+	List *nodeLoadList = NIL;
+	ListCell *workerNodeCell = NULL;
+	int32 movedShardCount = 0;
+
+	foreach(workerNodeCell, workerNodeList)
+	{
+		WorkerNode *workerNode = (WorkerNode *) lfirst(workerNodeCell);
+		NodeLoad *nodeLoad = (NodeLoad *) palloc0(sizeof(NodeLoad));
+		ListCell *shardGroupCell = NULL;
+
+		nodeLoad->workerNode = workerNode;
+
+		foreach(shardGroupCell, shardGroupList)
+		{
+			ShardGroup *shardGroup = (ShardGroup *) lfirst(shardGroupCell);
+
+			if (PlacementOnNode(shardGroup->placementList, workerNode) != NULL)
+			{
+				nodeLoad->load += shardGroup->load;
+			}
+		}
+
+		nodeLoadList = lappend(nodeLoadList, nodeLoad);
+	}
+
+	while (maxMoves == 0 || list_length(moveList) < maxMoves)
+	{
+		NodeLoad *sourceNodeLoad = NULL;
+		ShardGroupMove *move = NULL;
+		ListCell *nodeLoadCell = NULL;
+
+		if (nodeLoadList == NIL)
+		{
+			break;
+		}
+
+		/* least loaded nodes first, so the most loaded node comes last */
+		nodeLoadList = SortList(nodeLoadList, CompareNodeLoads);
+		sourceNodeLoad = (NodeLoad *) llast(nodeLoadList);
+
+		foreach(nodeLoadCell, nodeLoadList)
+		{
+			NodeLoad *targetNodeLoad = (NodeLoad *) lfirst(nodeLoadCell);
+
+			if (targetNodeLoad == sourceNodeLoad)
+			{
+				break;
+			}
+
+			move = PlanShardGroupMove(shardGroupList, sourceNodeLoad, targetNodeLoad);
+			if (move != NULL)
+			{
+				sourceNodeLoad->load -= move->shardGroup->load;
+				targetNodeLoad->load += move->shardGroup->load;
+				break;
+			}
+		}
+
+		if (move == NULL)
+		{
+			break;
+		}
+
+		movedShardCount += list_length(move->shardGroup->shardIntervalList);
+		if (maxMovedShards > 0 && movedShardCount > maxMovedShards)
+		{
+			break;
+		}
+
+		moveList = lappend(moveList, move);
+	}
+
+	return moveList;
+}
+
+
+/*
+ * PlanShardGroupMove picks the largest of the given groups which has a healthy
+ * placement on the source node, has no placement on the target node, and
+ * whose move narrows the gap between the nodes' loads. If there is such a
+ * group, the function updates the group's placement to be on the target node
+ * and returns the move; otherwise, it returns NULL.
+ */
+static ShardGroupMove *
+PlanShardGroupMove(List *shardGroupList, NodeLoad *sourceNodeLoad,
+				   NodeLoad *targetNodeLoad)
+{
+	int64 loadDifference = sourceNodeLoad->load - targetNodeLoad->load;
+	ShardGroup *movedGroup = NULL;
+	ShardPlacement *movedPlacement = NULL;
+	ShardGroupMove *move = NULL;
+	ListCell *shardGroupCell = NULL;
+
+	foreach(shardGroupCell, shardGroupList)
+	{
+		ShardGroup *shardGroup = (ShardGroup *) lfirst(shardGroupCell);
+		ShardPlacement *sourcePlacement = NULL;
+
+		if (shardGroup->moved || shardGroup->load >= loadDifference)
+		{
+			continue;
+		}
+
+		if (movedGroup != NULL && shardGroup->load <= movedGroup->load)
+		{
+			continue;
+		}
+
+		sourcePlacement = PlacementOnNode(shardGroup->placementList,
+										  sourceNodeLoad->workerNode);
+		if (sourcePlacement == NULL || sourcePlacement->shardState != STATE_FINALIZED)
+		{
+			continue;
+		}
+
+		if (PlacementOnNode(shardGroup->placementList,
+							targetNodeLoad->workerNode) != NULL)
+		{
+			continue;
+		}
+
+		movedGroup = shardGroup;
+		movedPlacement = sourcePlacement;
+	}
+
+	if (movedGroup == NULL)
+	{
+		return NULL;
+	}
+
+	move = (ShardGroupMove *) palloc0(sizeof(ShardGroupMove));
+	move->shardGroup = movedGroup;
+	move->sourceNode = sourceNodeLoad->workerNode;
+	move->targetNode = targetNodeLoad->workerNode;
+
+	/* later steps of the plan see the group's placement on its new node */
+	movedPlacement->nodeName = targetNodeLoad->workerNode->nodeName;
+	movedPlacement->nodePort = targetNodeLoad->workerNode->nodePort;
+	movedGroup->moved = true;
+
+	return move;
+}
+
+
+/*
+ * MoveShardGroups moves the placements of the given moves' shard groups from
+ * their source nodes to their target nodes. The placements of all groups are
+ * copied together, as a bulk repair would, with up to the given number of
+ * copies running at once on any one node. If pg_shard was loaded via
+ * shared_preload_libraries, the copies are made online: modifications of each
+ * shard continue while it is copied, and are logged and then replayed on its
+ * copy. Only the replay of the last of them, and the switch to the copies,
+ * lock out modifications of the moved shards, until the transaction ends.
+ * Otherwise, the moved shards are locked before their copies start.
+ *
+ * Only once all of a group's placements have been copied is the metadata
+ * switched over to the copies; see SwitchShardGroupMove. If the function errors
+ * out, the copies made so far are dropped. It returns the number of groups
+ * moved.
+ */
+int32
+MoveShardGroups(List *moveList, int32 maxParallel)
+{
+	bool onlineMove = OnlineRepairAvailable();
+	List *moveRepairListList = NIL;
+	List *repairList = NIL;
+	ListCell *moveCell = NULL;
+	ListCell *moveRepairListCell = NULL;
+	int32 movedCount = 0;
+
+	if (!onlineMove)
+	{
+		LockMovedShards(moveList);
+	}
+
+	foreach(moveCell, moveList)
+	{
+		ShardGroupMove *move = (ShardGroupMove *) lfirst(moveCell);
+		List *moveRepairList = ShardGroupMoveRepairList(move, onlineMove);
+
+		moveRepairListList = lappend(moveRepairListList, moveRepairList);
+		repairList = list_concat(repairList, list_copy(moveRepairList));
+	}
+
+	PG_TRY();
+	{
+		if (repairList != NIL)
+		{
+			ExecuteShardRepairs(repairList, maxParallel);
+		}
+
+		if (onlineMove)
+		{
+			/* catch up with the modifications logged while the data was copied */
+			ReplayMovedShardLogs(repairList, MAX_REPAIR_LOG_CATCH_UP_BATCHES);
+
+			/* lock out modifications again to replay those logged since */
+			LockMovedShards(moveList);
+			ReplayMovedShardLogs(repairList, 0);
+		}
+
+		forboth(moveCell, moveList, moveRepairListCell, moveRepairListList)
+		{
+			ShardGroupMove *move = (ShardGroupMove *) lfirst(moveCell);
+			List *moveRepairList = (List *) lfirst(moveRepairListCell);
+
+			bool moved = SwitchShardGroupMove(move, moveRepairList);
+			if (moved)
+			{
+				movedCount++;
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		ListCell *repairCell = NULL;
+
+		EndMoveCaptures(repairList);
+
+		/* the copies are committed on their nodes, but not in the metadata */
+		foreach(repairCell, repairList)
+		{
+			ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+
+			if (repair->targetCreated)
+			{
+				DropMoveTarget(repair);
+			}
+		}
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	EndMoveCaptures(repairList);
+
+	return movedCount;
+}
+
+
+/*
+ * ShardGroupMoveRepairList returns a list of repairs which copy the placement
+ * of each shard of the given move's group from the move's source node to a new
+ * placement on its target node, in shard id order. The new placements are added
+ * to the metadata as inactive, and the repairs copy them online if asked to. If
+ * a shard lacks a healthy placement on the source node or already has a
+ * placement on the target node, which can happen if its placements changed
+ * since the move was planned, the function warns and returns an empty list
+ * instead. Repairs check the placements again once they lock their shard.
+ */
+static List *
+ShardGroupMoveRepairList(ShardGroupMove *move, bool onlineMove)
+{
+	List *repairList = NIL;
+	List *movedShardList = list_copy(move->shardGroup->shardIntervalList);
+	List *sourcePlacementList = NIL;
+	ListCell *shardIntervalCell = NULL;
+	ListCell *sourcePlacementCell = NULL;
+	WorkerNode *sourceNode = move->sourceNode;
+	WorkerNode *targetNode = move->targetNode;
+
+	movedShardList = SortList(movedShardList, CompareShardIntervalsById);
+
+	foreach(shardIntervalCell, movedShardList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		int64 shardId = shardInterval->id;
+		List *shardPlacementList = LoadShardPlacementList(shardId);
+		ShardPlacement *sourcePlacement = NULL;
+
+		sourcePlacement = PlacementOnNode(shardPlacementList, sourceNode);
+		if (sourcePlacement == NULL || sourcePlacement->shardState != STATE_FINALIZED)
+		{
+			ereport(WARNING, (errmsg("shard " INT64_FORMAT " has no healthy "
+									 "placement on \"%s:%u\"", shardId,
+									 sourceNode->nodeName, sourceNode->nodePort)));
+			return NIL;
+		}
+
+		if (PlacementOnNode(shardPlacementList, targetNode) != NULL)
+		{
+			ereport(WARNING, (errmsg("shard " INT64_FORMAT " already has a "
+									 "placement on \"%s:%u\"", shardId,
+									 targetNode->nodeName, targetNode->nodePort)));
+			return NIL;
+		}
+
+		sourcePlacementList = lappend(sourcePlacementList, sourcePlacement);
+	}
+
+	forboth(shardIntervalCell, movedShardList, sourcePlacementCell, sourcePlacementList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		ShardPlacement *sourcePlacement = lfirst(sourcePlacementCell);
+		ShardPlacement *targetPlacement = NULL;
+		ShardRepair *repair = NULL;
+
+		targetPlacement = (ShardPlacement *) palloc0(sizeof(ShardPlacement));
+		targetPlacement->id = NextSequenceId(SHARD_PLACEMENT_ID_SEQUENCE_NAME);
+		targetPlacement->shardId = shardInterval->id;
+		targetPlacement->shardState = STATE_INACTIVE;
+		targetPlacement->nodeName = targetNode->nodeName;
+		targetPlacement->nodePort = targetNode->nodePort;
+
+		InsertShardPlacementRow(targetPlacement->id, targetPlacement->shardId,
+								targetPlacement->shardState,
+								targetPlacement->nodeName,
+								targetPlacement->nodePort);
+
+		repair = (ShardRepair *) palloc0(sizeof(ShardRepair));
+		repair->shardId = shardInterval->id;
+		repair->relationId = shardInterval->relationId;
+		repair->sourcePlacement = sourcePlacement;
+		repair->targetPlacement = targetPlacement;
+		repair->status = REPAIR_STATUS_PENDING;
+		repair->moveSource = true;
+		repair->onlineCopy = onlineMove;
+		repair->sourceSlot = -1;
+		repair->targetSlot = -1;
+
+		repairList = lappend(repairList, repair);
+	}
+
+	return repairList;
+}
+
+
+/*
+ * LockMovedShards locks the shards of all of the given moves' groups against
+ * modifications until the transaction ends. The shards are locked in shard id
+ * order across groups, as modifications of several shards lock them.
+ */
+static void
+LockMovedShards(List *moveList)
+{
+	List *movedShardList = NIL;
+	ListCell *moveCell = NULL;
+	ListCell *shardIntervalCell = NULL;
+
+	foreach(moveCell, moveList)
+	{
+		ShardGroupMove *move = (ShardGroupMove *) lfirst(moveCell);
+
+		movedShardList = list_concat(movedShardList,
+									 list_copy(move->shardGroup->shardIntervalList));
+	}
+
+	movedShardList = SortList(movedShardList, CompareShardIntervalsById);
+
+	foreach(shardIntervalCell, movedShardList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+
+		LockShard(shardInterval->id, ExclusiveLock);
+	}
+}
+
+
+/*
+ * ReplayMovedShardLogs replays the modifications logged during the given online
+ * copies on the copies which were made, in batches, until few of them remain.
+ * Unless the given number of batches is zero, at most that many batches are
+ * replayed for each copy. The function errors out if a replay fails.
+ */
+static void
+ReplayMovedShardLogs(List *repairList, int maxBatchCount)
+{
+	ListCell *repairCell = NULL;
+
+	foreach(repairCell, repairList)
+	{
+		ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+		ShardPlacement *targetPlacement = repair->targetPlacement;
+		PGconn *targetConnection = NULL;
+		int replayedEntryCount = 0;
+		int batchCount = 0;
+
+		if (!repair->onlineCopy || repair->status != REPAIR_STATUS_FINISHED)
+		{
+			continue;
+		}
+
+		targetConnection = GetConnection(targetPlacement->nodeName,
+										 targetPlacement->nodePort);
+		if (targetConnection == NULL)
+		{
+			ereport(ERROR, (errmsg("could not connect to \"%s:%u\"",
+								   targetPlacement->nodeName,
+								   targetPlacement->nodePort)));
+		}
+
+		do
+		{
+			replayedEntryCount = ReplayShardRepairLogBatch(repair->relationId,
+														   repair->shardId,
+														   targetConnection);
+			batchCount++;
+		}
+		while (replayedEntryCount == REPAIR_LOG_BATCH_ENTRY_COUNT &&
+			   (maxBatchCount == 0 || batchCount < maxBatchCount));
+	}
+}
+
+
+/*
+ * SwitchShardGroupMove switches the metadata of the given move's group over to
+ * the copies made by the given repairs, if all of them were copied and, for
+ * online copies, all modifications made meanwhile were logged. The copies are
+ * then finalized, and the placements they replace marked for deletion, so that
+ * the group's shards remain co-located. Otherwise, the copies are dropped and
+ * removed from the metadata, or marked for deletion if they cannot be dropped,
+ * and the function warns. The function returns whether the group was moved.
+ */
+static bool
+SwitchShardGroupMove(ShardGroupMove *move, List *moveRepairList)
+{
+	ShardInterval *groupShardInterval = linitial(move->shardGroup->shardIntervalList);
+	ListCell *repairCell = NULL;
+	bool moved = (moveRepairList != NIL);
+
+	foreach(repairCell, moveRepairList)
+	{
+		ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+
+		if (repair->status != REPAIR_STATUS_FINISHED)
+		{
+			moved = false;
+		}
+		else if (repair->onlineCopy && ModificationCaptureFailed(repair->shardId))
+		{
+			ereport(WARNING, (errmsg("could not log all modifications of shard "
+									 INT64_FORMAT " during its move",
+									 repair->shardId)));
+			moved = false;
+		}
+	}
+
+	foreach(repairCell, moveRepairList)
+	{
+		ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+		ShardPlacement *sourcePlacement = repair->sourcePlacement;
+		ShardPlacement *targetPlacement = repair->targetPlacement;
+		int targetState = STATE_FINALIZED;
+
+		DeleteShardPlacementRow(targetPlacement->id);
+
+		if (!moved)
+		{
+			/* leave copies which cannot be dropped for the next rebalance */
+			if (!repair->targetCreated || DropMoveTarget(repair))
+			{
+				continue;
+			}
+
+			targetState = STATE_TO_DELETE;
+		}
+
+		InsertShardPlacementRow(targetPlacement->id, targetPlacement->shardId,
+								targetState, targetPlacement->nodeName,
+								targetPlacement->nodePort);
+
+		if (!moved)
+		{
+			continue;
+		}
+
+		DeleteShardPlacementRow(sourcePlacement->id);
+		InsertShardPlacementRow(sourcePlacement->id, sourcePlacement->shardId,
+								STATE_TO_DELETE, sourcePlacement->nodeName,
+								sourcePlacement->nodePort);
+	}
+
+	if (!moved)
+	{
+		ereport(WARNING, (errmsg("could not move shard group of shard " INT64_FORMAT
+								 " from \"%s:%u\" to \"%s:%u\"",
+								 groupShardInterval->id, move->sourceNode->nodeName,
+								 move->sourceNode->nodePort, move->targetNode->nodeName,
+								 move->targetNode->nodePort)));
+	}
+
+	return moved;
+}
+
+
+/*
+ * DropMoveTarget drops the table of the given repair's target placement, and
+ * returns whether it was dropped.
+ */
+static bool
+DropMoveTarget(ShardRepair *repair)
+{
+	ShardPlacement *targetPlacement = repair->targetPlacement;
+	char *relationName = get_rel_name(repair->relationId);
+	StringInfo dropCommand = makeStringInfo();
+
+	AppendShardIdToName(&relationName, repair->shardId);
+	appendStringInfo(dropCommand, DROP_REGULAR_TABLE_COMMAND,
+					 quote_identifier(relationName));
+
+	return ExecuteRemoteCommandList(targetPlacement->nodeName,
+									targetPlacement->nodePort,
+									list_make1(dropCommand->data));
+}
+
+
+/*
+ * EndMoveCaptures stops logging the modifications of the shards copied online
+ * by the given repairs.
+ */
+static void
+EndMoveCaptures(List *repairList)
+{
+	ListCell *repairCell = NULL;
+
+	foreach(repairCell, repairList)
+	{
+		ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+
+		if (repair->onlineCopy)
+		{
+			EndModificationCapture(repair->shardId);
+		}
+	}
+}
+
+
+/*
+ * PlacementOnNode returns the placement in the given list which is on the given
+ * worker node, or NULL if there is none.
+ */
+static ShardPlacement *
+PlacementOnNode(List *shardPlacementList, WorkerNode *workerNode)
+{
+	ListCell *shardPlacementCell = NULL;
+
+	foreach(shardPlacementCell, shardPlacementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(shardPlacementCell);
+
+		if (placement->nodePort == (int32) workerNode->nodePort &&
+			strncmp(placement->nodeName, workerNode->nodeName, MAX_NODE_LENGTH) == 0)
+		{
+			return placement;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * CompareNodeLoads orders node loads from least to most loaded. Nodes which are
+ * equally loaded are ordered by name and port, so that plans are repeatable.
+ */
+static int
+CompareNodeLoads(const void *leftElement, const void *rightElement)
+{
+	const NodeLoad *leftNodeLoad = *((const NodeLoad **) leftElement);
+	const NodeLoad *rightNodeLoad = *((const NodeLoad **) rightElement);
+	int nameCompare = 0;
+
+	if (leftNodeLoad->load != rightNodeLoad->load)
+	{
+		return (leftNodeLoad->load > rightNodeLoad->load) ? 1 : -1;
+	}
+
+	nameCompare = strncmp(leftNodeLoad->workerNode->nodeName,
+						  rightNodeLoad->workerNode->nodeName, MAX_NODE_LENGTH);
+	if (nameCompare != 0)
+	{
+		return nameCompare;
+	}
+
+	return (int) leftNodeLoad->workerNode->nodePort -
+		   (int) rightNodeLoad->workerNode->nodePort;
+}
@@ -0,0 +1,73 @@
+/*-------------------------------------------------------------------------
+ *
+ * rebalance_shards.h
+ *
+ * Declarations for public functions and types to implement shard rebalancing
+ * functionality.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_REBALANCE_SHARDS_H
+#define PG_SHARD_REBALANCE_SHARDS_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "create_shards.h"
+
+#include "nodes/pg_list.h"
+
+
+/* measures of the load which a shard placement puts on its node */
+#define REBALANCE_BY_COUNT "count"
+#define REBALANCE_BY_SIZE "size"
+
+/* template for the query which measures a shard placement's size */
+#define SHARD_SIZE_QUERY "SELECT pg_total_relation_size(%s)"
+
+
+/*
+ * ShardGroup represents a shard of the rebalanced table together with the
+ * shards of co-located tables which cover the same range, all of which are
+ * moved together. The group keeps the placements of the rebalanced table's
+ * shard, which the rebalance plan updates as it moves the group, and the load
+ * which each placement of the group puts on its node.
+ */
+typedef struct ShardGroup
+{
+	List *shardIntervalList;  /* shards of the group, rebalanced table's first */
+	List *placementList;      /* placements of the rebalanced table's shard */
+	int64 load;               /* load of one placement of the group */
+	bool moved;               /* whether the plan already moves the group */
+} ShardGroup;
+
+
+/* NodeLoad tracks the load on a worker node while a rebalance is planned. */
+typedef struct NodeLoad
+{
+	WorkerNode *workerNode;   /* node from the worker list */
+	int64 load;               /* total load of the group placements on the node */
+} NodeLoad;
+
+
+/* ShardGroupMove describes a move of a shard group's placement to another node. */
+typedef struct ShardGroupMove
+{
+	ShardGroup *shardGroup;   /* group whose placement is moved */
+	WorkerNode *sourceNode;   /* node the placement is moved from */
+	WorkerNode *targetNode;   /* node the placement is moved to */
+} ShardGroupMove;
+
+
+/* function declarations for shard rebalancing functionality */
+extern Datum master_rebalance_table_shards(PG_FUNCTION_ARGS);
+extern List * LoadShardGroupList(Oid distributedTableId, List *colocatedTableList,
+								 bool rebalanceBySize);
+extern int32 MoveShardGroups(List *moveList, int32 maxParallel);
+extern void DropPlacementsToDelete(List *relationIdList);
+
+
+#endif /* PG_SHARD_REBALANCE_SHARDS_H */
@@ -23,51 +23,144 @@
 #include "distribution_metadata.h"
 #include "pg_shard.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <string.h>
 
 #include "access/heapam.h"
 #include "access/htup.h"
 #include "access/tupdesc.h"
+#include "access/transam.h"
 #include "access/xact.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
 #include "executor/tuptable.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
+#include "storage/ipc.h"
 #include "storage/lock.h"
+#include "storage/lwlock.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/errcodes.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/palloc.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
 #include "utils/tuplestore.h"
 
 
+/*
+ * OnlineRepairControl points to the shared state of online shard repairs, which
+ * OnlineRepairShmemStartup sets up. It remains NULL if pg_shard is not loaded
+ * via shared_preload_libraries, in which case shards cannot be repaired online.
+ */
+static OnlineRepairControlData *OnlineRepairControl = NULL;
+
+/*
+ * CapturedShardIdList holds the ids of the shards whose modifications this
+ * backend logged in its current transaction, in TopTransactionContext. Should
+ * the transaction abort, the log entries are lost, so the online repairs of
+ * these shards are failed.
+ */
+static List *CapturedShardIdList = NIL;
+
+/* saved hook value in case of unload */
+static shmem_startup_hook_type PreviousShmemStartupHook = NULL;
+
+
 /* local function forward declarations */
+static void LoadRepairPlacements(int64 shardId, text *sourceNodeName,
+								 int32 sourceNodePort, text *targetNodeName,
+								 int32 targetNodePort, ShardPlacement **sourcePlacement,
+								 ShardPlacement **targetPlacement);
 static ShardPlacement * SearchShardPlacementInList(List *shardPlacementList,
 												   text *nodeName, int32 nodePort);
 static List * RecreateTableDDLCommandList(Oid relationId, int64 shardId);
+static void RepairShardPlacement(Oid distributedTableId, int64 shardId,
+								 ShardPlacement *sourcePlacement,
+								 ShardPlacement *targetPlacement, bool onlineRepair);
+static void RecreateShardPlacementTable(Oid distributedTableId, int64 shardId,
+										ShardPlacement *targetPlacement);
+static void RepairShardPlacementOnline(Oid distributedTableId, int64 shardId,
+									   ShardPlacement *sourcePlacement,
+									   ShardPlacement *targetPlacement);
 static bool CopyDataFromFinalizedPlacement(Oid distributedTableId, int64 shardId,
 										   ShardPlacement *healthyPlacement,
-										   ShardPlacement *placementToRepair);
+										   ShardPlacement *placementToRepair,
+										   bool releaseShardLock);
+static char * ChecksumBucketExpression(Oid distributedTableId);
+static List * DivergentChecksumBuckets(Oid distributedTableId, int64 shardId,
+									   char *bucketExpression,
+									   ShardPlacement *sourcePlacement,
+									   ShardPlacement *targetPlacement);
+static char ** ReceiveBucketChecksums(PGconn *connection);
+static bool ResyncChecksumBuckets(Oid distributedTableId, int64 shardId,
+								  char *bucketExpression, List *bucketList,
+								  ShardPlacement *sourcePlacement,
+								  ShardPlacement *targetPlacement);
+static bool StreamShardData(PGconn *sourceConnection, char *copyOutCommand,
+							PGconn *targetConnection, char *copyInCommand,
+							int64 unlockShardId, int64 *bytesCopied);
+static void BuildShardCopyCommands(Oid relationId, int64 shardId,
+								   StringInfo copyOutCommand,
+								   StringInfo copyInCommand);
+static List * ShardIndexDDLCommandList(Oid relationId, int64 shardId);
+static bool StartShardCopy(PGconn *sourceConnection, char *copyOutCommand,
+						   PGconn *targetConnection, char *copyInCommand);
+static bool EndShardCopy(PGconn *sourceConnection, PGconn *targetConnection,
+						 bool dataSent);
+static bool StartRemoteCopy(PGconn *connection, char *copyCommand,
+							ExecStatusType copyStatus);
+static bool BinaryCopyFormatSupported(Oid relationId);
+static bool TypeSupportsBinaryIO(Oid typeId);
+static void ReportCopyThroughput(int64 shardId, int64 bytesCopied,
+								 TimestampTz copyStartTime);
+static char * CopyThroughputDetail(int64 bytesCopied, TimestampTz copyStartTime);
 static void CopyDataFromTupleStoreToRelation(Tuplestorestate *tupleStore,
 											 Relation relation);
+static List * PlanShardRepairs(Oid distributedTableId);
+static ShardPlacement * LeastUsedSourcePlacement(List *finalizedPlacementList,
+												 List *repairList);
+static void StartShardRepair(ShardRepair *repair, List *repairList, int32 maxParallel);
+static bool RepairPlacementsUnchanged(ShardRepair *repair);
+static int32 FreeRepairConnectionSlot(ShardPlacement *placement, List *repairList,
+									  int32 maxParallel);
+static void ContinueShardCopy(ShardRepair *repair);
+static void FinishShardCopy(ShardRepair *repair);
+static void ReceiveIndexResults(ShardRepair *repair);
+static void FailShardRepair(ShardRepair *repair);
+static void CompleteShardRepair(ShardRepair *repair, int32 completedCount,
+								int32 repairCount);
+static bool SamePlacementNode(ShardPlacement *leftPlacement,
+							  ShardPlacement *rightPlacement);
+static void OnlineRepairShmemStartup(void);
+static void OnlineRepairXactCallback(XactEvent event, void *arg);
+static void MarkModificationCaptureFailed(int64 shardId);
+static OnlineRepairEntry * FindOnlineRepairEntry(int64 shardId);
 
 
 /* declarations for dynamic loading */
 PG_FUNCTION_INFO_V1(master_copy_shard_placement);
+PG_FUNCTION_INFO_V1(master_resync_shard_placement);
+PG_FUNCTION_INFO_V1(master_repair_all_placements);
 PG_FUNCTION_INFO_V1(worker_copy_shard_placement);
 
 
 /*
  * master_copy_shard_placement implements a user-facing UDF to copy data from
  * a healthy (source) node to an inactive (target) node. To accomplish this it
- * entirely recreates the table structure before copying all data. During this
- * time all modifications are paused to the shard. After successful repair, the
- * inactive placement is marked healthy and modifications may continue. If the
- * repair fails at any point, this function throws an error, leaving the node
- * in an unhealthy state.
+ * entirely recreates the table structure before copying all data, and builds
+ * the table's indexes once the data is in place. During this time all
+ * modifications are paused to the shard, unless the repair is done online: see
+ * RepairShardPlacementOnline. After successful repair, the inactive placement
+ * is marked healthy and modifications may continue. If the repair fails at any
+ * point, this function throws an error, leaving the node in an unhealthy state.
  */
 Datum
 master_copy_shard_placement(PG_FUNCTION_ARGS)
@@ -80,63 +173,114 @@ master_copy_shard_placement(PG_FUNCTION_ARGS)
 	ShardInterval *shardInterval = LoadShardInterval(shardId);
 	Oid distributedTableId = shardInterval->relationId;
 
-	List *shardPlacementList = NIL;
 	ShardPlacement *sourcePlacement = NULL;
 	ShardPlacement *targetPlacement = NULL;
-	List *ddlCommandList = NIL;
-	bool recreated = false;
-	bool dataCopied = false;
+	bool onlineRepair = false;
+
+	/* the function is defined without the online argument before version 1.2 */
+	if (PG_NARGS() > 5)
+	{
+		onlineRepair = PG_GETARG_BOOL(5);
+	}
+
+	if (onlineRepair && OnlineRepairControl == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("online repair requires pg_shard to be loaded via "
+							   "shared_preload_libraries")));
+	}
 
 	/*
 	 * By taking an exclusive lock on the shard, we both stop all modifications
 	 * (INSERT, UPDATE, or DELETE) and prevent concurrent repair operations from
-	 * being able to operate on this shard.
+	 * being able to operate on this shard. Online repairs give up the lock for
+	 * a while, but are tracked in shared memory instead.
 	 */
 	LockShard(shardId, ExclusiveLock);
 
-	shardPlacementList = LoadShardPlacementList(shardId);
+	LoadRepairPlacements(shardId, sourceNodeName, sourceNodePort, targetNodeName,
+						 targetNodePort, &sourcePlacement, &targetPlacement);
 
-	sourcePlacement = SearchShardPlacementInList(shardPlacementList, sourceNodeName,
-												 sourceNodePort);
-	if (sourcePlacement->shardState != STATE_FINALIZED)
-	{
-		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-						errmsg("source placement must be in finalized state")));
-	}
+	RepairShardPlacement(distributedTableId, shardId, sourcePlacement, targetPlacement,
+						 onlineRepair);
 
-	targetPlacement = SearchShardPlacementInList(shardPlacementList, targetNodeName,
-												 targetNodePort);
-	if (targetPlacement->shardState != STATE_INACTIVE)
-	{
-		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-						errmsg("target placement must be in inactive state")));
-	}
+	PG_RETURN_VOID();
+}
 
-	/* retrieve the DDL commands for the table and run them */
-	ddlCommandList = RecreateTableDDLCommandList(distributedTableId, shardId);
 
-	recreated = ExecuteRemoteCommandList(targetPlacement->nodeName,
-										 targetPlacement->nodePort,
-										 ddlCommandList);
-	if (!recreated)
+/*
+ * master_resync_shard_placement implements a user-facing UDF to bring an
+ * inactive (target) placement up to date with a healthy (source) one without
+ * recreating it, for placements which only missed a few modifications. The
+ * rows of both placements are divided into buckets by the hash of their
+ * partition column, and each worker computes a checksum of every bucket, both
+ * at the same time. Only the rows of buckets whose checksums differ are then
+ * deleted from the inactive placement and copied over from the healthy one, so
+ * that the time taken depends on how far the placements diverged rather than
+ * on the size of the shard. All modifications of the shard are paused during
+ * the resync. Once done, the inactive placement is marked healthy. If the
+ * resync fails at any point, this function throws an error, leaving the node
+ * in an unhealthy state; master_copy_shard_placement can then repair it.
+ */
+Datum
+master_resync_shard_placement(PG_FUNCTION_ARGS)
+{
+	int64 shardId = PG_GETARG_INT64(0);
+	text *sourceNodeName = PG_GETARG_TEXT_P(1);
+	int32 sourceNodePort = PG_GETARG_INT32(2);
+	text *targetNodeName = PG_GETARG_TEXT_P(3);
+	int32 targetNodePort = PG_GETARG_INT32(4);
+	ShardInterval *shardInterval = LoadShardInterval(shardId);
+	Oid distributedTableId = shardInterval->relationId;
+
+	ShardPlacement *sourcePlacement = NULL;
+	ShardPlacement *targetPlacement = NULL;
+	char *bucketExpression = NULL;
+	List *divergentBucketList = NIL;
+	bool resynced = false;
+
+	char relationKind = get_rel_relkind(distributedTableId);
+	if (relationKind == RELKIND_FOREIGN_TABLE)
 	{
-		ereport(ERROR, (errmsg("could not recreate shard table"),
-						errhint("Consult recent messages in the server logs for "
-								"details.")));
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot resync shard"),
+						errdetail("Resyncing shards backed by foreign tables is "
+								  "not supported.")));
 	}
 
+	/* as with a repair, lock out modifications and other repairs of the shard */
+	LockShard(shardId, ExclusiveLock);
+
+	LoadRepairPlacements(shardId, sourceNodeName, sourceNodePort, targetNodeName,
+						 targetNodePort, &sourcePlacement, &targetPlacement);
+
+	bucketExpression = ChecksumBucketExpression(distributedTableId);
+
+	divergentBucketList = DivergentChecksumBuckets(distributedTableId, shardId,
+												   bucketExpression, sourcePlacement,
+												   targetPlacement);
+
+	ereport(LOG, (errmsg("found %d of %d row ranges of shard " INT64_FORMAT
+						 " to differ between placements",
+						 list_length(divergentBucketList), CHECKSUM_BUCKET_COUNT,
+						 shardId)));
+
 	HOLD_INTERRUPTS();
 
-	dataCopied = CopyDataFromFinalizedPlacement(distributedTableId, shardId,
-												sourcePlacement, targetPlacement);
-	if (!dataCopied)
+	if (divergentBucketList != NIL)
 	{
-		ereport(ERROR, (errmsg("could not copy shard data"),
-						errhint("Consult recent messages in the server logs for "
-								"details.")));
+		resynced = ResyncChecksumBuckets(distributedTableId, shardId, bucketExpression,
+										 divergentBucketList, sourcePlacement,
+										 targetPlacement);
+		if (!resynced)
+		{
+			ereport(ERROR, (errmsg("could not resync shard data"),
+							errhint("Consult recent messages in the server logs for "
+									"details.")));
+		}
 	}
 
-	/* the placement is repaired, so return to finalized state */
+	/* the placement is up to date, so return to finalized state */
 	DeleteShardPlacementRow(targetPlacement->id);
 	InsertShardPlacementRow(targetPlacement->id, targetPlacement->shardId,
 							STATE_FINALIZED, targetPlacement->nodeName,
@@ -148,10 +292,136 @@ master_copy_shard_placement(PG_FUNCTION_ARGS)
 }
 
 
+/*
+ * master_repair_all_placements implements a user-facing UDF to repair all
+ * inactive placements of the given table at once. Each inactive placement is
+ * repaired from one of its shard's healthy placements, which are chosen so as
+ * to spread the copying across nodes. Up to the given number of repairs run
+ * concurrently on any one node, whether they copy from or to it. Otherwise, a
+ * placement is repaired like master_copy_shard_placement would: its table is
+ * recreated, after which its data is streamed over using COPY and its indexes
+ * are built in a single transaction. Progress is reported as each repair
+ * finishes, and a repair which fails leaves its placement inactive and warns.
+ * Modifications of each shard are paused from when its first repair starts
+ * until the function returns. The function returns the number of placements
+ * repaired.
+ */
+Datum
+master_repair_all_placements(PG_FUNCTION_ARGS)
+{
+	text *tableNameText = PG_GETARG_TEXT_P(0);
+	int32 maxParallel = PG_GETARG_INT32(1);
+	Oid distributedTableId = ResolveRelationId(tableNameText);
+	char relationKind = get_rel_relkind(distributedTableId);
+	List *repairList = NIL;
+	int32 repairedCount = 0;
+
+	if (maxParallel < 1)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("max_parallel must be at least one")));
+	}
+
+	if (relationKind == RELKIND_FOREIGN_TABLE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot repair shard"),
+						errdetail("Repairing shards backed by foreign tables is "
+								  "not supported.")));
+	}
+
+	/* every repair needs its own connection to each of its nodes */
+	maxParallel = Min(maxParallel, MaxConnectionsPerNode);
+
+	repairList = PlanShardRepairs(distributedTableId);
+	if (repairList != NIL)
+	{
+		repairedCount = ExecuteShardRepairs(repairList, maxParallel);
+	}
+
+	PG_RETURN_INT32(repairedCount);
+}
+
+
+/*
+ * RepairInactivePlacement repairs the given inactive placement from a healthy
+ * placement of the same shard, as master_copy_shard_placement would, for use
+ * by the background repair worker. Rather than wait for modifications of the
+ * shard to finish, the function gives up and returns false if the shard lock
+ * is not immediately available. It also returns false if the placement is no
+ * longer inactive, the shard is being repaired online, is backed by foreign
+ * tables, or has no healthy placement. When pg_shard is loaded through
+ * shared_preload_libraries, as it is whenever the worker runs, the repair is
+ * done online, so that modifications of the shard are only paused briefly.
+ * Once the placement has been repaired, the function returns true; if the
+ * repair fails, it throws an error.
+ */
+bool
+RepairInactivePlacement(ShardPlacement *inactivePlacement)
+{
+	int64 shardId = inactivePlacement->shardId;
+	ShardInterval *shardInterval = NULL;
+	Oid distributedTableId = InvalidOid;
+	List *shardPlacementList = NIL;
+	ListCell *shardPlacementCell = NULL;
+	ShardPlacement *sourcePlacement = NULL;
+	ShardPlacement *targetPlacement = NULL;
+
+	if (!ConditionalLockShard(shardId, ExclusiveLock))
+	{
+		return false;
+	}
+
+	if (OnlineRepairInProgress(shardId))
+	{
+		return false;
+	}
+
+	shardInterval = LoadShardInterval(shardId);
+	distributedTableId = shardInterval->relationId;
+
+	if (get_rel_relkind(distributedTableId) == RELKIND_FOREIGN_TABLE)
+	{
+		return false;
+	}
+
+	/* the placement may have been repaired while we did not hold the lock */
+	shardPlacementList = LoadShardPlacementList(shardId);
+
+	foreach(shardPlacementCell, shardPlacementList)
+	{
+		ShardPlacement *shardPlacement = (ShardPlacement *) lfirst(shardPlacementCell);
+
+		if (shardPlacement->id == inactivePlacement->id &&
+			shardPlacement->shardState == STATE_INACTIVE)
+		{
+			targetPlacement = shardPlacement;
+		}
+		else if (shardPlacement->shardState == STATE_FINALIZED &&
+				 sourcePlacement == NULL)
+		{
+			sourcePlacement = shardPlacement;
+		}
+	}
+
+	if (targetPlacement == NULL || sourcePlacement == NULL)
+	{
+		return false;
+	}
+
+	RepairShardPlacement(distributedTableId, shardId, sourcePlacement, targetPlacement,
+						 OnlineRepairAvailable());
+
+	return true;
+}
+
+
 /*
  * worker_copy_shard_placement implements a internal UDF to copy a table's data from
  * a healthy placement into a receiving table on an unhealthy placement. This
- * function returns a boolean reflecting success or failure.
+ * function returns a boolean reflecting success or failure. Repairs no longer
+ * use this function, which streams the data between the placements instead; it
+ * is kept for masters running earlier versions.
  */
 Datum
 worker_copy_shard_placement(PG_FUNCTION_ARGS)
@@ -202,6 +472,47 @@ worker_copy_shard_placement(PG_FUNCTION_ARGS)
 }
 
 
+/*
+ * LoadRepairPlacements looks up the placements of the given shard on the given
+ * source and target nodes. The function errors out if either does not exist,
+ * if the source placement is not healthy or the target placement not inactive,
+ * or if the shard is being repaired online. The caller should hold an exclusive
+ * lock on the shard.
+ */
+static void
+LoadRepairPlacements(int64 shardId, text *sourceNodeName, int32 sourceNodePort,
+					 text *targetNodeName, int32 targetNodePort,
+					 ShardPlacement **sourcePlacement, ShardPlacement **targetPlacement)
+{
+	List *shardPlacementList = NIL;
+
+	if (OnlineRepairInProgress(shardId))
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_IN_USE),
+						errmsg("shard " INT64_FORMAT " is already being repaired",
+							   shardId)));
+	}
+
+	shardPlacementList = LoadShardPlacementList(shardId);
+
+	(*sourcePlacement) = SearchShardPlacementInList(shardPlacementList, sourceNodeName,
+													sourceNodePort);
+	if ((*sourcePlacement)->shardState != STATE_FINALIZED)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("source placement must be in finalized state")));
+	}
+
+	(*targetPlacement) = SearchShardPlacementInList(shardPlacementList, targetNodeName,
+													targetNodePort);
+	if ((*targetPlacement)->shardState != STATE_INACTIVE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("target placement must be in inactive state")));
+	}
+}
+
+
 /*
  * SearchShardPlacementInList searches a provided list for a shard placement
  * with the specified node name and port. This function throws an error if no
@@ -242,7 +553,8 @@ SearchShardPlacementInList(List *shardPlacementList, text *nodeNameText, int32 n
  * RecreateTableDDLCommandList returns a list of DDL statements similar to that
  * returned by ExtendedDDLCommandList except that the list begins with a "DROP
  * TABLE" or "DROP FOREIGN TABLE" statement to facilitate total recreation of a
- * placement.
+ * placement. The list leaves out the table's indexes, which are only created
+ * once the data has been copied; see CopyDataFromFinalizedPlacement.
  */
 static List *
 RecreateTableDDLCommandList(Oid relationId, int64 shardId)
@@ -276,7 +588,7 @@ RecreateTableDDLCommandList(Oid relationId, int64 shardId)
 
 	extendedDropCommandList = list_make1(extendedDropCommand->data);
 
-	createCommandList = TableDDLCommandList(relationId);
+	createCommandList = TableSchemaDDLCommandList(relationId);
 	extendedCreateCommandList = ExtendedDDLCommandList(relationId, shardId,
 													   createCommandList);
 
@@ -288,75 +600,2053 @@ RecreateTableDDLCommandList(Oid relationId, int64 shardId)
 
 
 /*
- * CopyDataFromFinalizedPlacement copies a the data for a shard (identified by
- * a relation and shard identifier) from a healthy placement to one needing
- * repair. The unhealthy placement must already have an empty relation in place
- * to receive rows from the healthy placement. This function returns a boolean
- * indicating success or failure.
+ * RepairShardPlacement repairs the given target placement of a shard from the
+ * given healthy source placement, and returns it to finalized state. The caller
+ * must hold an exclusive lock on the shard, which is held again by the time the
+ * function returns even if the repair is done online; see
+ * RepairShardPlacementOnline. The function errors out if the repair fails.
  */
-static bool
-CopyDataFromFinalizedPlacement(Oid distributedTableId, int64 shardId,
-							   ShardPlacement *healthyPlacement,
-							   ShardPlacement *placementToRepair)
+static void
+RepairShardPlacement(Oid distributedTableId, int64 shardId,
+					 ShardPlacement *sourcePlacement, ShardPlacement *targetPlacement,
+					 bool onlineRepair)
 {
-	char *relationName = get_rel_name(distributedTableId);
-	const char *shardName = NULL;
-	StringInfo copyRelationQuery = makeStringInfo();
-	bool copySuccessful = false;
+	bool dataCopied = false;
 
-	char relationKind = get_rel_relkind(distributedTableId);
-	if (relationKind == RELKIND_FOREIGN_TABLE)
+	RecreateShardPlacementTable(distributedTableId, shardId, targetPlacement);
+
+	if (onlineRepair)
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("cannot repair shard"),
-						errdetail("Repairing shards backed by foreign tables is "
-								  "not supported.")));
+		/* returns once the placement is up to date, with the lock held again */
+		RepairShardPlacementOnline(distributedTableId, shardId, sourcePlacement,
+								   targetPlacement);
+
+		HOLD_INTERRUPTS();
 	}
+	else
+	{
+		HOLD_INTERRUPTS();
 
-	AppendShardIdToName(&relationName, shardId);
-	shardName = quote_identifier(relationName);
+		dataCopied = CopyDataFromFinalizedPlacement(distributedTableId, shardId,
+													sourcePlacement, targetPlacement,
+													false);
+		if (!dataCopied)
+		{
+			ereport(ERROR, (errmsg("could not copy shard data"),
+							errhint("Consult recent messages in the server logs for "
+									"details.")));
+		}
+	}
+
+	/* the placement is repaired, so return to finalized state */
+	DeleteShardPlacementRow(targetPlacement->id);
+	InsertShardPlacementRow(targetPlacement->id, targetPlacement->shardId,
+							STATE_FINALIZED, targetPlacement->nodeName,
+							targetPlacement->nodePort);
 
-	appendStringInfo(copyRelationQuery, COPY_SHARD_PLACEMENT_COMMAND,
-					 quote_literal_cstr(shardName),
-					 quote_literal_cstr(healthyPlacement->nodeName),
-					 healthyPlacement->nodePort);
+	RESUME_INTERRUPTS();
+}
 
-	copySuccessful = ExecuteRemoteCommandList(placementToRepair->nodeName,
-											  placementToRepair->nodePort,
-											  list_make1(copyRelationQuery->data));
 
-	return copySuccessful;
+/*
+ * RecreateShardPlacementTable drops and recreates the given placement's table,
+ * leaving out its indexes, so that the placement is ready to receive a copy of
+ * the shard's data. The function throws an error if this fails.
+ */
+static void
+RecreateShardPlacementTable(Oid distributedTableId, int64 shardId,
+							ShardPlacement *targetPlacement)
+{
+	/* retrieve the DDL commands for the table (but not its indexes) and run them */
+	List *ddlCommandList = RecreateTableDDLCommandList(distributedTableId, shardId);
+
+	bool recreated = ExecuteRemoteCommandList(targetPlacement->nodeName,
+											  targetPlacement->nodePort,
+											  ddlCommandList);
+	if (!recreated)
+	{
+		ereport(ERROR, (errmsg("could not recreate shard table"),
+						errhint("Consult recent messages in the server logs for "
+								"details.")));
+	}
 }
 
 
 /*
- * CopyDataFromTupleStoreToRelation loads a specified relation with all tuples
- * stored in the provided tuplestore. This function assumes the relation's
- * layout (TupleDesc) exactly matches that of the provided tuplestore. This
- * function raises an error if the copy cannot be completed.
+ * RepairShardPlacementOnline copies the data of a shard from a healthy placement
+ * to one needing repair without locking out modifications of the shard for the
+ * length of the copy. The function is called with an exclusive lock on the
+ * shard, under which it starts logging the shard's modifications and starts the
+ * copy from the healthy placement, which takes the snapshot copied. The lock is
+ * then released while the data is copied, and while the modifications logged
+ * meanwhile are replayed on the placement being repaired. Once few logged
+ * modifications remain, the lock is taken again to replay the rest, so that the
+ * function returns with the placement up to date and modifications locked out.
+ * The function errors out if the repair fails.
  */
 static void
-CopyDataFromTupleStoreToRelation(Tuplestorestate *tupleStore, Relation relation)
+RepairShardPlacementOnline(Oid distributedTableId, int64 shardId,
+						   ShardPlacement *sourcePlacement,
+						   ShardPlacement *targetPlacement)
 {
-	TupleDesc tupleDescriptor = RelationGetDescr(relation);
-	TupleTableSlot *tupleTableSlot = MakeSingleTupleTableSlot(tupleDescriptor);
+	StartModificationCapture(shardId);
 
-	for (;;)
+	PG_TRY();
 	{
-		HeapTuple tupleToInsert = NULL;
-		bool nextTuple = tuplestore_gettupleslot(tupleStore, true, false, tupleTableSlot);
-		if (!nextTuple)
+		PGconn *targetConnection = NULL;
+		int replayedEntryCount = 0;
+		int catchUpBatchCount = 0;
+		bool dataCopied = false;
+
+		/* entries left behind by an earlier, failed repair no longer apply */
+		DeleteShardRepairLogRows(shardId);
+
+		dataCopied = CopyDataFromFinalizedPlacement(distributedTableId, shardId,
+													sourcePlacement, targetPlacement,
+													true);
+		if (!dataCopied)
 		{
-			break;
+			ereport(ERROR, (errmsg("could not copy shard data"),
+							errhint("Consult recent messages in the server logs for "
+									"details.")));
 		}
 
-		tupleToInsert = ExecMaterializeSlot(tupleTableSlot);
+		targetConnection = GetConnection(targetPlacement->nodeName,
+										 targetPlacement->nodePort);
+		if (targetConnection == NULL)
+		{
+			ereport(ERROR, (errmsg("could not connect to \"%s:%u\"",
+								   targetPlacement->nodeName,
+								   targetPlacement->nodePort)));
+		}
 
-		simple_heap_insert(relation, tupleToInsert);
-		CommandCounterIncrement();
+		/* catch up with the modifications logged while the data was copied */
+		do
+		{
+			replayedEntryCount = ReplayShardRepairLogBatch(distributedTableId, shardId,
+														   targetConnection);
+			catchUpBatchCount++;
+		}
+		while (replayedEntryCount == REPAIR_LOG_BATCH_ENTRY_COUNT &&
+			   catchUpBatchCount < MAX_REPAIR_LOG_CATCH_UP_BATCHES);
 
-		ExecClearTuple(tupleTableSlot);
+		/* lock out modifications again to replay those logged since */
+		LockShard(shardId, ExclusiveLock);
+
+		do
+		{
+			replayedEntryCount = ReplayShardRepairLogBatch(distributedTableId, shardId,
+														   targetConnection);
+		}
+		while (replayedEntryCount == REPAIR_LOG_BATCH_ENTRY_COUNT);
+
+		if (ModificationCaptureFailed(shardId))
+		{
+			ereport(ERROR, (errmsg("could not log all modifications of shard "
+								   INT64_FORMAT " during its repair", shardId),
+							errdetail("Modifications which read from other shards "
+									  "cannot be replayed on the placement being "
+									  "repaired."),
+							errhint("Repair the shard without the online option.")));
+		}
+	}
+	PG_CATCH();
+	{
+		EndModificationCapture(shardId);
+
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 
-	ExecDropSingleTupleTableSlot(tupleTableSlot);
+	EndModificationCapture(shardId);
+}
+
+
+/*
+ * ReplayShardRepairLogBatch takes the oldest logged modifications of the given
+ * shard from the repair log, up to REPAIR_LOG_BATCH_ENTRY_COUNT of them, and runs
+ * them on the given connection to the placement being repaired in the order in
+ * which they were made. The function returns the number of modifications run,
+ * and errors out if any of them fails.
+ */
+int
+ReplayShardRepairLogBatch(Oid distributedTableId, int64 shardId,
+						  PGconn *targetConnection)
+{
+	List *logEntryList = TakeShardRepairLogEntries(shardId,
+												   REPAIR_LOG_BATCH_ENTRY_COUNT);
+	ListCell *logEntryCell = NULL;
+
+	foreach(logEntryCell, logEntryList)
+	{
+		ShardRepairLogEntry *logEntry = (ShardRepairLogEntry *) lfirst(logEntryCell);
+		PGresult *result = NULL;
+		ExecStatusType resultStatus = PGRES_FATAL_ERROR;
+
+		result = ExecuteRemoteQueryParams(targetConnection, logEntry->queryString,
+										  logEntry->parameterCount,
+										  logEntry->parameterTypes,
+										  logEntry->parameterValues,
+										  distributedTableId);
+		resultStatus = PQresultStatus(result);
+		if (resultStatus != PGRES_COMMAND_OK && resultStatus != PGRES_TUPLES_OK)
+		{
+			ReportRemoteError(targetConnection, result);
+			PQclear(result);
+
+			ereport(ERROR, (errmsg("could not replay modification on placement being "
+								   "repaired"),
+							errhint("Consult recent messages in the server logs for "
+									"details.")));
+		}
+
+		PQclear(result);
+	}
+
+	return list_length(logEntryList);
+}
+
+
+/*
+ * CopyDataFromFinalizedPlacement copies a the data for a shard (identified by
+ * a relation and shard identifier) from a healthy placement to one needing
+ * repair. The unhealthy placement must already have an empty relation in place
+ * to receive rows from the healthy placement, but no indexes: the data is
+ * streamed from the healthy placement's COPY ... TO STDOUT straight into a COPY
+ * ... FROM STDIN on the unhealthy one, after which the indexes are built in the
+ * same transaction. Binary format is used unless a column's type lacks binary
+ * input or output functions. If asked to, the function releases the exclusive
+ * lock on the shard as soon as the healthy placement has taken the snapshot it
+ * copies. This function returns a boolean indicating success or failure.
+ */
+static bool
+CopyDataFromFinalizedPlacement(Oid distributedTableId, int64 shardId,
+							   ShardPlacement *healthyPlacement,
+							   ShardPlacement *placementToRepair,
+							   bool releaseShardLock)
+{
+	StringInfo copyOutCommand = makeStringInfo();
+	StringInfo copyInCommand = makeStringInfo();
+	List *indexCommandList = NIL;
+	ListCell *indexCommandCell = NULL;
+	PGconn *sourceConnection = NULL;
+	PGconn *targetConnection = NULL;
+	TimestampTz copyStartTime = 0;
+	int64 bytesCopied = 0;
+	int64 unlockShardId = INVALID_SHARD_ID;
+	bool beginIssued = false;
+	bool copySuccessful = false;
+
+	char relationKind = get_rel_relkind(distributedTableId);
+	if (relationKind == RELKIND_FOREIGN_TABLE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot repair shard"),
+						errdetail("Repairing shards backed by foreign tables is "
+								  "not supported.")));
+	}
+
+	BuildShardCopyCommands(distributedTableId, shardId, copyOutCommand,
+						   copyInCommand);
+	indexCommandList = ShardIndexDDLCommandList(distributedTableId, shardId);
+
+	sourceConnection = GetConnection(healthyPlacement->nodeName,
+									 healthyPlacement->nodePort);
+	targetConnection = GetConnection(placementToRepair->nodeName,
+									 placementToRepair->nodePort);
+	if (sourceConnection == NULL || targetConnection == NULL)
+	{
+		return false;
+	}
+
+	beginIssued = ExecuteRemoteCommand(targetConnection, BEGIN_COMMAND);
+	if (!beginIssued)
+	{
+		return false;
+	}
+
+	if (releaseShardLock)
+	{
+		unlockShardId = shardId;
+	}
+
+	copyStartTime = GetCurrentTimestamp();
+	copySuccessful = StreamShardData(sourceConnection, copyOutCommand->data,
+									 targetConnection, copyInCommand->data,
+									 unlockShardId, &bytesCopied);
+
+	/* building indexes over the loaded data beats maintaining them row by row */
+	foreach(indexCommandCell, indexCommandList)
+	{
+		char *indexCommand = (char *) lfirst(indexCommandCell);
+
+		if (!copySuccessful)
+		{
+			break;
+		}
+
+		copySuccessful = ExecuteRemoteCommand(targetConnection, indexCommand);
+	}
+
+	if (copySuccessful)
+	{
+		copySuccessful = ExecuteRemoteCommand(targetConnection, COMMIT_COMMAND);
+	}
+	else
+	{
+		ExecuteRemoteCommand(targetConnection, ROLLBACK_COMMAND);
+	}
+
+	if (copySuccessful)
+	{
+		ReportCopyThroughput(shardId, bytesCopied, copyStartTime);
+	}
+
+	return copySuccessful;
+}
+
+
+/*
+ * ChecksumBucketExpression returns an expression which computes the checksum
+ * bucket of a row of the given table's shards, when the shard is aliased as
+ * shard_row. Rows are bucketed by the hash of their partition column, or of the
+ * entire row for tables without one.
+ */
+static char *
+ChecksumBucketExpression(Oid distributedTableId)
+{
+	StringInfo bucketExpression = makeStringInfo();
+	Var *partitionColumn = PartitionColumn(distributedTableId);
+	StringInfo bucketKey = makeStringInfo();
+
+	if (partitionColumn != NULL)
+	{
+		char *columnName = get_attname(distributedTableId, partitionColumn->varattno);
+
+		appendStringInfo(bucketKey, "shard_row.%s", quote_identifier(columnName));
+	}
+	else
+	{
+		appendStringInfoString(bucketKey, "shard_row");
+	}
+
+	appendStringInfo(bucketExpression, CHECKSUM_BUCKET_EXPRESSION, bucketKey->data,
+					 CHECKSUM_BUCKET_COUNT);
+
+	return bucketExpression->data;
+}
+
+
+/*
+ * DivergentChecksumBuckets has the given source and target placements of a
+ * shard compute the checksums of the shard's row buckets concurrently, and
+ * returns the list of buckets whose checksums differ, including buckets which
+ * only have rows on one of the placements. The function errors out if either
+ * placement cannot compute its checksums.
+ */
+static List *
+DivergentChecksumBuckets(Oid distributedTableId, int64 shardId,
+						 char *bucketExpression, ShardPlacement *sourcePlacement,
+						 ShardPlacement *targetPlacement)
+{
+	char *relationName = get_rel_name(distributedTableId);
+	StringInfo checksumQuery = makeStringInfo();
+	PGconn *sourceConnection = NULL;
+	PGconn *targetConnection = NULL;
+	char **sourceChecksumArray = NULL;
+	char **targetChecksumArray = NULL;
+	List *divergentBucketList = NIL;
+	int bucketIndex = 0;
+	bool querySent = false;
+
+	AppendShardIdToName(&relationName, shardId);
+
+	/*
+	 * Rows are hashed in text form, which depends on settings that may differ
+	 * between nodes, so pin them first. Statements sent together run in a single
+	 * transaction, to which the settings are local.
+	 */
+	appendStringInfoString(checksumQuery, CHECKSUM_SETTINGS_QUERY);
+	appendStringInfo(checksumQuery, BUCKET_CHECKSUM_QUERY, bucketExpression,
+					 quote_identifier(relationName));
+
+	sourceConnection = GetConnection(sourcePlacement->nodeName,
+									 sourcePlacement->nodePort);
+	targetConnection = GetConnection(targetPlacement->nodeName,
+									 targetPlacement->nodePort);
+	if (sourceConnection == NULL || targetConnection == NULL)
+	{
+		ereport(ERROR, (errmsg("could not connect to shard placements")));
+	}
+
+	/* both placements read all of their rows, so have them do so at once */
+	querySent = (ApplyRemoteStatementTimeout(sourceConnection) &&
+				 SendRemoteQuery(sourceConnection, checksumQuery->data, 0, NULL, NULL,
+								 InvalidOid));
+	if (!querySent)
+	{
+		ReportRemoteError(sourceConnection, NULL);
+		ereport(ERROR, (errmsg("could not compute checksums of source placement")));
+	}
+
+	querySent = (ApplyRemoteStatementTimeout(targetConnection) &&
+				 SendRemoteQuery(targetConnection, checksumQuery->data, 0, NULL, NULL,
+								 InvalidOid));
+	if (!querySent)
+	{
+		ReportRemoteError(targetConnection, NULL);
+		AbandonRemoteQuery(sourceConnection);
+		ereport(ERROR, (errmsg("could not compute checksums of target placement")));
+	}
+
+	sourceChecksumArray = ReceiveBucketChecksums(sourceConnection);
+	targetChecksumArray = ReceiveBucketChecksums(targetConnection);
+	if (sourceChecksumArray == NULL || targetChecksumArray == NULL)
+	{
+		ereport(ERROR, (errmsg("could not compute checksums of shard placements"),
+						errhint("Consult recent messages in the server logs for "
+								"details.")));
+	}
+
+	for (bucketIndex = 0; bucketIndex < CHECKSUM_BUCKET_COUNT; bucketIndex++)
+	{
+		char *sourceChecksum = sourceChecksumArray[bucketIndex];
+		char *targetChecksum = targetChecksumArray[bucketIndex];
+
+		if (sourceChecksum == NULL && targetChecksum == NULL)
+		{
+			continue;
+		}
+
+		if (sourceChecksum == NULL || targetChecksum == NULL ||
+			strcmp(sourceChecksum, targetChecksum) != 0)
+		{
+			divergentBucketList = lappend_int(divergentBucketList, bucketIndex);
+		}
+	}
+
+	return divergentBucketList;
+}
+
+
+/*
+ * ReceiveBucketChecksums awaits the results of a checksum query sent on the
+ * given connection, and returns an array holding the checksum of each bucket,
+ * or NULL for buckets without rows. The function returns NULL and warns if the
+ * query failed.
+ */
+static char **
+ReceiveBucketChecksums(PGconn *connection)
+{
+	char **checksumArray = NULL;
+	int rowCount = 0;
+	int rowIndex = 0;
+
+	PGresult *result = AwaitRemoteResults(connection);
+	if (PQresultStatus(result) != PGRES_TUPLES_OK)
+	{
+		ReportRemoteError(connection, result);
+		PQclear(result);
+
+		return NULL;
+	}
+
+	checksumArray = palloc0(CHECKSUM_BUCKET_COUNT * sizeof(char *));
+
+	rowCount = PQntuples(result);
+	for (rowIndex = 0; rowIndex < rowCount; rowIndex++)
+	{
+		int bucketIndex = pg_atoi(PQgetvalue(result, rowIndex, 0), sizeof(int32), 0);
+		char *checksum = PQgetvalue(result, rowIndex, 1);
+
+		if (bucketIndex < 0 || bucketIndex >= CHECKSUM_BUCKET_COUNT)
+		{
+			PQclear(result);
+			ereport(ERROR, (errmsg("received invalid checksum bucket %d",
+								   bucketIndex)));
+		}
+
+		checksumArray[bucketIndex] = pstrdup(checksum);
+	}
+
+	PQclear(result);
+
+	return checksumArray;
+}
+
+
+/*
+ * ResyncChecksumBuckets rewrites the rows of the given buckets on the target
+ * placement of a shard with those of the source placement. Within a single
+ * transaction on the target placement, the buckets' rows are deleted, after
+ * which the source placement's rows of these buckets are streamed over using
+ * COPY. This function returns a boolean indicating success or failure.
+ */
+static bool
+ResyncChecksumBuckets(Oid distributedTableId, int64 shardId, char *bucketExpression,
+					  List *bucketList, ShardPlacement *sourcePlacement,
+					  ShardPlacement *targetPlacement)
+{
+	char *relationName = get_rel_name(distributedTableId);
+	const char *shardName = NULL;
+	const char *copyFormat = TEXT_COPY_FORMAT;
+	StringInfo bucketArray = makeStringInfo();
+	StringInfo deleteCommand = makeStringInfo();
+	StringInfo copyOutCommand = makeStringInfo();
+	StringInfo copyInCommand = makeStringInfo();
+	ListCell *bucketCell = NULL;
+	PGconn *sourceConnection = NULL;
+	PGconn *targetConnection = NULL;
+	TimestampTz copyStartTime = 0;
+	int64 bytesCopied = 0;
+	bool resyncSuccessful = false;
+
+	AppendShardIdToName(&relationName, shardId);
+	shardName = quote_identifier(relationName);
+
+	if (BinaryCopyFormatSupported(distributedTableId))
+	{
+		copyFormat = BINARY_COPY_FORMAT;
+	}
+
+	appendStringInfoChar(bucketArray, '{');
+	foreach(bucketCell, bucketList)
+	{
+		if (bucketCell != list_head(bucketList))
+		{
+			appendStringInfoChar(bucketArray, ',');
+		}
+
+		appendStringInfo(bucketArray, "%d", lfirst_int(bucketCell));
+	}
+	appendStringInfoChar(bucketArray, '}');
+
+	appendStringInfo(deleteCommand, DELETE_BUCKETS_COMMAND, shardName,
+					 bucketExpression, bucketArray->data);
+	appendStringInfo(copyOutCommand, COPY_BUCKETS_OUT_COMMAND, shardName,
+					 bucketExpression, bucketArray->data, copyFormat);
+	appendStringInfo(copyInCommand, COPY_IN_COMMAND, shardName, copyFormat);
+
+	sourceConnection = GetConnection(sourcePlacement->nodeName,
+									 sourcePlacement->nodePort);
+	targetConnection = GetConnection(targetPlacement->nodeName,
+									 targetPlacement->nodePort);
+	if (sourceConnection == NULL || targetConnection == NULL)
+	{
+		return false;
+	}
+
+	resyncSuccessful = ExecuteRemoteCommand(targetConnection, BEGIN_COMMAND);
+	if (!resyncSuccessful)
+	{
+		return false;
+	}
+
+	resyncSuccessful = ExecuteRemoteCommand(targetConnection, deleteCommand->data);
+	if (resyncSuccessful)
+	{
+		copyStartTime = GetCurrentTimestamp();
+		resyncSuccessful = StreamShardData(sourceConnection, copyOutCommand->data,
+										   targetConnection, copyInCommand->data,
+										   INVALID_SHARD_ID, &bytesCopied);
+	}
+
+	if (resyncSuccessful)
+	{
+		resyncSuccessful = ExecuteRemoteCommand(targetConnection, COMMIT_COMMAND);
+	}
+	else
+	{
+		ExecuteRemoteCommand(targetConnection, ROLLBACK_COMMAND);
+	}
+
+	if (resyncSuccessful)
+	{
+		ReportCopyThroughput(shardId, bytesCopied, copyStartTime);
+	}
+
+	return resyncSuccessful;
+}
+
+
+/*
+ * StreamShardData runs the given COPY ... TO STDOUT command on the source
+ * connection and the given COPY ... FROM STDIN command on the target connection,
+ * and passes the data from one to the other as it arrives, so that the data is
+ * neither converted nor stored along the way. If a shard to unlock is given,
+ * the function releases its exclusive lock once the copy from the source has
+ * started, at which point the source has taken the snapshot it copies. The
+ * function adds the number of bytes passed on to bytesCopied, and returns
+ * whether both commands succeeded.
+ */
+static bool
+StreamShardData(PGconn *sourceConnection, char *copyOutCommand,
+				PGconn *targetConnection, char *copyInCommand, int64 unlockShardId,
+				int64 *bytesCopied)
+{
+	int dataLength = 0;
+	bool dataSent = true;
+
+	bool copyStarted = StartShardCopy(sourceConnection, copyOutCommand,
+									  targetConnection, copyInCommand);
+	if (!copyStarted)
+	{
+		return false;
+	}
+
+	if (unlockShardId != INVALID_SHARD_ID)
+	{
+		UnlockShard(unlockShardId, ExclusiveLock);
+	}
+
+	for (;;)
+	{
+		char *dataBuffer = NULL;
+
+		dataLength = ReceiveRemoteCopyData(sourceConnection, &dataBuffer);
+		if (dataLength < 0)
+		{
+			break;
+		}
+
+		dataSent = (PQputCopyData(targetConnection, dataBuffer, dataLength) == 1);
+		PQfreemem(dataBuffer);
+
+		if (!dataSent)
+		{
+			ReportRemoteError(targetConnection, NULL);
+			break;
+		}
+
+		(*bytesCopied) += dataLength;
+	}
+
+	return EndShardCopy(sourceConnection, targetConnection, dataSent);
+}
+
+
+/*
+ * BuildShardCopyCommands appends to the given strings the COPY ... TO STDOUT
+ * command which reads all rows of the given shard from a healthy placement and
+ * the COPY ... FROM STDIN command which writes them into a placement being
+ * repaired. Binary format is used unless a column's type lacks binary input or
+ * output functions.
+ */
+static void
+BuildShardCopyCommands(Oid relationId, int64 shardId, StringInfo copyOutCommand,
+					   StringInfo copyInCommand)
+{
+	char *relationName = get_rel_name(relationId);
+	const char *shardName = NULL;
+	const char *copyFormat = TEXT_COPY_FORMAT;
+
+	AppendShardIdToName(&relationName, shardId);
+	shardName = quote_identifier(relationName);
+
+	if (BinaryCopyFormatSupported(relationId))
+	{
+		copyFormat = BINARY_COPY_FORMAT;
+	}
+
+	appendStringInfo(copyOutCommand, COPY_OUT_COMMAND, shardName, copyFormat);
+	appendStringInfo(copyInCommand, COPY_IN_COMMAND, shardName, copyFormat);
+}
+
+
+/*
+ * ShardIndexDDLCommandList returns the commands which build the indexes of the
+ * given shard, which placements being repaired only get once their data has
+ * been copied.
+ */
+static List *
+ShardIndexDDLCommandList(Oid relationId, int64 shardId)
+{
+	List *indexCommandList = TableIndexDDLCommandList(relationId);
+
+	return ExtendedDDLCommandList(relationId, shardId, indexCommandList);
+}
+
+
+/*
+ * StartShardCopy starts the given COPY ... FROM STDIN command on the target
+ * connection and then the given COPY ... TO STDOUT command on the source
+ * connection, after which the data may be passed from one to the other. If the
+ * copy from the source cannot be started, the copy into the target is ended
+ * again. The function returns whether both copies were started.
+ */
+static bool
+StartShardCopy(PGconn *sourceConnection, char *copyOutCommand,
+			   PGconn *targetConnection, char *copyInCommand)
+{
+	bool copyOutStarted = false;
+
+	bool copyInStarted = StartRemoteCopy(targetConnection, copyInCommand,
+										 PGRES_COPY_IN);
+	if (!copyInStarted)
+	{
+		return false;
+	}
+
+	copyOutStarted = StartRemoteCopy(sourceConnection, copyOutCommand,
+									 PGRES_COPY_OUT);
+	if (!copyOutStarted)
+	{
+		PQputCopyEnd(targetConnection, "could not start copy from source placement");
+		PQclear(AwaitRemoteResults(targetConnection));
+
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * EndShardCopy ends a copy started by StartShardCopy once the source has sent
+ * all of its data, or once passing the data on to the target has failed, as
+ * indicated by dataSent. In the latter case, the source is still sending data
+ * which will never be read, so its query is abandoned; otherwise, the outcome
+ * of the copy from the source is collected. The copy into the target is then
+ * ended, with an error unless all went well. The function returns whether both
+ * sides of the copy succeeded.
+ */
+static bool
+EndShardCopy(PGconn *sourceConnection, PGconn *targetConnection, bool dataSent)
+{
+	PGresult *result = NULL;
+	bool copySuccessful = true;
+
+	if (!dataSent)
+	{
+		AbandonRemoteQuery(sourceConnection);
+		copySuccessful = false;
+	}
+	else
+	{
+		/* the copy from the source has ended, successfully or not */
+		result = AwaitRemoteResults(sourceConnection);
+		if (PQresultStatus(result) != PGRES_COMMAND_OK)
+		{
+			ReportRemoteError(sourceConnection, result);
+			copySuccessful = false;
+		}
+
+		PQclear(result);
+	}
+
+	if (copySuccessful)
+	{
+		PQputCopyEnd(targetConnection, NULL);
+	}
+	else
+	{
+		PQputCopyEnd(targetConnection, "could not copy data from source placement");
+	}
+
+	result = AwaitRemoteResults(targetConnection);
+	if (copySuccessful && PQresultStatus(result) != PGRES_COMMAND_OK)
+	{
+		ReportRemoteError(targetConnection, result);
+		copySuccessful = false;
+	}
+
+	PQclear(result);
+
+	return copySuccessful;
+}
+
+
+/*
+ * StartRemoteCopy sends the given COPY command on the given connection and
+ * waits until the remote node is ready to send or receive data, as indicated by
+ * the given result status. The function returns false and warns if the copy
+ * could not be started.
+ */
+static bool
+StartRemoteCopy(PGconn *connection, char *copyCommand, ExecStatusType copyStatus)
+{
+	PGresult *result = NULL;
+	bool copyStarted = false;
+
+	bool querySent = (ApplyRemoteStatementTimeout(connection) &&
+					  SendRemoteQuery(connection, copyCommand, 0, NULL, NULL,
+									  InvalidOid));
+	if (!querySent || !AwaitRemoteResult(connection))
+	{
+		ReportRemoteError(connection, NULL);
+		return false;
+	}
+
+	result = PQgetResult(connection);
+	if (PQresultStatus(result) == copyStatus)
+	{
+		copyStarted = true;
+	}
+	else
+	{
+		ReportRemoteError(connection, result);
+
+		/* collect the end of the failed command */
+		PQclear(AwaitRemoteResults(connection));
+	}
+
+	PQclear(result);
+
+	return copyStarted;
+}
+
+
+/*
+ * BinaryCopyFormatSupported returns whether the rows of the given table can be
+ * copied in binary format, which requires all of its columns' types to have
+ * binary input and output functions.
+ */
+static bool
+BinaryCopyFormatSupported(Oid relationId)
+{
+	Relation relation = relation_open(relationId, AccessShareLock);
+	TupleDesc tupleDescriptor = RelationGetDescr(relation);
+	bool binaryFormatSupported = true;
+	int attributeIndex = 0;
+
+	for (attributeIndex = 0; attributeIndex < tupleDescriptor->natts; attributeIndex++)
+	{
+		Form_pg_attribute attributeForm = tupleDescriptor->attrs[attributeIndex];
+
+		if (attributeForm->attisdropped)
+		{
+			continue;
+		}
+
+		if (!TypeSupportsBinaryIO(attributeForm->atttypid))
+		{
+			binaryFormatSupported = false;
+			break;
+		}
+	}
+
+	relation_close(relation, AccessShareLock);
+
+	return binaryFormatSupported;
+}
+
+
+/*
+ * TypeSupportsBinaryIO returns whether values of the given type can be sent and
+ * received in binary format. Arrays qualify if their elements do, and if their
+ * element type is built in: binary arrays carry the OID of their element type,
+ * which for other types differs between nodes. Composite types are not
+ * inspected, and never qualify.
+ */
+static bool
+TypeSupportsBinaryIO(Oid typeId)
+{
+	HeapTuple typeTuple = NULL;
+	Form_pg_type typeForm = NULL;
+	bool binaryIOSupported = false;
+
+	Oid elementTypeId = get_element_type(typeId);
+	if (OidIsValid(elementTypeId))
+	{
+		if (elementTypeId >= FirstNormalObjectId)
+		{
+			return false;
+		}
+
+		return TypeSupportsBinaryIO(elementTypeId);
+	}
+
+	if (type_is_rowtype(typeId))
+	{
+		return false;
+	}
+
+	typeTuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typeId));
+	if (!HeapTupleIsValid(typeTuple))
+	{
+		ereport(ERROR, (errmsg("cache lookup failed for type %u", typeId)));
+	}
+
+	typeForm = (Form_pg_type) GETSTRUCT(typeTuple);
+	binaryIOSupported = (OidIsValid(typeForm->typsend) &&
+						 OidIsValid(typeForm->typreceive));
+
+	ReleaseSysCache(typeTuple);
+
+	return binaryIOSupported;
+}
+
+
+/*
+ * ReportCopyThroughput logs the amount of data copied into a shard placement
+ * since the given time, and the throughput this amounts to.
+ */
+static void
+ReportCopyThroughput(int64 shardId, int64 bytesCopied, TimestampTz copyStartTime)
+{
+	ereport(LOG, (errmsg("copied data into shard " INT64_FORMAT, shardId),
+				  errdetail_internal("%s", CopyThroughputDetail(bytesCopied,
+																copyStartTime))));
+}
+
+
+/*
+ * CopyThroughputDetail describes the amount of data copied since the given
+ * time, and the throughput this amounts to.
+ */
+static char *
+CopyThroughputDetail(int64 bytesCopied, TimestampTz copyStartTime)
+{
+	StringInfo throughputDetail = makeStringInfo();
+	long elapsedSeconds = 0;
+	int elapsedMicroseconds = 0;
+	double copySeconds = 0.0;
+	double megabytesCopied = ((double) bytesCopied) / (1024.0 * 1024.0);
+	double megabytesPerSecond = 0.0;
+
+	TimestampDifference(copyStartTime, GetCurrentTimestamp(), &elapsedSeconds,
+						&elapsedMicroseconds);
+	copySeconds = elapsedSeconds + (elapsedMicroseconds / 1000000.0);
+
+	if (copySeconds > 0.0)
+	{
+		megabytesPerSecond = megabytesCopied / copySeconds;
+	}
+
+	appendStringInfo(throughputDetail, "Copied %.1f MB in %.1f s (%.1f MB/s).",
+					 megabytesCopied, copySeconds, megabytesPerSecond);
+
+	return throughputDetail->data;
+}
+
+
+/*
+ * CopyDataFromTupleStoreToRelation loads a specified relation with all tuples
+ * stored in the provided tuplestore. This function assumes the relation's
+ * layout (TupleDesc) exactly matches that of the provided tuplestore. This
+ * function raises an error if the copy cannot be completed.
+ */
+static void
+CopyDataFromTupleStoreToRelation(Tuplestorestate *tupleStore, Relation relation)
+{
+	TupleDesc tupleDescriptor = RelationGetDescr(relation);
+	TupleTableSlot *tupleTableSlot = MakeSingleTupleTableSlot(tupleDescriptor);
+
+	for (;;)
+	{
+		HeapTuple tupleToInsert = NULL;
+		bool nextTuple = tuplestore_gettupleslot(tupleStore, true, false, tupleTableSlot);
+		if (!nextTuple)
+		{
+			break;
+		}
+
+		tupleToInsert = ExecMaterializeSlot(tupleTableSlot);
+
+		simple_heap_insert(relation, tupleToInsert);
+
+		ExecClearTuple(tupleTableSlot);
+	}
+
+	/* make the inserted rows visible at once, rather than after every row */
+	CommandCounterIncrement();
+
+	ExecDropSingleTupleTableSlot(tupleTableSlot);
+}
+
+
+/*
+ * PlanShardRepairs finds the inactive placements of the given table's shards,
+ * and returns a list of repairs for them, ordered by shard id. Shards which
+ * lack a healthy placement to repair from are skipped. The shards are not yet
+ * locked: each is only locked once its repair starts; see StartShardRepair.
+ */
+static List *
+PlanShardRepairs(Oid distributedTableId)
+{
+	List *shardIntervalList = LoadShardIntervalList(distributedTableId);
+	List *repairList = NIL;
+	ListCell *shardIntervalCell = NULL;
+
+	shardIntervalList = SortList(shardIntervalList, CompareShardIntervalsById);
+
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+		int64 shardId = shardInterval->id;
+		List *shardPlacementList = LoadShardPlacementList(shardId);
+		List *finalizedPlacementList = NIL;
+		List *inactivePlacementList = NIL;
+		ListCell *shardPlacementCell = NULL;
+
+		foreach(shardPlacementCell, shardPlacementList)
+		{
+			ShardPlacement *shardPlacement = lfirst(shardPlacementCell);
+
+			if (shardPlacement->shardState == STATE_FINALIZED)
+			{
+				finalizedPlacementList = lappend(finalizedPlacementList,
+												 shardPlacement);
+			}
+			else if (shardPlacement->shardState == STATE_INACTIVE)
+			{
+				inactivePlacementList = lappend(inactivePlacementList,
+												shardPlacement);
+			}
+		}
+
+		if (inactivePlacementList != NIL && finalizedPlacementList == NIL)
+		{
+			ereport(WARNING, (errmsg("skipping shard " INT64_FORMAT ", which has no "
+									 "healthy placement to repair from", shardId)));
+			continue;
+		}
+
+		foreach(shardPlacementCell, inactivePlacementList)
+		{
+			ShardPlacement *targetPlacement = lfirst(shardPlacementCell);
+			ShardRepair *repair = (ShardRepair *) palloc0(sizeof(ShardRepair));
+
+			repair->shardId = shardId;
+			repair->relationId = distributedTableId;
+			repair->sourcePlacement = LeastUsedSourcePlacement(finalizedPlacementList,
+															   repairList);
+			repair->targetPlacement = targetPlacement;
+			repair->status = REPAIR_STATUS_PENDING;
+			repair->sourceSlot = -1;
+			repair->targetSlot = -1;
+
+			repairList = lappend(repairList, repair);
+		}
+	}
+
+	return repairList;
+}
+
+
+/*
+ * LeastUsedSourcePlacement returns the placement among the given healthy ones
+ * whose node the fewest of the given repairs copy from.
+ */
+static ShardPlacement *
+LeastUsedSourcePlacement(List *finalizedPlacementList, List *repairList)
+{
+	ShardPlacement *leastUsedPlacement = NULL;
+	int32 leastUseCount = 0;
+	ListCell *placementCell = NULL;
+
+	foreach(placementCell, finalizedPlacementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		int32 useCount = 0;
+		ListCell *repairCell = NULL;
+
+		foreach(repairCell, repairList)
+		{
+			ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+
+			if (SamePlacementNode(repair->sourcePlacement, placement))
+			{
+				useCount++;
+			}
+		}
+
+		if (leastUsedPlacement == NULL || useCount < leastUseCount)
+		{
+			leastUsedPlacement = placement;
+			leastUseCount = useCount;
+		}
+	}
+
+	return leastUsedPlacement;
+}
+
+
+/*
+ * ExecuteShardRepairs runs the given repairs, up to the given number at once on
+ * any one node, and returns once each has finished or failed. Repairs which
+ * copy data wait for the data on their source connections, and repairs which
+ * build indexes for results on their target connections; all of these are
+ * polled together. A repair whose shard cannot be locked yet remains pending
+ * and is retried on the next round. The function returns the number of repairs
+ * which finished. If an error is thrown meanwhile, the connections of running
+ * repairs are closed, which rolls back their work on the repaired placements.
+ */
+int32
+ExecuteShardRepairs(List *repairList, int32 maxParallel)
+{
+	int32 repairCount = list_length(repairList);
+	int32 completedCount = 0;
+	int32 repairedCount = 0;
+	struct pollfd *pollDescriptorArray = palloc0(repairCount * sizeof(struct pollfd));
+	ShardRepair **pollRepairArray = palloc0(repairCount * sizeof(ShardRepair *));
+
+	PG_TRY();
+	{
+		while (completedCount < repairCount)
+		{
+			ListCell *repairCell = NULL;
+			int32 pollDescriptorCount = 0;
+			int32 pollIndex = 0;
+			int pollResult = 0;
+			bool repairWaiting = false;
+
+			foreach(repairCell, repairList)
+			{
+				ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+				struct pollfd *pollDescriptor = &pollDescriptorArray[pollDescriptorCount];
+
+				if (repair->status == REPAIR_STATUS_PENDING)
+				{
+					StartShardRepair(repair, repairList, maxParallel);
+				}
+
+				if (repair->status == REPAIR_STATUS_PENDING)
+				{
+					repairWaiting = true;
+					continue;
+				}
+				else if (repair->status == REPAIR_STATUS_COPYING)
+				{
+					pollDescriptor->fd = PQsocket(repair->sourceConnection);
+				}
+				else if (repair->status == REPAIR_STATUS_INDEXING)
+				{
+					pollDescriptor->fd = PQsocket(repair->targetConnection);
+				}
+				else
+				{
+					continue;
+				}
+
+				pollDescriptor->events = POLLIN;
+				pollDescriptor->revents = 0;
+
+				pollRepairArray[pollDescriptorCount] = repair;
+				pollDescriptorCount++;
+			}
+
+			if (pollDescriptorCount > 0)
+			{
+				pollResult = poll(pollDescriptorArray, pollDescriptorCount,
+								  EXECUTOR_POLL_TIMEOUT_MSECS);
+				if (pollResult < 0 && errno != EINTR && errno != EAGAIN)
+				{
+					ereport(ERROR, (errcode_for_socket_access(),
+									errmsg("poll() failed: %m")));
+				}
+			}
+			else if (repairWaiting)
+			{
+				/* only repairs waiting for their shard's lock remain */
+				pg_usleep(EXECUTOR_POLL_TIMEOUT_MSECS * 1000L);
+			}
+
+			CHECK_FOR_INTERRUPTS();
+
+			for (pollIndex = 0; pollIndex < pollDescriptorCount && pollResult > 0;
+				 pollIndex++)
+			{
+				ShardRepair *repair = pollRepairArray[pollIndex];
+
+				if (pollDescriptorArray[pollIndex].revents == 0)
+				{
+					continue;
+				}
+
+				if (repair->status == REPAIR_STATUS_COPYING)
+				{
+					ContinueShardCopy(repair);
+				}
+				else
+				{
+					ReceiveIndexResults(repair);
+				}
+			}
+
+			foreach(repairCell, repairList)
+			{
+				ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+
+				if (repair->completionReported ||
+					(repair->status != REPAIR_STATUS_FINISHED &&
+					 repair->status != REPAIR_STATUS_FAILED))
+				{
+					continue;
+				}
+
+				completedCount++;
+				if (repair->status == REPAIR_STATUS_FINISHED)
+				{
+					repairedCount++;
+				}
+
+				CompleteShardRepair(repair, completedCount, repairCount);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		ListCell *repairCell = NULL;
+
+		foreach(repairCell, repairList)
+		{
+			ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+
+			if (repair->status == REPAIR_STATUS_COPYING ||
+				repair->status == REPAIR_STATUS_INDEXING)
+			{
+				PurgeConnection(repair->sourceConnection);
+				PurgeConnection(repair->targetConnection);
+			}
+		}
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pfree(pollDescriptorArray);
+	pfree(pollRepairArray);
+
+	return repairedCount;
+}
+
+
+/*
+ * StartShardRepair tries to start a pending repair, using connections to its
+ * nodes which no other running repair holds. If either node already runs as
+ * many repairs as allowed, or the shard's lock is not immediately available,
+ * the repair remains pending. Otherwise, the shard is locked against
+ * modifications and other repairs until the transaction ends, and the repair
+ * fails if the shard is being repaired online or its placements changed since
+ * the repair was planned. The inactive placement's table is then recreated,
+ * and the copy from the healthy placement is started within a transaction on
+ * the repaired node; if any of this fails, the repair fails. A repair made
+ * online starts logging the shard's modifications before the copy starts, and
+ * releases the shard's lock once the copy has taken its snapshot.
+ */
+static void
+StartShardRepair(ShardRepair *repair, List *repairList, int32 maxParallel)
+{
+	ShardPlacement *sourcePlacement = repair->sourcePlacement;
+	ShardPlacement *targetPlacement = repair->targetPlacement;
+	StringInfo copyOutCommand = makeStringInfo();
+	StringInfo copyInCommand = makeStringInfo();
+	List *ddlCommandList = NIL;
+	ListCell *ddlCommandCell = NULL;
+	PGconn *sourceConnection = NULL;
+	PGconn *targetConnection = NULL;
+	bool copyStarted = true;
+
+	int32 sourceSlot = FreeRepairConnectionSlot(sourcePlacement, repairList,
+												maxParallel);
+	int32 targetSlot = FreeRepairConnectionSlot(targetPlacement, repairList,
+												maxParallel);
+	if (sourceSlot < 0 || targetSlot < 0)
+	{
+		return;
+	}
+
+	/* waiting for the lock would hold up the repairs already running */
+	if (!ConditionalLockShard(repair->shardId, ExclusiveLock))
+	{
+		return;
+	}
+
+	if (OnlineRepairInProgress(repair->shardId))
+	{
+		ereport(WARNING, (errmsg("skipping shard " INT64_FORMAT ", which is "
+								 "already being repaired", repair->shardId)));
+
+		repair->status = REPAIR_STATUS_FAILED;
+		return;
+	}
+
+	if (!RepairPlacementsUnchanged(repair))
+	{
+		ereport(WARNING, (errmsg("skipping shard " INT64_FORMAT ", whose placements "
+								 "changed since the repair was planned",
+								 repair->shardId)));
+
+		repair->status = REPAIR_STATUS_FAILED;
+		return;
+	}
+
+	sourceConnection = GetConnectionForSlot(sourcePlacement->nodeName,
+											sourcePlacement->nodePort, sourceSlot);
+	targetConnection = GetConnectionForSlot(targetPlacement->nodeName,
+											targetPlacement->nodePort, targetSlot);
+	if (sourceConnection == NULL || targetConnection == NULL)
+	{
+		repair->status = REPAIR_STATUS_FAILED;
+		return;
+	}
+
+	BuildShardCopyCommands(repair->relationId, repair->shardId, copyOutCommand,
+						   copyInCommand);
+
+	/* retrieve the DDL commands for the table (but not its indexes) and run them */
+	ddlCommandList = RecreateTableDDLCommandList(repair->relationId, repair->shardId);
+	ddlCommandList = lappend(ddlCommandList, BEGIN_COMMAND);
+
+	repair->targetCreated = true;
+
+	foreach(ddlCommandCell, ddlCommandList)
+	{
+		char *ddlCommand = (char *) lfirst(ddlCommandCell);
+
+		copyStarted = ExecuteRemoteCommand(targetConnection, ddlCommand);
+		if (!copyStarted)
+		{
+			break;
+		}
+	}
+
+	if (copyStarted && repair->onlineCopy)
+	{
+		/* entries left behind by an earlier, failed repair no longer apply */
+		StartModificationCapture(repair->shardId);
+		DeleteShardRepairLogRows(repair->shardId);
+	}
+
+	if (copyStarted)
+	{
+		copyStarted = StartShardCopy(sourceConnection, copyOutCommand->data,
+									 targetConnection, copyInCommand->data);
+	}
+
+	if (!copyStarted)
+	{
+		ExecuteRemoteCommand(targetConnection, ROLLBACK_COMMAND);
+
+		if (repair->onlineCopy)
+		{
+			EndModificationCapture(repair->shardId);
+		}
+
+		repair->status = REPAIR_STATUS_FAILED;
+		return;
+	}
+
+	if (repair->onlineCopy)
+	{
+		/* the copy has taken its snapshot, and later modifications are logged */
+		UnlockShard(repair->shardId, ExclusiveLock);
+	}
+
+	repair->status = REPAIR_STATUS_COPYING;
+	repair->sourceSlot = sourceSlot;
+	repair->targetSlot = targetSlot;
+	repair->sourceConnection = sourceConnection;
+	repair->targetConnection = targetConnection;
+	repair->copyStartTime = GetCurrentTimestamp();
+}
+
+
+/*
+ * RepairPlacementsUnchanged returns whether the given repair's source placement
+ * is still healthy and its target placement still inactive, which may no longer
+ * hold once the repair's shard is locked.
+ */
+static bool
+RepairPlacementsUnchanged(ShardRepair *repair)
+{
+	List *shardPlacementList = LoadShardPlacementList(repair->shardId);
+	ListCell *shardPlacementCell = NULL;
+	bool sourceFinalized = false;
+	bool targetInactive = false;
+
+	foreach(shardPlacementCell, shardPlacementList)
+	{
+		ShardPlacement *shardPlacement = (ShardPlacement *) lfirst(shardPlacementCell);
+
+		if (shardPlacement->id == repair->sourcePlacement->id &&
+			shardPlacement->shardState == STATE_FINALIZED)
+		{
+			sourceFinalized = true;
+		}
+		else if (shardPlacement->id == repair->targetPlacement->id &&
+				 shardPlacement->shardState == STATE_INACTIVE)
+		{
+			targetInactive = true;
+		}
+	}
+
+	return (sourceFinalized && targetInactive);
+}
+
+
+/*
+ * FreeRepairConnectionSlot returns the lowest connection slot to the given
+ * placement's node which no running repair uses, whether as source or target.
+ * If the given number of slots are all in use, the function returns -1.
+ */
+static int32
+FreeRepairConnectionSlot(ShardPlacement *placement, List *repairList,
+						 int32 maxParallel)
+{
+	int32 connectionSlot = 0;
+
+	for (connectionSlot = 0; connectionSlot < maxParallel; connectionSlot++)
+	{
+		bool slotInUse = false;
+		ListCell *repairCell = NULL;
+
+		foreach(repairCell, repairList)
+		{
+			ShardRepair *repair = (ShardRepair *) lfirst(repairCell);
+
+			if (repair->status != REPAIR_STATUS_COPYING &&
+				repair->status != REPAIR_STATUS_INDEXING)
+			{
+				continue;
+			}
+
+			if ((repair->sourceSlot == connectionSlot &&
+				 SamePlacementNode(repair->sourcePlacement, placement)) ||
+				(repair->targetSlot == connectionSlot &&
+				 SamePlacementNode(repair->targetPlacement, placement)))
+			{
+				slotInUse = true;
+				break;
+			}
+		}
+
+		if (!slotInUse)
+		{
+			return connectionSlot;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * ContinueShardCopy passes on whatever data has arrived from a copying repair's
+ * source connection to its target connection, without waiting for more. Once
+ * the source has sent all of its data, the copy is finished; if either side of
+ * the copy fails, so does the repair.
+ */
+static void
+ContinueShardCopy(ShardRepair *repair)
+{
+	PGconn *sourceConnection = repair->sourceConnection;
+	PGconn *targetConnection = repair->targetConnection;
+
+	if (PQconsumeInput(sourceConnection) == 0)
+	{
+		ReportRemoteError(sourceConnection, NULL);
+		FailShardRepair(repair);
+		return;
+	}
+
+	for (;;)
+	{
+		char *dataBuffer = NULL;
+		bool async = true;
+		bool dataSent = false;
+
+		int dataLength = PQgetCopyData(sourceConnection, &dataBuffer, async);
+		if (dataLength == 0)
+		{
+			/* wait for more data to arrive */
+			return;
+		}
+		else if (dataLength < 0)
+		{
+			/* the copy from the source has ended, successfully or not */
+			FinishShardCopy(repair);
+			return;
+		}
+
+		dataSent = (PQputCopyData(targetConnection, dataBuffer, dataLength) == 1);
+		PQfreemem(dataBuffer);
+
+		if (!dataSent)
+		{
+			ReportRemoteError(targetConnection, NULL);
+			FailShardRepair(repair);
+			return;
+		}
+
+		repair->bytesCopied += dataLength;
+	}
+}
+
+
+/*
+ * FinishShardCopy ends a repair's copy once the source has sent all of its
+ * data; see EndShardCopy. It then has the target build the placement's indexes
+ * and commit, which the repair awaits from then on. If any step fails, so does
+ * the repair.
+ */
+static void
+FinishShardCopy(ShardRepair *repair)
+{
+	PGconn *sourceConnection = repair->sourceConnection;
+	PGconn *targetConnection = repair->targetConnection;
+	List *indexCommandList = NIL;
+	ListCell *indexCommandCell = NULL;
+	StringInfo finishCommand = makeStringInfo();
+	bool commandSent = false;
+
+	bool copySuccessful = EndShardCopy(sourceConnection, targetConnection, true);
+	if (!copySuccessful)
+	{
+		ExecuteRemoteCommand(targetConnection, ROLLBACK_COMMAND);
+		repair->status = REPAIR_STATUS_FAILED;
+		return;
+	}
+
+	/* send the index builds and the commit at once, and await them with others */
+	indexCommandList = ShardIndexDDLCommandList(repair->relationId, repair->shardId);
+	indexCommandList = lappend(indexCommandList, COMMIT_COMMAND);
+
+	foreach(indexCommandCell, indexCommandList)
+	{
+		char *indexCommand = (char *) lfirst(indexCommandCell);
+
+		appendStringInfo(finishCommand, "%s;", indexCommand);
+	}
+
+	commandSent = (ApplyRemoteStatementTimeout(targetConnection) &&
+				   SendRemoteQuery(targetConnection, finishCommand->data, 0, NULL,
+								   NULL, InvalidOid));
+	if (!commandSent)
+	{
+		ReportRemoteError(targetConnection, NULL);
+		PurgeConnection(targetConnection);
+
+		repair->status = REPAIR_STATUS_FAILED;
+		return;
+	}
+
+	repair->status = REPAIR_STATUS_INDEXING;
+}
+
+
+/*
+ * ReceiveIndexResults consumes whatever input is available on an indexing
+ * repair's target connection without blocking. Once all results have arrived,
+ * the repair finishes if the indexes were built and the transaction committed,
+ * and fails otherwise, in which case the transaction is rolled back.
+ */
+static void
+ReceiveIndexResults(ShardRepair *repair)
+{
+	PGconn *targetConnection = repair->targetConnection;
+
+	if (PQconsumeInput(targetConnection) == 0)
+	{
+		ReportRemoteError(targetConnection, NULL);
+		PurgeConnection(targetConnection);
+
+		repair->status = REPAIR_STATUS_FAILED;
+		return;
+	}
+
+	while (PQisBusy(targetConnection) == 0)
+	{
+		PGresult *result = PQgetResult(targetConnection);
+		if (result == NULL)
+		{
+			RemoteQueryFinished(targetConnection);
+
+			if (repair->commandFailed)
+			{
+				/* a failed command skips those after it, including the commit */
+				ExecuteRemoteCommand(targetConnection, ROLLBACK_COMMAND);
+				repair->status = REPAIR_STATUS_FAILED;
+			}
+			else
+			{
+				repair->status = REPAIR_STATUS_FINISHED;
+			}
+
+			return;
+		}
+
+		if (PQresultStatus(result) != PGRES_COMMAND_OK && !repair->commandFailed)
+		{
+			ReportRemoteError(targetConnection, result);
+			repair->commandFailed = true;
+		}
+
+		PQclear(result);
+	}
+}
+
+
+/*
+ * FailShardRepair gives up on a copying repair: the copy from the source, which
+ * is still running, is cancelled, and the copy into the target is ended with an
+ * error and its transaction rolled back.
+ */
+static void
+FailShardRepair(ShardRepair *repair)
+{
+	PGconn *targetConnection = repair->targetConnection;
+
+	EndShardCopy(repair->sourceConnection, targetConnection, false);
+	ExecuteRemoteCommand(targetConnection, ROLLBACK_COMMAND);
+
+	repair->status = REPAIR_STATUS_FAILED;
+}
+
+
+/*
+ * CompleteShardRepair reports the outcome of a repair which has finished or
+ * failed, along with the progress of the bulk repair and, for finished repairs,
+ * the throughput of the copy. A repaired placement is returned to finalized
+ * state right away, rather than once all repairs are done. A copy made to move its source placement is instead left for the
+ * rebalancer to switch over to; see MoveShardGroups.
+ */
+static void
+CompleteShardRepair(ShardRepair *repair, int32 completedCount, int32 repairCount)
+{
+	ShardPlacement *sourcePlacement = repair->sourcePlacement;
+	ShardPlacement *targetPlacement = repair->targetPlacement;
+	char *throughputDetail = NULL;
+
+	repair->completionReported = true;
+
+	if (repair->status == REPAIR_STATUS_FINISHED && !repair->moveSource)
+	{
+		DeleteShardPlacementRow(targetPlacement->id);
+		InsertShardPlacementRow(targetPlacement->id, targetPlacement->shardId,
+								STATE_FINALIZED, targetPlacement->nodeName,
+								targetPlacement->nodePort);
+	}
+
+	if (repair->status == REPAIR_STATUS_FINISHED)
+	{
+		throughputDetail = CopyThroughputDetail(repair->bytesCopied,
+												repair->copyStartTime);
+	}
+
+	if (repair->status == REPAIR_STATUS_FINISHED && repair->moveSource)
+	{
+		ereport(NOTICE, (errmsg("copied placement of shard " INT64_FORMAT " from "
+								"\"%s:%u\" to \"%s:%u\" (%d of %d)", repair->shardId,
+								sourcePlacement->nodeName, sourcePlacement->nodePort,
+								targetPlacement->nodeName, targetPlacement->nodePort,
+								completedCount, repairCount),
+						 errdetail_internal("%s", throughputDetail)));
+	}
+	else if (repair->status == REPAIR_STATUS_FINISHED)
+	{
+		ereport(NOTICE, (errmsg("repaired placement of shard " INT64_FORMAT
+								" on \"%s:%u\" (%d of %d)", repair->shardId,
+								targetPlacement->nodeName, targetPlacement->nodePort,
+								completedCount, repairCount),
+						 errdetail_internal("%s", throughputDetail)));
+	}
+	else if (repair->moveSource)
+	{
+		ereport(WARNING, (errmsg("could not copy placement of shard " INT64_FORMAT
+								 " from \"%s:%u\" to \"%s:%u\" (%d of %d)",
+								 repair->shardId, sourcePlacement->nodeName,
+								 sourcePlacement->nodePort, targetPlacement->nodeName,
+								 targetPlacement->nodePort, completedCount,
+								 repairCount)));
+	}
+	else
+	{
+		ereport(WARNING, (errmsg("could not repair placement of shard " INT64_FORMAT
+								 " on \"%s:%u\" (%d of %d)", repair->shardId,
+								 targetPlacement->nodeName, targetPlacement->nodePort,
+								 completedCount, repairCount)));
+	}
+
+	repair->sourceSlot = -1;
+	repair->targetSlot = -1;
+	repair->sourceConnection = NULL;
+	repair->targetConnection = NULL;
+}
+
+
+/* SamePlacementNode returns whether the given placements are on the same node. */
+static bool
+SamePlacementNode(ShardPlacement *leftPlacement, ShardPlacement *rightPlacement)
+{
+	return (leftPlacement->nodePort == rightPlacement->nodePort &&
+			strncmp(leftPlacement->nodeName, rightPlacement->nodeName,
+					MAX_NODE_LENGTH) == 0);
+}
+
+
+/*
+ * InitializeOnlineRepair requests the shared memory and lock needed to track
+ * online shard repairs across backends. Both are only possible while shared
+ * preload libraries are being loaded; at any other time this function does
+ * nothing and shards cannot be repaired online.
+ */
+void
+InitializeOnlineRepair(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+	{
+		return;
+	}
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(OnlineRepairControlData)));
+	RequestAddinLWLocks(1);
+
+	PreviousShmemStartupHook = shmem_startup_hook;
+	shmem_startup_hook = OnlineRepairShmemStartup;
+
+	RegisterXactCallback(OnlineRepairXactCallback, NULL);
+}
+
+
+/*
+ * OnlineRepairAvailable returns whether the shared state needed to capture the
+ * modifications of shards during online repairs has been set up, which requires
+ * pg_shard to be loaded via shared_preload_libraries.
+ */
+bool
+OnlineRepairAvailable(void)
+{
+	return (OnlineRepairControl != NULL);
+}
+
+
+/*
+ * CaptureShardModification logs the given modification task for later replay
+ * if its shard is being repaired online. The function must be called after the
+ * task's shard lock was acquired, so that repairs can start and end capture
+ * while they lock out modifications, and before the task is sent to any
+ * placement: workers commit the modification on their own, so logging it only
+ * afterwards could lose it. Should the task then fail on all placements, or the
+ * transaction abort, the entry cannot be trusted, and the repair is failed.
+ *
+ * A task which reads from another shard cannot be replayed on the placement
+ * being repaired, which may not have that shard alongside it; such a task also
+ * makes the repair fail.
+ */
+void
+CaptureShardModification(Task *task)
+{
+	OnlineRepairEntry *repairEntry = NULL;
+	bool replayable = (task->sourceShardId == INVALID_SHARD_ID ||
+					   task->sourceShardId == task->shardId);
+
+	/* shards are rarely repaired online, so avoid taking the lock if none are */
+	if (OnlineRepairControl == NULL || OnlineRepairControl->activeRepairCount == 0)
+	{
+		return;
+	}
+
+	LWLockAcquire(OnlineRepairControl->lock, LW_EXCLUSIVE);
+
+	repairEntry = FindOnlineRepairEntry(task->shardId);
+	if (repairEntry != NULL && !replayable)
+	{
+		repairEntry->captureFailed = true;
+	}
+
+	LWLockRelease(OnlineRepairControl->lock);
+
+	if (repairEntry != NULL && replayable)
+	{
+		char *queryTree = NULL;
+		int64 *shardIdPointer = NULL;
+		MemoryContext oldContext = NULL;
+
+		/* shards being split need the query to replay it on their children */
+		if (task->query != NULL)
+		{
+			queryTree = nodeToString(task->query);
+		}
+
+		InsertShardRepairLogRow(task->shardId, task->queryString->data,
+								task->parameterCount, task->parameterTypes,
+								task->parameterValues, queryTree);
+
+		oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+		shardIdPointer = (int64 *) palloc(sizeof(int64));
+		*shardIdPointer = task->shardId;
+		CapturedShardIdList = lappend(CapturedShardIdList, shardIdPointer);
+
+		MemoryContextSwitchTo(oldContext);
+	}
+}
+
+
+/*
+ * FailModificationCapture fails the online repair of the given shard, if there
+ * is one, after a captured modification of the shard could not be applied to
+ * any of its placements. Replaying the logged modification would otherwise
+ * apply it to the repaired placement alone.
+ */
+void
+FailModificationCapture(int64 shardId)
+{
+	if (OnlineRepairControl == NULL || OnlineRepairControl->activeRepairCount == 0)
+	{
+		return;
+	}
+
+	MarkModificationCaptureFailed(shardId);
+}
+
+
+/*
+ * OnlineRepairShmemStartup creates or attaches to the shared online repair state.
+ */
+static void
+OnlineRepairShmemStartup(void)
+{
+	bool alreadyInitialized = false;
+
+	if (PreviousShmemStartupHook != NULL)
+	{
+		PreviousShmemStartupHook();
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	OnlineRepairControl = ShmemInitStruct("pg_shard online repair",
+										  sizeof(OnlineRepairControlData),
+										  &alreadyInitialized);
+	if (!alreadyInitialized)
+	{
+		memset(OnlineRepairControl, 0, sizeof(OnlineRepairControlData));
+		OnlineRepairControl->lock = LWLockAssign();
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * OnlineRepairXactCallback fails the online repairs of the shards whose
+ * modifications were logged by an aborted transaction: the log entries are
+ * rolled back, though workers may have committed the modifications.
+ */
+static void
+OnlineRepairXactCallback(XactEvent event, void *arg)
+{
+	ListCell *shardIdCell = NULL;
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT)
+	{
+		return;
+	}
+
+	if (event == XACT_EVENT_ABORT)
+	{
+		foreach(shardIdCell, CapturedShardIdList)
+		{
+			int64 *shardIdPointer = (int64 *) lfirst(shardIdCell);
+
+			MarkModificationCaptureFailed(*shardIdPointer);
+		}
+	}
+
+	/* the list is freed along with the transaction's memory */
+	CapturedShardIdList = NIL;
+}
+
+
+/*
+ * MarkModificationCaptureFailed marks the online repair of the given shard as
+ * failed, if the shard is being repaired online.
+ */
+static void
+MarkModificationCaptureFailed(int64 shardId)
+{
+	OnlineRepairEntry *repairEntry = NULL;
+
+	LWLockAcquire(OnlineRepairControl->lock, LW_EXCLUSIVE);
+
+	repairEntry = FindOnlineRepairEntry(shardId);
+	if (repairEntry != NULL)
+	{
+		repairEntry->captureFailed = true;
+	}
+
+	LWLockRelease(OnlineRepairControl->lock);
+}
+
+
+/*
+ * StartModificationCapture registers an online repair of the given shard, so
+ * that modifications of the shard are logged from now on. The function errors
+ * out if pg_shard was not loaded via shared_preload_libraries, if the shard is
+ * already being repaired, or if too many shards are.
+ */
+void
+StartModificationCapture(int64 shardId)
+{
+	OnlineRepairEntry *freeEntry = NULL;
+	int entryIndex = 0;
+
+	if (OnlineRepairControl == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("online repair requires pg_shard to be loaded via "
+							   "shared_preload_libraries")));
+	}
+
+	LWLockAcquire(OnlineRepairControl->lock, LW_EXCLUSIVE);
+
+	if (FindOnlineRepairEntry(shardId) != NULL)
+	{
+		LWLockRelease(OnlineRepairControl->lock);
+
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_IN_USE),
+						errmsg("shard " INT64_FORMAT " is already being repaired",
+							   shardId)));
+	}
+
+	for (entryIndex = 0; entryIndex < MAX_ONLINE_REPAIR_COUNT; entryIndex++)
+	{
+		OnlineRepairEntry *repairEntry = &OnlineRepairControl->repairEntries[entryIndex];
+
+		if (repairEntry->shardId == INVALID_SHARD_ID)
+		{
+			freeEntry = repairEntry;
+			break;
+		}
+	}
+
+	if (freeEntry == NULL)
+	{
+		LWLockRelease(OnlineRepairControl->lock);
+
+		ereport(ERROR, (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+						errmsg("cannot repair more than %d shards online at once",
+							   MAX_ONLINE_REPAIR_COUNT)));
+	}
+
+	freeEntry->shardId = shardId;
+	freeEntry->repairPid = MyProcPid;
+	freeEntry->captureFailed = false;
+	OnlineRepairControl->activeRepairCount++;
+
+	LWLockRelease(OnlineRepairControl->lock);
+}
+
+
+/*
+ * EndModificationCapture unregisters the online repair of the given shard, if
+ * this backend registered one, after which its modifications are not logged.
+ */
+void
+EndModificationCapture(int64 shardId)
+{
+	OnlineRepairEntry *repairEntry = NULL;
+
+	if (OnlineRepairControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(OnlineRepairControl->lock, LW_EXCLUSIVE);
+
+	repairEntry = FindOnlineRepairEntry(shardId);
+	if (repairEntry != NULL && repairEntry->repairPid == MyProcPid)
+	{
+		repairEntry->shardId = INVALID_SHARD_ID;
+		repairEntry->repairPid = 0;
+		repairEntry->captureFailed = false;
+		OnlineRepairControl->activeRepairCount--;
+	}
+
+	LWLockRelease(OnlineRepairControl->lock);
+}
+
+
+/*
+ * ModificationCaptureFailed returns whether a modification of the given shard
+ * could not be logged since its online repair started.
+ */
+bool
+ModificationCaptureFailed(int64 shardId)
+{
+	OnlineRepairEntry *repairEntry = NULL;
+	bool captureFailed = true;
+
+	if (OnlineRepairControl == NULL)
+	{
+		return captureFailed;
+	}
+
+	LWLockAcquire(OnlineRepairControl->lock, LW_EXCLUSIVE);
+
+	repairEntry = FindOnlineRepairEntry(shardId);
+	if (repairEntry != NULL)
+	{
+		captureFailed = repairEntry->captureFailed;
+	}
+
+	LWLockRelease(OnlineRepairControl->lock);
+
+	return captureFailed;
+}
+
+
+/*
+ * OnlineRepairInProgress returns whether the given shard is being repaired
+ * online by another backend.
+ */
+bool
+OnlineRepairInProgress(int64 shardId)
+{
+	bool repairInProgress = false;
+
+	if (OnlineRepairControl == NULL)
+	{
+		return false;
+	}
+
+	LWLockAcquire(OnlineRepairControl->lock, LW_EXCLUSIVE);
+
+	repairInProgress = (FindOnlineRepairEntry(shardId) != NULL);
+
+	LWLockRelease(OnlineRepairControl->lock);
+
+	return repairInProgress;
+}
+
+
+/*
+ * FindOnlineRepairEntry returns the entry tracking the online repair of the
+ * given shard, or NULL if the shard is not being repaired online. Entries left
+ * behind by processes which exited without unregistering their repair are
+ * released along the way. The caller must hold the online repair lock in
+ * exclusive mode.
+ */
+static OnlineRepairEntry *
+FindOnlineRepairEntry(int64 shardId)
+{
+	OnlineRepairEntry *matchingEntry = NULL;
+	int entryIndex = 0;
+
+	for (entryIndex = 0; entryIndex < MAX_ONLINE_REPAIR_COUNT; entryIndex++)
+	{
+		OnlineRepairEntry *repairEntry = &OnlineRepairControl->repairEntries[entryIndex];
+
+		if (repairEntry->shardId != shardId)
+		{
+			continue;
+		}
+
+		if (BackendPidGetProc(repairEntry->repairPid) == NULL)
+		{
+			repairEntry->shardId = INVALID_SHARD_ID;
+			repairEntry->repairPid = 0;
+			repairEntry->captureFailed = false;
+			OnlineRepairControl->activeRepairCount--;
+			continue;
+		}
+
+		matchingEntry = repairEntry;
+		break;
+	}
+
+	return matchingEntry;
 }
@@ -16,17 +16,147 @@
 #include "postgres.h"
 #include "fmgr.h"
 
+#include "distribution_metadata.h"
+#include "pg_shard.h"
+
+#include "datatype/timestamp.h"
+#include "libpq-fe.h"
+#include "storage/lwlock.h"
+
 
 /* templates for SQL commands used during shard placement repair */
 #define DROP_REGULAR_TABLE_COMMAND "DROP TABLE IF EXISTS %s"
 #define DROP_FOREIGN_TABLE_COMMAND "DROP FOREIGN TABLE IF EXISTS %s"
-#define COPY_SHARD_PLACEMENT_COMMAND "SELECT worker_copy_shard_placement(%s, %s, %d)"
+#define COPY_OUT_COMMAND "COPY %s TO STDOUT WITH (FORMAT %s)"
+#define COPY_IN_COMMAND "COPY %s FROM STDIN WITH (FORMAT %s)"
 #define SELECT_ALL_QUERY "SELECT * FROM %s"
 
+/* templates for SQL commands used during incremental shard placement resync */
+#define CHECKSUM_BUCKET_EXPRESSION "((hashtext(%s::text) & 2147483647) %% %d)"
+#define CHECKSUM_SETTINGS_QUERY \
+	"SELECT set_config('extra_float_digits', '3', true), " \
+	"set_config('DateStyle', 'ISO, MDY', true), " \
+	"set_config('IntervalStyle', 'postgres', true), " \
+	"set_config('TimeZone', 'UTC', true), set_config('bytea_output', 'hex', true); "
+#define BUCKET_CHECKSUM_QUERY \
+	"SELECT bucket, md5(string_agg(row_hash, '' ORDER BY row_hash)) " \
+	"FROM (SELECT %s AS bucket, md5(shard_row::text) AS row_hash " \
+	"FROM %s AS shard_row) AS bucketed_rows GROUP BY bucket"
+#define DELETE_BUCKETS_COMMAND \
+	"DELETE FROM %s AS shard_row WHERE %s = ANY ('%s'::integer[])"
+#define COPY_BUCKETS_OUT_COMMAND \
+	"COPY (SELECT shard_row.* FROM %s AS shard_row WHERE %s = ANY ('%s'::integer[])) " \
+	"TO STDOUT WITH (FORMAT %s)"
+
+/* number of row buckets whose checksums are compared during resync */
+#define CHECKSUM_BUCKET_COUNT 1024
+
+/* formats in which shard data is streamed between placements */
+#define BINARY_COPY_FORMAT "binary"
+#define TEXT_COPY_FORMAT "text"
+
+
+/* maximum number of shards which may be repaired online at the same time */
+#define MAX_ONLINE_REPAIR_COUNT 64
+
+/* number of logged modifications taken from the repair log at once */
+#define REPAIR_LOG_BATCH_ENTRY_COUNT 1000
+
+/* batches replayed while modifications continue, before they are locked out */
+#define MAX_REPAIR_LOG_CATCH_UP_BATCHES 100
+
+
+/*
+ * ShardRepairStatus represents the progress of a placement repair which runs
+ * alongside others during a bulk repair.
+ */
+typedef enum
+{
+	REPAIR_STATUS_INVALID_FIRST = 0,
+	REPAIR_STATUS_PENDING = 1,
+	REPAIR_STATUS_COPYING = 2,
+	REPAIR_STATUS_INDEXING = 3,
+	REPAIR_STATUS_FINISHED = 4,
+	REPAIR_STATUS_FAILED = 5
+} ShardRepairStatus;
+
+
+/*
+ * ShardRepair tracks the repair of a single inactive placement during a bulk
+ * repair, or the copy of a placement onto another node when shards are moved
+ * during a rebalance. A running repair holds a connection to each of its
+ * placements' nodes, using a slot which no other running repair uses on the
+ * same node. While its data is copied, the repair waits on the source
+ * connection; while the indexes are built and the transaction committed, it
+ * waits on the target connection. A copy made online only locks out the shard's
+ * modifications until the copy has started, and logs them from then on for the
+ * caller to replay.
+ */
+typedef struct ShardRepair
+{
+	int64 shardId;                  /* shard whose placement is repaired */
+	Oid relationId;                 /* distributed table the shard belongs to */
+	ShardPlacement *sourcePlacement; /* healthy placement copied from */
+	ShardPlacement *targetPlacement; /* inactive placement being repaired */
+	ShardRepairStatus status;       /* current state of the repair */
+	bool moveSource;                /* whether the source placement is moved */
+	bool onlineCopy;                /* whether modifications continue meanwhile */
+	bool targetCreated;             /* whether the target's table was created */
+	int32 sourceSlot;               /* connection slot on source node, if running */
+	int32 targetSlot;               /* connection slot on target node, if running */
+	PGconn *sourceConnection;       /* connection to source node, if running */
+	PGconn *targetConnection;       /* connection to target node, if running */
+	bool commandFailed;             /* whether a command on the target failed */
+	bool completionReported;        /* whether the outcome was reported */
+	TimestampTz copyStartTime;      /* time at which the copy started */
+	int64 bytesCopied;              /* amount of data copied so far */
+} ShardRepair;
+
+
+/*
+ * OnlineRepairEntry tracks a shard which is being repaired online. While the
+ * entry exists, modifications of the shard are logged for later replay on the
+ * placement being repaired. Modifications which cannot be replayed on that
+ * placement instead mark the repair as failed.
+ */
+typedef struct OnlineRepairEntry
+{
+	int64 shardId;          /* shard being repaired, or INVALID_SHARD_ID if unused */
+	int repairPid;          /* process running the repair */
+	bool captureFailed;     /* whether a modification could not be logged */
+} OnlineRepairEntry;
+
+
+/* OnlineRepairControlData holds the shared state of online shard repairs. */
+typedef struct OnlineRepairControlData
+{
+#if (PG_VERSION_NUM >= 90400)
+	LWLock *lock;           /* protects all online repair entries */
+#else
+	LWLockId lock;          /* protects all online repair entries */
+#endif
+	int activeRepairCount;  /* number of entries in use */
+	OnlineRepairEntry repairEntries[MAX_ONLINE_REPAIR_COUNT];
+} OnlineRepairControlData;
+
 
 /* function declarations for shard repair functionality */
 extern Datum master_copy_shard_placement(PG_FUNCTION_ARGS);
+extern Datum master_resync_shard_placement(PG_FUNCTION_ARGS);
+extern Datum master_repair_all_placements(PG_FUNCTION_ARGS);
 extern Datum worker_copy_shard_placement(PG_FUNCTION_ARGS);
+extern void InitializeOnlineRepair(void);
+extern bool OnlineRepairAvailable(void);
+extern void CaptureShardModification(Task *task);
+extern void FailModificationCapture(int64 shardId);
+extern void StartModificationCapture(int64 shardId);
+extern void EndModificationCapture(int64 shardId);
+extern bool ModificationCaptureFailed(int64 shardId);
+extern bool OnlineRepairInProgress(int64 shardId);
+extern bool RepairInactivePlacement(ShardPlacement *inactivePlacement);
+extern int32 ExecuteShardRepairs(List *repairList, int32 maxParallel);
+extern int ReplayShardRepairLogBatch(Oid distributedTableId, int64 shardId,
+									 PGconn *targetConnection);
 
 
 #endif /* PG_SHARD_REPAIR_SHARDS_H */
@@ -0,0 +1,332 @@
+/*-------------------------------------------------------------------------
+ *
+ * repair_worker.c
+ *
+ * This file contains the background worker which repairs inactive shard
+ * placements without anyone having to call master_copy_shard_placement. When
+ * pg_shard is loaded through the shared_preload_libraries setting and a
+ * database is configured for it, the worker periodically looks for inactive
+ * placements in that database's metadata and repairs one of them per round.
+ * Repairs are deferred while many backends are running queries or while the
+ * shard is being modified, and the worker backs off while rounds are deferred
+ * or fail.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h" /* IWYU pragma: keep */
+#include "c.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "repair_worker.h"
+#include "create_shards.h"
+#include "distribution_metadata.h"
+#include "repair_shards.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "nodes/pg_list.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/elog.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/palloc.h"
+#include "utils/snapmgr.h"
+
+
+/* database whose inactive placements are repaired; empty to disable the worker */
+char *RepairWorkerDatabase = "";
+
+/* time between rounds of background repairs, in milliseconds */
+int RepairWorkerInterval = 10000;
+
+/* number of backends running queries above which repairs are deferred */
+int RepairWorkerMaxActiveBackends = 8;
+
+
+/* flags set by signal handlers of the repair worker */
+static volatile sig_atomic_t GotSigterm = false;
+static volatile sig_atomic_t GotSighup = false;
+
+
+/* local function forward declarations */
+static void RepairWorkerMain(Datum mainArgument);
+static void RepairWorkerSigterm(SIGNAL_ARGS);
+static void RepairWorkerSighup(SIGNAL_ARGS);
+static RepairRoundOutcome RunRepairRound(int64 *lastPlacementId);
+static RepairRoundOutcome RepairNextInactivePlacement(int64 *lastPlacementId);
+static int ActiveBackendCount(void);
+
+
+/*
+ * InitializeRepairWorker registers the background worker which repairs inactive
+ * placements. The worker is only registered if a database has been configured
+ * for it, which is only possible while shared preload libraries are being
+ * loaded; at any other time this function does nothing.
+ */
+void
+InitializeRepairWorker(void)
+{
+	BackgroundWorker repairWorker;
+
+	if (!process_shared_preload_libraries_in_progress ||
+		RepairWorkerDatabase == NULL || RepairWorkerDatabase[0] == '\0')
+	{
+		return;
+	}
+
+	memset(&repairWorker, 0, sizeof(repairWorker));
+	repairWorker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+							 BGWORKER_BACKEND_DATABASE_CONNECTION;
+	repairWorker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	repairWorker.bgw_restart_time = REPAIR_WORKER_RESTART_SECONDS;
+	repairWorker.bgw_main = RepairWorkerMain;
+	repairWorker.bgw_main_arg = (Datum) 0;
+#if (PG_VERSION_NUM >= 90400)
+	snprintf(repairWorker.bgw_name, BGW_MAXLEN, "pg_shard repair worker");
+#else
+	repairWorker.bgw_name = "pg_shard repair worker";
+#endif
+
+	RegisterBackgroundWorker(&repairWorker);
+}
+
+
+/*
+ * RepairWorkerMain is the entry point of the background worker which repairs
+ * inactive placements. Each round repairs at most one placement, which limits
+ * the rate at which repairs add load to the cluster. Rounds which find the
+ * cluster busy or fail double the time until the next round, up to a limit;
+ * other rounds reset it to the configured interval. Placements are taken in
+ * order of their identifiers, continuing after the one last attempted, so that
+ * a placement which cannot be repaired does not hold up the others.
+ */
+static void
+RepairWorkerMain(Datum mainArgument)
+{
+	int64 lastPlacementId = 0;
+	int backoffDoublings = 0;
+
+	pqsignal(SIGTERM, RepairWorkerSigterm);
+	pqsignal(SIGHUP, RepairWorkerSighup);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(RepairWorkerDatabase, NULL);
+
+	while (!GotSigterm)
+	{
+		RepairRoundOutcome roundOutcome = REPAIR_ROUND_INVALID_FIRST;
+		int64 waitMsecs = ((int64) RepairWorkerInterval) << backoffDoublings;
+		int latchResult = 0;
+
+		latchResult = WaitLatch(&MyProc->procLatch,
+								WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+								(long) Min(waitMsecs, INT_MAX));
+		ResetLatch(&MyProc->procLatch);
+
+		if (latchResult & WL_POSTMASTER_DEATH)
+		{
+			proc_exit(1);
+		}
+
+		if (GotSighup)
+		{
+			GotSighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (GotSigterm)
+		{
+			break;
+		}
+
+		roundOutcome = RunRepairRound(&lastPlacementId);
+		if (roundOutcome == REPAIR_ROUND_DEFERRED || roundOutcome == REPAIR_ROUND_FAILED)
+		{
+			backoffDoublings = Min(backoffDoublings + 1, MAX_REPAIR_BACKOFF_DOUBLINGS);
+		}
+		else
+		{
+			backoffDoublings = 0;
+		}
+	}
+
+	proc_exit(0);
+}
+
+
+/* RepairWorkerSigterm asks the repair worker to exit. */
+static void
+RepairWorkerSigterm(SIGNAL_ARGS)
+{
+	int savedErrno = errno;
+
+	GotSigterm = true;
+	if (MyProc != NULL)
+	{
+		SetLatch(&MyProc->procLatch);
+	}
+
+	errno = savedErrno;
+}
+
+
+/* RepairWorkerSighup asks the repair worker to reload its settings. */
+static void
+RepairWorkerSighup(SIGNAL_ARGS)
+{
+	int savedErrno = errno;
+
+	GotSighup = true;
+	if (MyProc != NULL)
+	{
+		SetLatch(&MyProc->procLatch);
+	}
+
+	errno = savedErrno;
+}
+
+
+/*
+ * RunRepairRound runs a single round of background repairs in a transaction of
+ * its own. If the round raises an error, the error is logged and the
+ * transaction aborted, so that the worker can carry on with the next round.
+ */
+static RepairRoundOutcome
+RunRepairRound(int64 *lastPlacementId)
+{
+	RepairRoundOutcome roundOutcome = REPAIR_ROUND_INVALID_FIRST;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "repairing inactive shard placements");
+
+	PG_TRY();
+	{
+		roundOutcome = RepairNextInactivePlacement(lastPlacementId);
+
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(TopMemoryContext);
+
+		EmitErrorReport();
+		FlushErrorState();
+		AbortCurrentTransaction();
+
+		roundOutcome = REPAIR_ROUND_FAILED;
+	}
+	PG_END_TRY();
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return roundOutcome;
+}
+
+
+/*
+ * RepairNextInactivePlacement repairs the inactive placement which follows the
+ * given one by identifier, wrapping around to the first inactive placement, and
+ * notes its identifier as the one last attempted. Nothing is repaired if the
+ * database does not hold pg_shard's metadata, or if more backends are running
+ * queries than configured, in which case the repair is deferred.
+ */
+static RepairRoundOutcome
+RepairNextInactivePlacement(int64 *lastPlacementId)
+{
+	List *inactivePlacementList = NIL;
+	ListCell *inactivePlacementCell = NULL;
+	ShardPlacement *inactivePlacement = NULL;
+	bool missingOK = true;
+	bool repaired = false;
+
+	Oid metadataNamespaceId = get_namespace_oid(METADATA_SCHEMA_NAME, missingOK);
+	if (!OidIsValid(metadataNamespaceId))
+	{
+		return REPAIR_ROUND_IDLE;
+	}
+
+	inactivePlacementList = LoadInactiveShardPlacementList();
+	if (inactivePlacementList == NIL)
+	{
+		return REPAIR_ROUND_IDLE;
+	}
+
+	if (ActiveBackendCount() > RepairWorkerMaxActiveBackends)
+	{
+		return REPAIR_ROUND_DEFERRED;
+	}
+
+	inactivePlacementList = SortList(inactivePlacementList, ComparePlacementsById);
+	inactivePlacement = (ShardPlacement *) linitial(inactivePlacementList);
+
+	foreach(inactivePlacementCell, inactivePlacementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(inactivePlacementCell);
+
+		if (placement->id > (*lastPlacementId))
+		{
+			inactivePlacement = placement;
+			break;
+		}
+	}
+
+	(*lastPlacementId) = inactivePlacement->id;
+
+	repaired = RepairInactivePlacement(inactivePlacement);
+	if (!repaired)
+	{
+		return REPAIR_ROUND_DEFERRED;
+	}
+
+	ereport(LOG, (errmsg("repaired placement of shard " INT64_FORMAT " on \"%s:%u\"",
+						 inactivePlacement->shardId, inactivePlacement->nodeName,
+						 inactivePlacement->nodePort)));
+
+	return REPAIR_ROUND_REPAIRED;
+}
+
+
+/*
+ * ActiveBackendCount returns the number of other backends which are currently
+ * running a query. Since distributed queries are planned and executed on the
+ * master, this serves as a measure of how busy the cluster is.
+ */
+static int
+ActiveBackendCount(void)
+{
+	int activeBackendCount = 0;
+	int backendCount = pgstat_fetch_stat_numbackends();
+	int backendIndex = 0;
+
+	for (backendIndex = 1; backendIndex <= backendCount; backendIndex++)
+	{
+		PgBackendStatus *backendStatus = pgstat_fetch_stat_beentry(backendIndex);
+
+		if (backendStatus == NULL || backendStatus->st_procpid == MyProcPid)
+		{
+			continue;
+		}
+
+		if (backendStatus->st_state == STATE_RUNNING)
+		{
+			activeBackendCount++;
+		}
+	}
+
+	return activeBackendCount;
+}
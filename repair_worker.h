@@ -0,0 +1,51 @@
+/*-------------------------------------------------------------------------
+ *
+ * repair_worker.h
+ *
+ * Declarations for public functions and types related to the background
+ * worker which repairs inactive shard placements.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_REPAIR_WORKER_H
+#define PG_SHARD_REPAIR_WORKER_H
+
+#include "c.h"
+
+
+/* seconds after which a crashed repair worker is restarted */
+#define REPAIR_WORKER_RESTART_SECONDS 10
+
+/* upper bound on the exponent used when doubling the repair worker's interval */
+#define MAX_REPAIR_BACKOFF_DOUBLINGS 6
+
+
+/*
+ * RepairRoundOutcome describes what happened during one round of the repair
+ * worker. Rounds which were deferred or failed make the worker back off before
+ * the next round; other rounds keep it at its regular interval.
+ */
+typedef enum
+{
+	REPAIR_ROUND_INVALID_FIRST = 0,
+	REPAIR_ROUND_IDLE = 1,          /* there was nothing to repair */
+	REPAIR_ROUND_REPAIRED = 2,      /* a placement was repaired */
+	REPAIR_ROUND_DEFERRED = 3,      /* the cluster or the shard was busy */
+	REPAIR_ROUND_FAILED = 4         /* the repair raised an error */
+} RepairRoundOutcome;
+
+
+/* config variables managed via guc.c */
+extern char *RepairWorkerDatabase;
+extern int RepairWorkerInterval;
+extern int RepairWorkerMaxActiveBackends;
+
+
+/* function declarations for the background repair worker */
+extern void InitializeRepairWorker(void);
+
+
+#endif /* PG_SHARD_REPAIR_WORKER_H */
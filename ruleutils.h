@@ -21,8 +21,21 @@
 #include "nodes/parsenodes.h"
 
 
+/*
+ * RelationShard names the shard to refer to in place of a distributed table when
+ * deparsing a query which involves several tables.
+ */
+typedef struct RelationShard
+{
+	Oid relationId;     /* distributed table referenced by the query */
+	int64 shardId;      /* shard of the table to refer to instead */
+} RelationShard;
+
+
 /* function declarations for extending and deparsing a query */
 extern void deparse_shard_query(Query *query, int64 shardid, StringInfo buffer);
+extern void deparse_relation_shard_query(Query *query, List *relationShardList,
+										 StringInfo buffer);
 
 
 #endif /* PG_SHARD_RULEUTILS_H */
@@ -278,6 +278,15 @@ typedef struct
 	((deparse_columns *) list_nth((dpns)->rtable_columns, (rangetable_index)-1))
 
 
+/* ----------
+ * Global data
+ * ----------
+ */
+
+/* shards to name in place of relations, at any query level, while deparsing */
+static List *relation_shard_list = NIL;
+
+
 /* ----------
  * Local functions
  *
@@ -1697,6 +1706,36 @@ deparse_shard_query(Query *query, int64 shardid, StringInfo buffer)
 }
 
 
+/* ----------
+ * deparse_relation_shard_query	- Parse back a query referring to several shards
+ *
+ * Builds an SQL string to perform the provided query on specific shards of the
+ * relations it refers to, including relations referenced by subqueries, and
+ * places this string into the provided buffer. The shard to use for each
+ * relation is given by a list of RelationShard structs; relations missing from
+ * the list keep their names.
+ * ----------
+ */
+void
+deparse_relation_shard_query(Query *query, List *relationShardList, StringInfo buffer)
+{
+	relation_shard_list = relationShardList;
+
+	PG_TRY();
+	{
+		get_shard_query_def(query, buffer, NIL, 0, NULL, 0, WRAP_COLUMN_DEFAULT, 0);
+	}
+	PG_CATCH();
+	{
+		relation_shard_list = NIL;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	relation_shard_list = NIL;
+}
+
+
 /* ----------
  * get_query_def			- Parse back one query parsetree
  *
@@ -5980,6 +6019,13 @@ get_from_clause_item(Node *jtnode, Query *query, deparse_context *context)
 			 */
 			if (strcmp(refname, get_relation_name(rte->relid)) != 0)
 				printalias = true;
+
+			/*
+			 * Shards are named differently from their relation, so qualified
+			 * column references need the alias when several shards appear.
+			 */
+			else if (relation_shard_list != NIL)
+				printalias = true;
 		}
 		else if (rte->rtekind == RTE_FUNCTION)
 		{
@@ -6327,12 +6373,25 @@ get_relation_name(Oid relid)
  *
  * The function calls get_relation_name to produce the standard name for the
  * relation and operates on that result to append a shard suffix. If the
- * provided shardid is non-positive, no suffix is appended.
+ * provided shardid is non-positive, the shard is looked up in the list given
+ * to deparse_relation_shard_query; if none is found there, no suffix is
+ * appended.
  */
 static char *
 generate_shard_name(Oid relid, int64 shardid)
 {
 	char *relname = get_relation_name(relid);
+	ListCell *relation_shard_cell = NULL;
+
+	foreach(relation_shard_cell, relation_shard_list)
+	{
+		RelationShard *relation_shard = (RelationShard *) lfirst(relation_shard_cell);
+
+		if (shardid <= 0 && relation_shard->relationId == relid)
+		{
+			shardid = relation_shard->shardId;
+		}
+	}
 
 	if (shardid <= 0)
 	{
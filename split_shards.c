@@ -0,0 +1,832 @@
+/*-------------------------------------------------------------------------
+ *
+ * split_shards.c
+ *
+ * This file contains functions to split a shard of a hash partitioned table
+ * into several shards, each covering a part of the shard's hash range, so that
+ * a range of hash values which receives much of the table's load can be spread
+ * over more shards, and from there over more nodes.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "fmgr.h"
+#include "postgres_ext.h"
+
+#include "connection.h"
+#include "create_shards.h"
+#include "ddl_commands.h"
+#include "distribution_metadata.h"
+#include "pg_shard.h"
+#include "prune_shard_list.h"
+#include "rebalance_shards.h"
+#include "repair_shards.h"
+#include "ruleutils.h"
+#include "split_shards.h"
+
+#include <stddef.h>
+
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/nodes.h"
+#include "nodes/parsenodes.h"
+#include "nodes/pg_list.h"
+#include "nodes/primnodes.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/elog.h"
+#include "utils/errcodes.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/palloc.h"
+#include "utils/typcache.h"
+
+
+/* local function forward declarations */
+static void CheckSplitShard(ShardInterval *shardInterval, int32 splitCount);
+static void SplitShardPlacements(ShardInterval *shardInterval, List *childIntervalList,
+								 List *placementList, bool onlineSplit);
+static List * StartChildShardCopies(ShardInterval *shardInterval,
+									List *childIntervalList, List *placementList);
+static void CopyRowsToChildShards(ShardInterval *shardInterval, List *childIntervalList,
+								  List *connectionList);
+static Node * ResolveLoggedParams(Node *node, ShardRepairLogEntry *logEntry);
+static void AbortChildShardCopies(List *connectionList);
+static void DropChildShardTables(ShardInterval *shardInterval, List *childIntervalList,
+								 List *connectionList);
+static char * PartitionHashExpression(Oid distributedTableId);
+static void SwapSplitShardMetadata(ShardInterval *shardInterval,
+								   List *childIntervalList, List *shardPlacementList,
+								   List *finalizedPlacementList);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(master_split_shard);
+
+
+/*
+ * master_split_shard implements a user-facing UDF to split a shard of a hash
+ * partitioned table into the given number of shards, which divide the shard's
+ * hash range evenly between them. The new shards are placed on the nodes which
+ * hold the shard's healthy placements, where each placement's rows are copied
+ * into the new shards' placements. Once the copies have caught up with the
+ * modifications made meanwhile, the shard is replaced by the new shards in the
+ * metadata and its placements are marked for deletion. They are dropped by the
+ * next split or rebalance of the table, which first drops any placements left
+ * marked for deletion by earlier ones.
+ *
+ * If pg_shard was loaded via shared_preload_libraries, modifications of the
+ * shard continue while its rows are copied. They are logged like during an
+ * online repair, and replayed on whichever of the new shards they affect. Only
+ * the replay of the last modifications, and the switch to the new shards, lock
+ * out modifications of the shard. Otherwise, modifications are locked out for
+ * the length of the split. Reads continue throughout. The function returns the
+ * identifiers of the new shards.
+ */
+Datum
+master_split_shard(PG_FUNCTION_ARGS)
+{
+	int64 shardId = PG_GETARG_INT64(0);
+	int32 splitCount = PG_GETARG_INT32(1);
+	ShardInterval *shardInterval = LoadShardInterval(shardId);
+	List *shardPlacementList = NIL;
+	List *finalizedPlacementList = NIL;
+	List *childIntervalList = NIL;
+	ListCell *childIntervalCell = NULL;
+	Datum *childIdDatumArray = NULL;
+	ArrayType *childIdArray = NULL;
+	int childIndex = 0;
+	bool onlineSplit = OnlineRepairAvailable();
+
+	CheckSplitShard(shardInterval, splitCount);
+
+	DropPlacementsToDelete(list_make1_oid(shardInterval->relationId));
+
+	/* lock out modifications, repairs and other splits of the shard */
+	LockShard(shardId, ExclusiveLock);
+
+	if (OnlineRepairInProgress(shardId))
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_IN_USE),
+						errmsg("shard " INT64_FORMAT " is already being repaired",
+							   shardId)));
+	}
+
+	shardPlacementList = LoadShardPlacementList(shardId);
+	finalizedPlacementList = LoadFinalizedShardPlacementList(shardId);
+	if (finalizedPlacementList == NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("shard " INT64_FORMAT " has no healthy placements",
+							   shardId)));
+	}
+
+	childIntervalList = SplitShardInterval(shardInterval, splitCount,
+										   NextSequenceIdArray(SHARD_ID_SEQUENCE_NAME,
+															   splitCount));
+
+	if (onlineSplit)
+	{
+		StartModificationCapture(shardId);
+
+		PG_TRY();
+		{
+			/* returns once the new shards are up to date, with the lock held again */
+			SplitShardPlacements(shardInterval, childIntervalList,
+								 finalizedPlacementList, true);
+		}
+		PG_CATCH();
+		{
+			EndModificationCapture(shardId);
+
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		EndModificationCapture(shardId);
+	}
+	else
+	{
+		SplitShardPlacements(shardInterval, childIntervalList, finalizedPlacementList,
+							 false);
+	}
+
+	SwapSplitShardMetadata(shardInterval, childIntervalList, shardPlacementList,
+						   finalizedPlacementList);
+
+	childIdDatumArray = palloc0(splitCount * sizeof(Datum));
+
+	foreach(childIntervalCell, childIntervalList)
+	{
+		ShardInterval *childInterval = (ShardInterval *) lfirst(childIntervalCell);
+
+		childIdDatumArray[childIndex] = Int64GetDatum(childInterval->id);
+		childIndex++;
+	}
+
+	childIdArray = construct_array(childIdDatumArray, splitCount, INT8OID,
+								   sizeof(int64), FLOAT8PASSBYVAL, 'd');
+
+	PG_RETURN_ARRAYTYPE_P(childIdArray);
+}
+
+
+/*
+ * CheckSplitShard errors out if the given shard cannot be split into the given
+ * number of shards. Only shards of hash partitioned tables backed by regular
+ * tables may be split, and only if no other table is co-located with the table,
+ * since the co-located shards would no longer cover the same ranges.
+ */
+static void
+CheckSplitShard(ShardInterval *shardInterval, int32 splitCount)
+{
+	Oid distributedTableId = shardInterval->relationId;
+	int64 hashValueCount = 0;
+
+	if (splitCount < MIN_SPLIT_COUNT)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("split_count must be at least %d", MIN_SPLIT_COUNT)));
+	}
+
+	if (PartitionType(distributedTableId) != HASH_PARTITION_TYPE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot split shards of tables which are not hash "
+							   "partitioned")));
+	}
+
+	if (get_rel_relkind(distributedTableId) == RELKIND_FOREIGN_TABLE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot split shard"),
+						errdetail("Splitting shards backed by foreign tables is "
+								  "not supported.")));
+	}
+
+	if (list_length(ColocatedTableList(distributedTableId)) > 1)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot split shards of co-located tables"),
+						errdetail("Table \"%s\" shares its shard ranges with other "
+								  "tables.", get_rel_name(distributedTableId))));
+	}
+
+	hashValueCount = (int64) DatumGetInt32(shardInterval->maxValue) -
+					 (int64) DatumGetInt32(shardInterval->minValue) + 1;
+	if (splitCount > hashValueCount)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("cannot split shard " INT64_FORMAT " into more shards "
+							   "than its range has hash values", shardInterval->id)));
+	}
+}
+
+
+/*
+ * SplitShardInterval divides the hash range of the given shard evenly into the
+ * given number of ranges, and returns a new shard interval for each of them in
+ * order of their ranges. The new shards take their identifiers from the given
+ * array, in the same order.
+ */
+List *
+SplitShardInterval(ShardInterval *shardInterval, int32 splitCount,
+				   uint64 *childIdArray)
+{
+	List *childIntervalList = NIL;
+	int64 minHashValue = (int64) DatumGetInt32(shardInterval->minValue);
+	int64 maxHashValue = (int64) DatumGetInt32(shardInterval->maxValue);
+	int64 hashValueCount = maxHashValue - minHashValue + 1;
+	int32 childIndex = 0;
+
+	for (childIndex = 0; childIndex < splitCount; childIndex++)
+	{
+		ShardInterval *childInterval = (ShardInterval *) palloc0(sizeof(ShardInterval));
+		int64 childMinValue = minHashValue + (hashValueCount * childIndex) / splitCount;
+		int64 childMaxValue =
+			minHashValue + (hashValueCount * (childIndex + 1)) / splitCount - 1;
+
+		childInterval->id = (int64) childIdArray[childIndex];
+		childInterval->relationId = shardInterval->relationId;
+		childInterval->minValue = Int32GetDatum((int32) childMinValue);
+		childInterval->maxValue = Int32GetDatum((int32) childMaxValue);
+		childInterval->valueTypeId = INT4OID;
+
+		childIntervalList = lappend(childIntervalList, childInterval);
+	}
+
+	return childIntervalList;
+}
+
+
+/*
+ * SplitShardPlacements copies the rows of each of the given healthy placements
+ * of a shard into placements of the shard's new shards on the same node. The
+ * copies start while modifications of the shard are locked out, so that each
+ * takes its snapshot of the shard's rows at the same point. If the split is
+ * online, the lock is then released while the rows are copied and while the
+ * modifications logged meanwhile are replayed on the new shards. Once few
+ * logged modifications remain, the lock is taken again to replay the rest, so
+ * that the function returns with the new shards up to date and modifications
+ * locked out. The function errors out if the split fails, after dropping the
+ * new shards' tables if their copies have been committed already.
+ */
+static void
+SplitShardPlacements(ShardInterval *shardInterval, List *childIntervalList,
+					 List *placementList, bool onlineSplit)
+{
+	int64 shardId = shardInterval->id;
+	List *connectionList = NIL;
+	int replayedEntryCount = 0;
+	int catchUpBatchCount = 0;
+
+	if (onlineSplit)
+	{
+		/* entries left behind by an earlier, failed repair or split no longer apply */
+		DeleteShardRepairLogRows(shardId);
+	}
+
+	connectionList = StartChildShardCopies(shardInterval, childIntervalList,
+										   placementList);
+
+	/* the new shards' tables are committed before the split completes */
+	PG_TRY();
+	{
+		if (onlineSplit)
+		{
+			UnlockShard(shardId, ExclusiveLock);
+		}
+
+		CopyRowsToChildShards(shardInterval, childIntervalList, connectionList);
+
+		if (onlineSplit)
+		{
+			/* catch up with the modifications logged while the rows were copied */
+			do
+			{
+				replayedEntryCount = ReplaySplitLogBatch(shardInterval,
+														 childIntervalList,
+														 connectionList);
+				catchUpBatchCount++;
+			}
+			while (replayedEntryCount == REPAIR_LOG_BATCH_ENTRY_COUNT &&
+				   catchUpBatchCount < MAX_REPAIR_LOG_CATCH_UP_BATCHES);
+
+			/* lock out modifications again to replay those logged since */
+			LockShard(shardId, ExclusiveLock);
+
+			do
+			{
+				replayedEntryCount = ReplaySplitLogBatch(shardInterval,
+														 childIntervalList,
+														 connectionList);
+			}
+			while (replayedEntryCount == REPAIR_LOG_BATCH_ENTRY_COUNT);
+
+			if (ModificationCaptureFailed(shardId))
+			{
+				ereport(ERROR, (errmsg("could not log all modifications of shard "
+									   INT64_FORMAT " during its split", shardId),
+								errdetail("Modifications which read from other "
+										  "shards cannot be replayed on the new "
+										  "shards."),
+								errhint("Split the shard while such modifications "
+										"are not running.")));
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		DropChildShardTables(shardInterval, childIntervalList, connectionList);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+
+/*
+ * StartChildShardCopies opens a repeatable read transaction on the node of each
+ * of the given placements, and creates the tables of the new shards in it,
+ * leaving out their indexes until their rows have been copied. The creation of
+ * the tables takes the snapshot of the shard's rows which the transaction then
+ * copies into them. The function returns the connections to the nodes, in the
+ * order of the placements, and errors out if any transaction cannot be started.
+ */
+static List *
+StartChildShardCopies(ShardInterval *shardInterval, List *childIntervalList,
+					  List *placementList)
+{
+	Oid distributedTableId = shardInterval->relationId;
+	List *connectionList = NIL;
+	List *schemaCommandList = TableSchemaDDLCommandList(distributedTableId);
+	ListCell *placementCell = NULL;
+
+	foreach(placementCell, placementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		ListCell *childIntervalCell = NULL;
+		PGconn *connection = NULL;
+		bool tablesCreated = false;
+
+		connection = GetConnection(placement->nodeName, placement->nodePort);
+		if (connection == NULL)
+		{
+			AbortChildShardCopies(connectionList);
+
+			ereport(ERROR, (errmsg("could not connect to \"%s:%u\"",
+								   placement->nodeName, placement->nodePort)));
+		}
+
+		tablesCreated = ExecuteRemoteCommand(connection, BEGIN_REPEATABLE_READ_COMMAND);
+		connectionList = lappend(connectionList, connection);
+
+		foreach(childIntervalCell, childIntervalList)
+		{
+			ShardInterval *childInterval = (ShardInterval *) lfirst(childIntervalCell);
+			List *ddlCommandList = ExtendedDDLCommandList(distributedTableId,
+														  childInterval->id,
+														  schemaCommandList);
+			ListCell *ddlCommandCell = NULL;
+
+			foreach(ddlCommandCell, ddlCommandList)
+			{
+				char *ddlCommand = (char *) lfirst(ddlCommandCell);
+
+				if (!tablesCreated)
+				{
+					break;
+				}
+
+				tablesCreated = ExecuteRemoteCommand(connection, ddlCommand);
+			}
+		}
+
+		if (!tablesCreated)
+		{
+			AbortChildShardCopies(connectionList);
+
+			ereport(ERROR, (errmsg("could not create new shards on \"%s:%u\"",
+								   placement->nodeName, placement->nodePort),
+							errhint("Consult recent messages in the server logs for "
+									"details.")));
+		}
+	}
+
+	return connectionList;
+}
+
+
+/*
+ * CopyRowsToChildShards copies the rows of the given shard which fall into each
+ * new shard's hash range into the new shard's table, on each of the given
+ * connections at once. The new shards' indexes are then built over the copied
+ * rows, and the transactions committed. The function errors out if any of the
+ * copies fails, in which case none of them is committed.
+ */
+static void
+CopyRowsToChildShards(ShardInterval *shardInterval, List *childIntervalList,
+					  List *connectionList)
+{
+	Oid distributedTableId = shardInterval->relationId;
+	char *relationName = get_rel_name(distributedTableId);
+	char *hashExpression = PartitionHashExpression(distributedTableId);
+	List *indexCommandList = TableIndexDDLCommandList(distributedTableId);
+	ListCell *childIntervalCell = NULL;
+	ListCell *connectionCell = NULL;
+	bool copySuccessful = true;
+
+	AppendShardIdToName(&relationName, shardInterval->id);
+
+	foreach(childIntervalCell, childIntervalList)
+	{
+		ShardInterval *childInterval = (ShardInterval *) lfirst(childIntervalCell);
+		char *childName = get_rel_name(distributedTableId);
+		StringInfo copyCommand = makeStringInfo();
+		List *sentConnectionList = NIL;
+
+		AppendShardIdToName(&childName, childInterval->id);
+		appendStringInfo(copyCommand, COPY_SPLIT_ROWS_COMMAND,
+						 quote_identifier(childName), quote_identifier(relationName),
+						 hashExpression, DatumGetInt32(childInterval->minValue),
+						 DatumGetInt32(childInterval->maxValue));
+
+		/* each node reads its own placement of the shard, so have all do so at once */
+		foreach(connectionCell, connectionList)
+		{
+			PGconn *connection = (PGconn *) lfirst(connectionCell);
+
+			if (SendRemoteQuery(connection, copyCommand->data, 0, NULL, NULL,
+								InvalidOid))
+			{
+				sentConnectionList = lappend(sentConnectionList, connection);
+			}
+			else
+			{
+				ReportRemoteError(connection, NULL);
+				copySuccessful = false;
+			}
+		}
+
+		foreach(connectionCell, sentConnectionList)
+		{
+			PGconn *connection = (PGconn *) lfirst(connectionCell);
+			PGresult *result = AwaitRemoteResults(connection);
+
+			if (PQresultStatus(result) != PGRES_COMMAND_OK)
+			{
+				ReportRemoteError(connection, result);
+				copySuccessful = false;
+			}
+
+			PQclear(result);
+		}
+
+		if (!copySuccessful)
+		{
+			break;
+		}
+	}
+
+	/* building indexes over the copied rows beats maintaining them row by row */
+	foreach(childIntervalCell, childIntervalList)
+	{
+		ShardInterval *childInterval = (ShardInterval *) lfirst(childIntervalCell);
+		List *ddlCommandList = ExtendedDDLCommandList(distributedTableId,
+													  childInterval->id,
+													  indexCommandList);
+		ListCell *ddlCommandCell = NULL;
+
+		foreach(ddlCommandCell, ddlCommandList)
+		{
+			char *ddlCommand = (char *) lfirst(ddlCommandCell);
+
+			foreach(connectionCell, connectionList)
+			{
+				PGconn *connection = (PGconn *) lfirst(connectionCell);
+
+				if (!copySuccessful)
+				{
+					break;
+				}
+
+				copySuccessful = ExecuteRemoteCommand(connection, ddlCommand);
+			}
+		}
+	}
+
+	if (!copySuccessful)
+	{
+		AbortChildShardCopies(connectionList);
+
+		ereport(ERROR, (errmsg("could not copy rows of shard " INT64_FORMAT
+							   " into new shards", shardInterval->id),
+						errhint("Consult recent messages in the server logs for "
+								"details.")));
+	}
+
+	foreach(connectionCell, connectionList)
+	{
+		PGconn *connection = (PGconn *) lfirst(connectionCell);
+
+		if (!ExecuteRemoteCommand(connection, COMMIT_COMMAND))
+		{
+			ereport(ERROR, (errmsg("could not commit rows copied from shard "
+								   INT64_FORMAT, shardInterval->id),
+							errhint("Consult recent messages in the server logs for "
+									"details.")));
+		}
+	}
+}
+
+
+/*
+ * ReplaySplitLogBatch takes the oldest logged modifications of the given shard
+ * from the repair log, up to REPAIR_LOG_BATCH_ENTRY_COUNT of them, and replays
+ * each of them on the new shards it affects, in the order in which they were
+ * made. The logged parameter values are first put into the modification's
+ * query, whose new shards are then found by pruning them as the planner would.
+ * The query is deparsed for each of them and run on each of the given
+ * connections. The function returns the number of modifications replayed, and
+ * errors out if any of them fails.
+ */
+int
+ReplaySplitLogBatch(ShardInterval *shardInterval, List *childIntervalList,
+					List *connectionList)
+{
+	Oid distributedTableId = shardInterval->relationId;
+	List *logEntryList = TakeShardRepairLogEntries(shardInterval->id,
+												   REPAIR_LOG_BATCH_ENTRY_COUNT);
+	ListCell *logEntryCell = NULL;
+
+	foreach(logEntryCell, logEntryList)
+	{
+		ShardRepairLogEntry *logEntry = (ShardRepairLogEntry *) lfirst(logEntryCell);
+		Query *query = NULL;
+		List *restrictClauseList = NIL;
+		List *prunedChildList = NIL;
+		ListCell *childIntervalCell = NULL;
+
+		if (logEntry->queryTree == NULL)
+		{
+			ereport(ERROR, (errmsg("could not replay modification of shard "
+								   INT64_FORMAT " on the new shards",
+								   shardInterval->id),
+							errdetail("Rows inserted by an INSERT ... SELECT which "
+									  "runs through the master cannot be routed to "
+									  "the new shards.")));
+		}
+
+		query = (Query *) stringToNode(logEntry->queryTree);
+		if (logEntry->parameterCount > 0)
+		{
+			query = (Query *) ResolveLoggedParams((Node *) query, logEntry);
+			FoldConstantExpressions(query);
+		}
+
+		restrictClauseList = QueryRestrictList(query);
+		prunedChildList = PruneShardList(distributedTableId, restrictClauseList,
+										 childIntervalList);
+
+		foreach(childIntervalCell, prunedChildList)
+		{
+			ShardInterval *childInterval = (ShardInterval *) lfirst(childIntervalCell);
+			StringInfo queryString = makeStringInfo();
+			ListCell *connectionCell = NULL;
+
+			deparse_shard_query(query, childInterval->id, queryString);
+
+			foreach(connectionCell, connectionList)
+			{
+				PGconn *connection = (PGconn *) lfirst(connectionCell);
+				PGresult *result = NULL;
+				ExecStatusType resultStatus = PGRES_FATAL_ERROR;
+
+				result = ExecuteRemoteQueryParams(connection, queryString->data, 0,
+												  NULL, NULL, distributedTableId);
+				resultStatus = PQresultStatus(result);
+				if (resultStatus != PGRES_COMMAND_OK && resultStatus != PGRES_TUPLES_OK)
+				{
+					ReportRemoteError(connection, result);
+					PQclear(result);
+
+					ereport(ERROR, (errmsg("could not replay modification on new "
+										   "shards"),
+									errhint("Consult recent messages in the server "
+											"logs for details.")));
+				}
+
+				PQclear(result);
+			}
+		}
+	}
+
+	return list_length(logEntryList);
+}
+
+
+/*
+ * ResolveLoggedParams replaces the external parameters in the given expression
+ * or query with constants holding the values logged for them in the given log
+ * entry, which are converted from text using each parameter's type.
+ */
+static Node *
+ResolveLoggedParams(Node *node, ShardRepairLogEntry *logEntry)
+{
+	if (node == NULL)
+	{
+		return NULL;
+	}
+
+	if (IsA(node, Param))
+	{
+		Param *param = (Param *) node;
+		const char *parameterValue = NULL;
+		Oid inputFunctionId = InvalidOid;
+		Oid typeIOParam = InvalidOid;
+		int16 typeLength = 0;
+		bool typeByValue = false;
+		Datum constValue = 0;
+
+		if (param->paramkind != PARAM_EXTERN || param->paramid <= 0 ||
+			param->paramid > logEntry->parameterCount)
+		{
+			return node;
+		}
+
+		parameterValue = logEntry->parameterValues[param->paramid - 1];
+		if (parameterValue == NULL)
+		{
+			return (Node *) makeNullConst(param->paramtype, param->paramtypmod,
+										  param->paramcollid);
+		}
+
+		getTypeInputInfo(param->paramtype, &inputFunctionId, &typeIOParam);
+		get_typlenbyval(param->paramtype, &typeLength, &typeByValue);
+
+		constValue = OidInputFunctionCall(inputFunctionId, (char *) parameterValue,
+										  typeIOParam, param->paramtypmod);
+
+		return (Node *) makeConst(param->paramtype, param->paramtypmod,
+								  param->paramcollid, typeLength, constValue,
+								  false, typeByValue);
+	}
+	else if (IsA(node, Query))
+	{
+		return (Node *) query_tree_mutator((Query *) node, ResolveLoggedParams,
+										   logEntry, 0);
+	}
+
+	return expression_tree_mutator(node, ResolveLoggedParams, logEntry);
+}
+
+
+/*
+ * AbortChildShardCopies rolls back the transactions which copy rows into the
+ * new shards on the given connections, which drops the new shards' tables.
+ */
+static void
+AbortChildShardCopies(List *connectionList)
+{
+	ListCell *connectionCell = NULL;
+
+	foreach(connectionCell, connectionList)
+	{
+		PGconn *connection = (PGconn *) lfirst(connectionCell);
+
+		ExecuteRemoteCommand(connection, ROLLBACK_COMMAND);
+	}
+}
+
+
+/*
+ * DropChildShardTables drops the tables of the given new shards on each of the
+ * given connections whose copy has been committed, so that a failed split does
+ * not leave them behind. Tables whose copy is still in progress are dropped by
+ * the rollback of its transaction instead. Failures to drop a table are only
+ * reported, since the split is failing already.
+ */
+static void
+DropChildShardTables(ShardInterval *shardInterval, List *childIntervalList,
+					 List *connectionList)
+{
+	Oid distributedTableId = shardInterval->relationId;
+	ListCell *connectionCell = NULL;
+
+	foreach(connectionCell, connectionList)
+	{
+		PGconn *connection = (PGconn *) lfirst(connectionCell);
+		ListCell *childIntervalCell = NULL;
+
+		if (PQtransactionStatus(connection) != PQTRANS_IDLE)
+		{
+			continue;
+		}
+
+		foreach(childIntervalCell, childIntervalList)
+		{
+			ShardInterval *childInterval = (ShardInterval *) lfirst(childIntervalCell);
+			char *childName = get_rel_name(distributedTableId);
+			StringInfo dropCommand = makeStringInfo();
+
+			AppendShardIdToName(&childName, childInterval->id);
+			appendStringInfo(dropCommand, DROP_REGULAR_TABLE_COMMAND,
+							 quote_identifier(childName));
+
+			ExecuteRemoteCommand(connection, dropCommand->data);
+		}
+	}
+}
+
+
+/*
+ * PartitionHashExpression returns an expression which computes the hash value
+ * of a row's partition column on a worker node, using the same hash function
+ * by which the row was assigned to its shard.
+ */
+static char *
+PartitionHashExpression(Oid distributedTableId)
+{
+	Var *partitionColumn = PartitionColumn(distributedTableId);
+	char *columnName = get_attname(distributedTableId, partitionColumn->varattno);
+	TypeCacheEntry *typeEntry = lookup_type_cache(partitionColumn->vartype,
+												  TYPECACHE_HASH_PROC);
+	Oid hashFunctionId = typeEntry->hash_proc;
+	StringInfo hashExpression = makeStringInfo();
+
+	if (!OidIsValid(hashFunctionId))
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_FUNCTION),
+						errmsg("could not identify a hash function for type %s",
+							   format_type_be(partitionColumn->vartype))));
+	}
+
+	appendStringInfo(hashExpression, PARTITION_HASH_EXPRESSION,
+					 quote_identifier(get_namespace_name(get_func_namespace(
+															 hashFunctionId))),
+					 quote_identifier(get_func_name(hashFunctionId)),
+					 quote_identifier(columnName));
+
+	return hashExpression->data;
+}
+
+
+/*
+ * SwapSplitShardMetadata replaces the given shard by the given new shards in the
+ * metadata, placing each new shard on the nodes of the given healthy placements.
+ * All of the shard's placements are marked for deletion, which hides the shard
+ * from queries until its placements are dropped. Since the change is made in a
+ * single transaction, queries see either the shard or the new shards. Every
+ * session's cached shards of the table are invalidated, so that queries planned
+ * after the transaction commits use the new shards.
+ */
+static void
+SwapSplitShardMetadata(ShardInterval *shardInterval, List *childIntervalList,
+					   List *shardPlacementList, List *finalizedPlacementList)
+{
+	List *childPlacementList = NIL;
+	ListCell *shardPlacementCell = NULL;
+	ListCell *childIntervalCell = NULL;
+
+	foreach(shardPlacementCell, shardPlacementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(shardPlacementCell);
+
+		DeleteShardPlacementRow(placement->id);
+		InsertShardPlacementRow(placement->id, placement->shardId, STATE_TO_DELETE,
+								placement->nodeName, placement->nodePort);
+	}
+
+	InsertShardRowList(childIntervalList, SHARD_STORAGE_TABLE);
+
+	foreach(childIntervalCell, childIntervalList)
+	{
+		ShardInterval *childInterval = (ShardInterval *) lfirst(childIntervalCell);
+
+		foreach(shardPlacementCell, finalizedPlacementList)
+		{
+			ShardPlacement *placement = (ShardPlacement *) lfirst(shardPlacementCell);
+			ShardPlacement *childPlacement = palloc0(sizeof(ShardPlacement));
+
+			childPlacement->id = NextSequenceId(SHARD_PLACEMENT_ID_SEQUENCE_NAME);
+			childPlacement->shardId = childInterval->id;
+			childPlacement->shardState = STATE_FINALIZED;
+			childPlacement->nodeName = placement->nodeName;
+			childPlacement->nodePort = placement->nodePort;
+
+			childPlacementList = lappend(childPlacementList, childPlacement);
+		}
+	}
+
+	InsertShardPlacementRowList(childPlacementList);
+
+	CacheInvalidateRelcacheByRelid(shardInterval->relationId);
+}
+
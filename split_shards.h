@@ -0,0 +1,46 @@
+/*-------------------------------------------------------------------------
+ *
+ * split_shards.h
+ *
+ * Declarations for public functions and types to implement shard splitting
+ * functionality.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_SPLIT_SHARDS_H
+#define PG_SHARD_SPLIT_SHARDS_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "distribution_metadata.h"
+
+#include "nodes/pg_list.h"
+
+
+/* smallest number of shards a shard may be split into */
+#define MIN_SPLIT_COUNT 2
+
+/* transaction whose snapshot the rows copied into the new shards are taken from */
+#define BEGIN_REPEATABLE_READ_COMMAND "BEGIN ISOLATION LEVEL REPEATABLE READ"
+
+/* template for the command which copies a new shard's rows from the split shard */
+#define COPY_SPLIT_ROWS_COMMAND \
+	"INSERT INTO %s SELECT * FROM %s WHERE %s BETWEEN %d AND %d"
+
+/* template for the expression which computes the hash of a row's partition value */
+#define PARTITION_HASH_EXPRESSION "%s.%s(%s)"
+
+
+/* function declarations for shard splitting functionality */
+extern Datum master_split_shard(PG_FUNCTION_ARGS);
+extern List * SplitShardInterval(ShardInterval *shardInterval, int32 splitCount,
+								 uint64 *childIdArray);
+extern int ReplaySplitLogBatch(ShardInterval *shardInterval, List *childIntervalList,
+							   List *connectionList);
+
+
+#endif /* PG_SHARD_SPLIT_SHARDS_H */
@@ -36,6 +36,15 @@ SELECT partition_column_to_node_string('pg_class'::regclass);
 -- should get node representation for distributed table
 SELECT partition_column_to_node_string('set_of_ids'::regclass);
 
+-- should get ERROR for reference tables, which CitusDB lacks
+CREATE TABLE set_of_codes ( code text );
+
+INSERT INTO pgs_distribution_metadata.partition (relation_id, partition_method, key)
+VALUES
+	('set_of_codes'::regclass, 'n', '');
+
+SELECT partition_column_to_node_string('set_of_codes'::regclass);
+
 -- create subset of CitusDB metadata schema
 CREATE TABLE pg_dist_partition (
 	logicalrelid oid NOT NULL,
@@ -47,12 +47,15 @@ INSERT INTO limit_orders VALUES (18811, 'BUD', 14962, '2014-04-05 08:32:16', 'se
 -- INSERT violating primary key constraint
 INSERT INTO limit_orders VALUES (32743, 'LUV', 5994, '2001-04-16 03:37:28', 'buy', 0.58);
 
--- commands with non-constant partition values are unsupported
-INSERT INTO limit_orders VALUES (random() * 100, 'ORCL', 152, '2011-08-25 11:50:45',
-								 'sell', 0.58);
+-- non-constant partition values are evaluated on the master
+CREATE SEQUENCE limit_order_ids START 5000;
+INSERT INTO limit_orders VALUES (nextval('limit_order_ids'), 'ORCL', 152,
+								 '2011-08-25 11:50:45', 'sell', 0.58);
+SELECT COUNT(*) FROM limit_orders WHERE id = 5000;
 
--- commands with expressions that cannot be collapsed are unsupported
+-- as are other expressions that cannot be collapsed
 INSERT INTO limit_orders VALUES (2036, 'GOOG', 5634, now(), 'buy', random());
+SELECT COUNT(*) FROM limit_orders WHERE id = 2036;
 
 -- commands with mutable functions in their quals
 DELETE FROM limit_orders WHERE id = 246 AND bidder_id = (random() * 1000);
@@ -60,15 +63,65 @@ DELETE FROM limit_orders WHERE id = 246 AND bidder_id = (random() * 1000);
 -- commands with mutable but non-volatilte functions(ie: stable func.) in their quals
 DELETE FROM limit_orders WHERE id = 246 AND placed_at = current_timestamp;
 
+-- mutable functions referring to columns can't be evaluated on the master
+UPDATE limit_orders SET symbol = to_char(placed_at, 'YYYY') WHERE id = 2036;
+
 -- commands with multiple rows are unsupported
 INSERT INTO limit_orders VALUES (DEFAULT), (DEFAULT);
 
--- INSERT ... SELECT ... FROM commands are unsupported
-INSERT INTO limit_orders SELECT * FROM limit_orders;
+-- INSERT ... SELECT between co-located tables runs on the workers
+CREATE TABLE limit_order_history (LIKE limit_orders);
+SELECT master_create_distributed_table('limit_order_history', 'id');
+
+\set VERBOSITY terse
+SELECT master_create_worker_shards('limit_order_history', 2, 1, 'limit_orders');
+\set VERBOSITY default
+
+INSERT INTO limit_order_history SELECT * FROM limit_orders;
+SELECT COUNT(*) FROM limit_order_history;
+
+-- other INSERT ... SELECT commands route rows through the master
+CREATE TABLE bidder_orders ( bidder_id bigint, order_id bigint );
+SELECT master_create_distributed_table('bidder_orders', 'bidder_id');
+
+\set VERBOSITY terse
+SELECT master_create_worker_shards('bidder_orders', 2, 1);
+\set VERBOSITY default
+
+INSERT INTO bidder_orders SELECT bidder_id, id FROM limit_orders;
+SELECT COUNT(*) FROM bidder_orders;
+SELECT order_id FROM bidder_orders WHERE bidder_id = 9580;
+
+-- co-located shards are copied by one statement per shard, other rows in batches
+CREATE TABLE imported_bids ( bidder_id bigint, order_id bigint );
+INSERT INTO imported_bids VALUES (32743, 1), (18811, 2), (32743, 3);
 
--- commands with a RETURNING clause are unsupported
+SET pg_shard.log_distributed_statements = on;
+SET client_min_messages = log;
+
+INSERT INTO limit_order_history SELECT * FROM limit_orders WHERE id = 32743;
+INSERT INTO bidder_orders SELECT * FROM imported_bids;
+
+SET client_min_messages = DEFAULT;
+SET pg_shard.log_distributed_statements = DEFAULT;
+
+SELECT COUNT(*) FROM bidder_orders;
+DROP TABLE imported_bids;
+
+-- an INSERT ... SELECT routed through the master errors out if a batch fails
+CREATE TABLE imported_orders (LIKE limit_orders);
+INSERT INTO imported_orders VALUES (18811, 'BUD', 14962, '2014-04-05 08:32:16', 'sell',
+									-5.00);
+INSERT INTO limit_orders SELECT * FROM imported_orders;
+SELECT COUNT(*) FROM limit_orders WHERE id = 18811;
+DROP TABLE imported_orders;
+
+-- INSERT ... SELECT with a RETURNING clause is unsupported
+INSERT INTO limit_order_history SELECT * FROM limit_orders RETURNING id;
+
+-- INSERT with a RETURNING clause
 INSERT INTO limit_orders VALUES (7285, 'AMZN', 3278, '2016-01-05 02:07:36', 'sell', 0.00)
-						 RETURNING *;
+						 RETURNING id, symbol, limit_price;
 
 -- commands containing a CTE are unsupported
 WITH deleted_orders AS (DELETE FROM limit_orders RETURNING *)
@@ -88,8 +141,14 @@ SELECT COUNT(*) FROM limit_orders WHERE id = 246;
 DELETE FROM limit_orders WHERE id = (2 * 123);
 SELECT COUNT(*) FROM limit_orders WHERE id = 246;
 
--- commands with no constraints on the partition key are not supported
+-- commands with no constraints on the partition key modify all shards
+INSERT INTO limit_orders VALUES (246, 'TSLA', 162, '2007-07-02 16:32:15', 'sell', 20.69);
+INSERT INTO limit_orders VALUES (247, 'TSLA', 162, '2007-07-02 16:32:15', 'sell', 20.69);
+INSERT INTO limit_orders VALUES (248, 'TSLA', 162, '2007-07-02 16:32:15', 'sell', 20.69);
+SELECT COUNT(*) FROM limit_orders WHERE bidder_id = 162;
+
 DELETE FROM limit_orders WHERE bidder_id = 162;
+SELECT COUNT(*) FROM limit_orders WHERE bidder_id = 162;
 
 -- commands with a USING clause are unsupported
 CREATE TABLE bidders ( name text, id bigint );
@@ -97,8 +156,31 @@ DELETE FROM limit_orders USING bidders WHERE limit_orders.id = 246 AND
 											 limit_orders.bidder_id = bidders.id AND
 											 bidders.name = 'Bernie Madoff';
 
--- commands with a RETURNING clause are unsupported
-DELETE FROM limit_orders WHERE id = 246 RETURNING *;
+-- DELETE with a RETURNING clause
+DELETE FROM limit_orders WHERE id = 7285 RETURNING id, symbol;
+
+-- prepared INSERT and DELETE; later executions use the generic plan
+PREPARE insert_order (bigint, bigint) AS
+	INSERT INTO limit_orders VALUES ($1, 'CSCO', $2, '2015-03-25 12:56:47', 'buy', 0.58);
+PREPARE delete_order (bigint) AS
+	DELETE FROM limit_orders WHERE id = $1 RETURNING bidder_id;
+EXECUTE insert_order(9001, 1);
+EXECUTE insert_order(9002, 2);
+EXECUTE insert_order(9003, 3);
+EXECUTE insert_order(9004, 4);
+EXECUTE insert_order(9005, 5);
+EXECUTE insert_order(9006, 6);
+SELECT COUNT(*) FROM limit_orders WHERE symbol = 'CSCO';
+
+EXECUTE delete_order(9001);
+EXECUTE delete_order(9002);
+EXECUTE delete_order(9003);
+EXECUTE delete_order(9004);
+EXECUTE delete_order(9005);
+EXECUTE delete_order(9006);
+SELECT COUNT(*) FROM limit_orders WHERE symbol = 'CSCO';
+DEALLOCATE insert_order;
+DEALLOCATE delete_order;
 
 -- commands containing a CTE are unsupported
 WITH deleted_orders AS (INSERT INTO limit_orders DEFAULT VALUES RETURNING *)
@@ -121,8 +203,30 @@ SELECT bidder_id FROM limit_orders WHERE id = 246;
 UPDATE limit_orders SET (kind, limit_price) = ('buy', DEFAULT) WHERE id = 246;
 SELECT kind, limit_price FROM limit_orders WHERE id = 246;
 
--- commands with no constraints on the partition key are not supported
+-- prepared UPDATE; later executions use the generic plan
+PREPARE update_bidder (int, bigint) AS
+	UPDATE limit_orders SET bidder_id = $1 WHERE id = $2;
+EXECUTE update_bidder(1, 246);
+EXECUTE update_bidder(2, 246);
+EXECUTE update_bidder(3, 246);
+EXECUTE update_bidder(4, 246);
+EXECUTE update_bidder(5, 246);
+EXECUTE update_bidder(6, 246);
+EXECUTE update_bidder(7, 246);
+SELECT bidder_id FROM limit_orders WHERE id = 246;
+DEALLOCATE update_bidder;
+
+-- modifications of several shards error out if any shard could not be modified,
+-- but remain committed on the other shards
+INSERT INTO limit_orders VALUES (18811, 'BUD', 14962, '2014-04-05 08:32:16', 'sell', 0.50);
+UPDATE limit_orders SET limit_price = limit_price - 1.00 WHERE id IN (18811, 32743);
+SELECT id, limit_price FROM limit_orders WHERE id IN (18811, 32743) ORDER BY id;
+UPDATE limit_orders SET limit_price = 20.69 WHERE id = 32743;
+DELETE FROM limit_orders WHERE id = 18811;
+
+-- commands with no constraints on the partition key modify all shards
 UPDATE limit_orders SET limit_price = 0.00;
+SELECT COUNT(*) FROM limit_orders WHERE limit_price <> 0.00;
 
 -- UPDATEs with a FROM clause are unsupported
 UPDATE limit_orders SET limit_price = 0.00 FROM bidders
@@ -130,8 +234,8 @@ UPDATE limit_orders SET limit_price = 0.00 FROM bidders
 						  limit_orders.bidder_id = bidders.id AND
 						  bidders.name = 'Bernie Madoff';
 
--- commands with a RETURNING clause are unsupported
-UPDATE limit_orders SET symbol = 'GM' WHERE id = 246 RETURNING *;
+-- UPDATE with a RETURNING clause
+UPDATE limit_orders SET symbol = 'GM' WHERE id = 246 RETURNING id, symbol, bidder_id;
 
 -- commands containing a CTE are unsupported
 WITH deleted_orders AS (INSERT INTO limit_orders DEFAULT VALUES RETURNING *)
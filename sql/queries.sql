@@ -17,9 +17,12 @@ SELECT master_create_distributed_table('articles', 'author_id');
 -- test when a table is distributed but no shards created yet
 SELECT count(*) from articles;
 
--- squelch noisy warnings when creating shards
+-- squelch noisy warnings when creating shards, and NOTICEs that contain PGPORT
+-- to avoid needing tmpl file
 \set VERBOSITY terse
+SET client_min_messages TO WARNING;
 SELECT master_create_worker_shards('articles', 2, 1);
+SET client_min_messages TO DEFAULT;
 \set VERBOSITY default
 
 -- create a bunch of test data
@@ -112,11 +115,29 @@ SELECT author_id, sum(word_count) AS corpus_size FROM articles
 	HAVING sum(word_count) > 40000
 	ORDER BY sum(word_count) DESC;
 
--- UNION/INTERSECT queries are unsupported
+-- UNION/INTERSECT queries are pushed down when they read a single shard
 SELECT * FROM articles WHERE author_id = 10 UNION
-SELECT * FROM articles WHERE author_id = 1; 
+SELECT * FROM articles WHERE author_id = 1
+ORDER BY id;
 
--- queries using CTEs are unsupported
+-- as are CTEs and subqueries
+WITH recent_articles AS (
+	SELECT id, title FROM articles WHERE author_id = 1 ORDER BY id DESC LIMIT 2
+)
+SELECT title FROM recent_articles ORDER BY id;
+
+SELECT id, title FROM articles
+	WHERE author_id = 1 AND
+		  word_count > (SELECT avg(word_count) FROM articles WHERE author_id = 1)
+	ORDER BY id;
+
+SELECT author_id, corpus_size FROM (
+	SELECT author_id, sum(word_count) AS corpus_size FROM articles
+		WHERE author_id = 10
+		GROUP BY author_id
+) AS corpus_sizes;
+
+-- queries using CTEs are unsupported if they read local tables
 WITH long_names AS ( SELECT id FROM authors WHERE char_length(name) > 15 )
 SELECT title FROM articles;
 
@@ -126,7 +147,7 @@ SELECT * FROM articles, position('om' in 'Thomas');
 -- subqueries are not supported in WHERE clause
 SELECT * FROM articles WHERE author_id IN (SELECT id FROM authors WHERE name LIKE '%a');
 
--- subqueries are not supported in FROM clause
+-- subqueries are not supported in FROM clause if they read several shards
 SELECT articles.id,test.word_count
 FROM articles, (SELECT id, word_count FROM articles) AS test WHERE test.id = articles.id;
 
@@ -134,10 +155,10 @@ FROM articles, (SELECT id, word_count FROM articles) AS test WHERE test.id = art
 SELECT a.title AS name, (SELECT a2.id FROM authors a2 WHERE a.id = a2.id  LIMIT 1)
 						 AS special_price FROM articles a;
 
--- joins are not supported in WHERE clause
+-- joins with local tables are not supported in WHERE clause
 SELECT title, authors.name FROM authors, articles WHERE authors.id = articles.author_id;
 
--- joins are not supported in FROM clause
+-- joins with local tables are not supported in FROM clause
 SELECT * FROM  (articles INNER JOIN authors ON articles.id = authors.id);
 
 -- test cross-shard queries
@@ -150,6 +171,155 @@ SELECT author_id, sum(word_count) AS corpus_size FROM articles
 	ORDER BY sum(word_count) DESC
 	LIMIT 5;
 
+-- run cross-shard queries over several connections per node
+SET pg_shard.max_connections_per_node = 4;
+
+SELECT COUNT(*) FROM articles;
+
+SELECT author_id, sum(word_count) AS corpus_size FROM articles
+	GROUP BY author_id
+	HAVING sum(word_count) > 25000
+	ORDER BY sum(word_count) DESC
+	LIMIT 5;
+
+-- shard queries to the same node run over separate connections at the same time
+SET pg_shard.log_distributed_statements = on;
+SET client_min_messages = log;
+
+SELECT count(*) FROM articles WHERE word_count > 10000;
+
+SET client_min_messages = DEFAULT;
+SET pg_shard.log_distributed_statements = DEFAULT;
+
+RESET pg_shard.max_connections_per_node;
+
+-- combine each node's shard queries into a single query
+SET pg_shard.group_tasks_by_node = on;
+
+SELECT COUNT(*) FROM articles;
+
+SELECT author_id, sum(word_count) AS corpus_size FROM articles
+	GROUP BY author_id
+	HAVING sum(word_count) > 25000
+	ORDER BY sum(word_count) DESC
+	LIMIT 5;
+
+-- a node's shard queries are sent to it together, as a single query
+SET pg_shard.log_distributed_statements = on;
+SET client_min_messages = log;
+
+SELECT count(*) FROM articles WHERE word_count > 10000;
+
+SET client_min_messages = DEFAULT;
+SET pg_shard.log_distributed_statements = DEFAULT;
+
+RESET pg_shard.group_tasks_by_node;
+
+-- remote queries are subject to the local statement_timeout
+SET statement_timeout TO '1min';
+
+SELECT COUNT(*) FROM articles;
+SELECT title FROM articles WHERE author_id = 10 AND id = 50;
+
+RESET statement_timeout;
+
+SELECT COUNT(*) FROM articles;
+
+-- remote queries are cancelled once the local statement_timeout expires
+SET statement_timeout TO '200ms';
+
+SELECT count(*) FROM articles WHERE pg_sleep(10) IS NULL;
+SELECT title FROM articles WHERE author_id = 10 AND id = 50 AND pg_sleep(10) IS NULL;
+
+RESET statement_timeout;
+
+SELECT count(*) FROM pg_stat_activity
+	WHERE application_name = 'pg_shard' AND state = 'active';
+
+-- queries cancelled within a subtransaction leave their connections usable
+BEGIN;
+SAVEPOINT before_timeout;
+SET LOCAL statement_timeout TO '200ms';
+SELECT count(*) FROM articles WHERE pg_sleep(10) IS NULL;
+ROLLBACK TO SAVEPOINT before_timeout;
+SELECT count(*) FROM articles;
+COMMIT;
+
+-- outside of cursors, single-shard reads may not run in transaction blocks
+BEGIN;
+SELECT title FROM articles WHERE author_id = 10 AND id = 50;
+ROLLBACK;
+
+-- cursors fetch rows from a single shard as they are needed
+BEGIN;
+DECLARE author_articles CURSOR FOR
+	SELECT id, title FROM articles WHERE author_id = 10 ORDER BY id;
+FETCH 2 FROM author_articles;
+FETCH 2 FROM author_articles;
+FETCH ALL FROM author_articles;
+CLOSE author_articles;
+
+-- cursors may also span shards, and may be closed before reading all rows
+DECLARE all_articles CURSOR FOR SELECT COUNT(*) FROM articles;
+FETCH 1 FROM all_articles;
+CLOSE all_articles;
+
+DECLARE early_close CURSOR FOR SELECT id FROM articles WHERE author_id = 1 ORDER BY id;
+FETCH 1 FROM early_close;
+CLOSE early_close;
+COMMIT;
+
+-- prepared statements are planned once; the executions after the fifth reuse
+-- the cached generic plan, whose shards are pruned once parameters are bound
+PREPARE article_title (bigint, bigint) AS
+	SELECT title FROM articles WHERE author_id = $1 AND id = $2;
+EXECUTE article_title(1, 1);
+EXECUTE article_title(2, 12);
+EXECUTE article_title(3, 23);
+EXECUTE article_title(4, 34);
+EXECUTE article_title(5, 45);
+EXECUTE article_title(6, 6);
+EXECUTE article_title(10, 50);
+DEALLOCATE article_title;
+
+PREPARE long_article_count (int) AS
+	SELECT COUNT(*) FROM articles WHERE word_count > $1;
+EXECUTE long_article_count(10000);
+EXECUTE long_article_count(18000);
+DEALLOCATE long_article_count;
+
+-- statements prepared on workers are evicted once too many are cached
+SET pg_shard.max_cached_statements_per_connection TO 1;
+
+PREPARE author_article_count (bigint) AS
+	SELECT COUNT(*) FROM articles WHERE author_id = $1;
+PREPARE article_word_count (bigint, bigint) AS
+	SELECT word_count FROM articles WHERE author_id = $1 AND id = $2;
+EXECUTE author_article_count(1);
+EXECUTE article_word_count(1, 11);
+EXECUTE author_article_count(1);
+RESET pg_shard.max_cached_statements_per_connection;
+
+-- statements prepared on workers are reused by later executions
+SELECT get_and_purge_connection(node_name::cstring, node_port)
+	FROM pgs_distribution_metadata.shard_placement WHERE shard_id = 10040;
+EXECUTE author_article_count(1);
+EXECUTE article_word_count(1, 11);
+EXECUTE author_article_count(1);
+SELECT count_remote_prepared_statements(node_name::cstring, node_port)
+	FROM pgs_distribution_metadata.shard_placement WHERE shard_id = 10040;
+
+-- and are deallocated once the shards of their table change
+BEGIN;
+SELECT insert_monolithic_shard_row('articles', 99999);
+ROLLBACK;
+EXECUTE author_article_count(1);
+SELECT count_remote_prepared_statements(node_name::cstring, node_port)
+	FROM pgs_distribution_metadata.shard_placement WHERE shard_id = 10040;
+
+DEALLOCATE author_article_count;
+DEALLOCATE article_word_count;
+
 -- verify pg_shard produces correct remote SQL using logging flag
 SET pg_shard.log_distributed_statements = on;
 SET client_min_messages = log;
@@ -165,6 +335,110 @@ SELECT author_id FROM articles
 	HAVING sum(word_count) > 50000
 	ORDER BY author_id;
 
+-- tables co-located with articles may be joined with it on the partition column
+CREATE TABLE writers (
+	id bigint NOT NULL,
+	name text NOT NULL
+);
+
+SELECT master_create_distributed_table('writers', 'id');
+SET client_min_messages TO WARNING;
+SELECT master_create_worker_shards('writers', 2, 1, 'articles');
+SET client_min_messages TO DEFAULT;
+
+SELECT count(DISTINCT colocation_id) FROM pgs_distribution_metadata.partition
+	WHERE relation_id IN ('articles'::regclass, 'writers'::regclass);
+
+INSERT INTO writers VALUES ( 1, 'Abbott');
+INSERT INTO writers VALUES ( 2, 'Bronte');
+INSERT INTO writers VALUES ( 3, 'Carver');
+INSERT INTO writers VALUES ( 5, 'Dickens');
+INSERT INTO writers VALUES (10, 'Eliot');
+
+-- joins of a single pair of shards are pushed down as they are
+SELECT articles.id, title, name FROM articles JOIN writers ON (author_id = writers.id)
+	WHERE author_id = 10
+	ORDER BY articles.id;
+
+-- joins across shards are pushed down shard by shard
+SELECT name, count(*) FROM articles, writers
+	WHERE author_id = writers.id
+	GROUP BY name
+	ORDER BY name;
+
+SELECT count(*) FROM articles LEFT JOIN writers ON (author_id = writers.id)
+	WHERE writers.id IS NULL;
+
+-- tables must be joined on their partition columns
+SELECT title, name FROM articles JOIN writers ON (articles.id = writers.id);
+
+-- and must be co-located
+CREATE TABLE reviewers (
+	id bigint NOT NULL,
+	name text NOT NULL
+);
+
+SELECT master_create_distributed_table('reviewers', 'id');
+SELECT master_create_worker_shards('reviewers', 4, 1, 'articles');
+
+\set VERBOSITY terse
+SET client_min_messages TO WARNING;
+SELECT master_create_worker_shards('reviewers', 2, 1);
+SET client_min_messages TO DEFAULT;
+\set VERBOSITY default
+
+SELECT count(*) FROM articles JOIN reviewers ON (author_id = reviewers.id);
+
+-- reference tables may be joined with any table, on any column
+CREATE TABLE editors (
+	author_id bigint NOT NULL,
+	name text NOT NULL
+);
+
+SELECT master_create_distributed_table('editors', 'author_id', 'n');
+
+\set VERBOSITY terse
+SET client_min_messages TO WARNING;
+SELECT master_create_reference_table('editors');
+SET client_min_messages TO DEFAULT;
+\set VERBOSITY default
+
+SELECT count(*) FROM pgs_distribution_metadata.shard
+	WHERE relation_id = 'editors'::regclass;
+
+-- the unreachable worker receives an inactive placement, to be repaired later
+SELECT node_name, shard_state FROM pgs_distribution_metadata.shard_placement
+	WHERE shard_id IN (SELECT id FROM pgs_distribution_metadata.shard
+					   WHERE relation_id = 'editors'::regclass)
+	ORDER BY node_name;
+
+INSERT INTO editors VALUES (1, 'Perkins');
+INSERT INTO editors VALUES (2, 'Perkins');
+INSERT INTO editors VALUES (5, 'Lish');
+UPDATE editors SET name = 'Gottlieb' WHERE author_id = 5;
+
+SELECT articles.id, title, editors.name FROM articles
+	JOIN editors ON (articles.author_id = editors.author_id)
+	WHERE articles.author_id = 1
+	ORDER BY articles.id;
+
+SELECT editors.name, count(*) FROM articles, editors
+	WHERE articles.author_id = editors.author_id
+	GROUP BY editors.name
+	ORDER BY editors.name;
+
+SELECT count(*) FROM articles
+	JOIN writers ON (articles.author_id = writers.id)
+	JOIN editors ON (writers.id = editors.author_id);
+
+SELECT count(*) FROM articles LEFT JOIN editors
+	ON (articles.author_id = editors.author_id)
+	WHERE editors.author_id IS NULL;
+
+-- but may not be the preserved side of outer joins with distributed tables
+SELECT count(*) FROM editors LEFT JOIN articles
+	ON (editors.author_id = articles.author_id);
+
 -- verify temp tables used by cross-shard queries do not persist
 SELECT COUNT(*) FROM pg_class WHERE relname LIKE 'pg_shard_temp_table%' AND
 									relkind = 'r';
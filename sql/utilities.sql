@@ -10,11 +10,13 @@ COPY sharded_table TO STDOUT;
 COPY (SELECT COUNT(*) FROM sharded_table) TO STDOUT;
 COPY sharded_table FROM STDIN;
 
--- cursors may not involve distributed tables
-DECLARE all_sharded_rows CURSOR FOR SELECT * FROM sharded_table;
+-- cursors on distributed tables may not scroll
+DECLARE all_sharded_rows SCROLL CURSOR FOR SELECT * FROM sharded_table;
 
 -- EXPLAIN support isn't implemented
 EXPLAIN SELECT * FROM sharded_table;
 
--- PREPARE support isn't implemented
+-- prepared statements are supported, but EXPLAIN EXECUTE isn't
 PREPARE sharded_query (bigint) AS SELECT * FROM sharded_table WHERE id = $1;
+EXPLAIN EXECUTE sharded_query(1);
+DEALLOCATE sharded_query;
@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include "catalog/pg_type.h"
+#include "utils/builtins.h"
 #include "utils/lsyscache.h"
 
 
@@ -34,6 +35,8 @@ static Datum ExtractIntegerDatum(char *input);
 PG_FUNCTION_INFO_V1(initialize_remote_temp_table);
 PG_FUNCTION_INFO_V1(count_remote_temp_table_rows);
 PG_FUNCTION_INFO_V1(get_and_purge_connection);
+PG_FUNCTION_INFO_V1(count_remote_prepared_statements);
+PG_FUNCTION_INFO_V1(execute_remote_query);
 
 
 /*
@@ -127,6 +130,88 @@ get_and_purge_connection(PG_FUNCTION_ARGS)
 }
 
 
+/*
+ * count_remote_prepared_statements returns the number of statements prepared
+ * on the remote session of the connection to the specified host and port, such
+ * as those pg_shard keeps prepared for parameterized queries. If the statements
+ * cannot be counted, this function emits a warning and returns -1.
+ */
+Datum
+count_remote_prepared_statements(PG_FUNCTION_ARGS)
+{
+	char *nodeName = PG_GETARG_CSTRING(0);
+	int32 nodePort = PG_GETARG_INT32(1);
+	Datum count = Int32GetDatum(-1);
+	PGresult *result = NULL;
+
+	PGconn *connection = GetConnection(nodeName, nodePort);
+	if (connection == NULL)
+	{
+		PG_RETURN_DATUM(count);
+	}
+
+	result = PQexec(connection, COUNT_PREPARED_STATEMENTS);
+	if (PQresultStatus(result) != PGRES_TUPLES_OK)
+	{
+		ReportRemoteError(connection, result);
+	}
+	else
+	{
+		char *countText = PQgetvalue(result, 0, 0);
+		count = ExtractIntegerDatum(countText);
+	}
+
+	PQclear(result);
+
+	PG_RETURN_DATUM(count);
+}
+
+
+/*
+ * execute_remote_query runs the given query on the remote session of the
+ * connection to the specified host and port, and returns the first value of
+ * its result in textual form. Commands which return no rows, and queries which
+ * return a null value, yield NULL. If the query fails, this function emits a
+ * warning and returns NULL as well.
+ */
+Datum
+execute_remote_query(PG_FUNCTION_ARGS)
+{
+	char *nodeName = PG_GETARG_CSTRING(0);
+	int32 nodePort = PG_GETARG_INT32(1);
+	char *queryString = PG_GETARG_CSTRING(2);
+	text *value = NULL;
+	PGresult *result = NULL;
+
+	PGconn *connection = GetConnection(nodeName, nodePort);
+	if (connection == NULL)
+	{
+		PG_RETURN_NULL();
+	}
+
+	result = PQexec(connection, queryString);
+	if (PQresultStatus(result) != PGRES_COMMAND_OK &&
+		PQresultStatus(result) != PGRES_TUPLES_OK)
+	{
+		ReportRemoteError(connection, result);
+	}
+	else if (PQntuples(result) > 0 && PQnfields(result) > 0 &&
+			 !PQgetisnull(result, 0, 0))
+	{
+		value = cstring_to_text(PQgetvalue(result, 0, 0));
+	}
+
+	PQclear(result);
+
+	if (value == NULL)
+	{
+		PG_RETURN_NULL();
+	}
+
+	PG_RETURN_TEXT_P(value);
+}
+
+
 /*
  * ExtractIntegerDatum transforms an integer in textual form into a Datum.
  */
@@ -0,0 +1,82 @@
+/*-------------------------------------------------------------------------
+ *
+ * test/rebalance_shards.c
+ *
+ * This file contains functions to exercise shard rebalancing functionality
+ * within pg_shard.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "fmgr.h"
+#include "postgres_ext.h"
+
+#include "create_shards.h"
+#include "distribution_metadata.h"
+#include "rebalance_shards.h"
+#include "test/test_helper_functions.h" /* IWYU pragma: keep */
+
+#include "nodes/pg_list.h"
+#include "utils/builtins.h"
+#include "utils/palloc.h"
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(move_shard_group);
+
+
+/*
+ * move_shard_group moves the placements of the shard with the given id, and of
+ * the shards co-located with it, from the first given node to the second as a
+ * rebalance would, one copy at a time. The function returns whether the shards
+ * were moved.
+ */
+Datum
+move_shard_group(PG_FUNCTION_ARGS)
+{
+	int64 shardId = PG_GETARG_INT64(0);
+	WorkerNode *sourceNode = (WorkerNode *) palloc0(sizeof(WorkerNode));
+	WorkerNode *targetNode = (WorkerNode *) palloc0(sizeof(WorkerNode));
+	ShardInterval *shardInterval = LoadShardInterval(shardId);
+	Oid distributedTableId = shardInterval->relationId;
+	List *colocatedTableList = ColocatedTableList(distributedTableId);
+	List *shardGroupList = LoadShardGroupList(distributedTableId, colocatedTableList,
+											  false);
+	ShardGroupMove *move = (ShardGroupMove *) palloc0(sizeof(ShardGroupMove));
+	ListCell *shardGroupCell = NULL;
+	int32 movedCount = 0;
+
+	sourceNode->nodeName = text_to_cstring(PG_GETARG_TEXT_P(1));
+	sourceNode->nodePort = PG_GETARG_INT32(2);
+	targetNode->nodeName = text_to_cstring(PG_GETARG_TEXT_P(3));
+	targetNode->nodePort = PG_GETARG_INT32(4);
+
+	foreach(shardGroupCell, shardGroupList)
+	{
+		ShardGroup *shardGroup = (ShardGroup *) lfirst(shardGroupCell);
+		ShardInterval *groupShardInterval = linitial(shardGroup->shardIntervalList);
+
+		if (groupShardInterval->id == shardId)
+		{
+			move->shardGroup = shardGroup;
+			break;
+		}
+	}
+
+	if (move->shardGroup == NULL)
+	{
+		ereport(ERROR, (errmsg("could not find shard group of shard " INT64_FORMAT,
+							   shardId)));
+	}
+
+	move->sourceNode = sourceNode;
+	move->targetNode = targetNode;
+
+	movedCount = MoveShardGroups(list_make1(move), 1);
+
+	PG_RETURN_BOOL(movedCount == 1);
+}
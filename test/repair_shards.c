@@ -0,0 +1,118 @@
+/*-------------------------------------------------------------------------
+ *
+ * test/repair_shards.c
+ *
+ * This file contains functions to exercise shard repair functionality within
+ * pg_shard.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "fmgr.h"
+
+#include "connection.h"
+#include "distribution_metadata.h"
+#include "repair_shards.h"
+#include "test/test_helper_functions.h" /* IWYU pragma: keep */
+
+#include <string.h>
+
+#include "nodes/pg_list.h"
+#include "utils/builtins.h"
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(start_modification_capture);
+PG_FUNCTION_INFO_V1(end_modification_capture);
+PG_FUNCTION_INFO_V1(modification_capture_failed);
+PG_FUNCTION_INFO_V1(repair_inactive_placement);
+
+
+/*
+ * start_modification_capture registers an online repair of the shard with the
+ * given id, so that its modifications are logged as they would be during the
+ * copy of an online repair.
+ */
+Datum
+start_modification_capture(PG_FUNCTION_ARGS)
+{
+	int64 shardId = PG_GETARG_INT64(0);
+
+	StartModificationCapture(shardId);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * end_modification_capture unregisters the online repair of the shard with the
+ * given id which this backend registered.
+ */
+Datum
+end_modification_capture(PG_FUNCTION_ARGS)
+{
+	int64 shardId = PG_GETARG_INT64(0);
+
+	EndModificationCapture(shardId);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * modification_capture_failed returns whether the online repair of the shard
+ * with the given id would fail because a modification could not be logged.
+ */
+Datum
+modification_capture_failed(PG_FUNCTION_ARGS)
+{
+	int64 shardId = PG_GETARG_INT64(0);
+	bool captureFailed = ModificationCaptureFailed(shardId);
+
+	PG_RETURN_BOOL(captureFailed);
+}
+
+
+/*
+ * repair_inactive_placement repairs the placement of the shard with the given
+ * id on the given node as the background repair worker would, and returns
+ * whether it was repaired. The function errors out if there is no such
+ * placement.
+ */
+Datum
+repair_inactive_placement(PG_FUNCTION_ARGS)
+{
+	int64 shardId = PG_GETARG_INT64(0);
+	char *nodeName = text_to_cstring(PG_GETARG_TEXT_P(1));
+	int32 nodePort = PG_GETARG_INT32(2);
+	List *shardPlacementList = LoadShardPlacementList(shardId);
+	ShardPlacement *inactivePlacement = NULL;
+	ListCell *shardPlacementCell = NULL;
+	bool repaired = false;
+
+	foreach(shardPlacementCell, shardPlacementList)
+	{
+		ShardPlacement *shardPlacement = (ShardPlacement *) lfirst(shardPlacementCell);
+
+		if (strncmp(shardPlacement->nodeName, nodeName, MAX_NODE_LENGTH) == 0 &&
+			shardPlacement->nodePort == nodePort)
+		{
+			inactivePlacement = shardPlacement;
+			break;
+		}
+	}
+
+	if (inactivePlacement == NULL)
+	{
+		ereport(ERROR, (errmsg("could not find placement matching \"%s:%d\"",
+							   nodeName, nodePort)));
+	}
+
+	repaired = RepairInactivePlacement(inactivePlacement);
+
+	PG_RETURN_BOOL(repaired);
+}
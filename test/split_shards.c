@@ -0,0 +1,118 @@
+/*-------------------------------------------------------------------------
+ *
+ * test/split_shards.c
+ *
+ * This file contains functions to exercise shard splitting functionality
+ * within pg_shard.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "fmgr.h"
+#include "libpq-fe.h"
+#include "postgres_ext.h"
+
+#include "connection.h"
+#include "create_shards.h"
+#include "ddl_commands.h"
+#include "distribution_metadata.h"
+#include "repair_shards.h"
+#include "split_shards.h"
+#include "test/test_helper_functions.h" /* IWYU pragma: keep */
+
+#include "catalog/pg_type.h"
+#include "nodes/pg_list.h"
+#include "utils/array.h"
+#include "utils/palloc.h"
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(replay_split_log);
+
+
+/*
+ * replay_split_log creates empty tables for new shards with the given ids on
+ * the nodes of the healthy placements of the shard with the given id, which
+ * divide the shard's hash range like a split would, and replays the shard's
+ * logged modifications on them as a split would. The function returns the
+ * number of modifications replayed.
+ */
+Datum
+replay_split_log(PG_FUNCTION_ARGS)
+{
+	int64 shardId = PG_GETARG_INT64(0);
+	ArrayType *childIdArrayType = PG_GETARG_ARRAYTYPE_P(1);
+	ShardInterval *shardInterval = LoadShardInterval(shardId);
+	Oid distributedTableId = shardInterval->relationId;
+	List *schemaCommandList = TableSchemaDDLCommandList(distributedTableId);
+	List *placementList = LoadFinalizedShardPlacementList(shardId);
+	List *childIntervalList = NIL;
+	List *connectionList = NIL;
+	ListCell *placementCell = NULL;
+	Datum *childIdDatumArray = NULL;
+	uint64 *childIdArray = NULL;
+	int childCount = 0;
+	int childIndex = 0;
+	int replayedEntryCount = 0;
+	int totalReplayedCount = 0;
+
+	deconstruct_array(childIdArrayType, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd',
+					  &childIdDatumArray, NULL, &childCount);
+
+	childIdArray = (uint64 *) palloc0(childCount * sizeof(uint64));
+	for (childIndex = 0; childIndex < childCount; childIndex++)
+	{
+		childIdArray[childIndex] = (uint64) DatumGetInt64(childIdDatumArray[childIndex]);
+	}
+
+	childIntervalList = SplitShardInterval(shardInterval, childCount, childIdArray);
+
+	foreach(placementCell, placementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		PGconn *connection = GetConnection(placement->nodeName, placement->nodePort);
+		ListCell *childIntervalCell = NULL;
+
+		if (connection == NULL)
+		{
+			ereport(ERROR, (errmsg("could not connect to \"%s:%u\"",
+								   placement->nodeName, placement->nodePort)));
+		}
+
+		foreach(childIntervalCell, childIntervalList)
+		{
+			ShardInterval *childInterval = (ShardInterval *) lfirst(childIntervalCell);
+			List *ddlCommandList = ExtendedDDLCommandList(distributedTableId,
+														  childInterval->id,
+														  schemaCommandList);
+			ListCell *ddlCommandCell = NULL;
+
+			foreach(ddlCommandCell, ddlCommandList)
+			{
+				char *ddlCommand = (char *) lfirst(ddlCommandCell);
+
+				if (!ExecuteRemoteCommand(connection, ddlCommand))
+				{
+					ereport(ERROR, (errmsg("could not create new shards on \"%s:%u\"",
+										   placement->nodeName, placement->nodePort)));
+				}
+			}
+		}
+
+		connectionList = lappend(connectionList, connection);
+	}
+
+	do
+	{
+		replayedEntryCount = ReplaySplitLogBatch(shardInterval, childIntervalList,
+												 connectionList);
+		totalReplayedCount += replayedEntryCount;
+	}
+	while (replayedEntryCount == REPAIR_LOG_BATCH_ENTRY_COUNT);
+
+	PG_RETURN_INT32(totalReplayedCount);
+}
@@ -24,6 +24,7 @@
 #define POPULATE_TEMP_TABLE "CREATE TEMPORARY TABLE numbers " \
 							"AS SELECT * FROM generate_series(1, 100);"
 #define COUNT_TEMP_TABLE "SELECT COUNT(*) FROM numbers;"
+#define COUNT_PREPARED_STATEMENTS "SELECT COUNT(*) FROM pg_prepared_statements;"
 
 
 /* function declarations for generic test functions */
@@ -34,6 +35,8 @@ extern ArrayType * DatumArrayToArrayType(Datum *datumArray, int datumCount,
 extern Datum initialize_remote_temp_table(PG_FUNCTION_ARGS);
 extern Datum count_remote_temp_table_rows(PG_FUNCTION_ARGS);
 extern Datum get_and_purge_connection(PG_FUNCTION_ARGS);
+extern Datum count_remote_prepared_statements(PG_FUNCTION_ARGS);
+extern Datum execute_remote_query(PG_FUNCTION_ARGS);
 
 /* function declarations for exercising metadata functions */
 extern Datum load_shard_id_array(PG_FUNCTION_ARGS);
@@ -66,5 +69,17 @@ extern Datum prune_using_either_value(PG_FUNCTION_ARGS);
 extern Datum prune_using_both_values(PG_FUNCTION_ARGS);
 extern Datum debug_equality_expression(PG_FUNCTION_ARGS);
 
+/* function declarations for exercising shard repair functions */
+extern Datum start_modification_capture(PG_FUNCTION_ARGS);
+extern Datum end_modification_capture(PG_FUNCTION_ARGS);
+extern Datum modification_capture_failed(PG_FUNCTION_ARGS);
+extern Datum repair_inactive_placement(PG_FUNCTION_ARGS);
+
+/* function declarations for exercising shard rebalancing functions */
+extern Datum move_shard_group(PG_FUNCTION_ARGS);
+
+/* function declarations for exercising shard splitting functions */
+extern Datum replay_split_log(PG_FUNCTION_ARGS);
+
 
 #endif /* PG_SHARD_TEST_HELPER_FUNCTIONS_H */